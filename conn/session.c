@@ -4,6 +4,7 @@
 #include "libp2p/crypto/ephemeral.h"
 #include "libp2p/conn/session.h"
 #include "libp2p/net/stream.h"
+#include "libp2p/utils/slab.h"
 
 struct SessionContext* libp2p_session_context_new() {
 	struct SessionContext* context = (struct SessionContext*) malloc(sizeof(struct SessionContext));
@@ -12,6 +13,10 @@ struct SessionContext* libp2p_session_context_new() {
 		memset(&context->aes_decode_stream_block[0], 0, 16);
 		context->aes_encode_nonce_offset = 0;
 		memset(&context->aes_encode_stream_block[0], 0, 16);
+		mbedtls_aes_init(&context->aes_encode_context);
+		mbedtls_aes_init(&context->aes_decode_context);
+		mbedtls_md_init(&context->hmac_encode_context);
+		mbedtls_md_init(&context->hmac_decode_context);
 		context->chosen_cipher = NULL;
 		context->chosen_curve = NULL;
 		context->chosen_hash = NULL;
@@ -84,46 +89,50 @@ int libp2p_session_context_free(struct SessionContext* context) {
 			libp2p_crypto_ephemeral_key_free(context->ephemeral_private_key);
 			context->ephemeral_private_key = NULL;
 		}
+		mbedtls_aes_free(&context->aes_encode_context);
+		mbedtls_aes_free(&context->aes_decode_context);
+		mbedtls_md_free(&context->hmac_encode_context);
+		mbedtls_md_free(&context->hmac_decode_context);
 		free(context);
 	}
 	return 1;
 }
 
 /***
- * Attempt to lock a stream for personal use. Does not block.
+ * Attempt to take the read side of a stream for personal use. Does not block.
  * @param stream the stream to lock
  * @returns true(1) on success, false(0) otherwise
  */
 int libp2p_stream_try_lock(struct Stream* stream) {
 	if (stream == NULL)
 		return 0;
-	if (pthread_mutex_trylock(stream->socket_mutex) == 0)
+	if (pthread_mutex_trylock(stream->read_mutex) == 0)
 		return 1;
 	return 0;
 }
 
 /***
- * Attempt to lock a stream for personal use. Blocks until the lock is acquired
+ * Attempt to take the read side of a stream for personal use. Blocks until the lock is acquired
  * @param stream the stream to lock
  * @returns true(1) on success, false(0) otherwise
  */
 int libp2p_stream_lock(struct Stream* stream) {
 	if (stream == NULL)
 		return 0;
-	if (pthread_mutex_lock(stream->socket_mutex) == 0)
+	if (pthread_mutex_lock(stream->read_mutex) == 0)
 		return 1;
 	return 0;
 }
 
 /***
- * Attempt to unlock the mutex for this stream
+ * Attempt to give back the read side of this stream
  * @param stream the stream to unlock
  * @returns true(1) on success, false(0) otherwise
  */
 int libp2p_stream_unlock(struct Stream* stream) {
 	if (stream == NULL)
 		return 0;
-	if (pthread_mutex_unlock(stream->socket_mutex) == 0)
+	if (pthread_mutex_unlock(stream->read_mutex) == 0)
 		return 1;
 	return 0;
 }
@@ -133,11 +142,12 @@ int libp2p_stream_unlock(struct Stream* stream) {
  * @returns a StreamMessage struct
  */
 struct StreamMessage* libp2p_stream_message_new() {
-	struct StreamMessage* out = (struct StreamMessage*) malloc(sizeof(struct StreamMessage));
+	struct StreamMessage* out = (struct StreamMessage*) libp2p_utils_slab_alloc(sizeof(struct StreamMessage));
 	if (out != NULL) {
 		out->data = NULL;
 		out->data_size = 0;
 		out->error_number = 0;
+		out->buffer = NULL;
 	}
 	return out;
 }
@@ -148,11 +158,21 @@ struct StreamMessage* libp2p_stream_message_new() {
  */
 void libp2p_stream_message_free(struct StreamMessage* msg) {
 	if (msg != NULL) {
+		if (msg->buffer != NULL) {
+			// the data belongs to the buffer, which goes away with its last message
+			struct StreamBuffer* buffer = msg->buffer;
+			int embedded = (msg == &buffer->message);
+			if (__atomic_sub_fetch(&buffer->ref_count, 1, __ATOMIC_ACQ_REL) == 0)
+				libp2p_utils_slab_free(buffer);
+			if (!embedded)
+				libp2p_utils_slab_free(msg);
+			return;
+		}
 		if (msg->data != NULL) {
 			free(msg->data);
 			msg->data = NULL;
 		}
-		free(msg);
+		libp2p_utils_slab_free(msg);
 		msg = NULL;
 	}
 }
@@ -163,20 +183,78 @@ void libp2p_stream_message_free(struct StreamMessage* msg) {
  * @returns a StreamMessage that is a copy of the original
  */
 struct StreamMessage* libp2p_stream_message_copy(const struct StreamMessage* original) {
-	struct StreamMessage* copy = libp2p_stream_message_new();
+	struct StreamMessage* copy = libp2p_stream_message_new_buffer(original->data_size);
 	if (copy != NULL) {
 		copy->error_number = original->error_number;
-		copy->data_size = original->data_size;
-		copy->data = (uint8_t*) malloc(copy->data_size);
-		if (copy->data == NULL) {
-			libp2p_stream_message_free(copy);
-			return NULL;
-		}
 		memcpy(copy->data, original->data, copy->data_size);
 	}
 	return copy;
 }
 
+/***
+ * Create a StreamMessage whose data lives in a shared buffer. The message, the
+ * buffer and its data are one allocation.
+ * @param data_size the number of bytes of data
+ * @returns the StreamMessage, or NULL on error
+ */
+struct StreamMessage* libp2p_stream_message_new_buffer(size_t data_size) {
+	struct StreamBuffer* buffer = (struct StreamBuffer*) libp2p_utils_slab_alloc(sizeof(struct StreamBuffer) + data_size);
+	if (buffer == NULL)
+		return NULL;
+	buffer->ref_count = 1;
+	buffer->capacity = data_size;
+	struct StreamMessage* msg = &buffer->message;
+	msg->data = buffer->bytes;
+	msg->data_size = data_size;
+	msg->error_number = 0;
+	msg->buffer = buffer;
+	return msg;
+}
+
+/***
+ * Create a message that shares part of another message's data. If the original
+ * has no shared buffer, the part is copied.
+ * @param original the original message
+ * @param offset where the part starts in the original's data
+ * @param data_size the size of the part
+ * @returns the new StreamMessage, or NULL on error
+ */
+struct StreamMessage* libp2p_stream_message_slice(struct StreamMessage* original, size_t offset, size_t data_size) {
+	if (original == NULL || offset + data_size > original->data_size)
+		return NULL;
+	if (original->buffer == NULL) {
+		struct StreamMessage* copy = libp2p_stream_message_new_buffer(data_size);
+		if (copy != NULL)
+			memcpy(copy->data, &original->data[offset], data_size);
+		return copy;
+	}
+	struct StreamMessage* slice = libp2p_stream_message_new();
+	if (slice == NULL)
+		return NULL;
+	__atomic_add_fetch(&original->buffer->ref_count, 1, __ATOMIC_RELAXED);
+	slice->buffer = original->buffer;
+	slice->data = &original->data[offset];
+	slice->data_size = data_size;
+	return slice;
+}
+
+/***
+ * Remove bytes from the front of a message (i.e. a header that has been parsed)
+ * @param msg the message
+ * @param num_bytes the number of bytes to remove
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_stream_message_strip(struct StreamMessage* msg, size_t num_bytes) {
+	if (msg == NULL || num_bytes > msg->data_size)
+		return 0;
+	if (msg->buffer != NULL)
+		msg->data += num_bytes; // the buffer still owns the memory
+	else
+		memmove(msg->data, &msg->data[num_bytes], msg->data_size - num_bytes);
+	msg->data_size -= num_bytes;
+	return 1;
+}
+
 /****
  * Make a copy of a SessionContext
  * @param original the original
@@ -3,6 +3,7 @@
 
 #include "libp2p/db/datastore.h"
 #include "libp2p/os/utils.h"
+#include "libp2p/utils/logger.h"
 
 int alloc_and_assign(char** result, const char* string) {
 	*result = malloc(strlen(string)+1);
@@ -46,6 +47,10 @@ int libp2p_datastore_new(struct Datastore** datastore) {
 	(*datastore)->storage_max = NULL;
 	(*datastore)->gc_period = NULL;
 	(*datastore)->params = NULL;
+	(*datastore)->bloom_filter_size = 0;
+	(*datastore)->bloom_filter = NULL;
+	(*datastore)->datastore_has = NULL;
+	(*datastore)->datastore_put_unfiltered = NULL;
 	return 1;
 }
 
@@ -69,6 +74,7 @@ int libp2p_datastore_free(struct Datastore* datastore) {
 			free(datastore->params);
 		if (datastore->datastore_context != NULL)
 			datastore->datastore_close(datastore);
+		libp2p_utils_bloom_filter_free(datastore->bloom_filter);
 		free(datastore);
 	}
 	return 1;
@@ -103,3 +109,136 @@ int libp2p_datastore_record_free(struct DatastoreRecord* rec) {
 	}
 	return 1;
 }
+
+/***
+ * Stands in for datastore_put while there is a Bloom filter
+ * @param record the record
+ * @param datastore the datastore
+ * @returns the results of the datastore's own put
+ */
+static int libp2p_datastore_filtered_put(struct DatastoreRecord* record, const struct Datastore* datastore) {
+	// before the put, so the filter never says no to something that is there
+	libp2p_utils_bloom_filter_add(datastore->bloom_filter, record->key, record->key_size);
+	return datastore->datastore_put_unfiltered(record, datastore);
+}
+
+/***
+ * Throw away the Bloom filter, and give the datastore its own put back
+ * @param datastore the datastore
+ */
+static void libp2p_datastore_bloom_filter_drop(struct Datastore* datastore) {
+	if (datastore->datastore_put == libp2p_datastore_filtered_put) {
+		datastore->datastore_put = datastore->datastore_put_unfiltered;
+		datastore->datastore_put_unfiltered = NULL;
+	}
+	libp2p_utils_bloom_filter_free(datastore->bloom_filter);
+	datastore->bloom_filter = NULL;
+}
+
+/***
+ * Add every key in the datastore to the filter
+ * @param datastore the datastore
+ * @param filter the filter
+ * @returns true(1) if every key was read, false(0) if the cursor stopped early
+ */
+static int libp2p_datastore_bloom_filter_fill(struct Datastore* datastore, struct BloomFilter* filter) {
+	int retVal = 0;
+	unsigned char* key = NULL;
+	unsigned char* value = NULL;
+	unsigned char* last_key = NULL;
+	int key_length = 0;
+	int value_length = 0;
+	int last_key_length = 0;
+	enum DatastoreCursorOp op = CURSOR_FIRST;
+	while (datastore->datastore_cursor_get(&key, &key_length, &value, &value_length, op, datastore)) {
+		libp2p_utils_bloom_filter_add(filter, key, key_length);
+		free(last_key);
+		last_key = key;
+		last_key_length = key_length;
+		key = NULL;
+		free(value);
+		value = NULL;
+		op = CURSOR_NEXT;
+	}
+	// the cursor stops on errors too. It only got to the end if the last key is the last one read
+	if (!datastore->datastore_cursor_get(&key, &key_length, &value, &value_length, CURSOR_LAST, datastore)) {
+		retVal = (last_key == NULL);
+		goto exit;
+	}
+	retVal = (last_key != NULL && key_length == last_key_length && memcmp(key, last_key, key_length) == 0);
+	exit:
+	free(key);
+	free(value);
+	free(last_key);
+	return retVal;
+}
+
+/***
+ * Build the Bloom filter from the keys already in the datastore. Call this after datastore_open,
+ * before the datastore is in use. While there is a filter, datastore_put is wrapped so every put adds its key to it.
+ * NOTE: If bloom_filter_size is 0, or the keys cannot all be read, there will be no filter.
+ * @param datastore the datastore
+ * @returns true(1) on success (even if there is no filter), false(0) on error
+ */
+int libp2p_datastore_bloom_filter_load(struct Datastore* datastore) {
+	if (datastore == NULL)
+		return 0;
+	libp2p_datastore_bloom_filter_drop(datastore);
+	if (datastore->bloom_filter_size <= 0)
+		return 1;
+	// a filter missing keys would hide them, so every key has to be read
+	if (datastore->datastore_put == NULL || datastore->datastore_cursor_open == NULL || datastore->datastore_cursor_get == NULL || datastore->datastore_cursor_close == NULL)
+		return 1;
+	struct BloomFilter* filter = libp2p_utils_bloom_filter_new(datastore->bloom_filter_size, DATASTORE_BLOOM_FILTER_HASHES);
+	if (filter == NULL)
+		return 0;
+	if (!datastore->datastore_cursor_open(datastore)) {
+		libp2p_utils_bloom_filter_free(filter);
+		return 0;
+	}
+	int success = libp2p_datastore_bloom_filter_fill(datastore, filter);
+	datastore->datastore_cursor_close(datastore);
+	if (!success) {
+		libp2p_logger_error("datastore", "bloom_filter_load: Unable to read every key. Not using a Bloom filter.\n");
+		libp2p_utils_bloom_filter_free(filter);
+		return 0;
+	}
+	datastore->bloom_filter = filter;
+	datastore->datastore_put_unfiltered = datastore->datastore_put;
+	datastore->datastore_put = libp2p_datastore_filtered_put;
+	return 1;
+}
+
+/***
+ * See if a key is in the datastore, without retrieving its value
+ * NOTE: If the Bloom filter says no, the datastore is not asked
+ * @param datastore the datastore
+ * @param key the key
+ * @param key_size the size of the key
+ * @returns true(1) if it is there, false(0) otherwise
+ */
+int libp2p_datastore_has(const struct Datastore* datastore, const unsigned char* key, size_t key_size) {
+	if (datastore == NULL || key == NULL)
+		return 0;
+	if (!libp2p_utils_bloom_filter_contains(datastore->bloom_filter, key, key_size))
+		return 0;
+	if (datastore->datastore_has != NULL)
+		return datastore->datastore_has(key, key_size, datastore);
+	struct DatastoreRecord* record = NULL;
+	if (!datastore->datastore_get(key, key_size, &record, datastore))
+		return 0;
+	libp2p_datastore_record_free(record);
+	return 1;
+}
+
+/***
+ * Put a record in the datastore, keeping the Bloom filter up to date
+ * @param datastore the datastore
+ * @param record the record
+ * @returns the results of datastore_put
+ */
+int libp2p_datastore_put(const struct Datastore* datastore, struct DatastoreRecord* record) {
+	if (datastore == NULL || record == NULL)
+		return 0;
+	return datastore->datastore_put(record, datastore);
+}
@@ -377,6 +377,7 @@ struct Libp2pProtocolHandler* libp2p_identify_build_protocol_handler(char* publi
 		identify->PublicKey = public_key;
 		identify->PublicKeyLength = public_key_length;
 		handler->context = identify;
+		handler->protocol_id = "/ipfs/id/1.0.0";
 		handler->CanHandle = libp2p_identify_can_handle;
 		handler->HandleMessage = libp2p_identify_handle_message;
 		handler->Shutdown = libp2p_identify_shutdown;
@@ -3,6 +3,8 @@
 #include "libp2p/crypto/key.h"
 #include "libp2p/db/datastore.h"
 #include "libp2p/db/filestore.h"
+#include "mbedtls/aes.h"
+#include "mbedtls/md.h"
 
 /***
  * Holds the details of communication between two hosts
@@ -43,6 +45,14 @@ struct SessionContext {
 	unsigned char aes_encode_stream_block[16];
 	size_t aes_decode_nonce_offset;
 	unsigned char aes_decode_stream_block[16];
+	/**
+	 * Expanded cipher keys and keyed HMAC states, built once per session by
+	 * libp2p_secio_make_mac_and_cipher and reused for every record.
+	 */
+	mbedtls_aes_context aes_encode_context;
+	mbedtls_aes_context aes_decode_context;
+	mbedtls_md_context_t hmac_encode_context;
+	mbedtls_md_context_t hmac_decode_context;
 	/**
 	 * The mac function to use
 	 * @param 1 the incoming data bytes
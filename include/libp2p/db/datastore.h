@@ -1,6 +1,10 @@
 #pragma once
 
 #include <stdint.h>
+#include "libp2p/utils/bloom_filter.h"
+
+// the number of bits each key sets in the datastore's Bloom filter
+#define DATASTORE_BLOOM_FILTER_HASHES 7
 
 /***
  * Interface to data storage
@@ -25,16 +29,22 @@ struct Datastore {
 	char* params;
 	int no_sync;
 	int hash_on_read;
-	int bloom_filter_size;
+	int bloom_filter_size; // in bytes. 0 for no Bloom filter
+	// which keys may be in the datastore (see libp2p_datastore_bloom_filter_load). NULL if there is none
+	struct BloomFilter* bloom_filter;
 
 	// function pointers for datastore operations
 	int (*datastore_open)(int argc, char** argv, struct Datastore* datastore);
 	int (*datastore_close)(struct Datastore* datastore);
 	int (*datastore_put)(struct DatastoreRecord* record, const struct Datastore* datastore);
 	int (*datastore_get)(const unsigned char* key, size_t key_size, struct DatastoreRecord** record, const struct Datastore* datastore);
+	// optional. Like datastore_get, but without retrieving the value
+	int (*datastore_has)(const unsigned char* key, size_t key_size, const struct Datastore* datastore);
 	int (*datastore_cursor_open)(struct Datastore* datastore);
 	int (*datastore_cursor_close)(struct Datastore* datastore);
 	int (*datastore_cursor_get)(unsigned char** key, int* key_length, unsigned char** value, int* value_length, enum DatastoreCursorOp op, struct Datastore* datastore);
+	// the datastore's own put, while datastore_put is wrapped to keep the Bloom filter current
+	int (*datastore_put_unfiltered)(struct DatastoreRecord* record, const struct Datastore* datastore);
 	// generic connection and status variables for the datastore
 	void* datastore_context; // a handle to a context that holds connectivity information
 };
@@ -73,3 +83,31 @@ struct DatastoreRecord* libp2p_datastore_record_new();
  * Free resources of a DatastoreRecord
  */
 int libp2p_datastore_record_free(struct DatastoreRecord* record);
+
+/***
+ * Build the Bloom filter from the keys already in the datastore. Call this after datastore_open,
+ * before the datastore is in use. While there is a filter, datastore_put is wrapped so every put adds its key to it.
+ * NOTE: If bloom_filter_size is 0, or the keys cannot all be read, there will be no filter.
+ * @param datastore the datastore
+ * @returns true(1) on success (even if there is no filter), false(0) on error
+ */
+int libp2p_datastore_bloom_filter_load(struct Datastore* datastore);
+
+/***
+ * See if a key is in the datastore, without retrieving its value
+ * NOTE: If the Bloom filter says no, the datastore is not asked
+ * @param datastore the datastore
+ * @param key the key
+ * @param key_size the size of the key
+ * @returns true(1) if it is there, false(0) otherwise
+ */
+int libp2p_datastore_has(const struct Datastore* datastore, const unsigned char* key, size_t key_size);
+
+/***
+ * Put a record in the datastore
+ * NOTE: the same as calling datastore_put, which keeps the Bloom filter up to date
+ * @param datastore the datastore
+ * @param record the record
+ * @returns the results of datastore_put
+ */
+int libp2p_datastore_put(const struct Datastore* datastore, struct DatastoreRecord* record);
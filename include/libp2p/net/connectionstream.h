@@ -33,6 +33,68 @@ struct Stream* libp2p_net_connection_established(int fd, char* ip, int port, str
  */
 int libp2p_net_connection_upgrade(struct Stream* parent_stream, struct Stream* new_stream);
 
+/***
+ * Change how many bytes may wait to go out a connection before writers are held back
+ * @param stream a stream on the connection
+ * @param high_water the number of bytes
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_net_connection_set_write_high_water(struct Stream* stream, size_t high_water);
+
+/***
+ * Wait until the connection will take another write without refusing it
+ * NOTE: For writers that can't take back what they are about to write (i.e. a cipher
+ * that has moved on). Wait here, then write with libp2p_net_connection_writev_reserved.
+ * @param stream a stream on the connection
+ * @returns true(1) if there is room (or the stream is not on a network connection), false(0) otherwise
+ */
+int libp2p_net_connection_wait_writable(struct Stream* stream);
+
+/***
+ * Write several buffers to the connection, queueing them even past the high water mark
+ * @param stream a stream on the connection
+ * @param regions the buffers to write, in order
+ * @param num_regions the number of buffers
+ * @returns number of bytes written (or queued), or -1 on error
+ */
+int libp2p_net_connection_writev_reserved(struct Stream* stream, const struct iovec* regions, int num_regions);
+
+/***
+ * Create something to send what connections have queued, as their sockets become writable
+ * NOTE: It has no thread of its own. The event loop that owns it watches
+ * libp2p_net_connection_flusher_fd, and calls libp2p_net_connection_flusher_run when it is readable.
+ * @returns the ConnectionFlusher, or NULL on error
+ */
+struct ConnectionFlusher* libp2p_net_connection_flusher_new();
+
+/***
+ * Free a ConnectionFlusher. The connections it was sending for go back to their writers flushing.
+ * @param flusher the ConnectionFlusher
+ */
+void libp2p_net_connection_flusher_free(struct ConnectionFlusher* flusher);
+
+/***
+ * The descriptor an event loop should watch (for reading) on behalf of the flusher
+ * @param flusher the ConnectionFlusher
+ * @returns the descriptor
+ */
+int libp2p_net_connection_flusher_fd(struct ConnectionFlusher* flusher);
+
+/***
+ * Have the flusher send what a connection queues, so that its writers never wait on the socket
+ * @param flusher the ConnectionFlusher
+ * @param stream a stream on the connection
+ * @returns true(1) on success, false(0) otherwise (i.e. not a network connection, or it already has a different flusher)
+ */
+int libp2p_net_connection_flusher_attach(struct ConnectionFlusher* flusher, struct Stream* stream);
+
+/***
+ * Send what the connections have queued, for the sockets that will take more. Does not wait.
+ * @param flusher the ConnectionFlusher
+ * @returns the number of connections sent for, or -1 on error
+ */
+int libp2p_net_connection_flusher_run(struct ConnectionFlusher* flusher);
+
 /**
  * Given a stream, find the SessionContext
  * NOTE: This is done by navigating to the root context, which should
@@ -70,6 +132,24 @@ int libp2p_net_connection_peek(void* stream_context);
  */
 int libp2p_net_connection_read(void* stream_context, struct StreamMessage** msg, int timeout_secs);
 
+/***
+ * Read what has already arrived on the connection, without waiting for more
+ * @param stream_context the ConnectionContext
+ * @param buffer where to put the results
+ * @param buffer_size the most bytes to read
+ * @returns number of bytes read (0 if nothing has arrived), or -1 if nothing was read and the connection is gone
+ */
+int libp2p_net_connection_read_now(void* stream_context, uint8_t* buffer, int buffer_size);
+
+/***
+ * Take in what has already arrived on the connection, and look at the start of it without consuming it
+ * @param stream_context the ConnectionContext
+ * @param buffer where to copy the first bytes
+ * @param buffer_size the most bytes to copy
+ * @returns number of bytes that have arrived (can be more than buffer_size), or -1 if none have and the connection is gone
+ */
+int libp2p_net_connection_peek_now(void* stream_context, uint8_t* buffer, int buffer_size);
+
 /**
  * Reads a certain amount of bytes directly from the stream
  * @param stream_context the context
@@ -87,3 +167,15 @@ int libp2p_net_connection_read_raw(void* stream_context, uint8_t* buffer, int bu
  * @returns number of bytes written
  */
 int libp2p_net_connection_write(void* stream_context, struct StreamMessage* msg);
+
+/**
+ * Writes several buffers to the connection. What the socket can't take right away
+ * is queued, and sent by the connection's flusher, or whichever writer is flushing the queue.
+ * @param stream_context the ConnectionContext
+ * @param regions the buffers to write, in order
+ * @param num_regions the number of buffers
+ * @returns number of bytes written (or queued), or -1 on error. If the queue is above the
+ * high water mark (with a flusher), or stays above it for too long (without), nothing is
+ * written, -1 is returned, and errno is EAGAIN.
+ */
+int libp2p_net_connection_writev(void* stream_context, const struct iovec* regions, int num_regions);
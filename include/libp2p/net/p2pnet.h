@@ -2,6 +2,8 @@
 
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/uio.h>
+#include <time.h>
 
 int socket_open4();
 int socket_bind4(int s, uint32_t ip, uint16_t port);
@@ -26,6 +28,52 @@ int socket_listen(int s, uint32_t *localip, uint16_t *localport);
  * @returns number of bytes, 0, or negative number on error (i.e. EAGAIN or EWOULDBLOCK)
 */
 ssize_t socket_read(int s, char *buf, size_t len, int flags, int timeout_secs);
+/***
+ * Compute a deadline that is a number of milliseconds from now
+ * @param deadline where to put the results
+ * @param milliseconds how far in the future. 0 or less means no deadline (wait forever)
+ * @returns the deadline, or NULL if there is no deadline
+ */
+struct timespec* socket_deadline_after_ms(struct timespec* deadline, long milliseconds);
+
+/***
+ * How long until a deadline passes
+ * @param deadline the deadline, or NULL for none
+ * @returns milliseconds left (0 if it has passed), or -1 if there is no deadline
+ */
+int socket_deadline_remaining_ms(const struct timespec* deadline);
+
+/***
+ * Wait until a socket has something to read
+ * @param s the socket
+ * @param deadline when to give up, or NULL to wait forever
+ * @returns >0 if readable, 0 on timeout, negative on error
+ */
+int socket_wait_readable(int s, const struct timespec* deadline);
+
+/***
+ * Receive from a socket, waiting no later than the deadline. The socket is only
+ * polled if there is nothing to read yet, so the usual case is a single recv.
+ *
+ * @param s the socket
+ * @param buf where to put the bytes
+ * @param len the size of buf
+ * @param flags network flags
+ * @param deadline when to give up, or NULL to wait forever
+ * @returns number of bytes, 0 if the other side hung up, or -1 on error (errno is EAGAIN on timeout)
+ */
+ssize_t socket_read_until(int s, char *buf, size_t len, int flags, const struct timespec* deadline);
+
+/***
+ * Same as socket_read_until, but scatters the incoming bytes over several buffers
+ *
+ * @param s the socket
+ * @param regions where to put the bytes
+ * @param num_regions the number of entries in regions
+ * @param deadline when to give up, or NULL to wait forever
+ * @returns number of bytes, 0 if the other side hung up, or -1 on error (errno is EAGAIN on timeout)
+ */
+ssize_t socket_readv_until(int s, const struct iovec* regions, int num_regions, const struct timespec* deadline);
 ssize_t socket_write(int s, const char *buf, size_t len, int flags);
 /**
  * Used to send the size of the next transmission for "framed" transmissions. NOTE: This will send in big endian format
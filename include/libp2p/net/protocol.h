@@ -11,6 +11,11 @@ struct Libp2pProtocolHandler {
 	 * A protocol dependent context (often an IpfsNode pointer, but libp2p doesn't know about that)
 	 */
 	void* context;
+	/**
+	 * The protocol id (i.e. "/secio/1.0.0"), without the trailing newline. Handlers
+	 * with an id are found with a hash lookup. If NULL, CanHandle is asked instead.
+	 */
+	const char* protocol_id;
 	/**
 	 * Determines if this protocol can handle the incoming message
 	 * @param incoming the incoming data
@@ -50,6 +55,8 @@ void libp2p_protocol_handler_free(struct Libp2pProtocolHandler* handler);
 
 /***
  * Handle an incoming message
+ * NOTE: A message that names a protocol binds that protocol's handler to the stream. Later
+ * messages that are not protocol ids go straight to it.
  * @param message the incoming message
  * @param stream the incoming connection
  * @param handlers a Vector of protocol handlers
@@ -1,7 +1,12 @@
+#pragma once
+
 /**
  * Header for libp2p/net/server
  */
 
+// the number of connections a server (or each shard of a sharded server) will accept before turning new ones away
+#define LIBP2P_NET_SERVER_DEFAULT_MAX_CONNECTIONS 50
+
 /***
  * Start a server given the information
  * NOTE: This spins off a thread.
@@ -13,7 +18,20 @@
 int libp2p_net_server_start(const char* ip, int port, struct Libp2pVector* protocol_handlers);
 
 /***
- * Shut down the server started by libp2p_net_start_server
+ * Start a server that is split into shards. Each shard has its own listener on the
+ * same port (via SO_REUSEPORT), its own connections, and its own thread
+ * pinned to a core. Connections are never handed between shards.
+ * @param ip the ip address to attach to
+ * @param port the port to use
+ * @param protocol_handlers the protocol handlers
+ * @param num_shards the number of shards, or 0 for one per core
+ * @param max_connections the connection limit of each shard, or 0 for the default
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_net_server_start_sharded(const char* ip, int port, struct Libp2pVector* protocol_handlers, int num_shards, int max_connections);
+
+/***
+ * Shut down the server started by libp2p_net_server_start or libp2p_net_server_start_sharded
  * @returns true(1) on success, false(0) otherwise
  */
 int libp2p_net_server_stop();
@@ -2,6 +2,11 @@
 
 #include <pthread.h>
 #include <stdint.h>
+#include <sys/uio.h>
+#include "libp2p/utils/ring_buffer.h"
+
+struct StreamBuffer;
+struct Libp2pProtocolHandler;
 
 /**
  * Encapsulates a message that (was/will be) sent
@@ -11,6 +16,20 @@ struct StreamMessage {
 	uint8_t* data;
 	size_t data_size;
 	int error_number;
+	// if not NULL, data points into this shared buffer instead of its own allocation
+	struct StreamBuffer* buffer;
+};
+
+/**
+ * Memory that several StreamMessages can point into. Layers hand their
+ * payload up by moving data and data_size, instead of copying it.
+ */
+struct StreamBuffer {
+	int ref_count;
+	size_t capacity;
+	// the message that came with the buffer (in the same allocation)
+	struct StreamMessage message;
+	uint8_t bytes[];
 };
 
 /***
@@ -32,6 +51,40 @@ void libp2p_stream_message_free(struct StreamMessage* msg);
  */
 struct StreamMessage* libp2p_stream_message_copy(const struct StreamMessage* original);
 
+/***
+ * Create a StreamMessage whose data lives in a shared buffer. The message, the
+ * buffer and its data are one allocation.
+ * @param data_size the number of bytes of data
+ * @returns the StreamMessage, or NULL on error
+ */
+struct StreamMessage* libp2p_stream_message_new_buffer(size_t data_size);
+
+/***
+ * Create a message that shares part of another message's data. If the original
+ * has no shared buffer, the part is copied.
+ * @param original the original message
+ * @param offset where the part starts in the original's data
+ * @param data_size the size of the part
+ * @returns the new StreamMessage, or NULL on error
+ */
+struct StreamMessage* libp2p_stream_message_slice(struct StreamMessage* original, size_t offset, size_t data_size);
+
+/***
+ * Remove bytes from the front of a message (i.e. a header that has been parsed)
+ * @param msg the message
+ * @param num_bytes the number of bytes to remove
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_stream_message_strip(struct StreamMessage* msg, size_t num_bytes);
+
+// bytes waiting to go out a connection (defined in connectionstream.c)
+struct ConnectionWrite;
+// sends queued bytes for the connections of an event loop (defined in connectionstream.c)
+struct ConnectionFlusher;
+
+// how many bytes a connection can hold between reads from the socket
+#define CONNECTION_READ_BUFFER_SIZE 65536
+
 /**
  * This is a context struct for a basic IP connection
  */
@@ -39,6 +92,27 @@ struct ConnectionContext {
 	int socket_descriptor;
 	unsigned long long last_comm_epoch;
 	struct SessionContext* session_context;
+	// bytes received from the socket but not yet handed to a reader
+	struct RingBuffer* read_buffer;
+	/**
+	 * The outbound queue. Writers add to the tail. If the connection belongs to an
+	 * event loop with a ConnectionFlusher, that sends the queue as the socket becomes
+	 * writable. Otherwise the writer that finds the queue idle becomes the flusher,
+	 * waiting for the socket to become writable until the queue is empty.
+	 */
+	pthread_mutex_t write_lock;
+	pthread_cond_t write_drained; // signaled as the flusher makes progress
+	struct ConnectionWrite* write_queue;
+	struct ConnectionWrite* write_queue_tail;
+	size_t write_queue_size; // bytes waiting
+	size_t write_high_water; // writers wait (then give up) while write_queue_size is above this
+	int flushing;
+	int write_failed; // the queue could not be sent, so nothing more will be
+	// the ConnectionFlusher that sends the queue (NULL if writers do), and its list of connections
+	struct ConnectionFlusher* flusher;
+	int flusher_socket; // the socket as the flusher knows it
+	struct ConnectionContext* flusher_prev;
+	struct ConnectionContext* flusher_next;
 };
 
 /**
@@ -63,10 +137,17 @@ struct Stream {
 	 * A generic socket descriptor
 	 */
 	struct MultiAddress* address; // helps identify who is on the other end
-	pthread_mutex_t* socket_mutex; // only 1 transmission at a time
+	/**
+	 * Only 1 reader at a time (shared by the streams of a connection). Writers never
+	 * take it; each layer's write serializes itself (i.e. the connection's write queue),
+	 * so sending does not wait on a blocked read.
+	 */
+	pthread_mutex_t* read_mutex;
 	struct Stream* parent_stream; // what stream wraps this stream
 	int channel; // the channel (for multiplexing streams)
 	enum stream_type stream_type;
+	// the protocol negotiated on this stream, which gets messages that are not protocol ids (see libp2p_protocol_marshal)
+	const struct Libp2pProtocolHandler* protocol_handler;
 
 	/**
 	 * A generic place to store implementation-specific context items
@@ -92,6 +173,18 @@ struct Stream {
 	 */
 	int (*read_raw)(void* stream_context, uint8_t* buffer, int buffer_size, int timeout_secs);
 
+	/**
+	 * Reads exactly num_bytes as a message. The message may share memory with
+	 * what the stream already has, so the bytes are not copied. May be NULL;
+	 * see libp2p_stream_read_slice.
+	 * @param stream_context the context
+	 * @param num_bytes the number of bytes to read
+	 * @param message where to put the message
+	 * @param timeout_secs number of seconds before a timeout
+	 * @returns true(1) on success, false(0) otherwise
+	 */
+	int (*read_slice)(void* stream_context, size_t num_bytes, struct StreamMessage** message, int timeout_secs);
+
 	/**
 	 * Writes to a stream
 	 * @param stream the stream context (usually a SessionContext pointer)
@@ -100,6 +193,17 @@ struct Stream {
 	 */
 	int (*write)(void* stream_context, struct StreamMessage* buffer);
 
+	/**
+	 * Writes several buffers to a stream as if they were one. Layers add their own
+	 * header region in front and pass the chain down, so the payload is not copied
+	 * on the way to the socket. May be NULL; see libp2p_stream_writev.
+	 * @param stream_context the stream context
+	 * @param regions the buffers to write, in order
+	 * @param num_regions the number of buffers
+	 * @returns the number of bytes of the regions written, or 0 (or less) on error
+	 */
+	int (*writev)(void* stream_context, const struct iovec* regions, int num_regions);
+
 	/**
 	 * Closes a stream
 	 *
@@ -144,21 +248,44 @@ struct Stream* libp2p_stream_new();
 void libp2p_stream_free(struct Stream* stream);
 
 /***
- * Attempt to lock a stream for personal use. Does not block.
+ * Write several buffers to a stream as if they were one. If the stream has no
+ * writev, the buffers are joined and passed to write.
+ * @param stream the stream
+ * @param regions the buffers to write, in order
+ * @param num_regions the number of buffers
+ * @returns the number of bytes of the regions written, or 0 (or less) on error
+ */
+int libp2p_stream_writev(struct Stream* stream, const struct iovec* regions, int num_regions);
+
+/***
+ * Read exactly num_bytes from a stream as a message. If the stream has no
+ * read_slice, the bytes are read with read_raw into a new message.
+ * NOTE: yamux channels have no read_slice. Frame data is copied into the
+ * channel's buffer, so protocols running over yamux get copies.
+ * @param stream the stream
+ * @param num_bytes the number of bytes to read
+ * @param message where to put the message
+ * @param timeout_secs number of seconds before a timeout
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_stream_read_slice(struct Stream* stream, size_t num_bytes, struct StreamMessage** message, int timeout_secs);
+
+/***
+ * Attempt to take the read side of a stream for personal use. Does not block.
  * @param stream the stream to lock
  * @returns true(1) on success, false(0) otherwise
  */
 int libp2p_stream_try_lock(struct Stream* stream);
 
 /***
- * Attempt to lock a stream for personal use. Blocks until the lock is acquired
+ * Attempt to take the read side of a stream for personal use. Blocks until the lock is acquired
  * @param stream the stream to lock
  * @returns true(1) on success, false(0) otherwise
  */
 int libp2p_stream_lock(struct Stream* stream);
 
 /***
- * Attempt to unlock the mutex for this stream
+ * Attempt to give back the read side of this stream
  * @param stream the stream to unlock
  * @returns true(1) on success, false(0) otherwise
  */
@@ -1,7 +1,12 @@
 #pragma once
 
+#include <pthread.h>
 #include "libp2p/utils/linked_list.h"
 #include "libp2p/peer/peer.h"
+#include "libp2p/routing/routing_table.h"
+
+// peers are spread across this many independently locked indexes
+#define PEERSTORE_SHARDS 16
 
 /**
  * Structures and functions to implement a storage area for peers and
@@ -20,12 +25,16 @@ struct PeerEntry {
 
 /**
  * Contains a collection of peers and their metadata
- * NOTE: this is currently a linked list. Perhaps a better algo would
- * improve performance, but will wait.
+ * NOTE: Peers are found through the sharded index. The linked list holds the same
+ * entries in the order they were added (the local peer first), for walking through them.
+ * Entries are only removed when the peerstore is freed.
  */
 struct Peerstore {
 	struct Libp2pLinkedList* head_entry;
 	struct Libp2pLinkedList* last_entry;
+	pthread_mutex_t list_lock; // held while adding to the list
+	struct PeerstoreShard* shards; // the index by peer id, PEERSTORE_SHARDS of them (see peerstore.c)
+	struct RoutingTable* routing_table; // the same peers, by distance from the local peer
 };
 
 struct PeerEntry* libp2p_peer_entry_new();
@@ -48,8 +57,8 @@ int libp2p_peerstore_free(struct Peerstore* in);
 /**
  * Add a Peer to the Peerstore
  * @param peerstore the peerstore to add the entry to
- * @param peer_entry the entry to add
- * @returns true(1) on success, otherwise false
+ * @param peer_entry the entry to add. The peerstore owns it if this succeeds
+ * @returns true(1) on success, otherwise false (i.e. a peer with that id is already there)
  */
 int libp2p_peerstore_add_peer_entry(struct Peerstore* peerstore, struct PeerEntry* peer_entry);
 
@@ -1,26 +1,58 @@
 #pragma once
 
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
 #include "libp2p/db/datastore.h"
 #include "libp2p/peer/peer.h"
 
+// how long someone's announcement is good for, unless they announce again
+#define PROVIDERSTORE_DEFAULT_TTL (24 * 60 * 60)
+// how often expired announcements are cleaned out
+#define PROVIDERSTORE_SWEEP_INTERVAL (60 * 60)
+// how many buckets one request sweeps, so a big store is cleaned out a piece at a time
+#define PROVIDERSTORE_SWEEP_BUCKETS 64
+// the most providers kept for one hash. When full, the one closest to expiring is replaced
+#define PROVIDERSTORE_MAX_PROVIDERS 20
+
 /**
- * Contains a hash and the peer id of
- * who can provide it
+ * The peer id of someone who can provide a hash.
+ * NOTE: This is one allocation, the peer id follows the struct
  */
-struct ProviderEntry {
-	unsigned char* hash;
-	int hash_size;
-	unsigned char* peer_id;
+struct ProviderRecord {
+	struct ProviderRecord* next; // the next provider of the same hash
+	time_t expires;
 	int peer_id_size;
+	unsigned char peer_id[];
+};
+
+/**
+ * A hash, and who can provide it.
+ * NOTE: This is one allocation, the hash follows the struct
+ */
+struct ProviderKey {
+	struct ProviderKey* next; // the next key in the same bucket
+	uint64_t hash_code;
+	struct ProviderRecord* providers;
+	int num_providers;
+	int hash_size;
+	unsigned char hash[];
 };
 
 /***
  * A structure to store providers. The implementation
- * is a vector of ProviderEntry structures, which contain
- * the hash and peer id.
+ * is a hash table of ProviderKeys, each with a list of
+ * ProviderRecords.
  */
 struct ProviderStore {
-	struct Libp2pVector* provider_entries;
+	struct ProviderKey** buckets;
+	size_t num_buckets; // a power of 2
+	size_t num_keys;
+	size_t num_records;
+	int record_ttl; // seconds an announcement is good for
+	time_t last_sweep; // when the last sweep finished
+	size_t sweep_bucket; // where the sweep in progress picks up. 0 if there is none
+	pthread_mutex_t lock;
 	// this is requred so we can look locally for requests
 	const struct Datastore* datastore;
 	const struct Libp2pPeer* local_peer;
@@ -38,6 +70,49 @@ struct ProviderStore* libp2p_providerstore_new(const struct Datastore* datastore
  */
 void libp2p_providerstore_free(struct ProviderStore* in);
 
+/***
+ * Remember that a peer can provide a hash. If it was already known, its time is extended.
+ * @param store the ProviderStore
+ * @param hash the hash
+ * @param hash_size the size of the hash
+ * @param peer_id the peer that can provide it
+ * @param peer_id_size the size of peer_id
+ * @returns true(1) on success, false(0) otherwise
+ */
 int libp2p_providerstore_add(struct ProviderStore* store, const unsigned char* hash, int hash_size, const unsigned char* peer_id, int peer_id_size);
 
+/**
+ * See if someone has announced a key. If so, pass the peer_id
+ * NOTE: This will check to see if I can provide it from my datastore
+ *
+ * @param store the list of providers
+ * @param hash what we're looking for
+ * @param hash_size the length of the hash
+ * @param peer_id the peer_id of who can provide it
+ * @param peer_id_size the allocated size of peer_id
+ * @returns true(1) if we found something, false(0) if not.
+ */
 int libp2p_providerstore_get(struct ProviderStore* store, const unsigned char* hash, int hash_size, unsigned char** peer_id, int *peer_id_size);
+
+/***
+ * Get the peers that have announced a hash
+ * NOTE: This does not check the datastore
+ * @param store the ProviderStore
+ * @param hash what we're looking for
+ * @param hash_size the length of the hash
+ * @param peer_ids where to put the peer ids (allocated here, the caller frees each of them)
+ * @param peer_id_sizes where to put the sizes of the peer ids
+ * @param max the number of slots in peer_ids and peer_id_sizes
+ * @returns the number of peer ids found
+ */
+int libp2p_providerstore_get_providers(struct ProviderStore* store, const unsigned char* hash, int hash_size, unsigned char** peer_ids, int* peer_id_sizes, int max);
+
+/***
+ * Remove announcements that have expired, all at once
+ * NOTE: This happens on its own every PROVIDERSTORE_SWEEP_INTERVAL as the store is used,
+ * PROVIDERSTORE_SWEEP_BUCKETS buckets per request
+ * @param store the ProviderStore
+ * @param now the current time
+ * @returns the number of announcements removed
+ */
+int libp2p_providerstore_sweep(struct ProviderStore* store, time_t now);
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdint.h>
+#include <pthread.h>
+#include "libp2p/peer/peer.h"
+
+/***
+ * A Kademlia routing table. Peers are placed by the SHA256 of their id,
+ * in the bucket for the number of leading bits they share with the local peer.
+ */
+
+// the size of the keys (SHA256)
+#define ROUTING_TABLE_KEY_SIZE 32
+// one bucket for each possible length of the shared prefix
+#define ROUTING_TABLE_NUM_BUCKETS (ROUTING_TABLE_KEY_SIZE * 8)
+// the most peers in one bucket (Kademlia's K)
+#define ROUTING_TABLE_BUCKET_SIZE 20
+
+struct RoutingTableEntry {
+	uint8_t key[ROUTING_TABLE_KEY_SIZE];
+	struct Libp2pPeer* peer; // owned by the peerstore
+};
+
+/***
+ * The peers that share the same number of leading bits with the local peer.
+ * The least recently seen is first.
+ */
+struct RoutingTableBucket {
+	struct RoutingTableEntry entries[ROUTING_TABLE_BUCKET_SIZE];
+	int count;
+};
+
+struct RoutingTable {
+	uint8_t local_key[ROUTING_TABLE_KEY_SIZE];
+	struct RoutingTableBucket* buckets[ROUTING_TABLE_NUM_BUCKETS]; // NULL until something goes in it
+	int num_peers;
+	pthread_mutex_t lock;
+};
+
+/***
+ * Create a new, empty routing table
+ * @param local_id the id of the local peer
+ * @param local_id_size the size of local_id
+ * @returns the table, or NULL on error
+ */
+struct RoutingTable* libp2p_routing_table_new(const unsigned char* local_id, size_t local_id_size);
+
+/***
+ * Free resources of a routing table (but not the peers in it)
+ * @param table the table
+ */
+void libp2p_routing_table_free(struct RoutingTable* table);
+
+/***
+ * We heard from (or about) a peer. Add it, or mark it as the most recently seen.
+ * NOTE: If its bucket is full, the least recently seen peer is replaced only if it is not connected.
+ * @param table the table
+ * @param peer the peer. It must live as long as it is in the table
+ * @returns true(1) if the peer is in the table, false(0) otherwise
+ */
+int libp2p_routing_table_update(struct RoutingTable* table, struct Libp2pPeer* peer);
+
+/***
+ * Take a peer out of the table (i.e. it cannot be reached)
+ * @param table the table
+ * @param peer_id the id of the peer
+ * @param peer_id_size the size of peer_id
+ * @returns true(1) if it was there, false(0) otherwise
+ */
+int libp2p_routing_table_remove(struct RoutingTable* table, const unsigned char* peer_id, size_t peer_id_size);
+
+/***
+ * Find the peers closest to a key
+ * @param table the table
+ * @param key the key (it is hashed, as peer ids are). NULL for the peers closest to us
+ * @param key_size the size of key
+ * @param results where to put the peers, closest first
+ * @param max the number of slots in results
+ * @returns the number of peers found
+ */
+int libp2p_routing_table_nearest(struct RoutingTable* table, const unsigned char* key, size_t key_size, struct Libp2pPeer** results, int max);
@@ -10,6 +10,9 @@
  * Handling of a secure connection
  */
 
+// how long an incoming handshake may take, in seconds
+#define SECIO_HANDSHAKE_TIMEOUT 10
+
 enum SecioStatus {
 	secio_status_unknown,
 	secio_status_initialized,
@@ -24,7 +27,14 @@ struct SecioContext {
 	struct Peerstore* peer_store;
 	struct StreamMessage* buffered_message;
 	size_t buffered_message_pos;
+	// the record that is arriving. Kept between reads, so one that trickles in is never waited on.
+	uint8_t record_size_bytes[4];
+	size_t record_size_pos;
+	struct StreamMessage* record;
+	size_t record_pos;
 	volatile enum SecioStatus status;
+	// keeps records in the order the cipher produced them. Only writers take it.
+	pthread_mutex_t write_lock;
 };
 
 struct Libp2pProtocolHandler* libp2p_secio_build_protocol_handler(struct RsaPrivateKey* private_key, struct Peerstore* peer_store);
@@ -66,9 +76,10 @@ int libp2p_secio_receive_protocol(struct Stream* stream);
  * keys, IDs, and initiate connection. This is a framed messaging system
  * NOTE: session must contain a valid socket_descriptor that is a multistream.
  * @param secio_stream a stream that is a Secio stream
+ * @param timeout_secs how long the whole handshake may take (0 or less for no limit)
  * @returns true(1) on success, false(0) otherwise
  */
-int libp2p_secio_handshake(struct Stream* secio_stream);
+int libp2p_secio_handshake(struct Stream* secio_stream, int timeout_secs);
 
 /***
  * Wait for secio stream to become ready
@@ -3,13 +3,18 @@
 /***
  * This listens for requests from the connected peers
  */
+#include <pthread.h>
 #include "libp2p/utils/thread_pool.h"
 #include "libp2p/db/datastore.h"
 #include "libp2p/db/filestore.h"
 #include "libp2p/peer/peer.h"
 
 struct SwarmContext {
-	threadpool thread_pool;
+	threadpool thread_pool; // handles connections that have bytes waiting
+	int epoll_fd; // the connections being watched
+	struct ConnectionFlusher* flusher; // sends what the connections have queued, as their sockets take more
+	pthread_t event_thread; // the thread that waits on epoll_fd
+	volatile int shutting_down;
 	struct Libp2pVector* protocol_handlers;
 	struct Datastore* datastore;
 	struct Filestore* filestore;
@@ -42,3 +47,10 @@ int libp2p_swarm_add_connection(struct SwarmContext* context, int file_descripto
  * @returns the SwarmContext
  */
 struct SwarmContext* libp2p_swarm_new(struct Libp2pVector* protocol_handlers, struct Datastore* datastore, struct Filestore* filestore);
+
+/***
+ * Shut down the swarm engine, and free the resources of libp2p_swarm_new
+ * NOTE: the connections that were added stay open. They belong to their sessions.
+ * @param context the SwarmContext
+ */
+void libp2p_swarm_free(struct SwarmContext* context);
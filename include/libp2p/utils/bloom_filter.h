@@ -0,0 +1,49 @@
+#pragma once
+
+/**
+ * A Bloom filter. It can say for certain that a key was never added,
+ * but "maybe" is all it can say about the rest.
+ *
+ * NOTE: Adding and checking may happen on different threads at the same time.
+ * Keys cannot be removed.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct BloomFilter {
+	size_t num_bits;
+	int num_hashes;
+	uint8_t bits[];
+};
+
+/***
+ * Create a new, empty Bloom filter
+ * @param size the number of bytes to use for the filter
+ * @param num_hashes the number of bits each key sets
+ * @returns the filter, or NULL on error
+ */
+struct BloomFilter* libp2p_utils_bloom_filter_new(size_t size, int num_hashes);
+
+/***
+ * Free resources of a Bloom filter
+ * @param filter the filter
+ */
+void libp2p_utils_bloom_filter_free(struct BloomFilter* filter);
+
+/***
+ * Add a key to the filter
+ * @param filter the filter
+ * @param key the key
+ * @param key_size the size of the key
+ */
+void libp2p_utils_bloom_filter_add(struct BloomFilter* filter, const uint8_t* key, size_t key_size);
+
+/***
+ * See if a key may have been added
+ * @param filter the filter
+ * @param key the key
+ * @param key_size the size of the key
+ * @returns true(1) if the key may have been added, false(0) if it definitely was not
+ */
+int libp2p_utils_bloom_filter_contains(const struct BloomFilter* filter, const uint8_t* key, size_t key_size);
@@ -0,0 +1,29 @@
+#pragma once
+
+/**
+ * Lets threads sleep until a connection changes state (a protocol is acknowledged,
+ * a stream is upgraded, etc.) instead of polling. Whoever changes the state calls
+ * signal, and waiters re-check their condition.
+ */
+
+/***
+ * Checks whether the thing being waited on is ready
+ * @param context what was passed to wait
+ * @returns true(1) if ready, false(0) otherwise
+ */
+typedef int (*libp2p_utils_readiness_check)(void* context);
+
+/***
+ * Wake up everyone waiting, so they can check whether they are ready.
+ * Call this after the state has changed.
+ */
+void libp2p_utils_readiness_signal();
+
+/***
+ * Wait until the check passes, or the time runs out
+ * @param check the function that decides if we're ready
+ * @param context passed to check
+ * @param timeout_secs the number of seconds to wait
+ * @returns true(1) if check passed, false(0) on timeout
+ */
+int libp2p_utils_readiness_wait(libp2p_utils_readiness_check check, void* context, int timeout_secs);
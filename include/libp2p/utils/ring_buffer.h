@@ -0,0 +1,82 @@
+#pragma once
+
+/**
+ * A fixed size ring buffer of bytes. Not threadsafe; it is meant to be owned
+ * by one reader (i.e. the receive side of a connection).
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+/***
+ * Holds the information about the ring buffer
+ */
+struct RingBuffer {
+	uint8_t* buffer;
+	size_t capacity;
+	size_t head; // where the next byte will be read from
+	size_t size; // how many bytes are waiting
+};
+
+/***
+ * Allocate a new ring buffer
+ * @param capacity the number of bytes the buffer can hold
+ * @returns the newly allocated RingBuffer, or NULL on error (out of memory?)
+ */
+struct RingBuffer* libp2p_utils_ring_buffer_new(size_t capacity);
+
+/***
+ * Free resources of a ring buffer
+ * @param ring the ring buffer
+ */
+void libp2p_utils_ring_buffer_free(struct RingBuffer* ring);
+
+/***
+ * The number of bytes waiting to be read
+ * @param ring the ring buffer
+ * @returns the number of bytes waiting
+ */
+size_t libp2p_utils_ring_buffer_size(const struct RingBuffer* ring);
+
+/***
+ * Look at bytes without consuming them
+ * @param ring the ring buffer
+ * @param results where to put the bytes
+ * @param results_size the most bytes to copy
+ * @returns the number of bytes copied
+ */
+size_t libp2p_utils_ring_buffer_peek(const struct RingBuffer* ring, uint8_t* results, size_t results_size);
+
+/***
+ * Copy bytes out of the buffer, and consume them
+ * @param ring the ring buffer
+ * @param results where to put the bytes
+ * @param results_size the most bytes to copy
+ * @returns the number of bytes copied
+ */
+size_t libp2p_utils_ring_buffer_read(struct RingBuffer* ring, uint8_t* results, size_t results_size);
+
+/***
+ * Throw away bytes from the front of the buffer
+ * @param ring the ring buffer
+ * @param num_bytes the number of bytes to throw away
+ * @returns the number of bytes thrown away
+ */
+size_t libp2p_utils_ring_buffer_consume(struct RingBuffer* ring, size_t num_bytes);
+
+/***
+ * Describe the free space of the buffer, so that it can be filled directly (i.e. with readv).
+ * Call libp2p_utils_ring_buffer_commit afterwards with the number of bytes that were placed.
+ * @param ring the ring buffer
+ * @param regions where to put the description. Must have room for 2 entries.
+ * @returns the number of regions (0 if the buffer is full)
+ */
+int libp2p_utils_ring_buffer_free_regions(struct RingBuffer* ring, struct iovec* regions);
+
+/***
+ * Mark bytes placed into the free regions as waiting to be read
+ * @param ring the ring buffer
+ * @param num_bytes the number of bytes that were placed
+ */
+void libp2p_utils_ring_buffer_commit(struct RingBuffer* ring, size_t num_bytes);
@@ -0,0 +1,52 @@
+#pragma once
+
+/**
+ * A size classed allocator for the small objects that come and go with every
+ * message (StreamMessages, Streams, frames, jobs, etc.)
+ *
+ * Each thread keeps a few free blocks of each size class, so in steady state
+ * an allocation is a pop off of a thread local list. Blocks that pile up on one
+ * thread go to a shared depot, where other threads can pick them up.
+ *
+ * NOTE: memory from libp2p_utils_slab_alloc must be released with
+ * libp2p_utils_slab_free, never free(). Any thread may free a block.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/***
+ * Counts of what the allocator has done, since the program started
+ */
+struct SlabStats {
+	uint64_t allocations; // calls to libp2p_utils_slab_alloc
+	uint64_t frees; // calls to libp2p_utils_slab_free
+	uint64_t system_allocations; // allocations that had to go to malloc
+	uint64_t system_frees; // frees that went to free
+};
+
+/***
+ * Allocate memory
+ * @param size the number of bytes needed
+ * @returns the memory, or NULL on error (out of memory?)
+ */
+void* libp2p_utils_slab_alloc(size_t size);
+
+/***
+ * Allocate memory and set it to zero
+ * @param size the number of bytes needed
+ * @returns the memory, or NULL on error (out of memory?)
+ */
+void* libp2p_utils_slab_calloc(size_t size);
+
+/***
+ * Give back memory from libp2p_utils_slab_alloc
+ * @param ptr the memory (may be NULL)
+ */
+void libp2p_utils_slab_free(void* ptr);
+
+/***
+ * Get the counters, summed over all threads
+ * @param stats where to put the results
+ */
+void libp2p_utils_slab_stats(struct SlabStats* stats);
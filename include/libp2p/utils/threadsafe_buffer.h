@@ -2,19 +2,41 @@
 
 /**
  * A thredsafe buffer
+ *
+ * NOTE: This is a single producer / single consumer buffer. One thread may write while
+ * another reads (or peeks, or waits) without either taking a lock. Bytes are kept in a
+ * chain of fixed size segments, so nothing is moved or reallocated as the buffer fills
+ * and drains.
  */
 
 #include <string.h>
 #include <pthread.h>
 #include <stdint.h>
 
+#define THREADSAFE_BUFFER_SEGMENT_SIZE (16 * 1024)
+
+/***
+ * A piece of the buffer
+ */
+struct ThreadsafeBufferSegment {
+	struct ThreadsafeBufferSegment* next; // set by the writer when this one is full
+	size_t write_pos; // how far the writer has filled this segment
+	size_t read_pos; // how far the reader has read this segment
+	uint8_t data[THREADSAFE_BUFFER_SEGMENT_SIZE];
+};
+
 /***
  * Holds the information about the buffer
  */
 struct ThreadsafeBufferContext {
-	size_t buffer_size;
-	uint8_t* buffer;
-	pthread_mutex_t lock;
+	struct ThreadsafeBufferSegment* head; // where the reader is (only the reader touches this)
+	struct ThreadsafeBufferSegment* tail; // where the writer is (only the writer touches this)
+	struct ThreadsafeBufferSegment* spare; // a drained segment, passed back to the writer for reuse
+	size_t bytes_written; // total bytes ever written
+	size_t bytes_read; // total bytes ever read
+	int waiting; // number of readers waiting for bytes
+	pthread_mutex_t lock; // only used to wait for bytes
+	pthread_cond_t readable;
 };
 
 /***
@@ -29,6 +51,13 @@ struct ThreadsafeBufferContext* threadsafe_buffer_context_new();
  */
 void threadsafe_buffer_context_free(struct ThreadsafeBufferContext* context);
 
+/***
+ * The number of bytes waiting to be read
+ * @param context the context
+ * @returns the number of bytes
+ */
+size_t threadsafe_buffer_size(struct ThreadsafeBufferContext* context);
+
 /***
  * Read from the buffer without destroying its contents or moving its read pointer
  * @param context the context
@@ -48,6 +77,15 @@ size_t threadsafe_buffer_peek(struct ThreadsafeBufferContext* context, uint8_t*
  */
 size_t threadsafe_buffer_read(struct ThreadsafeBufferContext* context, uint8_t* results, size_t results_size);
 
+/***
+ * Wait for bytes to be written
+ * @param context the context
+ * @param min_bytes how many bytes we want waiting
+ * @param timeout_secs how long to wait
+ * @returns the number of bytes waiting (which may be less than min_bytes if it timed out)
+ */
+size_t threadsafe_buffer_wait(struct ThreadsafeBufferContext* context, size_t min_bytes, int timeout_secs);
+
 /****
  * Add bytes to the end of the buffer
  * @param context the context
@@ -7,13 +7,24 @@
 struct yamux_config
 {
     size_t   accept_backlog        ;
-    uint32_t max_stream_window_size;
+    uint32_t max_stream_window_size; // how far the receive window of one stream may grow
+    size_t   max_session_window_growth; // how far the receive windows of all streams of a session may grow, combined
+    size_t   send_quantum          ; // how much one stream may send before the next stream gets a turn
+    size_t   coalesce_size         ; // frames waiting to be sent are put in one write until it is this big
 };
 
+// the window every stream starts with (from the yamux spec)
 #define YAMUX_DEFAULT_WINDOW (0x100*0x400)
+#define YAMUX_DEFAULT_MAX_WINDOW (0x10*0x400*0x400)
+#define YAMUX_DEFAULT_MAX_SESSION_WINDOW_GROWTH (0x40*0x400*0x400)
+#define YAMUX_DEFAULT_SEND_QUANTUM (0x10*0x400)
+#define YAMUX_DEFAULT_COALESCE_SIZE (0x10*0x400)
 
 #define YAMUX_DEFAULT_CONFIG ((struct yamux_config)\
 {\
     .accept_backlog=0x100,\
-    .max_stream_window_size=YAMUX_DEFAULT_WINDOW\
+    .max_stream_window_size=YAMUX_DEFAULT_MAX_WINDOW,\
+    .max_session_window_growth=YAMUX_DEFAULT_MAX_SESSION_WINDOW_GROWTH,\
+    .send_quantum=YAMUX_DEFAULT_SEND_QUANTUM,\
+    .coalesce_size=YAMUX_DEFAULT_COALESCE_SIZE\
 })
@@ -3,7 +3,9 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <time.h>
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include "config.h"
 #include "frame.h"
@@ -23,6 +25,22 @@ enum yamux_error
     yamux_error_intern = 0x02
 };
 
+/**
+ * Priority classes for sending. Streams in a higher class always go
+ * first. Streams in the same class take turns.
+ */
+enum yamux_priority
+{
+    yamux_priority_high   = 0, // small, latency sensitive messages
+    yamux_priority_normal = 1,
+    yamux_priority_bulk   = 2, // large transfers
+};
+#define YAMUX_PRIORITY_CLASSES 3
+
+// the most frames, and buffers, the scheduler puts in one write
+#define YAMUX_SEND_MAX_FRAMES 32
+#define YAMUX_SEND_MAX_REGIONS 64
+
 // forward declarations
 struct yamux_session;
 struct yamux_stream;
@@ -37,10 +55,37 @@ typedef void  (*yamux_session_go_away_fn   )(struct yamux_session* session, enum
 typedef void  (*yamux_session_new_stream_fn)(struct YamuxContext* context, struct Stream* stream, struct StreamMessage* msg);
 typedef void  (*yamux_session_free_fn      )(struct yamux_session* sesssion                            );
 
+/**
+ * A slot in the session's stream table
+ */
 struct yamux_session_stream
 {
     struct yamux_stream* stream;
-    int alive;
+    int alive; // true(1) if this slot is in use
+};
+
+/**
+ * Data waiting for its turn to be sent. The data is not copied, so the
+ * writer waits until it is done.
+ */
+struct yamux_send_request
+{
+    struct yamux_send_request* next;
+    struct Stream* parent_stream; // where the frames go
+    int priority; // the class this request is queued in
+    struct yamux_frame* control; // an encoded frame with no data (window update, ping...) to send as is, or NULL
+    int after_data; // true(1) if the control frame waits for the data queued for its stream (all streams if 0)
+    yamux_streamid streamid;
+    uint16_t flags; // for the first frame
+    const struct iovec* regions; // the data
+    int num_regions;
+    int region; // where we are in the regions
+    size_t region_pos;
+    size_t remaining; // data bytes not yet given a turn
+    size_t sent; // data bytes sent
+    size_t deficit; // how many bytes this request may send in its turn
+    int done; // 1 when sent, -1 on failure
+    int error; // the errno of the failure
 };
 
 /**
@@ -50,9 +95,9 @@ struct yamux_session
 {
     struct yamux_config* config; // configuration of size of windows and max number of streams
 
-    size_t num_streams; // number of streams
-    size_t cap_streams; // capacity of stream array
-    struct yamux_session_stream* streams; // array of streams
+    size_t num_streams; // number of streams in the table
+    size_t cap_streams; // number of slots in the table (always a power of 2)
+    struct yamux_session_stream* streams; // hash table of streams, keyed by stream id
 
     /**
      * Get user data
@@ -89,6 +134,47 @@ struct yamux_session
      */
     struct timespec since_ping;
 
+    /**
+     * The round trip time measured by the last ping, in microseconds (0 if not yet known)
+     */
+    uint64_t rtt_usecs;
+
+    /**
+     * Protects the window sizes of the streams, and changes to the stream table
+     */
+    pthread_mutex_t window_lock;
+
+    /**
+     * Signalled when the remote opens up the send window of a stream
+     */
+    pthread_cond_t window_opened;
+
+    /**
+     * How far the receive windows of the streams have grown beyond YAMUX_DEFAULT_WINDOW, combined
+     */
+    size_t window_growth;
+
+    /**
+     * Protects the send queues
+     */
+    pthread_mutex_t send_lock;
+
+    /**
+     * Signalled when requests are finished, or nobody is sending
+     */
+    pthread_cond_t send_done;
+
+    /**
+     * Writes waiting for their turn, by priority class
+     */
+    struct yamux_send_request* send_queue[YAMUX_PRIORITY_CLASSES];
+    struct yamux_send_request* send_queue_tail[YAMUX_PRIORITY_CLASSES];
+
+    /**
+     * True(1) while a writer is sending for everyone
+     */
+    int sending;
+
     /**
      * Session type (client or server)
      */
@@ -148,8 +234,71 @@ int yamux_decode(void* context, const uint8_t* incoming, size_t incoming_size, s
 
 /***
  * Find the correct yamux session stream
+ * NOTE: the window_lock should be held, as the slot moves when the table changes
  * @param streams the collection
  * @param channel the id
  * @returns the correce yamux_session_stream
  */
 struct yamux_session_stream* yamux_get_session_stream(struct yamux_session* session, int channel);
+
+/***
+ * Look up a stream by id, safe against other threads adding or removing streams
+ * @param session the session
+ * @param id the stream id
+ * @returns the stream, or NULL if there is no stream with that id
+ */
+struct yamux_stream* yamux_session_get_stream(struct yamux_session* session, yamux_streamid id);
+
+/***
+ * Add a stream to the session's stream table, growing the table if necessary
+ * @param session the session
+ * @param stream the stream (its id must be set)
+ * @returns the slot that now holds the stream, or NULL if the id is in use (or out of memory)
+ */
+struct yamux_session_stream* yamux_session_add_stream(struct yamux_session* session, struct yamux_stream* stream);
+
+/***
+ * Take a stream out of the session's stream table, so the slot can be reused
+ * NOTE: this does not free the stream
+ * @param session the session
+ * @param stream the stream (nothing is removed if its id now belongs to another stream)
+ * @returns true(1) if it was found and removed, false(0) otherwise
+ */
+int yamux_session_remove_stream(struct yamux_session* session, struct yamux_stream* stream);
+
+/***
+ * Send data frames through the session's scheduler. Writers take turns: each gets to send
+ * up to config->send_quantum bytes (deficit round robin), and higher priority classes go first.
+ * Frames that are waiting together are sent together, up to config->coalesce_size bytes.
+ * NOTE: The caller must already have the window for all of the data
+ * @param session the session
+ * @param parent_stream where the frames go
+ * @param streamid the stream the data is for
+ * @param flags the flags for the first frame
+ * @param priority the priority class (see enum yamux_priority)
+ * @param regions the data
+ * @param num_regions the number of regions
+ * @returns the number of data bytes sent, or -1 if nothing was sent (errno is set)
+ */
+ssize_t yamux_session_send(struct yamux_session* session, struct Stream* parent_stream, yamux_streamid streamid, uint16_t flags, int priority, const struct iovec* regions, int num_regions);
+
+/***
+ * Send a frame without data (a window update, ping, etc.) through the session's scheduler.
+ * It goes ahead of data frames, and shares a secio record with whatever else is waiting.
+ * @param session the session
+ * @param parent_stream where the frame goes
+ * @param frame the frame, already encoded
+ * @returns true(1) on success, false(0) otherwise
+ */
+int yamux_session_send_frame(struct yamux_session* session, struct Stream* parent_stream, struct yamux_frame* frame);
+
+/***
+ * Send a frame that ends a stream (a FIN) or the session (a go away) through the session's
+ * scheduler. It waits for the data already queued for its stream (or, for the session, all
+ * streams), so it can't get there before that data does.
+ * @param session the session
+ * @param parent_stream where the frame goes
+ * @param frame the frame, already encoded
+ * @returns true(1) on success, false(0) otherwise
+ */
+int yamux_session_send_last_frame(struct yamux_session* session, struct Stream* parent_stream, struct yamux_frame* frame);
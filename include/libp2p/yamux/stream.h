@@ -70,11 +70,67 @@ ssize_t yamux_stream_close(void* context);
 // uses RST
 ssize_t yamux_stream_reset(struct YamuxChannelContext* stream);
 
+/***
+ * Allocate an empty yamux_stream
+ * @returns the new stream, or NULL if out of memory
+ */
+struct yamux_stream* yamux_stream_new();
+
+/***
+ * Release resources of stream, and take it out of the session's stream table
+ * @param stream the stream
+ */
 void yamux_stream_free(struct yamux_stream* stream);
 
 ssize_t yamux_stream_window_update(struct YamuxChannelContext* ctx, int32_t delta);
 ssize_t yamux_stream_write(struct YamuxChannelContext* ctx, uint32_t data_length, void* data);
 
+/***
+ * The application has read bytes out of the channel's buffer. Sends window updates
+ * (and grows the window) as needed.
+ * @param channel_ctx the channel
+ * @param bytes the number of bytes read
+ */
+void yamux_stream_consumed(struct YamuxChannelContext* channel_ctx, size_t bytes);
+
+/**
+ * Have a dispatcher thread handle a child's reading of data
+ * @param context the YamuxChannelContext
+ * @returns true(1) if the channel was handed to the dispatcher, false(0) if it is already there (or on error)
+ */
+int libp2p_yamux_notify_child_stream_has_data(struct YamuxChannelContext* context);
+
+/***
+ * A channel is being closed. Stop handing it to the dispatcher, and wait for a
+ * dispatcher thread that has it to let go.
+ * @param context the YamuxChannelContext
+ * @returns true(1) if the caller may free the channel now, false(0) if we were called
+ * from the channel's own handler, and the dispatcher thread will free it when the handler returns
+ */
+int yamux_stream_dispatch_stop(struct YamuxChannelContext* context);
+
+/***
+ * The buffer holds part of a message the child can't read yet. If the part is half the
+ * receive window, give the window back now, or a message bigger than the window could
+ * never arrive. Nothing is given back once max_stream_window_size bytes are waiting.
+ * @param channel_ctx the channel
+ */
+void yamux_stream_credit_buffered(struct YamuxChannelContext* channel_ctx);
+
+/***
+ * A channel is going away. Give back what its receive window grew.
+ * @param channel_ctx the channel
+ */
+void yamux_stream_release_window(struct YamuxChannelContext* channel_ctx);
+
+/***
+ * Take bytes from the send window of a channel, waiting for the remote to open it if it is empty
+ * @param channel_ctx the channel
+ * @param wanted the number of bytes we would like to send
+ * @returns the number of bytes that may be sent now (up to wanted), or 0 if the window stayed closed
+ */
+uint32_t yamux_stream_reserve_window(struct YamuxChannelContext* channel_ctx, uint32_t wanted);
+
 /***
  * process stream
  * @param stream the stream
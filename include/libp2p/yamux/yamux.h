@@ -38,6 +38,15 @@ struct YamuxContext {
 	 */
 	struct StreamMessage* buffered_message;
 	long buffered_message_pos;
+	/**
+	 * Bytes from the network that have not been decoded yet. This is
+	 * usually the start of a frame whose data has not all arrived. The
+	 * waiting bytes begin at frame_buffer_pos.
+	 */
+	uint8_t* frame_buffer;
+	size_t frame_buffer_pos;
+	size_t frame_buffer_size;
+	size_t frame_buffer_capacity;
 };
 
 struct YamuxChannelContext {
@@ -57,8 +66,26 @@ struct YamuxChannelContext {
 	int closed;
 	// a buffer for data coming in from the network
 	struct ThreadsafeBufferContext* buffer;
-	// true if read is already running
+	// how many bytes the remote may send before hearing from us (protected by the session's window_lock)
+	uint32_t receive_window;
+	// bytes read out of the buffer since the last window update
+	uint32_t receive_consumed;
+	// buffered bytes given back to the remote before they were read (part of a message bigger than the window)
+	uint32_t receive_credited;
+	// how many more bytes the remote may send with the window updates it has been sent
+	uint32_t receive_remaining;
+	// when the last window update was sent
+	struct timespec receive_window_time;
+	// true if the dispatcher has this channel (protected by the dispatcher's lock)
 	int read_running;
+	// true if more data came in while the dispatcher had this channel
+	int read_pending;
+	// set when the channel is closed, 2 if the dispatcher thread should free it (protected by the dispatcher's lock)
+	int read_closed;
+	// the dispatcher thread that last ran this channel
+	pthread_t read_thread;
+	// the send priority class (see enum yamux_priority)
+	int priority;
 };
 
 /**
@@ -112,8 +139,27 @@ int libp2p_yamux_stream_add(struct YamuxContext* ctx, struct Stream* stream);
  */
 struct Stream* libp2p_yamux_channel_stream_new(struct Stream* incoming_stream, int channelNumber);
 
+/***
+ * Free the memory of a channel that has been closed
+ * @param ctx the YamuxChannelContext
+ */
 void libp2p_yamux_channel_free(struct YamuxChannelContext* ctx);
 
+/***
+ * Sends a FIN to close a channel
+ * @param channel the channel to close
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_yamux_channel_send_FIN(struct YamuxChannelContext* channel);
+
+/***
+ * Change how a channel's writes are scheduled against the other channels of the session
+ * @param stream the yamux channel stream (or a stream above it)
+ * @param priority the priority class (see enum yamux_priority)
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_yamux_channel_set_priority(struct Stream* stream, int priority);
+
 /***
  * Prepare a new Yamux StreamMessage based on another StreamMessage
  * NOTE: This is here for testing. This should normally not be used.
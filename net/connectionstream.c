@@ -6,15 +6,86 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 #include "libp2p/net/stream.h"
 #include "libp2p/net/p2pnet.h"
 #include "libp2p/utils/logger.h"
+#include "libp2p/utils/readiness.h"
 #include "libp2p/conn/session.h"
 #include "multiaddr/multiaddr.h"
 
+// how many bytes may wait to go out a connection before writers are held back
+#define CONNECTION_WRITE_HIGH_WATER (1024 * 1024)
+// how long a writer waits for a slow peer before giving up
+#define CONNECTION_WRITE_TIMEOUT 5
+// the most queued writes sent with one system call
+#define CONNECTION_WRITE_MAX_REGIONS 64
+// the most connections a flusher sends for in one run
+#define CONNECTION_FLUSHER_MAX_EVENTS 64
+
+/***
+ * Bytes waiting to go out a connection
+ */
+struct ConnectionWrite {
+	struct ConnectionWrite* next;
+	size_t size;
+	size_t pos; // how much has been sent
+	uint8_t data[];
+};
+
+/***
+ * Sends what the connections of an event loop have queued, as their sockets become writable
+ */
+struct ConnectionFlusher {
+	int epoll_fd; // connections with something queued, waiting for their sockets to take more
+	struct ConnectionContext* connections; // everything attached
+};
+
+// guards which flusher a connection belongs to, and keeps a connection from being freed while a flusher sends for it
+static pthread_mutex_t connection_flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/***
+ * Stop a flusher from sending for a connection
+ * NOTE: connection_flusher_lock and the write_lock should be held
+ * @param ctx the ConnectionContext
+ */
+static void libp2p_net_connection_flusher_detach(struct ConnectionContext* ctx) {
+	struct ConnectionFlusher* flusher = ctx->flusher;
+	if (flusher == NULL)
+		return;
+	epoll_ctl(flusher->epoll_fd, EPOLL_CTL_DEL, ctx->flusher_socket, NULL);
+	if (ctx->flusher_prev != NULL)
+		ctx->flusher_prev->flusher_next = ctx->flusher_next;
+	else
+		flusher->connections = ctx->flusher_next;
+	if (ctx->flusher_next != NULL)
+		ctx->flusher_next->flusher_prev = ctx->flusher_prev;
+	ctx->flusher = NULL;
+	ctx->flusher_prev = NULL;
+	ctx->flusher_next = NULL;
+}
+
+/***
+ * Throw away everything in the outbound queue
+ * NOTE: the write_lock should be held
+ * @param ctx the ConnectionContext
+ */
+static void libp2p_net_connection_clear_queue(struct ConnectionContext* ctx) {
+	while (ctx->write_queue != NULL) {
+		struct ConnectionWrite* next = ctx->write_queue->next;
+		free(ctx->write_queue);
+		ctx->write_queue = next;
+	}
+	ctx->write_queue_tail = NULL;
+	ctx->write_queue_size = 0;
+}
+
 /**
  * Close a network connection
  * @param stream_context the ConnectionContext
@@ -25,9 +96,21 @@ int libp2p_net_connection_close(struct Stream* stream) {
 		return 0;
 	struct ConnectionContext* ctx = (struct ConnectionContext*)stream->stream_context;
 	if (ctx != NULL) {
+		// make sure no flusher is sending for it
+		pthread_mutex_lock(&connection_flusher_lock);
+		pthread_mutex_lock(&ctx->write_lock);
+		libp2p_net_connection_flusher_detach(ctx);
+		pthread_mutex_unlock(&ctx->write_lock);
+		pthread_mutex_unlock(&connection_flusher_lock);
 		if (ctx->socket_descriptor > 0) {
 			close(ctx->socket_descriptor);
 		}
+		libp2p_utils_ring_buffer_free(ctx->read_buffer);
+		pthread_mutex_lock(&ctx->write_lock);
+		libp2p_net_connection_clear_queue(ctx);
+		pthread_mutex_unlock(&ctx->write_lock);
+		pthread_cond_destroy(&ctx->write_drained);
+		pthread_mutex_destroy(&ctx->write_lock);
 		free(ctx);
 		ctx = NULL;
 		return 1;
@@ -36,6 +119,110 @@ int libp2p_net_connection_close(struct Stream* stream) {
 	return 0;
 }
 
+/***
+ * Pull whatever the socket has into the connection's read buffer
+ * @param ctx the ConnectionContext
+ * @param deadline when to give up if nothing has arrived yet (NULL to wait forever)
+ * @returns number of bytes added, 0 if the other side hung up (or the buffer is full), or negative on error
+ */
+int libp2p_net_connection_fill(struct ConnectionContext* ctx, const struct timespec* deadline) {
+	if (ctx->read_buffer == NULL) {
+		ctx->read_buffer = libp2p_utils_ring_buffer_new(CONNECTION_READ_BUFFER_SIZE);
+		if (ctx->read_buffer == NULL)
+			return -1;
+	}
+	struct iovec regions[2];
+	int num_regions = libp2p_utils_ring_buffer_free_regions(ctx->read_buffer, regions);
+	if (num_regions == 0)
+		return 0;
+	int retVal = socket_readv_until(ctx->socket_descriptor, regions, num_regions, deadline);
+	ctx->last_comm_epoch = time(NULL);
+	if (retVal > 0)
+		libp2p_utils_ring_buffer_commit(ctx->read_buffer, retVal);
+	return retVal;
+}
+
+/***
+ * Pull whatever the socket has into the connection's read buffer, without waiting
+ * @param ctx the ConnectionContext
+ * @returns number of bytes added, 0 if nothing has arrived (or the buffer is full), or -1 if the other side hung up or on error
+ */
+static int libp2p_net_connection_fill_now(struct ConnectionContext* ctx) {
+	if (ctx->read_buffer == NULL) {
+		ctx->read_buffer = libp2p_utils_ring_buffer_new(CONNECTION_READ_BUFFER_SIZE);
+		if (ctx->read_buffer == NULL)
+			return -1;
+	}
+	struct iovec regions[2];
+	int num_regions = libp2p_utils_ring_buffer_free_regions(ctx->read_buffer, regions);
+	if (num_regions == 0)
+		return 0;
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = regions;
+	message.msg_iovlen = num_regions;
+	for(;;) {
+		ssize_t retVal = recvmsg(ctx->socket_descriptor, &message, MSG_DONTWAIT);
+		if (retVal > 0) {
+			ctx->last_comm_epoch = time(NULL);
+			libp2p_utils_ring_buffer_commit(ctx->read_buffer, retVal);
+			return retVal;
+		}
+		if (retVal == 0)
+			return -1;
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		return -1;
+	}
+}
+
+/***
+ * Read what has already arrived on the connection, without waiting for more
+ * @param stream_context the ConnectionContext
+ * @param buffer where to put the results
+ * @param buffer_size the most bytes to read
+ * @returns number of bytes read (0 if nothing has arrived), or -1 if nothing was read and the connection is gone
+ */
+int libp2p_net_connection_read_now(void* stream_context, uint8_t* buffer, int buffer_size) {
+	if (stream_context == NULL)
+		return -1;
+	struct ConnectionContext* ctx = (struct ConnectionContext*) stream_context;
+	int num_read = libp2p_utils_ring_buffer_read(ctx->read_buffer, buffer, buffer_size);
+	while (num_read < buffer_size) {
+		int retVal = libp2p_net_connection_fill_now(ctx);
+		if (retVal < 0)
+			return (num_read > 0 ? num_read : -1);
+		if (retVal == 0)
+			break;
+		num_read += libp2p_utils_ring_buffer_read(ctx->read_buffer, &buffer[num_read], buffer_size - num_read);
+	}
+	return num_read;
+}
+
+/***
+ * Take in what has already arrived on the connection, and look at the start of it without consuming it
+ * @param stream_context the ConnectionContext
+ * @param buffer where to copy the first bytes
+ * @param buffer_size the most bytes to copy
+ * @returns number of bytes that have arrived (can be more than buffer_size), or -1 if none have and the connection is gone
+ */
+int libp2p_net_connection_peek_now(void* stream_context, uint8_t* buffer, int buffer_size) {
+	if (stream_context == NULL)
+		return -1;
+	struct ConnectionContext* ctx = (struct ConnectionContext*) stream_context;
+	int retVal = 0;
+	do {
+		retVal = libp2p_net_connection_fill_now(ctx);
+	} while (retVal > 0);
+	int arrived = libp2p_utils_ring_buffer_size(ctx->read_buffer);
+	if (arrived == 0 && retVal < 0)
+		return -1;
+	libp2p_utils_ring_buffer_peek(ctx->read_buffer, buffer, buffer_size);
+	return arrived;
+}
+
 /***
  * Check and see if there is anything waiting on this network connection
  * @param stream_context the ConnectionContext
@@ -57,7 +244,8 @@ int libp2p_net_connection_peek(void* stream_context) {
 		libp2p_logger_error("connectionstream", "Attempted a peek, but ioctl reported %s.\n", strerror(errno));
 		return -1;
 	}
-	return bytes;
+	// include what has already been pulled off of the socket
+	return bytes + libp2p_utils_ring_buffer_size(ctx->read_buffer);
 }
 
 /**
@@ -68,54 +256,35 @@ int libp2p_net_connection_peek(void* stream_context) {
  */
 int libp2p_net_connection_read(void* stream_context, struct StreamMessage** msg, int timeout_secs) {
 	struct ConnectionContext* ctx = (struct ConnectionContext*) stream_context;
-	// read from the socket
-	uint8_t buffer[4096];
-	uint8_t* result_buffer = NULL;
-	int current_size = 0;
-	while (1) {
-		int retVal = socket_read(ctx->socket_descriptor, (char*)&buffer[0], 4096, 0, timeout_secs);
-		ctx->last_comm_epoch = time(NULL);
+	// wait for something to arrive if we have nothing buffered
+	if (libp2p_utils_ring_buffer_size(ctx->read_buffer) == 0) {
+		struct timespec deadline;
+		int retVal = libp2p_net_connection_fill(ctx, socket_deadline_after_ms(&deadline, (long)timeout_secs * 1000));
 		libp2p_logger_debug("connectionstream", "Retrieved %d bytes from socket %d.\n", retVal, ctx->socket_descriptor);
-		if (retVal < 1) { // get out of the loop
-			if (retVal < 0) // error
-				return 0;
-			break;
-		}
-		// add what we got to the message
-		if (result_buffer == NULL) {
-			result_buffer = malloc(retVal);
-			if (result_buffer == NULL)
-				return 0;
-			current_size = retVal;
-			memcpy(result_buffer, buffer, retVal);
-		} else {
-			void* alloc = realloc(result_buffer, current_size + retVal);
-			if (alloc == NULL) {
-				free(result_buffer);
-				return 0;
-			}
-			memcpy(&result_buffer[current_size], buffer, retVal);
-			current_size += retVal;
-		}
-		// Everything ok, loop again (possibly)
-		if (retVal != 4096)
-			break;
-	}
-
-	// now build the message
-	if (current_size > 0) {
-		*msg = libp2p_stream_message_new();
-		struct StreamMessage* result = *msg;
-		if (result == NULL) {
-			libp2p_logger_error("connectionstream", "read: Attempted to allocate memory for message, but allocation failed.\n");
-			free(result_buffer);
+		if (retVal < 1)
 			return 0;
-		}
-		result->data = result_buffer;
-		result->data_size = current_size;
-		result->error_number = 0;
-		libp2p_logger_debug("connectionstream", "libp2p_connectionstream_read: Received %d bytes from socket %d.\n", result->data_size, ctx->socket_descriptor);
 	}
+	// hand back everything that is buffered, plus what the socket still has, in one allocation
+	int pending = 0;
+	if (ioctl(ctx->socket_descriptor, FIONREAD, &pending) < 0)
+		pending = 0;
+	size_t buffered = libp2p_utils_ring_buffer_size(ctx->read_buffer);
+	*msg = libp2p_stream_message_new_buffer(buffered + pending);
+	struct StreamMessage* result = *msg;
+	if (result == NULL) {
+		libp2p_logger_error("connectionstream", "read: Attempted to allocate memory for message, but allocation failed.\n");
+		return 0;
+	}
+	size_t current_size = libp2p_utils_ring_buffer_read(ctx->read_buffer, result->data, buffered);
+	while (pending > 0) {
+		int retVal = recv(ctx->socket_descriptor, &result->data[current_size], pending, MSG_DONTWAIT);
+		if (retVal < 1)
+			break;
+		current_size += retVal;
+		pending -= retVal;
+	}
+	result->data_size = current_size;
+	libp2p_logger_debug("connectionstream", "libp2p_connectionstream_read: Received %d bytes from socket %d.\n", result->data_size, ctx->socket_descriptor);
 
 	return current_size;
 }
@@ -132,20 +301,358 @@ int libp2p_net_connection_read_raw(void* stream_context, uint8_t* buffer, int bu
 	if (stream_context == NULL)
 		return -1;
 	struct ConnectionContext* ctx = (struct ConnectionContext*) stream_context;
-	int num_read = 0;
-	for(int i = 0; i < buffer_size; i++) {
-		int retVal = socket_read(ctx->socket_descriptor, (char*)&buffer[i], 1, 0, timeout_secs);
-		ctx->last_comm_epoch = time(NULL);
+	// the timeout covers the whole read, not each trip to the socket
+	struct timespec deadline;
+	const struct timespec* until = socket_deadline_after_ms(&deadline, (long)timeout_secs * 1000);
+	// start with what has already arrived
+	int num_read = libp2p_utils_ring_buffer_read(ctx->read_buffer, buffer, buffer_size);
+	while (num_read < buffer_size) {
+		int left = buffer_size - num_read;
+		int retVal = 0;
+		if (left >= CONNECTION_READ_BUFFER_SIZE) {
+			// big enough that staging it in the read buffer would just be an extra copy
+			retVal = socket_read_until(ctx->socket_descriptor, (char*)&buffer[num_read], left, 0, until);
+			ctx->last_comm_epoch = time(NULL);
+			if (retVal > 0)
+				num_read += retVal;
+		} else {
+			retVal = libp2p_net_connection_fill(ctx, until);
+			if (retVal > 0)
+				num_read += libp2p_utils_ring_buffer_read(ctx->read_buffer, &buffer[num_read], left);
+		}
 		if (retVal < 1) { // get out of the loop
 			if (retVal < 0) // error
 				return -1;
 			break;
 		}
-		num_read += retVal; // Everything ok, loop again (possibly)
 	}
 	return num_read;
 }
 
+/***
+ * Send as much as the socket will take right now
+ * @param fd the socket
+ * @param regions what to send
+ * @param num_regions the number of regions
+ * @returns the number of bytes sent (0 if the socket is full), or -1 on error
+ */
+ssize_t libp2p_net_connection_send_now(int fd, struct iovec* regions, int num_regions) {
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = regions;
+	message.msg_iovlen = num_regions;
+	for(;;) {
+		ssize_t sent = sendmsg(fd, &message, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent >= 0)
+			return sent;
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		return -1;
+	}
+}
+
+/***
+ * Give up on the outbound queue, as the connection can't take it
+ * NOTE: the write_lock should be held
+ * @param ctx the ConnectionContext
+ */
+static void libp2p_net_connection_fail_writes(struct ConnectionContext* ctx) {
+	// part of a record may have gone out, so the rest of the stream is useless now
+	libp2p_logger_error("connectionstream", "flush: Unable to write to socket %d: %s.\n", ctx->socket_descriptor, strerror(errno));
+	libp2p_net_connection_clear_queue(ctx);
+	ctx->write_failed = 1;
+	pthread_cond_broadcast(&ctx->write_drained);
+}
+
+/***
+ * Send as much of the outbound queue as the socket will take right now
+ * NOTE: the write_lock should be held
+ * @param ctx the ConnectionContext
+ * @returns the number of bytes sent, or -1 if the connection failed
+ */
+static ssize_t libp2p_net_connection_send_queued(struct ConnectionContext* ctx) {
+	struct iovec regions[CONNECTION_WRITE_MAX_REGIONS];
+	ssize_t total_sent = 0;
+	while (ctx->write_queue != NULL) {
+		// send as many queued writes as we can in one go
+		int num_regions = 0;
+		for(struct ConnectionWrite* current = ctx->write_queue; current != NULL && num_regions < CONNECTION_WRITE_MAX_REGIONS; current = current->next) {
+			regions[num_regions].iov_base = &current->data[current->pos];
+			regions[num_regions].iov_len = current->size - current->pos;
+			num_regions++;
+		}
+		ssize_t sent = libp2p_net_connection_send_now(ctx->socket_descriptor, regions, num_regions);
+		if (sent < 0) {
+			libp2p_net_connection_fail_writes(ctx);
+			return -1;
+		}
+		if (sent == 0) // the socket is full
+			break;
+		ctx->last_comm_epoch = time(NULL);
+		total_sent += sent;
+		// take what was sent off of the queue
+		ctx->write_queue_size -= sent;
+		while (sent > 0) {
+			struct ConnectionWrite* current = ctx->write_queue;
+			size_t left = current->size - current->pos;
+			if ((size_t)sent < left) {
+				current->pos += sent;
+				break;
+			}
+			sent -= left;
+			ctx->write_queue = current->next;
+			free(current);
+		}
+	}
+	if (ctx->write_queue == NULL)
+		ctx->write_queue_tail = NULL;
+	if (total_sent > 0)
+		pthread_cond_broadcast(&ctx->write_drained);
+	return total_sent;
+}
+
+/***
+ * Drain the outbound queue, waiting for the socket to become writable as needed
+ * NOTE: the write_lock should be held, and will be held on return. It is released while waiting.
+ * @param ctx the ConnectionContext
+ * @returns true(1) if everything was sent, false(0) if the connection failed
+ */
+int libp2p_net_connection_flush(struct ConnectionContext* ctx) {
+	// a peer that takes nothing for this long is not coming back
+	struct timespec deadline;
+	socket_deadline_after_ms(&deadline, CONNECTION_WRITE_TIMEOUT * 1000);
+	for(;;) {
+		if (ctx->write_failed)
+			return 0;
+		ssize_t sent = libp2p_net_connection_send_queued(ctx);
+		if (sent < 0)
+			return 0;
+		if (ctx->write_queue == NULL)
+			return 1;
+		if (sent > 0)
+			socket_deadline_after_ms(&deadline, CONNECTION_WRITE_TIMEOUT * 1000);
+		// the socket is full. Wait for room instead of trying again right away
+		int wait_ms = socket_deadline_remaining_ms(&deadline);
+		if (wait_ms == 0) {
+			errno = ETIMEDOUT;
+			libp2p_net_connection_fail_writes(ctx);
+			return 0;
+		}
+		struct pollfd poll_fd;
+		poll_fd.fd = ctx->socket_descriptor;
+		poll_fd.events = POLLOUT;
+		poll_fd.revents = 0;
+		pthread_mutex_unlock(&ctx->write_lock);
+		int ready = poll(&poll_fd, 1, wait_ms);
+		pthread_mutex_lock(&ctx->write_lock);
+		if (ready < 0 && errno != EINTR) {
+			libp2p_net_connection_fail_writes(ctx);
+			return 0;
+		}
+	}
+}
+
+/***
+ * Ask the connection's flusher to send the queue once the socket will take more
+ * NOTE: the write_lock should be held, and the connection should have a flusher
+ * @param ctx the ConnectionContext
+ * @returns true(1) on success, false(0) otherwise
+ */
+static int libp2p_net_connection_flusher_arm(struct ConnectionContext* ctx) {
+	struct epoll_event event;
+	event.events = EPOLLOUT | EPOLLONESHOT;
+	event.data.ptr = ctx;
+	if (epoll_ctl(ctx->flusher->epoll_fd, EPOLL_CTL_MOD, ctx->flusher_socket, &event) == 0)
+		return 1;
+	if (errno == ENOENT && epoll_ctl(ctx->flusher->epoll_fd, EPOLL_CTL_ADD, ctx->flusher_socket, &event) == 0)
+		return 1;
+	libp2p_logger_error("connectionstream", "Unable to have socket %d flushed: %s.\n", ctx->flusher_socket, strerror(errno));
+	return 0;
+}
+
+/***
+ * Wait until the outbound queue is at or below the high water mark
+ * NOTE: the write_lock should be held
+ * @param ctx the ConnectionContext
+ * @returns true(1) if there is room, false(0) if it timed out or there is a flusher to wait on
+ * instead (errno is EAGAIN), or the connection failed
+ */
+static int libp2p_net_connection_wait_for_room(struct ConnectionContext* ctx) {
+	// with a flusher, the writer is told right away, instead of being held
+	if (ctx->write_queue_size > ctx->write_high_water && !ctx->write_failed && ctx->flusher == NULL) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += CONNECTION_WRITE_TIMEOUT;
+		while (ctx->write_queue_size > ctx->write_high_water && !ctx->write_failed) {
+			if (pthread_cond_timedwait(&ctx->write_drained, &ctx->write_lock, &deadline) == ETIMEDOUT)
+				break;
+		}
+	}
+	if (ctx->write_failed)
+		return 0;
+	if (ctx->write_queue_size > ctx->write_high_water) {
+		libp2p_logger_debug("connectionstream", "writev: Socket %d has %d bytes waiting. Refusing more.\n", ctx->socket_descriptor, (int)ctx->write_queue_size);
+		errno = EAGAIN;
+		return 0;
+	}
+	return 1;
+}
+
+/***
+ * Write several buffers to the connection
+ * @param ctx the ConnectionContext
+ * @param regions the buffers to write, in order
+ * @param num_regions the number of buffers
+ * @param wait_for_room true(1) to hold back (and possibly refuse) the write if the queue is too big
+ * @returns number of bytes written (or queued), or -1 on error
+ */
+static int libp2p_net_connection_writev_internal(struct ConnectionContext* ctx, const struct iovec* regions, int num_regions, int wait_for_room) {
+	size_t total = 0;
+	for(int i = 0; i < num_regions; i++)
+		total += regions[i].iov_len;
+	libp2p_logger_debug("connectionstream", "writev: About to write %d bytes to socket %d.\n", (int)total, ctx->socket_descriptor);
+
+	pthread_mutex_lock(&ctx->write_lock);
+	// backpressure: wait for a slow peer to catch up, but not forever
+	if ((wait_for_room && !libp2p_net_connection_wait_for_room(ctx)) || ctx->write_failed) {
+		pthread_mutex_unlock(&ctx->write_lock);
+		return -1;
+	}
+	size_t sent = 0;
+	if (ctx->write_queue == NULL) {
+		// nothing ahead of us, so try the socket directly
+		struct iovec remaining[num_regions];
+		memcpy(remaining, regions, sizeof(struct iovec) * num_regions);
+		ssize_t retVal = libp2p_net_connection_send_now(ctx->socket_descriptor, remaining, num_regions);
+		if (retVal < 0) {
+			libp2p_logger_error("connectionstream", "writev: Unable to write to socket %d: %s.\n", ctx->socket_descriptor, strerror(errno));
+			pthread_mutex_unlock(&ctx->write_lock);
+			return -1;
+		}
+		ctx->last_comm_epoch = time(NULL);
+		sent = retVal;
+		if (sent == total) {
+			pthread_mutex_unlock(&ctx->write_lock);
+			return total;
+		}
+	}
+
+	// queue what is left
+	struct ConnectionWrite* entry = (struct ConnectionWrite*) malloc(sizeof(struct ConnectionWrite) + total - sent);
+	if (entry == NULL) {
+		pthread_mutex_unlock(&ctx->write_lock);
+		return -1;
+	}
+	entry->next = NULL;
+	entry->size = total - sent;
+	entry->pos = 0;
+	size_t pos = 0;
+	size_t skip = sent;
+	for(int i = 0; i < num_regions; i++) {
+		size_t len = regions[i].iov_len;
+		if (skip >= len) {
+			skip -= len;
+			continue;
+		}
+		memcpy(&entry->data[pos], (uint8_t*)regions[i].iov_base + skip, len - skip);
+		pos += len - skip;
+		skip = 0;
+	}
+	if (ctx->write_queue_tail == NULL)
+		ctx->write_queue = entry;
+	else
+		ctx->write_queue_tail->next = entry;
+	ctx->write_queue_tail = entry;
+	ctx->write_queue_size += entry->size;
+
+	int retVal = total;
+	if (ctx->flusher != NULL && libp2p_net_connection_flusher_arm(ctx)) {
+		// the event loop sends it once the socket will take more
+		pthread_mutex_unlock(&ctx->write_lock);
+		return retVal;
+	}
+	if (!ctx->flushing) {
+		// nobody is sending, so it's up to us
+		ctx->flushing = 1;
+		if (!libp2p_net_connection_flush(ctx))
+			retVal = -1;
+		ctx->flushing = 0;
+	}
+	pthread_mutex_unlock(&ctx->write_lock);
+	return retVal;
+}
+
+/**
+ * Writes several buffers to the connection. What the socket can't take right away
+ * is queued, and sent by the connection's flusher, or whichever writer is flushing the queue.
+ * @param stream_context the ConnectionContext
+ * @param regions the buffers to write, in order
+ * @param num_regions the number of buffers
+ * @returns number of bytes written (or queued), or -1 on error. If the queue is above the
+ * high water mark (with a flusher), or stays above it for too long (without), nothing is
+ * written, -1 is returned, and errno is EAGAIN.
+ */
+int libp2p_net_connection_writev(void* stream_context, const struct iovec* regions, int num_regions) {
+	if (stream_context == NULL) {
+		libp2p_logger_error("connectionstream", "writev called with no context.\n");
+		return -1;
+	}
+	return libp2p_net_connection_writev_internal((struct ConnectionContext*)stream_context, regions, num_regions, 1);
+}
+
+/***
+ * Find the ConnectionContext under a stream
+ * @param stream a stream on the connection
+ * @returns the ConnectionContext, or NULL if the stream is not on a network connection
+ */
+static struct ConnectionContext* libp2p_net_connection_find_context(struct Stream* stream) {
+	if (stream == NULL)
+		return NULL;
+	struct Stream* root_stream = stream;
+	while (root_stream->parent_stream != NULL)
+		root_stream = root_stream->parent_stream;
+	if (root_stream->stream_type != STREAM_TYPE_RAW)
+		return NULL;
+	return (struct ConnectionContext*) root_stream->stream_context;
+}
+
+/***
+ * Wait until the connection will take another write without refusing it
+ * NOTE: For writers that can't take back what they are about to write (i.e. a cipher
+ * that has moved on). Wait here, then write with libp2p_net_connection_writev_reserved.
+ * @param stream a stream on the connection
+ * @returns true(1) if there is room (or the stream is not on a network connection), false(0) otherwise
+ */
+int libp2p_net_connection_wait_writable(struct Stream* stream) {
+	struct ConnectionContext* ctx = libp2p_net_connection_find_context(stream);
+	if (ctx == NULL)
+		return 1;
+	pthread_mutex_lock(&ctx->write_lock);
+	int retVal = libp2p_net_connection_wait_for_room(ctx);
+	pthread_mutex_unlock(&ctx->write_lock);
+	return retVal;
+}
+
+/***
+ * Write several buffers to the connection, queueing them even past the high water mark
+ * @param stream a stream on the connection
+ * @param regions the buffers to write, in order
+ * @param num_regions the number of buffers
+ * @returns number of bytes written (or queued), or -1 on error
+ */
+int libp2p_net_connection_writev_reserved(struct Stream* stream, const struct iovec* regions, int num_regions) {
+	struct ConnectionContext* ctx = libp2p_net_connection_find_context(stream);
+	if (ctx == NULL) {
+		struct Stream* root_stream = stream;
+		while (root_stream->parent_stream != NULL)
+			root_stream = root_stream->parent_stream;
+		return libp2p_stream_writev(root_stream, regions, num_regions);
+	}
+	return libp2p_net_connection_writev_internal(ctx, regions, num_regions, 0);
+}
+
 /**
  * Writes to a stream
  * @param stream the stream context (usually a SessionContext pointer)
@@ -153,20 +660,141 @@ int libp2p_net_connection_read_raw(void* stream_context, uint8_t* buffer, int bu
  * @returns number of bytes written
  */
 int libp2p_net_connection_write(void* stream_context, struct StreamMessage* msg) {
-	if (stream_context == NULL) {
-		libp2p_logger_error("connectionstream", "write called with no context.\n");
-		return -1;
+	struct iovec region;
+	region.iov_base = msg->data;
+	region.iov_len = msg->data_size;
+	return libp2p_net_connection_writev(stream_context, &region, 1);
+}
+
+/***
+ * Change how many bytes may wait to go out a connection before writers are held back
+ * @param stream a stream on the connection
+ * @param high_water the number of bytes
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_net_connection_set_write_high_water(struct Stream* stream, size_t high_water) {
+	if (stream == NULL)
+		return 0;
+	struct Stream* root_stream = stream;
+	while (root_stream->parent_stream != NULL)
+		root_stream = root_stream->parent_stream;
+	if (root_stream->stream_type != STREAM_TYPE_RAW || root_stream->stream_context == NULL)
+		return 0;
+	struct ConnectionContext* ctx = (struct ConnectionContext*) root_stream->stream_context;
+	pthread_mutex_lock(&ctx->write_lock);
+	ctx->write_high_water = high_water;
+	pthread_cond_broadcast(&ctx->write_drained);
+	pthread_mutex_unlock(&ctx->write_lock);
+	return 1;
+}
+
+/***
+ * Create something to send what connections have queued, as their sockets become writable
+ * NOTE: It has no thread of its own. The event loop that owns it watches
+ * libp2p_net_connection_flusher_fd, and calls libp2p_net_connection_flusher_run when it is readable.
+ * @returns the ConnectionFlusher, or NULL on error
+ */
+struct ConnectionFlusher* libp2p_net_connection_flusher_new() {
+	struct ConnectionFlusher* flusher = (struct ConnectionFlusher*) malloc(sizeof(struct ConnectionFlusher));
+	if (flusher != NULL) {
+		flusher->connections = NULL;
+		flusher->epoll_fd = epoll_create1(0);
+		if (flusher->epoll_fd < 0) {
+			libp2p_logger_error("connectionstream", "Unable to create epoll descriptor for flusher: %s.\n", strerror(errno));
+			free(flusher);
+			return NULL;
+		}
 	}
-	struct ConnectionContext* ctx = (struct ConnectionContext*) stream_context;
-	libp2p_logger_debug("connectionstream", "write: About to write %d bytes to socket %d.\n", msg->data_size, ctx->socket_descriptor);
-	ctx->last_comm_epoch = time(NULL);
-	return socket_write(ctx->socket_descriptor, (char*)msg->data, msg->data_size, 0);
+	return flusher;
+}
+
+/***
+ * Free a ConnectionFlusher. The connections it was sending for go back to their writers flushing.
+ * @param flusher the ConnectionFlusher
+ */
+void libp2p_net_connection_flusher_free(struct ConnectionFlusher* flusher) {
+	if (flusher == NULL)
+		return;
+	pthread_mutex_lock(&connection_flusher_lock);
+	while (flusher->connections != NULL) {
+		struct ConnectionContext* ctx = flusher->connections;
+		pthread_mutex_lock(&ctx->write_lock);
+		libp2p_net_connection_flusher_detach(ctx);
+		pthread_mutex_unlock(&ctx->write_lock);
+	}
+	pthread_mutex_unlock(&connection_flusher_lock);
+	close(flusher->epoll_fd);
+	free(flusher);
+}
+
+/***
+ * The descriptor an event loop should watch (for reading) on behalf of the flusher
+ * @param flusher the ConnectionFlusher
+ * @returns the descriptor
+ */
+int libp2p_net_connection_flusher_fd(struct ConnectionFlusher* flusher) {
+	return flusher->epoll_fd;
+}
+
+/***
+ * Have the flusher send what a connection queues, so that its writers never wait on the socket
+ * @param flusher the ConnectionFlusher
+ * @param stream a stream on the connection
+ * @returns true(1) on success, false(0) otherwise (i.e. not a network connection, or it already has a different flusher)
+ */
+int libp2p_net_connection_flusher_attach(struct ConnectionFlusher* flusher, struct Stream* stream) {
+	struct ConnectionContext* ctx = libp2p_net_connection_find_context(stream);
+	if (flusher == NULL || ctx == NULL)
+		return 0;
+	int retVal = 1;
+	pthread_mutex_lock(&connection_flusher_lock);
+	pthread_mutex_lock(&ctx->write_lock);
+	if (ctx->flusher == NULL) {
+		ctx->flusher = flusher;
+		ctx->flusher_socket = ctx->socket_descriptor;
+		ctx->flusher_prev = NULL;
+		ctx->flusher_next = flusher->connections;
+		if (flusher->connections != NULL)
+			flusher->connections->flusher_prev = ctx;
+		flusher->connections = ctx;
+		// pick up anything that is already waiting
+		if (ctx->write_queue != NULL && !ctx->flushing)
+			libp2p_net_connection_flusher_arm(ctx);
+	} else if (ctx->flusher != flusher) {
+		retVal = 0;
+	}
+	pthread_mutex_unlock(&ctx->write_lock);
+	pthread_mutex_unlock(&connection_flusher_lock);
+	return retVal;
+}
+
+/***
+ * Send what the connections have queued, for the sockets that will take more. Does not wait.
+ * @param flusher the ConnectionFlusher
+ * @returns the number of connections sent for, or -1 on error
+ */
+int libp2p_net_connection_flusher_run(struct ConnectionFlusher* flusher) {
+	struct epoll_event events[CONNECTION_FLUSHER_MAX_EVENTS];
+	pthread_mutex_lock(&connection_flusher_lock);
+	int num_events = epoll_wait(flusher->epoll_fd, events, CONNECTION_FLUSHER_MAX_EVENTS, 0);
+	for(int i = 0; i < num_events; i++) {
+		struct ConnectionContext* ctx = (struct ConnectionContext*) events[i].data.ptr;
+		pthread_mutex_lock(&ctx->write_lock);
+		if (!ctx->write_failed && libp2p_net_connection_send_queued(ctx) >= 0 && ctx->write_queue != NULL)
+			libp2p_net_connection_flusher_arm(ctx);
+		pthread_mutex_unlock(&ctx->write_lock);
+	}
+	pthread_mutex_unlock(&connection_flusher_lock);
+	if (num_events < 0 && errno != EINTR)
+		return -1;
+	return (num_events < 0 ? 0 : num_events);
 }
 
 int libp2p_net_handle_upgrade(struct Stream* old_stream, struct Stream* new_stream) {
 	struct ConnectionContext* ctx = (struct ConnectionContext*) old_stream->stream_context;
 	if (ctx->session_context != NULL) {
 		ctx->session_context->default_stream = new_stream;
+		libp2p_utils_readiness_signal();
 	}
 	return 1;
 }
@@ -179,7 +807,7 @@ int libp2p_net_handle_upgrade(struct Stream* old_stream, struct Stream* new_stre
  * @returns a Stream
  */
 struct Stream* libp2p_net_connection_established(int fd, char* ip, int port, struct SessionContext* session_context) {
-	struct Stream* out = (struct Stream*) malloc(sizeof(struct Stream));
+	struct Stream* out = libp2p_stream_new();
 	if (out != NULL) {
 		out->stream_type = STREAM_TYPE_RAW;
 		out->close = libp2p_net_connection_close;
@@ -187,6 +815,7 @@ struct Stream* libp2p_net_connection_established(int fd, char* ip, int port, str
 		out->read = libp2p_net_connection_read;
 		out->read_raw = libp2p_net_connection_read_raw;
 		out->write = libp2p_net_connection_write;
+		out->writev = libp2p_net_connection_writev;
 		out->handle_upgrade = libp2p_net_handle_upgrade;
 		// Multiaddresss
 		char str[strlen(ip) + 25];
@@ -195,14 +824,27 @@ struct Stream* libp2p_net_connection_established(int fd, char* ip, int port, str
 		out->address = multiaddress_new_from_string(str);
 		out->parent_stream = NULL;
 		// mutex
-		out->socket_mutex = (pthread_mutex_t*) malloc(sizeof(pthread_mutex_t));
-		pthread_mutex_init(out->socket_mutex, NULL);
+		out->read_mutex = (pthread_mutex_t*) malloc(sizeof(pthread_mutex_t));
+		pthread_mutex_init(out->read_mutex, NULL);
 		// context
 		struct ConnectionContext* ctx = (struct ConnectionContext*) malloc(sizeof(struct ConnectionContext));
 		if (ctx != NULL) {
 			out->stream_context = ctx;
 			ctx->socket_descriptor = fd;
 			ctx->session_context = session_context;
+			ctx->read_buffer = NULL;
+			pthread_mutex_init(&ctx->write_lock, NULL);
+			pthread_cond_init(&ctx->write_drained, NULL);
+			ctx->write_queue = NULL;
+			ctx->write_queue_tail = NULL;
+			ctx->write_queue_size = 0;
+			ctx->write_high_water = CONNECTION_WRITE_HIGH_WATER;
+			ctx->flushing = 0;
+			ctx->write_failed = 0;
+			ctx->flusher = NULL;
+			ctx->flusher_socket = -1;
+			ctx->flusher_prev = NULL;
+			ctx->flusher_next = NULL;
 		}
 	}
 	return out;
@@ -243,6 +885,7 @@ int libp2p_net_connection_upgrade(struct Stream* parent_stream, struct Stream* n
 	// current_stream is now the root, and should have a ConnectionContext
 	struct ConnectionContext* ctx = (struct ConnectionContext*)current_stream->stream_context;
 	ctx->session_context->default_stream = new_stream;
+	libp2p_utils_readiness_signal();
 	return 1;
 }
 
@@ -15,6 +15,7 @@
 #include "varint.h"
 #include "libp2p/net/multistream.h"
 #include "libp2p/utils/logger.h"
+#include "libp2p/utils/readiness.h"
 #include "multiaddr/multiaddr.h"
 #include "libp2p/yamux/yamux.h"
 
@@ -125,6 +126,7 @@ int libp2p_net_multistream_close(struct Stream* stream) {
 
 /***
  * Check the stream to see if there is something to read
+ * NOTE: Directly over a connection, this only counts a message when all of it has arrived
  * @param stream_context a MultistreamContext
  * @returns number of bytes to be read, or -1 if there was an error
  */
@@ -137,7 +139,29 @@ int libp2p_net_multistream_peek(void* stream_context) {
 	if (parent_stream == NULL)
 		return -1;
 
-	return parent_stream->peek(parent_stream->stream_context);
+	if (parent_stream->stream_type != STREAM_TYPE_RAW)
+		return parent_stream->peek(parent_stream->stream_context);
+
+	// only report a message once all of it has arrived, so that reading it won't wait on the network
+	if (pthread_mutex_trylock(parent_stream->read_mutex) != 0)
+		return 0; // someone is already reading
+	uint8_t varint[12];
+	int arrived = libp2p_net_connection_peek_now(parent_stream->stream_context, varint, 12);
+	pthread_mutex_unlock(parent_stream->read_mutex);
+	if (arrived <= 0)
+		return arrived;
+	for(int i = 0; i < 12 && i < arrived; i++) {
+		if (varint[i] >> 7 == 0) {
+			size_t varint_length = 0;
+			size_t message_size = varint_decode(&varint[0], i+1, &varint_length);
+			// a message bigger than the connection can hold has to be read as it arrives
+			if ((size_t)arrived >= varint_length + message_size || arrived >= CONNECTION_READ_BUFFER_SIZE)
+				return arrived;
+			return 0;
+		}
+	}
+	// a length that never ends is for the reader to reject
+	return (arrived >= 12 ? arrived : 0);
 }
 
 /**
@@ -165,6 +189,42 @@ struct StreamMessage* libp2p_net_multistream_prepare_to_send(struct StreamMessag
 	return out;
 }
 
+/**
+ * Write several buffers to an open multistream host, with the varint
+ * size in front of them
+ * @param stream_context the MultistreamContext
+ * @param regions the buffers to send
+ * @param num_regions the number of buffers
+ * @returns the number of bytes of the regions written
+ */
+int libp2p_net_multistream_writev_without_check(void* stream_context, const struct iovec* regions, int num_regions) {
+	struct MultistreamContext* multistream_context = (struct MultistreamContext*) stream_context;
+	struct Stream* parent_stream = multistream_context->stream->parent_stream;
+
+	size_t data_size = 0;
+	for(int i = 0; i < num_regions; i++)
+		data_size += regions[i].iov_len;
+	if (data_size == 0) // only do this is if there is something to send
+		return 0;
+
+	// the varint goes in front, the data is passed along as is
+	unsigned char varint[12];
+	size_t varint_size = 0;
+	varint_encode(data_size, &varint[0], 12, &varint_size);
+	struct iovec outgoing[num_regions + 1];
+	outgoing[0].iov_base = varint;
+	outgoing[0].iov_len = varint_size;
+	memcpy(&outgoing[1], regions, sizeof(struct iovec) * num_regions);
+
+	// now ship it
+	libp2p_logger_debug("multistream", "Attempting write %d bytes.\n", (int)(varint_size + data_size));
+	int num_bytes = libp2p_stream_writev(parent_stream, outgoing, num_regions + 1);
+	// subtract the varint if all went well
+	if (num_bytes == varint_size + data_size)
+		num_bytes = data_size;
+	return num_bytes;
+}
+
 /**
  * Write to an open multistream host
  * @param stream_context the session context
@@ -172,34 +232,43 @@ struct StreamMessage* libp2p_net_multistream_prepare_to_send(struct StreamMessag
  * @returns the number of bytes written
  */
 int libp2p_net_multistream_write_without_check(void* stream_context, struct StreamMessage* incoming) {
-	struct MultistreamContext* multistream_context = (struct MultistreamContext*) stream_context;
-	struct Stream* parent_stream = multistream_context->stream->parent_stream;
-	int num_bytes = 0;
-
-	if (incoming->data_size > 0) { // only do this is if there is something to send
-		struct StreamMessage* out = libp2p_net_multistream_prepare_to_send(incoming);
-		// now ship it
-		libp2p_logger_debug("multistream", "Attempting write %d bytes.\n", (int)out->data_size);
-		num_bytes = parent_stream->write(parent_stream->stream_context, out);
-		// subtract the varint if all went well
-		if (num_bytes == out->data_size)
-			num_bytes = incoming->data_size;
-		libp2p_stream_message_free(out);
-	}
+	struct iovec region;
+	region.iov_base = incoming->data;
+	region.iov_len = incoming->data_size;
+	return libp2p_net_multistream_writev_without_check(stream_context, &region, 1);
+}
 
-	return num_bytes;
+/***
+ * See if a multistream has been acknowledged by the other side
+ * @param context the MultistreamContext
+ * @returns true(1) if the remote acknowledged, false(0) otherwise
+ */
+int libp2p_net_multistream_is_acked(void* context) {
+	struct MultistreamContext* ctx = (struct MultistreamContext*)context;
+	return ctx->status == multistream_status_ack;
 }
 
 int multistream_wait(struct Stream* stream, int timeout_secs) {
-	int counter = 0;
-	struct MultistreamContext* ctx = (struct MultistreamContext*)stream->stream_context;
-	while (ctx->status != multistream_status_ack && counter <= timeout_secs) {
-		counter++;
-		sleep(1);
+	return libp2p_utils_readiness_wait(libp2p_net_multistream_is_acked, stream->stream_context, timeout_secs);
+}
+
+/***
+ * See if the stream on a session or yamux channel is a ready multistream
+ * @param context a SessionContext or YamuxChannelContext
+ * @returns true(1) if ready, false(0) otherwise
+ */
+int libp2p_net_multistream_is_ready(void* context) {
+	struct Stream* stream = NULL;
+	struct YamuxChannelContext* yamuxChannelContext = libp2p_yamux_get_channel_context(context);
+	if (yamuxChannelContext != NULL) {
+		stream = yamuxChannelContext->child_stream;
+	} else {
+		struct SessionContext* session_context = (struct SessionContext*)context;
+		stream = session_context->default_stream;
 	}
-	if (ctx->status == multistream_status_ack)
-		return 1;
-	return 0;
+	return stream != NULL
+			&& stream->stream_type == STREAM_TYPE_MULTISTREAM
+			&& libp2p_net_multistream_is_acked(stream->stream_context);
 }
 
 /***
@@ -209,26 +278,7 @@ int multistream_wait(struct Stream* stream, int timeout_secs) {
  * @returns true(1) if it becomes ready, false(0) otherwise
  */
 int libp2p_net_multistream_ready(void* context, int timeout_secs) {
-	int counter = 0;
-	struct YamuxChannelContext* yamuxChannelContext = libp2p_yamux_get_channel_context(context);
-	if (yamuxChannelContext != NULL) {
-		while (yamuxChannelContext->child_stream->stream_type != STREAM_TYPE_MULTISTREAM && counter <= timeout_secs) {
-			counter++;
-			sleep(1);
-		}
-		if (counter <= 5)
-			return multistream_wait(yamuxChannelContext->child_stream, timeout_secs - counter);
-	} else {
-		struct SessionContext* session_context = (struct SessionContext*)context;
-		while (session_context->default_stream->stream_type != STREAM_TYPE_MULTISTREAM && counter <= timeout_secs) {
-			counter++;
-			sleep(1);
-		}
-		if (counter <= 5) {
-			return multistream_wait(session_context->default_stream, timeout_secs - counter);
-		}
-	}
-	return 0;
+	return libp2p_utils_readiness_wait(libp2p_net_multistream_is_ready, context, timeout_secs);
 }
 
 /**
@@ -248,6 +298,24 @@ int libp2p_net_multistream_write(void* stream_context, struct StreamMessage* inc
 	return libp2p_net_multistream_write_without_check(stream_context, incoming);
 }
 
+/**
+ * Write several buffers to an open multistream host
+ * @param stream_context the MultistreamContext
+ * @param regions the buffers to send
+ * @param num_regions the number of buffers
+ * @returns the number of bytes of the regions written
+ */
+int libp2p_net_multistream_writev(void* stream_context, const struct iovec* regions, int num_regions) {
+	struct MultistreamContext* multistream_context = (struct MultistreamContext*) stream_context;
+
+	if (multistream_context->status != multistream_status_ack) {
+		libp2p_logger_error("multistream", "Attempt to write before protocol is completely set up.\n");
+		return 0;
+	}
+
+	return libp2p_net_multistream_writev_without_check(stream_context, regions, num_regions);
+}
+
 /**
  * Read from a multistream socket
  * @param socket_fd the socket file descriptor
@@ -261,6 +329,8 @@ int libp2p_net_multistream_read(void* stream_context, struct StreamMessage** res
 	struct Stream* parent_stream = multistream_context->stream->parent_stream;
 
 	// find out the length
+	// NOTE: this is a read_raw per byte. The bytes come out of the parent's buffer (the
+	// connection's ring buffer, or the decrypted secio record), not one recv() each.
 	uint8_t varint[12];
 	memset(varint, 0, 12);
 	size_t num_bytes_requested = 0;
@@ -279,23 +349,9 @@ int libp2p_net_multistream_read(void* stream_context, struct StreamMessage** res
 	if (num_bytes_requested <= 0)
 		return 0;
 
-	// now get the data
-	*results = libp2p_stream_message_new();
-	struct StreamMessage* rslts = *results;
-	rslts->data_size = num_bytes_requested;
-	rslts->data = (uint8_t*) malloc(num_bytes_requested);
-	if (rslts->data == NULL) {
-		libp2p_logger_error("multistream", "read: Attempted allocation of stream message failed.\n");
-		libp2p_stream_message_free(rslts);
-		rslts = NULL;
-	}
-	// now get the data from the parent stream
-	int bytes_read = parent_stream->read_raw(parent_stream->stream_context, rslts->data, rslts->data_size, timeout_secs);
-	if (bytes_read != num_bytes_requested) {
-		libp2p_logger_error("multistream", "read: Was supposed to read %d bytes, but read_raw returned %d.\n", num_bytes_requested, bytes_read);
-		// problem reading from the parent stream
-		libp2p_stream_message_free(*results);
-		*results = NULL;
+	// now get the data from the parent stream, sharing its memory if it can
+	if (!libp2p_stream_read_slice(parent_stream, num_bytes_requested, results, timeout_secs)) {
+		libp2p_logger_error("multistream", "read: Was supposed to read %d bytes, but was unable to.\n", (int)num_bytes_requested);
 		return 0;
 	}
 
@@ -360,7 +416,7 @@ struct Stream* libp2p_net_multistream_connect_with_timeout(const char* hostname,
 	retVal = socket;
 	exit:
 	if (results != NULL)
-		free(results);
+		libp2p_stream_message_free(results);
 	if (retVal < 0 && stream != NULL) {
 		libp2p_net_multistream_stream_free(stream);
 		stream = NULL;
@@ -398,6 +454,7 @@ int libp2p_net_multistream_negotiate(struct MultistreamContext* ctx, int theyReq
 	// update the status
 	if (theyRequested) {
 		ctx->status = multistream_status_ack;
+		libp2p_utils_readiness_signal();
 	} else {
 		ctx->status = multistream_status_syn;
 	}
@@ -405,7 +462,7 @@ int libp2p_net_multistream_negotiate(struct MultistreamContext* ctx, int theyReq
 	retVal = 1;
 	exit:
 	if (results != NULL)
-		free(results);
+		libp2p_stream_message_free(results);
 	return retVal;
 }
 
@@ -459,19 +516,20 @@ int libp2p_net_multistream_handle_upgrade(struct Stream* multistream, struct Str
  * @returns the new Stream
  */
 struct Stream* libp2p_net_multistream_stream_new(struct Stream* parent_stream, int theyRequested) {
-	struct Stream* out = (struct Stream*)malloc(sizeof(struct Stream));
+	struct Stream* out = libp2p_stream_new();
 	if (out != NULL) {
 		out->stream_type = STREAM_TYPE_MULTISTREAM;
 		out->parent_stream = parent_stream;
 		out->close = libp2p_net_multistream_close;
 		out->read = libp2p_net_multistream_read;
 		out->write = libp2p_net_multistream_write;
+		out->writev = libp2p_net_multistream_writev;
 		out->peek = libp2p_net_multistream_peek;
 		out->read_raw = libp2p_net_multistream_read_raw;
 		out->negotiate = libp2p_net_multistream_handshake;
 		out->handle_upgrade = libp2p_net_multistream_handle_upgrade;
 		out->address = parent_stream->address;
-		out->socket_mutex = parent_stream->socket_mutex;
+		out->read_mutex = parent_stream->read_mutex;
 		out->bytes_waiting = libp2p_net_multistream_bytes_waiting;
 		// build MultistreamContext
 		struct MultistreamContext* ctx = (struct MultistreamContext*) malloc(sizeof(struct MultistreamContext));
@@ -492,13 +550,8 @@ struct Stream* libp2p_net_multistream_stream_new(struct Stream* parent_stream, i
 			return NULL;
 		}
 		if (!theyRequested) {
-			int timeout = 5;
-			int counter = 0;
 			// wait for the response
-			while(ctx->status != multistream_status_ack && counter < timeout) {
-				sleep(1);
-				counter++;
-			}
+			multistream_wait(out, 5);
 		}
 	}
 	return out;
@@ -524,14 +577,16 @@ int libp2p_net_multistream_handle_message(const struct StreamMessage* msg, struc
 			return -1;
 		} else {
 			ctx->status = multistream_status_ack;
+			libp2p_utils_readiness_signal();
 		}
 		return 1;
 	}
 	// the incoming stream is not a multistream. They are attempting to upgrade to multistream
 	struct Stream* new_stream = libp2p_net_multistream_stream_new(stream, 1);
 	if (new_stream != NULL) {
-		struct MultistreamContext* ctx = (struct MultistreamContext*)stream->stream_context;
+		struct MultistreamContext* ctx = (struct MultistreamContext*)new_stream->stream_context;
 		ctx->status = multistream_status_ack;
+		libp2p_utils_readiness_signal();
 		// upgrade
 		return stream->handle_upgrade(stream, new_stream);
 	}
@@ -576,6 +631,7 @@ struct Libp2pProtocolHandler* libp2p_net_multistream_build_protocol_handler(void
 	struct Libp2pProtocolHandler *handler = libp2p_protocol_handler_new();
 	if (handler != NULL) {
 		handler->context = context;
+		handler->protocol_id = "/multistream/1.0.0";
 		handler->CanHandle = libp2p_net_multistream_can_handle;
 		handler->HandleMessage = libp2p_net_multistream_handle_message;
 		handler->Shutdown = libp2p_net_multistream_shutdown;
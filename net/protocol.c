@@ -1,5 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include "varint.h"
 #include "libp2p/utils/logger.h"
 #include "libp2p/net/protocol.h"
 
@@ -7,6 +9,220 @@
  * Handle the different protocols
  */
 
+// the longest protocol id we will look for the end of
+#define PROTOCOL_ID_MAX_LENGTH 256
+// how many handler vectors we keep an index for
+#define PROTOCOL_TABLE_CACHE_SIZE 8
+
+/***
+ * A slot in the index
+ */
+struct ProtocolTableEntry {
+	const char* id; // NULL if the slot is empty
+	size_t id_size;
+	uint32_t hash;
+	int index; // where the handler is in the vector
+};
+
+/***
+ * Protocol ids of a vector of handlers, hashed
+ */
+struct ProtocolTable {
+	struct Libp2pVector* handlers; // the vector this was built from
+	const void** items; // if the vector's items or total change, the index is rebuilt
+	int total;
+	struct ProtocolTableEntry* entries;
+	size_t capacity; // a power of 2
+};
+
+static struct ProtocolTable protocol_tables[PROTOCOL_TABLE_CACHE_SIZE];
+static int protocol_tables_next = 0;
+static pthread_rwlock_t protocol_tables_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/***
+ * Hash a protocol id (FNV-1a)
+ * @param id the id
+ * @param id_size the length of the id
+ * @returns the hash
+ */
+static uint32_t protocol_hash(const char* id, size_t id_size) {
+	uint32_t hash = 2166136261u;
+	for(size_t i = 0; i < id_size; i++) {
+		hash ^= (uint8_t)id[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/***
+ * Find the protocol id at the start of a message (i.e. "/secio/1.0.0\n", perhaps with a varint in front)
+ * @param msg the message
+ * @param id where the id starts
+ * @param id_size the length of the id, without the newline
+ * @returns true(1) if the message starts with a protocol id, false(0) otherwise
+ */
+static int protocol_id_parse(const struct StreamMessage* msg, const char** id, size_t* id_size) {
+	if (msg == NULL || msg->data == NULL || msg->data_size < 2)
+		return 0;
+	size_t pos = 0;
+	if (msg->data[0] != '/') {
+		// is there a varint in front?
+		varint_decode(msg->data, msg->data_size, &pos);
+		if (pos == 0 || pos >= msg->data_size || msg->data[pos] != '/')
+			return 0;
+	}
+	size_t remaining = msg->data_size - pos;
+	const uint8_t* end = memchr(&msg->data[pos], '\n', remaining < PROTOCOL_ID_MAX_LENGTH ? remaining : PROTOCOL_ID_MAX_LENGTH);
+	if (end != NULL)
+		*id_size = end - &msg->data[pos];
+	else if (remaining <= PROTOCOL_ID_MAX_LENGTH)
+		*id_size = remaining;
+	else
+		return 0;
+	*id = (const char*)&msg->data[pos];
+	return 1;
+}
+
+/***
+ * Index the protocol ids of a vector of handlers
+ * NOTE: protocol_tables_lock should be held for writing
+ * @param table where to put the index
+ * @param handlers the handlers
+ * @returns true(1) on success, false(0) otherwise
+ */
+static int protocol_table_build(struct ProtocolTable* table, struct Libp2pVector* handlers) {
+	size_t capacity = 8;
+	while (capacity < (size_t)handlers->total * 2)
+		capacity <<= 1;
+	struct ProtocolTableEntry* entries = (struct ProtocolTableEntry*) calloc(capacity, sizeof(struct ProtocolTableEntry));
+	if (entries == NULL)
+		return 0;
+	for(int i = 0; i < handlers->total; i++) {
+		const struct Libp2pProtocolHandler* handler = (const struct Libp2pProtocolHandler*) libp2p_utils_vector_get(handlers, i);
+		if (handler == NULL || handler->protocol_id == NULL)
+			continue;
+		size_t id_size = strlen(handler->protocol_id);
+		uint32_t hash = protocol_hash(handler->protocol_id, id_size);
+		size_t slot = hash & (capacity - 1);
+		// the first handler registered for an id wins, as it did when they were tried in order
+		while (entries[slot].id != NULL && !(entries[slot].hash == hash && entries[slot].id_size == id_size && memcmp(entries[slot].id, handler->protocol_id, id_size) == 0))
+			slot = (slot + 1) & (capacity - 1);
+		if (entries[slot].id != NULL)
+			continue;
+		entries[slot].id = handler->protocol_id;
+		entries[slot].id_size = id_size;
+		entries[slot].hash = hash;
+		entries[slot].index = i;
+	}
+	free(table->entries);
+	table->entries = entries;
+	table->capacity = capacity;
+	table->handlers = handlers;
+	table->items = handlers->items;
+	table->total = handlers->total;
+	return 1;
+}
+
+/***
+ * Get the index of a vector of handlers, if it is still current
+ * NOTE: protocol_tables_lock should be held
+ * @param handlers the handlers
+ * @returns the index, or NULL if there isn't one
+ */
+static struct ProtocolTable* protocol_table_get(struct Libp2pVector* handlers) {
+	for(int i = 0; i < PROTOCOL_TABLE_CACHE_SIZE; i++) {
+		struct ProtocolTable* table = &protocol_tables[i];
+		if (table->handlers == handlers && table->items == handlers->items && table->total == handlers->total)
+			return table;
+	}
+	return NULL;
+}
+
+/***
+ * Look up a protocol id in an index
+ * @param table the index
+ * @param id the protocol id
+ * @param id_size the length of the id
+ * @returns the handler, or NULL if none has that id
+ */
+static const struct Libp2pProtocolHandler* protocol_table_lookup(struct ProtocolTable* table, const char* id, size_t id_size) {
+	uint32_t hash = protocol_hash(id, id_size);
+	size_t slot = hash & (table->capacity - 1);
+	while (table->entries[slot].id != NULL) {
+		struct ProtocolTableEntry* entry = &table->entries[slot];
+		if (entry->hash == hash && entry->id_size == id_size && memcmp(entry->id, id, id_size) == 0) {
+			const struct Libp2pProtocolHandler* handler = (const struct Libp2pProtocolHandler*) libp2p_utils_vector_get(table->handlers, entry->index);
+			// if the handler was replaced, the caller falls back to asking each one
+			if (handler == NULL || handler->protocol_id != entry->id)
+				return NULL;
+			return handler;
+		}
+		slot = (slot + 1) & (table->capacity - 1);
+	}
+	return NULL;
+}
+
+/***
+ * Find the handler for a protocol id. The index of the handlers is built the first time,
+ * and again if the handlers change.
+ * @param handlers the handlers
+ * @param id the protocol id
+ * @param id_size the length of the id
+ * @returns the handler, or NULL if none has that id
+ */
+static const struct Libp2pProtocolHandler* protocol_find(struct Libp2pVector* handlers, const char* id, size_t id_size) {
+	if (handlers == NULL)
+		return NULL;
+	const struct Libp2pProtocolHandler* handler = NULL;
+	pthread_rwlock_rdlock(&protocol_tables_lock);
+	struct ProtocolTable* table = protocol_table_get(handlers);
+	if (table != NULL) {
+		handler = protocol_table_lookup(table, id, id_size);
+		pthread_rwlock_unlock(&protocol_tables_lock);
+		return handler;
+	}
+	pthread_rwlock_unlock(&protocol_tables_lock);
+
+	pthread_rwlock_wrlock(&protocol_tables_lock);
+	table = protocol_table_get(handlers);
+	if (table == NULL) {
+		// reuse this vector's old slot, or take the next one
+		for(int i = 0; i < PROTOCOL_TABLE_CACHE_SIZE && table == NULL; i++) {
+			if (protocol_tables[i].handlers == handlers)
+				table = &protocol_tables[i];
+		}
+		if (table == NULL) {
+			table = &protocol_tables[protocol_tables_next];
+			protocol_tables_next = (protocol_tables_next + 1) % PROTOCOL_TABLE_CACHE_SIZE;
+		}
+		if (!protocol_table_build(table, handlers)) {
+			libp2p_logger_error("protocol", "Unable to allocate memory for the protocol index.\n");
+			table->handlers = NULL;
+			table = NULL;
+		}
+	}
+	if (table != NULL)
+		handler = protocol_table_lookup(table, id, id_size);
+	pthread_rwlock_unlock(&protocol_tables_lock);
+	return handler;
+}
+
+/***
+ * Forget the index of a vector of handlers
+ * @param handlers the handlers
+ */
+static void protocol_table_remove(struct Libp2pVector* handlers) {
+	pthread_rwlock_wrlock(&protocol_tables_lock);
+	for(int i = 0; i < PROTOCOL_TABLE_CACHE_SIZE; i++) {
+		struct ProtocolTable* table = &protocol_tables[i];
+		if (table->handlers == handlers) {
+			free(table->entries);
+			memset(table, 0, sizeof(struct ProtocolTable));
+		}
+	}
+	pthread_rwlock_unlock(&protocol_tables_lock);
+}
+
 
 /***
  * Compare incoming to see if they are requesting a protocol upgrade
@@ -27,6 +243,24 @@ const struct Libp2pProtocolHandler* protocol_compare(struct StreamMessage* msg,
 	return NULL;
 }
 
+/***
+ * Find the handler for a message that names a protocol. Handlers are looked up by
+ * protocol id, and asked with CanHandle only if that finds nothing.
+ * @param msg the message
+ * @param protocol_handlers the handlers
+ * @returns the handler, or NULL if there is none
+ */
+const struct Libp2pProtocolHandler* protocol_lookup(struct StreamMessage* msg, struct Libp2pVector* protocol_handlers) {
+	const char* id = NULL;
+	size_t id_size = 0;
+	const struct Libp2pProtocolHandler* handler = NULL;
+	if (protocol_id_parse(msg, &id, &id_size))
+		handler = protocol_find(protocol_handlers, id, id_size);
+	if (handler == NULL)
+		handler = protocol_compare(msg, protocol_handlers);
+	return handler;
+}
+
 /***
  * Retrieve the correct protocol handlder for a particular protocol id
  * @param protocol_handlers the collection of protocol handlers
@@ -37,7 +271,7 @@ const struct Libp2pProtocolHandler* libp2p_protocol_get_handler(struct Libp2pVec
 	struct StreamMessage message;
 	message.data_size = strlen(id);
 	message.data = (uint8_t*)id;
-	return protocol_compare(&message, protocol_handlers);
+	return protocol_lookup(&message, protocol_handlers);
 }
 
 /**
@@ -47,6 +281,7 @@ const struct Libp2pProtocolHandler* libp2p_protocol_get_handler(struct Libp2pVec
 struct Libp2pProtocolHandler* libp2p_protocol_handler_new() {
 	struct Libp2pProtocolHandler* h = (struct Libp2pProtocolHandler*) malloc(sizeof(struct Libp2pProtocolHandler));
 	if (h != NULL) {
+		h->protocol_id = NULL;
 		h->CanHandle = NULL;
 		h->HandleMessage = NULL;
 		h->Shutdown = NULL;
@@ -82,7 +317,18 @@ int appears_to_be_a_protocol(struct StreamMessage* msg) {
  * @returns -1 on error, 0 if everything was okay, but the daemon should no longer handle this connection, 1 on success
  */
 int libp2p_protocol_marshal(struct StreamMessage* msg, struct Stream* stream, struct Libp2pVector* handlers) {
-	const struct Libp2pProtocolHandler* handler = protocol_compare(msg, handlers);
+	const struct Libp2pProtocolHandler* handler = NULL;
+	const char* id = NULL;
+	size_t id_size = 0;
+
+	if (protocol_id_parse(msg, &id, &id_size)) {
+		handler = protocol_find(handlers, id, id_size);
+	} else if (stream != NULL && stream->protocol_handler != NULL) {
+		// not a protocol id, so it belongs to the protocol already negotiated
+		return stream->protocol_handler->HandleMessage(msg, stream, stream->protocol_handler->context);
+	}
+	if (handler == NULL)
+		handler = protocol_compare(msg, handlers);
 
 	if (handler == NULL) {
 		if (appears_to_be_a_protocol(msg)) {
@@ -96,6 +342,8 @@ int libp2p_protocol_marshal(struct StreamMessage* msg, struct Stream* stream, st
 		return -1;
 	}
 
+	if (stream != NULL)
+		stream->protocol_handler = handler;
 	return handler->HandleMessage(msg, stream, handler->context);
 }
 
@@ -105,7 +353,7 @@ int libp2p_protocol_marshal(struct StreamMessage* msg, struct Stream* stream, st
  * @param handlers the vector of handlers
  */
 int libp2p_protocol_is_valid_protocol(struct StreamMessage* msg, struct Libp2pVector* handlers) {
-	if (protocol_compare(msg, handlers) == NULL)
+	if (protocol_lookup(msg, handlers) == NULL)
 		return 0;
 	return 1;
 }
@@ -120,6 +368,7 @@ int libp2p_protocol_handlers_shutdown(struct Libp2pVector* handlers) {
 		struct Libp2pProtocolHandler* handler = (struct Libp2pProtocolHandler*)libp2p_utils_vector_get(handlers, i);
 		handler->Shutdown(handler->context);
 	}
+	protocol_table_remove(handlers);
 	libp2p_utils_vector_free(handlers);
 	return 1;
 }
@@ -1,13 +1,19 @@
 /**
  * A simple tcp server that uses thread pools and protocol handlers
  */
-
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -16,6 +22,7 @@
 #include "libp2p/net/multistream.h"
 #include "libp2p/net/p2pnet.h"
 #include "libp2p/net/protocol.h"
+#include "libp2p/net/server.h"
 #include "libp2p/nodeio/nodeio.h"
 #include "libp2p/os/utils.h"
 #include "libp2p/record/message.h"
@@ -28,6 +35,7 @@ struct server_connection_params {
 	uint32_t ip_address_binary;
 	const char* ip_address_text;
 	uint16_t port;
+	int max_connections;
 	struct Libp2pVector* protocol_handlers;
 };
 
@@ -39,11 +47,62 @@ struct client_connection_params {
 	struct Libp2pVector* protocol_handlers;
 };
 
+/***
+ * A connection owned by a shard
+ */
+struct server_shard_connection {
+	int file_descriptor;
+	int slot; // where this connection lives in the shard's connection table
+	struct SessionContext* session_context;
+	struct server_shard* shard;
+	// set by a worker that is done with the connection, for the shard thread to pick up
+	struct server_shard_connection* next_done;
+	int close_it;
+};
+
+/***
+ * One shard of a sharded server. A shard owns its listener, its connections and
+ * the thread that watches them. Nothing here is shared with the other shards.
+ * The shard thread hands a connection with a whole message waiting to one of the
+ * shard's workers, and takes it back when the worker is done. Only the shard
+ * thread changes what epoll watches, or closes a connection. It also sends what
+ * the workers have queued, as the sockets become writable.
+ */
+struct server_shard {
+	int index;
+	pthread_t thread;
+	int listen_fd;
+	int epoll_fd;
+	uint32_t ip_address_binary;
+	uint16_t port;
+	struct Libp2pVector* protocol_handlers;
+	int max_connections;
+	int connection_count;
+	struct server_shard_connection** connections; // max_connections slots
+	threadpool workers; // run the protocol handlers, so one slow peer doesn't hold up the rest
+	int done_fd; // an eventfd the workers signal when they hand a connection back
+	struct ConnectionFlusher* flusher; // sends what the connections have queued, as their sockets take more
+	pthread_mutex_t done_lock;
+	struct server_shard_connection* done; // connections handed back by the workers
+};
+
 // this is the thread id NOTE: there should only be 1 server per instance, as this is a global
 pthread_t server_pthread;
 
+// the shards, if the server was started with libp2p_net_server_start_sharded
+static struct server_shard* server_shards = NULL;
+static int server_num_shards = 0;
+
+// connections currently being handled by libp2p_server_listen
+static int server_connection_count = 0;
+
 #define BUF_SIZE 4096
 
+// the most events handled per trip through a shard's event loop
+#define SERVER_MAX_EVENTS 64
+// number of threads each shard has to run protocol handlers
+#define SERVER_SHARD_WORKERS 4
+
 // this should be set to 5 for normal operation, perhaps higher for debugging purposes
 #define DEFAULT_NETWORK_TIMEOUT 5
 
@@ -65,7 +124,7 @@ void libp2p_net_connection (void *ptr) {
     sessionContext.default_stream = clientStream;
 
     if (sessionContext.default_stream == NULL)
-    	return;
+    	goto exit;
 
     // try to read from the network
     struct StreamMessage *results = NULL;
@@ -87,7 +146,8 @@ void libp2p_net_connection (void *ptr) {
 		}
 	} // end of loop
 
-	connection_param->count--; // update counter.
+	exit:
+	__sync_fetch_and_sub(&server_connection_count, 1); // update counter.
 	if (connection_param->ip != NULL)
 		free(connection_param->ip);
 	free (connection_param);
@@ -102,7 +162,9 @@ void libp2p_net_connection (void *ptr) {
 void* libp2p_server_listen (void *ptr)
 {
 	server_shutting_down = 0;
-    int socketfd, s, count = 0;
+    int socketfd, s;
+    uint32_t remote_ip;
+    uint16_t remote_port;
     threadpool thpool = thpool_init(25);
     struct server_connection_params *connection_param = (struct server_connection_params*)ptr;
 
@@ -120,26 +182,29 @@ void* libp2p_server_listen (void *ptr)
 			break;
 		}
 		if (numDescriptors > 0) {
-			s = socket_accept4(socketfd, &(connection_param->ip_address_binary), &(connection_param->port));
-			if (count >= 50) { // limit reached.
+			s = socket_accept4(socketfd, &remote_ip, &remote_port);
+			if (s < 0)
+				continue;
+			if (server_connection_count >= connection_param->max_connections) { // limit reached.
 				close (s);
 				continue;
 			}
 
-			count++;
 			clientConnection = malloc (sizeof (struct client_connection_params));
 			if (clientConnection) {
 				clientConnection->file_descriptor = s;
-				clientConnection->count = count;
-				clientConnection->port = connection_param->port;
+				clientConnection->count = __sync_add_and_fetch(&server_connection_count, 1);
+				clientConnection->port = remote_port;
 				clientConnection->ip = malloc(INET_ADDRSTRLEN);
 				clientConnection->protocol_handlers = connection_param->protocol_handlers;
 				if (clientConnection->ip == NULL) {
 					// we are out of memory
+					__sync_fetch_and_sub(&server_connection_count, 1);
 					free(clientConnection);
+					close(s);
 					continue;
 				}
-				if (inet_ntop(AF_INET, &(connection_param->ip_address_binary), clientConnection->ip, INET_ADDRSTRLEN) == NULL) {
+				if (inet_ntop(AF_INET, &remote_ip, clientConnection->ip, INET_ADDRSTRLEN) == NULL) {
 					free(clientConnection->ip);
 					clientConnection->ip = NULL;
 					clientConnection->port = 0;
@@ -161,6 +226,349 @@ void* libp2p_server_listen (void *ptr)
     return (void*) 2;
 }
 
+/***
+ * Drop a connection that belongs to a shard, and free its slot
+ * @param shard the shard
+ * @param connection the connection
+ */
+void libp2p_net_server_shard_close(struct server_shard* shard, struct server_shard_connection* connection) {
+	epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, connection->file_descriptor, NULL);
+	shard->connections[connection->slot] = NULL;
+	shard->connection_count--;
+	struct SessionContext* session_context = connection->session_context;
+	if (session_context->host != NULL) {
+		free(session_context->host);
+		session_context->host = NULL;
+	}
+	// closing the default stream closes the streams below it
+	libp2p_session_context_free(session_context);
+	free(connection);
+}
+
+/***
+ * Take ownership of a newly accepted connection
+ * @param shard the shard that accepted the connection
+ * @param fd the new socket
+ * @param ip the remote ip address
+ * @param port the remote port
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_net_server_shard_add(struct server_shard* shard, int fd, uint32_t ip, uint16_t port) {
+	// find an empty slot
+	int slot = -1;
+	for(int i = 0; i < shard->max_connections; i++) {
+		if (shard->connections[i] == NULL) {
+			slot = i;
+			break;
+		}
+	}
+	if (slot < 0)
+		return 0;
+	struct server_shard_connection* connection = (struct server_shard_connection*) malloc(sizeof(struct server_shard_connection));
+	if (connection == NULL)
+		return 0;
+	connection->file_descriptor = fd;
+	connection->slot = slot;
+	connection->session_context = libp2p_session_context_new();
+	if (connection->session_context == NULL) {
+		free(connection);
+		return 0;
+	}
+	struct SessionContext* session_context = connection->session_context;
+	session_context->host = malloc(INET_ADDRSTRLEN);
+	if (session_context->host == NULL || inet_ntop(AF_INET, &ip, session_context->host, INET_ADDRSTRLEN) == NULL) {
+		free(session_context->host);
+		session_context->host = NULL;
+		libp2p_session_context_free(session_context);
+		free(connection);
+		return 0;
+	}
+	session_context->port = port;
+	session_context->default_stream = libp2p_net_connection_established(fd, session_context->host, port, session_context);
+	if (session_context->default_stream == NULL) {
+		free(session_context->host);
+		session_context->host = NULL;
+		libp2p_session_context_free(session_context);
+		free(connection);
+		return 0;
+	}
+	session_context->insecure_stream = session_context->default_stream;
+	// writers on this connection leave what the socket can't take to the shard thread
+	libp2p_net_connection_flusher_attach(shard->flusher, session_context->default_stream);
+
+	connection->shard = shard;
+	connection->next_done = NULL;
+	connection->close_it = 0;
+
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	event.data.ptr = connection;
+	shard->connections[slot] = connection;
+	shard->connection_count++;
+	if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+		libp2p_logger_error("server", "Shard %d unable to watch connection %d: %s.\n", shard->index, fd, strerror(errno));
+		libp2p_net_server_shard_close(shard, connection);
+		return 0;
+	}
+	return 1;
+}
+
+/***
+ * Accept everything that is waiting on the shard's listener
+ * @param shard the shard
+ */
+void libp2p_net_server_shard_accept(struct server_shard* shard) {
+	uint32_t remote_ip;
+	uint16_t remote_port;
+	for(;;) {
+		int s = socket_accept4(shard->listen_fd, &remote_ip, &remote_port);
+		if (s < 0)
+			return;
+		if (shard->connection_count >= shard->max_connections) { // limit reached.
+			close(s);
+			continue;
+		}
+		if (!libp2p_net_server_shard_add(shard, s, remote_ip, remote_port))
+			close(s);
+	}
+}
+
+/***
+ * Runs on one of the shard's workers. Handles the messages that are waiting on a
+ * connection, then hands the connection back to the shard thread.
+ * @param ptr the server_shard_connection
+ */
+void libp2p_net_server_shard_work(void* ptr) {
+	struct server_shard_connection* connection = (struct server_shard_connection*) ptr;
+	struct server_shard* shard = connection->shard;
+	int close_it = 0;
+	for(;;) {
+		struct Stream* stream = connection->session_context->default_stream;
+		struct StreamMessage* results = NULL;
+		int retVal = 0;
+		pthread_mutex_lock(stream->read_mutex);
+		int success = stream->read(stream->stream_context, &results, DEFAULT_NETWORK_TIMEOUT);
+		pthread_mutex_unlock(stream->read_mutex);
+		if (!success) {
+			// problem reading, or the other side hung up
+			libp2p_stream_message_free(results);
+			close_it = 1;
+			break;
+		}
+		if (results != NULL) {
+			// handle the call
+			retVal = libp2p_protocol_marshal(results, connection->session_context->default_stream, shard->protocol_handlers);
+			libp2p_stream_message_free(results);
+		}
+		if (retVal < 0) {
+			close_it = 1;
+			break;
+		}
+		// epoll only knows about the socket, so drain anything the connection has already buffered
+		stream = connection->session_context->default_stream;
+		if (stream->peek == NULL || stream->peek(stream->stream_context) <= 0)
+			break;
+	}
+	// give it back to the shard thread
+	pthread_mutex_lock(&shard->done_lock);
+	connection->close_it = close_it;
+	connection->next_done = shard->done;
+	shard->done = connection;
+	pthread_mutex_unlock(&shard->done_lock);
+	uint64_t one = 1;
+	if (write(shard->done_fd, &one, sizeof(one)) < 0)
+		libp2p_logger_error("server", "Shard %d unable to signal a finished connection: %s.\n", shard->index, strerror(errno));
+}
+
+/***
+ * A connection on this shard has something for us (or has gone away). If a whole
+ * message is waiting, a worker handles it. Otherwise the connection waits for more.
+ * NOTE: only called on the shard thread
+ * @param shard the shard
+ * @param connection the connection
+ * @param events what epoll saw (0 if the connection came back from a worker)
+ */
+void libp2p_net_server_shard_handle(struct server_shard* shard, struct server_shard_connection* connection, uint32_t events) {
+	struct Stream* stream = connection->session_context->default_stream;
+	int bytes_waiting = 0;
+	if (stream->peek != NULL)
+		bytes_waiting = stream->peek(stream->stream_context);
+	else if (events & EPOLLIN)
+		bytes_waiting = 1;
+	if (bytes_waiting < 0 || (bytes_waiting == 0 && (events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR)))) {
+		// the other side has gone away
+		libp2p_net_server_shard_close(shard, connection);
+		return;
+	}
+	if (bytes_waiting > 0) {
+		if (thpool_add_work(shard->workers, libp2p_net_server_shard_work, connection) == 0)
+			return;
+		libp2p_logger_error("server", "Shard %d unable to hand connection %d to a worker.\n", shard->index, connection->file_descriptor);
+	}
+	// wait for more
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	event.data.ptr = connection;
+	if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_MOD, connection->file_descriptor, &event) != 0) {
+		libp2p_logger_error("server", "Shard %d unable to rearm connection %d: %s.\n", shard->index, connection->file_descriptor, strerror(errno));
+		libp2p_net_server_shard_close(shard, connection);
+	}
+}
+
+/***
+ * Take back the connections the workers are done with
+ * NOTE: only called on the shard thread
+ * @param shard the shard
+ */
+void libp2p_net_server_shard_take_back(struct server_shard* shard) {
+	uint64_t count = 0;
+	if (read(shard->done_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		libp2p_logger_error("server", "Shard %d unable to read its eventfd: %s.\n", shard->index, strerror(errno));
+	pthread_mutex_lock(&shard->done_lock);
+	struct server_shard_connection* current = shard->done;
+	shard->done = NULL;
+	pthread_mutex_unlock(&shard->done_lock);
+	while (current != NULL) {
+		struct server_shard_connection* next = current->next_done;
+		current->next_done = NULL;
+		if (current->close_it)
+			libp2p_net_server_shard_close(shard, current);
+		else
+			libp2p_net_server_shard_handle(shard, current, 0);
+		current = next;
+	}
+}
+
+/***
+ * The thread behind a shard. Accepts connections from its own listener, and
+ * services them.
+ * @param ptr the server_shard
+ * @returns nothing useful
+ */
+void* libp2p_net_server_shard_run(void* ptr) {
+	struct server_shard* shard = (struct server_shard*) ptr;
+	struct epoll_event events[SERVER_MAX_EVENTS];
+
+#ifdef __linux__
+	// stay on our own core
+	long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_cpus > 0) {
+		cpu_set_t cpu_set;
+		CPU_ZERO(&cpu_set);
+		CPU_SET(shard->index % num_cpus, &cpu_set);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpu_set);
+	}
+#endif
+
+	while (!server_shutting_down) {
+		int num_events = epoll_wait(shard->epoll_fd, events, SERVER_MAX_EVENTS, 1000);
+		if (num_events < 0) {
+			if (errno == EINTR)
+				continue;
+			libp2p_logger_error("server", "Shard %d: epoll_wait returned %s. Exiting.\n", shard->index, strerror(errno));
+			break;
+		}
+		for(int i = 0; i < num_events && !server_shutting_down; i++) {
+			if (events[i].data.ptr == NULL)
+				libp2p_net_server_shard_accept(shard);
+			else if (events[i].data.ptr == &shard->done_fd)
+				libp2p_net_server_shard_take_back(shard);
+			else if (events[i].data.ptr == shard->flusher)
+				libp2p_net_connection_flusher_run(shard->flusher);
+			else
+				libp2p_net_server_shard_handle(shard, (struct server_shard_connection*)events[i].data.ptr, events[i].events);
+		}
+	}
+
+	// shut down everything this shard owns, once the workers have let go
+	thpool_wait(shard->workers);
+	thpool_destroy(shard->workers);
+	shard->workers = NULL;
+	for(int i = 0; i < shard->max_connections; i++) {
+		if (shard->connections[i] != NULL)
+			libp2p_net_server_shard_close(shard, shard->connections[i]);
+	}
+	libp2p_net_connection_flusher_free(shard->flusher);
+	shard->flusher = NULL;
+	close(shard->listen_fd);
+	close(shard->epoll_fd);
+	close(shard->done_fd);
+	pthread_mutex_destroy(&shard->done_lock);
+	return NULL;
+}
+
+/***
+ * Give a shard its own listener and epoll instance
+ * @param shard the shard, with the address, port and limits filled in
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_net_server_shard_init(struct server_shard* shard) {
+	shard->listen_fd = -1;
+	shard->epoll_fd = -1;
+	shard->done_fd = -1;
+	shard->flusher = NULL;
+	shard->workers = NULL;
+	shard->done = NULL;
+	pthread_mutex_init(&shard->done_lock, NULL);
+	shard->connection_count = 0;
+	shard->connections = (struct server_shard_connection**) calloc(shard->max_connections, sizeof(struct server_shard_connection*));
+	if (shard->connections == NULL)
+		return 0;
+	// every shard binds the same address and port. SO_REUSEPORT lets the kernel spread new connections between them
+	shard->listen_fd = socket_listen(socket_tcp4(), &shard->ip_address_binary, &shard->port);
+	if (shard->listen_fd <= 0) {
+		libp2p_logger_error("server", "Shard %d unable to listen on port %d.\n", shard->index, shard->port);
+		return 0;
+	}
+	fcntl(shard->listen_fd, F_SETFL, fcntl(shard->listen_fd, F_GETFL, 0) | O_NONBLOCK);
+	shard->epoll_fd = epoll_create1(0);
+	if (shard->epoll_fd < 0)
+		return 0;
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = NULL; // NULL marks the listener
+	if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->listen_fd, &event) != 0)
+		return 0;
+	shard->done_fd = eventfd(0, EFD_NONBLOCK);
+	if (shard->done_fd < 0)
+		return 0;
+	event.events = EPOLLIN;
+	event.data.ptr = &shard->done_fd; // marks the workers handing connections back
+	if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->done_fd, &event) != 0)
+		return 0;
+	shard->flusher = libp2p_net_connection_flusher_new();
+	if (shard->flusher == NULL)
+		return 0;
+	event.events = EPOLLIN;
+	event.data.ptr = shard->flusher; // marks the flusher
+	if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, libp2p_net_connection_flusher_fd(shard->flusher), &event) != 0)
+		return 0;
+	shard->workers = thpool_init(SERVER_SHARD_WORKERS);
+	if (shard->workers == NULL)
+		return 0;
+	return 1;
+}
+
+/***
+ * Release what libp2p_net_server_shard_init built, if the shard never started
+ * @param shard the shard
+ */
+void libp2p_net_server_shard_free(struct server_shard* shard) {
+	if (shard->listen_fd > 0)
+		close(shard->listen_fd);
+	if (shard->epoll_fd >= 0)
+		close(shard->epoll_fd);
+	if (shard->done_fd >= 0)
+		close(shard->done_fd);
+	if (shard->workers != NULL)
+		thpool_destroy(shard->workers);
+	libp2p_net_connection_flusher_free(shard->flusher);
+	shard->flusher = NULL;
+	pthread_mutex_destroy(&shard->done_lock);
+	free(shard->connections);
+	shard->connections = NULL;
+}
+
 /***
  * Start a server given the information
  * NOTE: This spins off a thread.
@@ -171,21 +579,104 @@ void* libp2p_server_listen (void *ptr)
  */
 int libp2p_net_server_start(const char* ip, int port, struct Libp2pVector* protocol_handlers) {
 	struct server_connection_params* params = (struct server_connection_params*) malloc(sizeof(struct server_connection_params));
+	if (params == NULL)
+		return 0;
 	params->ip_address_text = ip;
 	inet_pton(AF_INET, ip, &params->ip_address_binary);
 	params->port = port;
+	params->max_connections = LIBP2P_NET_SERVER_DEFAULT_MAX_CONNECTIONS;
 	params->protocol_handlers = protocol_handlers;
+	server_shutting_down = 0;
+	server_num_shards = 0;
 	// start on a separate thread
 	pthread_create(&server_pthread, NULL, libp2p_server_listen, params);
 	return 1;
 }
 
 /***
- * Shut down the server started by libp2p_net_start_server
+ * Start a server that is split into shards. Each shard has its own listener on the
+ * same port (via SO_REUSEPORT), its own connections, and its own thread
+ * pinned to a core. Connections are never handed between shards.
+ * @param ip the ip address to attach to
+ * @param port the port to use
+ * @param protocol_handlers the protocol handlers
+ * @param num_shards the number of shards, or 0 for one per core
+ * @param max_connections the connection limit of each shard, or 0 for the default
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_net_server_start_sharded(const char* ip, int port, struct Libp2pVector* protocol_handlers, int num_shards, int max_connections) {
+	if (server_shards != NULL) {
+		libp2p_logger_error("server", "start_sharded: The server is already running.\n");
+		return 0;
+	}
+	if (num_shards <= 0) {
+		num_shards = sysconf(_SC_NPROCESSORS_ONLN);
+		if (num_shards <= 0)
+			num_shards = 1;
+	}
+	if (max_connections <= 0)
+		max_connections = LIBP2P_NET_SERVER_DEFAULT_MAX_CONNECTIONS;
+	uint32_t ip_address_binary = 0;
+	if (inet_pton(AF_INET, ip, &ip_address_binary) != 1) {
+		libp2p_logger_error("server", "start_sharded: Invalid address %s.\n", ip);
+		return 0;
+	}
+
+	struct server_shard* shards = (struct server_shard*) calloc(num_shards, sizeof(struct server_shard));
+	if (shards == NULL)
+		return 0;
+	for(int i = 0; i < num_shards; i++) {
+		struct server_shard* shard = &shards[i];
+		shard->index = i;
+		shard->ip_address_binary = ip_address_binary;
+		shard->port = port;
+		shard->protocol_handlers = protocol_handlers;
+		shard->max_connections = max_connections;
+		if (!libp2p_net_server_shard_init(shard)) {
+			for(int j = 0; j <= i; j++)
+				libp2p_net_server_shard_free(&shards[j]);
+			free(shards);
+			return 0;
+		}
+	}
+
+	server_shutting_down = 0;
+	server_shards = shards;
+	server_num_shards = 0;
+	for(int i = 0; i < num_shards; i++) {
+		if (pthread_create(&shards[i].thread, NULL, libp2p_net_server_shard_run, &shards[i]) != 0) {
+			libp2p_logger_error("server", "start_sharded: Unable to start shard %d.\n", i);
+			// the shards that did start clean up after themselves
+			for(int j = i; j < num_shards; j++)
+				libp2p_net_server_shard_free(&shards[j]);
+			break;
+		}
+		server_num_shards++;
+	}
+	if (server_num_shards == 0) {
+		free(server_shards);
+		server_shards = NULL;
+		return 0;
+	}
+	return 1;
+}
+
+/***
+ * Shut down the server started by libp2p_net_start_server or libp2p_net_server_start_sharded
  * @returns true(1) on success, false(0) otherwise
  */
 int libp2p_net_server_stop() {
 	server_shutting_down = 1;
+	if (server_shards != NULL) {
+		for(int i = 0; i < server_num_shards; i++) {
+			pthread_join(server_shards[i].thread, NULL);
+			free(server_shards[i].connections);
+		}
+		free(server_shards);
+		server_shards = NULL;
+		server_num_shards = 0;
+		return 1;
+	}
 	pthread_join(server_pthread, NULL);
 	return 1;
 }
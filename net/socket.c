@@ -1,6 +1,10 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <limits.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <string.h>
@@ -149,17 +153,29 @@ int socket_connect4_with_timeout(int s, uint32_t ip, uint16_t port, int timeout_
 
    // connect
    int retVal = connect(s, (struct sockaddr *) &sa, sizeof sa);
-   int tried_secs = 0;
-   while (retVal == -1 && errno == EINPROGRESS && tried_secs < timeout_secs) {
-	   libp2p_logger_debug("socket", "Socket connect unsuccessful. Waiting to try again.\n");
-	   // wait for timeout
-	   sleep(1);
-	   tried_secs++;
-	   retVal = connect(s, (struct sockaddr *) &sa, sizeof sa);
-	   if (retVal == -1 && errno == EALREADY) {
-		   libp2p_logger_debug("socket", "Socket connect completed.\n");
-		   retVal = 0;
-		   break;
+   if (retVal == -1 && errno == EINPROGRESS) {
+	   // wait for the connection to complete (or fail), but no longer than the deadline
+	   struct timespec deadline;
+	   struct timespec* until = socket_deadline_after_ms(&deadline, (long)timeout_secs * 1000);
+	   struct pollfd poll_fd;
+	   poll_fd.fd = s;
+	   poll_fd.events = POLLOUT;
+	   int num_ready;
+	   do {
+		   poll_fd.revents = 0;
+		   num_ready = poll(&poll_fd, 1, socket_deadline_remaining_ms(until)); // -1 (no limit) if there is no deadline
+	   } while (num_ready < 0 && errno == EINTR);
+	   if (num_ready > 0) {
+		   int error = 0;
+		   socklen_t error_size = sizeof(error);
+		   if (getsockopt(s, SOL_SOCKET, SO_ERROR, &error, &error_size) == 0 && error == 0) {
+			   libp2p_logger_debug("socket", "Socket connect completed.\n");
+			   retVal = 0;
+		   } else {
+			   errno = error;
+		   }
+	   } else if (num_ready == 0) {
+		   errno = ETIMEDOUT;
 	   }
    }
 
@@ -194,13 +210,134 @@ int socket_listen(int s, uint32_t *localip, uint16_t *localport)
       close(s);
       return -1;
    }
-   if (listen(s, 1) == -1) {
+   if (listen(s, SOMAXCONN) == -1) {
       close(s);
       return -1;
    }
    return s;
 }
 
+/***
+ * Compute a deadline that is a number of milliseconds from now
+ * @param deadline where to put the results
+ * @param milliseconds how far in the future. 0 or less means no deadline (wait forever)
+ * @returns the deadline, or NULL if there is no deadline
+ */
+struct timespec* socket_deadline_after_ms(struct timespec* deadline, long milliseconds) {
+	if (milliseconds <= 0)
+		return NULL;
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += milliseconds / 1000;
+	deadline->tv_nsec += (milliseconds % 1000) * 1000000;
+	if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+	return deadline;
+}
+
+/***
+ * How long until a deadline passes
+ * @param deadline the deadline, or NULL for none
+ * @returns milliseconds left (0 if it has passed), or -1 if there is no deadline
+ */
+int socket_deadline_remaining_ms(const struct timespec* deadline) {
+	if (deadline == NULL)
+		return -1;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long long remaining = (long long)(deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+	if (remaining < 0)
+		return 0;
+	// round up, so that we don't spin on the last partial millisecond
+	if (remaining == 0 && (deadline->tv_sec > now.tv_sec || deadline->tv_nsec > now.tv_nsec))
+		return 1;
+	return remaining > INT_MAX ? INT_MAX : (int)remaining;
+}
+
+/***
+ * Wait until a socket has something to read
+ * @param s the socket
+ * @param deadline when to give up, or NULL to wait forever
+ * @returns >0 if readable, 0 on timeout, negative on error
+ */
+int socket_wait_readable(int s, const struct timespec* deadline) {
+	struct pollfd poll_fd;
+	poll_fd.fd = s;
+	poll_fd.events = POLLIN;
+	for(;;) {
+		poll_fd.revents = 0;
+		int retVal = poll(&poll_fd, 1, socket_deadline_remaining_ms(deadline));
+		if (retVal < 0 && errno == EINTR)
+			continue;
+		return retVal;
+	}
+}
+
+/***
+ * Receive from a socket, waiting no later than the deadline. The socket is only
+ * polled if there is nothing to read yet, so the usual case is a single recv.
+ *
+ * @param s the socket
+ * @param buf where to put the bytes
+ * @param len the size of buf
+ * @param flags network flags
+ * @param deadline when to give up, or NULL to wait forever
+ * @returns number of bytes, 0 if the other side hung up, or -1 on error (errno is EAGAIN on timeout)
+ */
+ssize_t socket_read_until(int s, char *buf, size_t len, int flags, const struct timespec* deadline)
+{
+	for(;;) {
+		ssize_t retVal = recv(s, buf, len, flags | MSG_DONTWAIT);
+		if (retVal >= 0)
+			return retVal;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+		int ready = socket_wait_readable(s, deadline);
+		if (ready == 0) {
+			errno = EAGAIN;
+			return -1;
+		}
+		if (ready < 0)
+			return -1;
+	}
+}
+
+/***
+ * Same as socket_read_until, but scatters the incoming bytes over several buffers
+ *
+ * @param s the socket
+ * @param regions where to put the bytes
+ * @param num_regions the number of entries in regions
+ * @param deadline when to give up, or NULL to wait forever
+ * @returns number of bytes, 0 if the other side hung up, or -1 on error (errno is EAGAIN on timeout)
+ */
+ssize_t socket_readv_until(int s, const struct iovec* regions, int num_regions, const struct timespec* deadline)
+{
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = (struct iovec*)regions;
+	message.msg_iovlen = num_regions;
+	for(;;) {
+		ssize_t retVal = recvmsg(s, &message, MSG_DONTWAIT);
+		if (retVal >= 0)
+			return retVal;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+		int ready = socket_wait_readable(s, deadline);
+		if (ready == 0) {
+			errno = EAGAIN;
+			return -1;
+		}
+		if (ready < 0)
+			return -1;
+	}
+}
+
 /***
  * Reads data from a socket, used instead of recv so if a protocol needs
  * to use something else before or after it can be done here instead of
@@ -215,12 +352,8 @@ int socket_listen(int s, uint32_t *localip, uint16_t *localport)
  */
 ssize_t socket_read(int s, char *buf, size_t len, int flags, int num_secs)
 {
-	struct timeval tv;
-	tv.tv_sec = num_secs;
-	tv.tv_usec = 0;
-	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(struct timeval));
-
-	return recv(s, buf, len, flags);
+	struct timespec deadline;
+	return socket_read_until(s, buf, len, flags, socket_deadline_after_ms(&deadline, (long)num_secs * 1000));
 }
 
 /* Same reason as socket_read, but to send data instead of receive.
@@ -1,16 +1,18 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "multiaddr/multiaddr.h"
 #include "libp2p/net/stream.h"
 #include "libp2p/net/connectionstream.h"
 #include "libp2p/yamux/yamux.h"
+#include "libp2p/utils/slab.h"
 
 int libp2p_stream_default_handle_upgrade(struct Stream* parent_stream, struct Stream* new_stream) {
 	return libp2p_net_connection_upgrade(parent_stream, new_stream);
 }
 
 struct Stream* libp2p_stream_new() {
-	struct Stream* stream = (struct Stream*) malloc(sizeof(struct Stream));
+	struct Stream* stream = (struct Stream*) libp2p_utils_slab_alloc(sizeof(struct Stream));
 	if (stream != NULL) {
 		stream->address = NULL;
 		stream->close = NULL;
@@ -18,29 +20,102 @@ struct Stream* libp2p_stream_new() {
 		stream->peek = NULL;
 		stream->read = NULL;
 		stream->read_raw = NULL;
-		stream->socket_mutex = NULL;
+		stream->read_slice = NULL;
+		stream->read_mutex = NULL;
 		stream->stream_context = NULL;
 		stream->write = NULL;
+		stream->writev = NULL;
 		stream->handle_upgrade = libp2p_stream_default_handle_upgrade;
 		stream->channel = -1;
+		stream->protocol_handler = NULL;
 	}
 	return stream;
 }
 
 void libp2p_stream_free(struct Stream* stream) {
 	if (stream != NULL) {
-		if (stream->socket_mutex != NULL) {
-			free(stream->socket_mutex);
-			stream->socket_mutex = NULL;
+		if (stream->read_mutex != NULL) {
+			free(stream->read_mutex);
+			stream->read_mutex = NULL;
 		}
 		if (stream->address != NULL) {
 			multiaddress_free(stream->address);
 			stream->address = NULL;
 		}
-		free(stream);
+		libp2p_utils_slab_free(stream);
 	}
 }
 
+/***
+ * Write several buffers to a stream as if they were one. If the stream has no
+ * writev, the buffers are joined and passed to write.
+ * @param stream the stream
+ * @param regions the buffers to write, in order
+ * @param num_regions the number of buffers
+ * @returns the number of bytes of the regions written, or 0 (or less) on error
+ */
+int libp2p_stream_writev(struct Stream* stream, const struct iovec* regions, int num_regions) {
+	if (stream == NULL)
+		return 0;
+	if (stream->writev != NULL)
+		return stream->writev(stream->stream_context, regions, num_regions);
+	if (stream->write == NULL)
+		return 0;
+	// this stream can only take one buffer
+	struct StreamMessage msg;
+	msg.data_size = 0;
+	msg.error_number = 0;
+	msg.buffer = NULL;
+	for(int i = 0; i < num_regions; i++)
+		msg.data_size += regions[i].iov_len;
+	msg.data = (uint8_t*) malloc(msg.data_size);
+	if (msg.data == NULL)
+		return 0;
+	size_t pos = 0;
+	for(int i = 0; i < num_regions; i++) {
+		memcpy(&msg.data[pos], regions[i].iov_base, regions[i].iov_len);
+		pos += regions[i].iov_len;
+	}
+	int retVal = stream->write(stream->stream_context, &msg);
+	free(msg.data);
+	if (retVal <= 0)
+		return retVal;
+	return msg.data_size;
+}
+
+/***
+ * Read exactly num_bytes from a stream as a message. If the stream has no
+ * read_slice, the bytes are read with read_raw into a new message.
+ * @param stream the stream
+ * @param num_bytes the number of bytes to read
+ * @param message where to put the message
+ * @param timeout_secs number of seconds before a timeout
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_stream_read_slice(struct Stream* stream, size_t num_bytes, struct StreamMessage** message, int timeout_secs) {
+	*message = NULL;
+	if (stream == NULL)
+		return 0;
+	if (stream->read_slice != NULL)
+		return stream->read_slice(stream->stream_context, num_bytes, message, timeout_secs);
+	if (stream->read_raw == NULL)
+		return 0;
+	struct StreamMessage* msg = libp2p_stream_message_new_buffer(num_bytes);
+	if (msg == NULL)
+		return 0;
+	size_t pos = 0;
+	while (pos < num_bytes) {
+		int bytes_read = stream->read_raw(stream->stream_context, &msg->data[pos], num_bytes - pos, timeout_secs);
+		if (bytes_read <= 0) {
+			libp2p_stream_message_free(msg);
+			return 0;
+		}
+		pos += bytes_read;
+	}
+	*message = msg;
+	return 1;
+}
+
 int libp2p_stream_is_open(struct Stream* stream) {
 	if (stream == NULL)
 		return 0;
@@ -5,6 +5,7 @@
 #include "protobuf.h"
 #include "libp2p/net/multistream.h"
 #include "libp2p/peer/peer.h"
+#include "libp2p/peer/peerstore.h"
 #include "libp2p/secio/secio.h"
 #include "libp2p/utils/linked_list.h"
 #include "libp2p/utils/logger.h"
@@ -103,7 +104,17 @@ int libp2p_peer_connect(const struct Dialer* dialer, struct Libp2pPeer* peer, st
 	if (peer->connection_type == CONNECTION_TYPE_CONNECTED && peer->sessionContext == NULL)
 		peer->connection_type = CONNECTION_TYPE_NOT_CONNECTED;
 	libp2p_logger_debug("peer", "Attemping to connect to %s.\n", libp2p_peer_id_to_string(peer));
-	return libp2p_conn_dialer_join_swarm(dialer, peer, timeout);
+	int retVal = libp2p_conn_dialer_join_swarm(dialer, peer, timeout);
+	if (peerstore != NULL) {
+		// keep the routing table to peers we can reach
+		if (retVal) {
+			struct Libp2pPeer* stored = libp2p_peerstore_get_peer(peerstore, (unsigned char*)peer->id, peer->id_size);
+			libp2p_routing_table_update(peerstore->routing_table, stored);
+		} else {
+			libp2p_routing_table_remove(peerstore->routing_table, (unsigned char*)peer->id, peer->id_size);
+		}
+	}
+	return retVal;
 }
 
 /**
@@ -1,5 +1,9 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include "libp2p/peer/peerstore.h"
 #include "libp2p/utils/logger.h"
@@ -44,6 +48,91 @@ struct PeerEntry* libp2p_peer_entry_copy(struct PeerEntry* in) {
 	return out;
 }
 
+/**
+ * Part of the index of peers by id. Lookups take the lock for reading,
+ * so threads only wait on each other when a peer is being added to the same shard.
+ */
+struct PeerstoreShard {
+	pthread_rwlock_t lock;
+	struct PeerEntry** entries; // open addressing, by the hash of the peer id
+	size_t capacity; // a power of 2
+	size_t count;
+};
+
+/***
+ * Hash a peer id (FNV-1a)
+ * @param peer_id the id
+ * @param peer_id_size the size of the id
+ * @returns the hash
+ */
+static uint64_t libp2p_peerstore_hash(const unsigned char* peer_id, size_t peer_id_size) {
+	uint64_t hash = 14695981039346656037ull;
+	for(size_t i = 0; i < peer_id_size; i++) {
+		hash ^= peer_id[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+/***
+ * The shard a hash belongs to
+ * @param peerstore the peerstore
+ * @param hash the hash of the peer id
+ * @returns the shard
+ */
+static struct PeerstoreShard* libp2p_peerstore_shard(struct Peerstore* peerstore, uint64_t hash) {
+	// the low bits pick the slot, so use the high ones here
+	return &peerstore->shards[(hash >> 56) % PEERSTORE_SHARDS];
+}
+
+/***
+ * Find a peer in a shard
+ * NOTE: the shard's lock should be held
+ * @param shard the shard
+ * @param hash the hash of the peer id
+ * @param peer_id the id
+ * @param peer_id_size the size of the id
+ * @returns the slot the peer is in, or the empty slot where it would go
+ */
+static size_t libp2p_peerstore_shard_find(struct PeerstoreShard* shard, uint64_t hash, const unsigned char* peer_id, size_t peer_id_size) {
+	size_t slot = hash & (shard->capacity - 1);
+	while (shard->entries[slot] != NULL) {
+		struct Libp2pPeer* peer = shard->entries[slot]->peer;
+		if (peer->id_size == peer_id_size && memcmp(peer->id, peer_id, peer_id_size) == 0)
+			break;
+		slot = (slot + 1) & (shard->capacity - 1);
+	}
+	return slot;
+}
+
+/***
+ * Make room in a shard for another entry, if needed
+ * NOTE: the shard's lock should be held for writing
+ * @param shard the shard
+ * @returns true(1) on success, false(0) if out of memory
+ */
+static int libp2p_peerstore_shard_reserve(struct PeerstoreShard* shard) {
+	if ((shard->count + 1) * 2 <= shard->capacity)
+		return 1;
+	size_t capacity = (shard->capacity == 0 ? 16 : shard->capacity * 2);
+	struct PeerEntry** entries = (struct PeerEntry**) calloc(capacity, sizeof(struct PeerEntry*));
+	if (entries == NULL)
+		return 0;
+	struct PeerEntry** old_entries = shard->entries;
+	size_t old_capacity = shard->capacity;
+	shard->entries = entries;
+	shard->capacity = capacity;
+	for(size_t i = 0; i < old_capacity; i++) {
+		if (old_entries[i] == NULL)
+			continue;
+		struct Libp2pPeer* peer = old_entries[i]->peer;
+		uint64_t hash = libp2p_peerstore_hash((unsigned char*)peer->id, peer->id_size);
+		shard->entries[libp2p_peerstore_shard_find(shard, hash, (unsigned char*)peer->id, peer->id_size)] = old_entries[i];
+	}
+	free(old_entries);
+	return 1;
+}
+
 /**
  * Creates a new empty peerstore
  * @param peer_id the peer id as a null terminated string
@@ -52,8 +141,23 @@ struct PeerEntry* libp2p_peer_entry_copy(struct PeerEntry* in) {
 struct Peerstore* libp2p_peerstore_new(const struct Libp2pPeer* local_peer) {
 	struct Peerstore* out = (struct Peerstore*)malloc(sizeof(struct Peerstore));
 	if (out != NULL) {
+		out->shards = (struct PeerstoreShard*) malloc(sizeof(struct PeerstoreShard) * PEERSTORE_SHARDS);
+		if (out->shards == NULL) {
+			free(out);
+			return NULL;
+		}
 		out->head_entry = NULL;
 		out->last_entry = NULL;
+		out->routing_table = NULL;
+		if (local_peer != NULL)
+			out->routing_table = libp2p_routing_table_new((unsigned char*)local_peer->id, local_peer->id_size);
+		pthread_mutex_init(&out->list_lock, NULL);
+		for(int i = 0; i < PEERSTORE_SHARDS; i++) {
+			pthread_rwlock_init(&out->shards[i].lock, NULL);
+			out->shards[i].entries = NULL;
+			out->shards[i].capacity = 0;
+			out->shards[i].count = 0;
+		}
 		// now add this peer as the first entry
 		libp2p_peerstore_add_peer(out, local_peer);
 	}
@@ -78,6 +182,14 @@ int libp2p_peerstore_free(struct Peerstore* in) {
 		}
 		// now free the linked list entries
 		libp2p_utils_linked_list_free(in->head_entry);
+		// and the index
+		for(int i = 0; i < PEERSTORE_SHARDS; i++) {
+			free(in->shards[i].entries);
+			pthread_rwlock_destroy(&in->shards[i].lock);
+		}
+		free(in->shards);
+		libp2p_routing_table_free(in->routing_table);
+		pthread_mutex_destroy(&in->list_lock);
 		// and finally the peerstore itself
 		free(in);
 	}
@@ -91,21 +203,45 @@ int libp2p_peerstore_free(struct Peerstore* in) {
  * @returns true(1) on success, otherwise false
  */
 int libp2p_peerstore_add_peer_entry(struct Peerstore* peerstore, struct PeerEntry* peer_entry) {
-	if (peer_entry == NULL)
+	if (peerstore == NULL || peer_entry == NULL || peer_entry->peer == NULL || peer_entry->peer->id_size == 0)
 		return 0;
 
 	struct Libp2pLinkedList* new_item = libp2p_utils_linked_list_new();
 	if (new_item == NULL)
 		return 0;
-
 	new_item->item = peer_entry;
+
+	struct Libp2pPeer* peer = peer_entry->peer;
+	uint64_t hash = libp2p_peerstore_hash((unsigned char*)peer->id, peer->id_size);
+	struct PeerstoreShard* shard = libp2p_peerstore_shard(peerstore, hash);
+	pthread_rwlock_wrlock(&shard->lock);
+	if (!libp2p_peerstore_shard_reserve(shard)) {
+		pthread_rwlock_unlock(&shard->lock);
+		libp2p_utils_linked_list_free(new_item);
+		return 0;
+	}
+	size_t slot = libp2p_peerstore_shard_find(shard, hash, (unsigned char*)peer->id, peer->id_size);
+	if (shard->entries[slot] != NULL) {
+		// someone beat us to it
+		pthread_rwlock_unlock(&shard->lock);
+		new_item->item = NULL;
+		libp2p_utils_linked_list_free(new_item);
+		return 0;
+	}
+	shard->entries[slot] = peer_entry;
+	shard->count++;
+	// add it to the list while the shard is locked, so the list has no duplicates either
+	pthread_mutex_lock(&peerstore->list_lock);
 	if (peerstore->head_entry == NULL) {
 		peerstore->head_entry = new_item;
-		peerstore->last_entry = new_item;
 	} else {
-		peerstore->last_entry->next = new_item;
-		peerstore->last_entry = new_item;
+		// threads walking the list see the whole item, or nothing
+		__atomic_store_n(&peerstore->last_entry->next, new_item, __ATOMIC_RELEASE);
 	}
+	peerstore->last_entry = new_item;
+	pthread_mutex_unlock(&peerstore->list_lock);
+	pthread_rwlock_unlock(&shard->lock);
+	libp2p_routing_table_update(peerstore->routing_table, peer);
 	return 1;
 }
 
@@ -179,9 +315,19 @@ int libp2p_peerstore_add_peer(struct Peerstore* peerstore, const struct Libp2pPe
 		peer_entry->peer = libp2p_peer_copy(peer);
 		if (peer_entry->peer == NULL) {
 			libp2p_logger_error("peerstore", "Could not copy peer for PeerEntry.\n");
+			libp2p_peer_entry_free(peer_entry);
 			return 0;
 		}
 		retVal = libp2p_peerstore_add_peer_entry(peerstore, peer_entry);
+		if (!retVal) {
+			libp2p_peer_entry_free(peer_entry);
+			// another thread may have added it since we looked
+			struct PeerEntry* existing = libp2p_peerstore_get_peer_entry(peerstore, (unsigned char*)peer->id, peer->id_size);
+			if (existing == NULL)
+				return 0;
+			libp2p_peerstore_update_addresses(existing->peer, peer);
+			return 1;
+		}
 		libp2p_logger_debug("peerstore", "Adding peer %s to peerstore was a success\n", libp2p_peer_id_to_string(peer));
 	}
 	return retVal;
@@ -198,17 +344,15 @@ struct PeerEntry* libp2p_peerstore_get_peer_entry(struct Peerstore* peerstore, c
 	if (peer_id_size == 0 || peer_id == NULL || peerstore == NULL)
 		return NULL;
 
-	struct Libp2pLinkedList* current = peerstore->head_entry;
-	while(current != NULL) {
-		struct Libp2pPeer* peer = ((struct PeerEntry*)current->item)->peer;
-		if (peer->id_size == peer_id_size) {
-			if (memcmp(peer_id, peer->id, peer->id_size) == 0) {
-				return (struct PeerEntry*)current->item;
-			}
-		}
-		current = current->next;
-	}
-	return NULL;
+	uint64_t hash = libp2p_peerstore_hash(peer_id, peer_id_size);
+	struct PeerstoreShard* shard = libp2p_peerstore_shard(peerstore, hash);
+	struct PeerEntry* entry = NULL;
+	pthread_rwlock_rdlock(&shard->lock);
+	if (shard->capacity > 0)
+		entry = shard->entries[libp2p_peerstore_shard_find(shard, hash, peer_id, peer_id_size)];
+	pthread_rwlock_unlock(&shard->lock);
+	// entries live as long as the peerstore, so this is safe to hand back
+	return entry;
 }
 
 /**
@@ -2,13 +2,27 @@
 #include <string.h>
 
 #include "libp2p/peer/providerstore.h"
-#include "libp2p/utils/vector.h"
 #include "libp2p/utils/logger.h"
 
 /***
  * Stores hashes, and peers where you can possibly get them
  */
 
+/***
+ * Hash a key (FNV-1a)
+ * @param hash the key
+ * @param hash_size the size of the key
+ * @returns the hash code
+ */
+static uint64_t libp2p_providerstore_hash_code(const unsigned char* hash, int hash_size) {
+	uint64_t code = 14695981039346656037ull;
+	for(int i = 0; i < hash_size; i++) {
+		code ^= hash[i];
+		code *= 1099511628211ull;
+	}
+	return code;
+}
+
 /**
  * Create a new ProviderStore
  * @param datastore the datastore (required in order to look for the file locally)
@@ -20,23 +34,34 @@ struct ProviderStore* libp2p_providerstore_new(const struct Datastore* datastore
 	if (out != NULL) {
 		out->datastore = datastore;
 		out->local_peer = local_peer;
-		out->provider_entries = libp2p_utils_vector_new(4);
+		out->num_buckets = 64;
+		out->buckets = (struct ProviderKey**) calloc(out->num_buckets, sizeof(struct ProviderKey*));
+		if (out->buckets == NULL) {
+			free(out);
+			return NULL;
+		}
+		out->num_keys = 0;
+		out->num_records = 0;
+		out->record_ttl = PROVIDERSTORE_DEFAULT_TTL;
+		out->last_sweep = time(NULL);
+		out->sweep_bucket = 0;
+		pthread_mutex_init(&out->lock, NULL);
 	}
 	return out;
 }
 
-void libp2p_providerstore_entry_free(struct ProviderEntry* in) {
-	if (in != NULL) {
-		if (in->hash != NULL) {
-			free(in->hash);
-			in->hash_size = 0;
-		}
-		if (in->peer_id != NULL) {
-			free(in->peer_id);
-			in->peer_id_size = 0;
-		}
-		free(in);
+/***
+ * Free a key and its providers
+ * @param key the key
+ */
+static void libp2p_providerstore_key_free(struct ProviderKey* key) {
+	struct ProviderRecord* record = key->providers;
+	while (record != NULL) {
+		struct ProviderRecord* next = record->next;
+		free(record);
+		record = next;
 	}
+	free(key);
 }
 
 /***
@@ -45,33 +70,286 @@ void libp2p_providerstore_entry_free(struct ProviderEntry* in) {
  */
 void libp2p_providerstore_free(struct ProviderStore* in) {
 	if (in != NULL) {
-		for(int i = 0; i < in->provider_entries->total; i++) {
-			struct ProviderEntry* entry = (struct ProviderEntry*) libp2p_utils_vector_get(in->provider_entries, i);
-			libp2p_providerstore_entry_free(entry);
+		for(size_t i = 0; i < in->num_buckets; i++) {
+			struct ProviderKey* key = in->buckets[i];
+			while (key != NULL) {
+				struct ProviderKey* next = key->next;
+				libp2p_providerstore_key_free(key);
+				key = next;
+			}
 		}
-		libp2p_utils_vector_free(in->provider_entries);
+		free(in->buckets);
+		pthread_mutex_destroy(&in->lock);
 		free(in);
 		in = NULL;
 	}
 }
 
+/***
+ * Find a key
+ * NOTE: the store's lock should be held
+ * @param store the ProviderStore
+ * @param hash the key
+ * @param hash_size the size of the key
+ * @param hash_code the hash code of the key
+ * @returns where the pointer to the key is (the pointer is NULL if it is not there)
+ */
+static struct ProviderKey** libp2p_providerstore_find(struct ProviderStore* store, const unsigned char* hash, int hash_size, uint64_t hash_code) {
+	struct ProviderKey** current = &store->buckets[hash_code & (store->num_buckets - 1)];
+	while (*current != NULL) {
+		if ((*current)->hash_code == hash_code && (*current)->hash_size == hash_size && memcmp((*current)->hash, hash, hash_size) == 0)
+			break;
+		current = &(*current)->next;
+	}
+	return current;
+}
+
+/***
+ * Double the number of buckets once there are more keys than buckets
+ * NOTE: the store's lock should be held. If memory is short, things stay as they are.
+ * @param store the ProviderStore
+ */
+static void libp2p_providerstore_grow(struct ProviderStore* store) {
+	if (store->num_keys < store->num_buckets)
+		return;
+	size_t num_buckets = store->num_buckets * 2;
+	struct ProviderKey** buckets = (struct ProviderKey**) calloc(num_buckets, sizeof(struct ProviderKey*));
+	if (buckets == NULL)
+		return;
+	for(size_t i = 0; i < store->num_buckets; i++) {
+		struct ProviderKey* key = store->buckets[i];
+		while (key != NULL) {
+			struct ProviderKey* next = key->next;
+			size_t pos = key->hash_code & (num_buckets - 1);
+			key->next = buckets[pos];
+			buckets[pos] = key;
+			key = next;
+		}
+	}
+	free(store->buckets);
+	store->buckets = buckets;
+	store->num_buckets = num_buckets;
+}
+
+/***
+ * Remove expired providers of a key
+ * NOTE: the store's lock should be held
+ * @param store the ProviderStore
+ * @param key the key
+ * @param now the current time
+ * @returns the number of providers removed
+ */
+static int libp2p_providerstore_expire(struct ProviderStore* store, struct ProviderKey* key, time_t now) {
+	int removed = 0;
+	struct ProviderRecord** current = &key->providers;
+	while (*current != NULL) {
+		struct ProviderRecord* record = *current;
+		if (record->expires <= now) {
+			*current = record->next;
+			free(record);
+			removed++;
+		} else {
+			current = &record->next;
+		}
+	}
+	key->num_providers -= removed;
+	store->num_records -= removed;
+	return removed;
+}
+
+/***
+ * Remove expired announcements from the next few buckets, picking up where the last call stopped
+ * NOTE: the store's lock should be held
+ * @param store the ProviderStore
+ * @param now the current time
+ * @param max_buckets the most buckets to look at
+ * @returns the number of announcements removed
+ */
+static int libp2p_providerstore_sweep_locked(struct ProviderStore* store, time_t now, size_t max_buckets) {
+	int removed = 0;
+	size_t last = store->sweep_bucket + max_buckets;
+	if (last > store->num_buckets)
+		last = store->num_buckets;
+	for(size_t i = store->sweep_bucket; i < last; i++) {
+		struct ProviderKey** current = &store->buckets[i];
+		while (*current != NULL) {
+			struct ProviderKey* key = *current;
+			removed += libp2p_providerstore_expire(store, key, now);
+			if (key->providers == NULL) {
+				*current = key->next;
+				free(key);
+				store->num_keys--;
+			} else {
+				current = &key->next;
+			}
+		}
+	}
+	if (last == store->num_buckets) {
+		// all done until the next interval
+		store->sweep_bucket = 0;
+		store->last_sweep = now;
+	} else {
+		store->sweep_bucket = last;
+	}
+	if (removed > 0)
+		libp2p_logger_debug("providerstore", "Removed %d expired providers. %d remain.\n", removed, (int)store->num_records);
+	return removed;
+}
+
+/***
+ * Remove expired announcements, all at once
+ * NOTE: This happens on its own every PROVIDERSTORE_SWEEP_INTERVAL as the store is used,
+ * PROVIDERSTORE_SWEEP_BUCKETS buckets per request
+ * @param store the ProviderStore
+ * @param now the current time
+ * @returns the number of announcements removed
+ */
+int libp2p_providerstore_sweep(struct ProviderStore* store, time_t now) {
+	if (store == NULL)
+		return 0;
+	pthread_mutex_lock(&store->lock);
+	store->sweep_bucket = 0;
+	int removed = libp2p_providerstore_sweep_locked(store, now, store->num_buckets);
+	pthread_mutex_unlock(&store->lock);
+	return removed;
+}
+
+/***
+ * Sweep a few more buckets, if a sweep is under way or it has been a while.
+ * Expired announcements that haven't been swept yet are skipped by lookups.
+ * NOTE: the store's lock should be held
+ * @param store the ProviderStore
+ * @param now the current time
+ */
+static void libp2p_providerstore_sweep_if_due(struct ProviderStore* store, time_t now) {
+	if (store->sweep_bucket > 0 || now - store->last_sweep >= PROVIDERSTORE_SWEEP_INTERVAL)
+		libp2p_providerstore_sweep_locked(store, now, PROVIDERSTORE_SWEEP_BUCKETS);
+}
+
+/***
+ * Remember that a peer can provide a hash. If it was already known, its time is extended.
+ * @param store the ProviderStore
+ * @param hash the hash
+ * @param hash_size the size of the hash
+ * @param peer_id the peer that can provide it
+ * @param peer_id_size the size of peer_id
+ * @returns true(1) on success, false(0) otherwise
+ */
 int libp2p_providerstore_add(struct ProviderStore* store, const unsigned char* hash, int hash_size, const unsigned char* peer_id, int peer_id_size) {
-	char hash_str[hash_size + 1];
-	memcpy(hash_str, hash, hash_size);
-	hash_str[hash_size] = 0;
+	if (store == NULL || hash == NULL || hash_size <= 0 || peer_id == NULL || peer_id_size <= 0)
+		return 0;
 	char peer_str[peer_id_size + 1];
 	memcpy(peer_str, peer_id, peer_id_size);
 	peer_str[peer_id_size] = 0;
 	libp2p_logger_debug("providerstore", "Adding hash to providerstore. It can be retrieved from %s\n", peer_str);
-	struct ProviderEntry* entry = (struct ProviderEntry*)malloc(sizeof(struct ProviderEntry));
-	entry->hash = malloc(hash_size);
-	memcpy(entry->hash, hash, hash_size);
-	entry->hash_size = hash_size;
-	entry->peer_id = malloc(peer_id_size);
-	memcpy(entry->peer_id, peer_id, peer_id_size);
-	entry->peer_id_size = peer_id_size;
-	libp2p_utils_vector_add(store->provider_entries, entry);
-	return 1;
+
+	uint64_t hash_code = libp2p_providerstore_hash_code(hash, hash_size);
+	time_t now = time(NULL);
+	int retVal = 0;
+
+	pthread_mutex_lock(&store->lock);
+	libp2p_providerstore_sweep_if_due(store, now);
+	struct ProviderKey** found = libp2p_providerstore_find(store, hash, hash_size, hash_code);
+	struct ProviderKey* key = *found;
+	if (key == NULL) {
+		key = (struct ProviderKey*) malloc(sizeof(struct ProviderKey) + hash_size);
+		if (key == NULL)
+			goto exit;
+		key->next = NULL;
+		key->hash_code = hash_code;
+		key->providers = NULL;
+		key->num_providers = 0;
+		key->hash_size = hash_size;
+		memcpy(key->hash, hash, hash_size);
+		*found = key;
+		store->num_keys++;
+		libp2p_providerstore_grow(store);
+	}
+
+	// if we already know about them, they get more time
+	struct ProviderRecord* oldest = NULL;
+	for(struct ProviderRecord* current = key->providers; current != NULL; current = current->next) {
+		if (current->peer_id_size == peer_id_size && memcmp(current->peer_id, peer_id, peer_id_size) == 0) {
+			current->expires = now + store->record_ttl;
+			retVal = 1;
+			goto exit;
+		}
+		if (oldest == NULL || current->expires < oldest->expires)
+			oldest = current;
+	}
+
+	if (key->num_providers >= PROVIDERSTORE_MAX_PROVIDERS) {
+		// full, so the newest announcement replaces the one closest to expiring
+		struct ProviderRecord** current = &key->providers;
+		while (*current != oldest)
+			current = &(*current)->next;
+		*current = oldest->next;
+		free(oldest);
+		key->num_providers--;
+		store->num_records--;
+	}
+
+	struct ProviderRecord* record = (struct ProviderRecord*) malloc(sizeof(struct ProviderRecord) + peer_id_size);
+	if (record == NULL)
+		goto exit;
+	record->expires = now + store->record_ttl;
+	record->peer_id_size = peer_id_size;
+	memcpy(record->peer_id, peer_id, peer_id_size);
+	record->next = key->providers;
+	key->providers = record;
+	key->num_providers++;
+	store->num_records++;
+	retVal = 1;
+
+	exit:
+	// a key only exists while it has providers
+	if (key != NULL && key->providers == NULL) {
+		*libp2p_providerstore_find(store, hash, hash_size, hash_code) = key->next;
+		free(key);
+		store->num_keys--;
+	}
+	pthread_mutex_unlock(&store->lock);
+	if (!retVal)
+		libp2p_logger_error("providerstore", "Unable to allocate memory for provider %s.\n", peer_str);
+	return retVal;
+}
+
+/***
+ * Get the peers that have announced a hash
+ * NOTE: This does not check the datastore
+ * @param store the ProviderStore
+ * @param hash what we're looking for
+ * @param hash_size the length of the hash
+ * @param peer_ids where to put the peer ids (allocated here, the caller frees each of them)
+ * @param peer_id_sizes where to put the sizes of the peer ids
+ * @param max the number of slots in peer_ids and peer_id_sizes
+ * @returns the number of peer ids found
+ */
+int libp2p_providerstore_get_providers(struct ProviderStore* store, const unsigned char* hash, int hash_size, unsigned char** peer_ids, int* peer_id_sizes, int max) {
+	if (store == NULL || hash == NULL || hash_size <= 0)
+		return 0;
+	uint64_t hash_code = libp2p_providerstore_hash_code(hash, hash_size);
+	time_t now = time(NULL);
+	int count = 0;
+
+	pthread_mutex_lock(&store->lock);
+	libp2p_providerstore_sweep_if_due(store, now);
+	struct ProviderKey* key = *libp2p_providerstore_find(store, hash, hash_size, hash_code);
+	if (key != NULL) {
+		for(struct ProviderRecord* current = key->providers; current != NULL && count < max; current = current->next) {
+			// it may have expired since the last sweep
+			if (current->expires <= now)
+				continue;
+			peer_ids[count] = malloc(current->peer_id_size);
+			if (peer_ids[count] == NULL)
+				break;
+			memcpy(peer_ids[count], current->peer_id, current->peer_id_size);
+			peer_id_sizes[count] = current->peer_id_size;
+			count++;
+		}
+	}
+	pthread_mutex_unlock(&store->lock);
+	return count;
 }
 
 /**
@@ -86,28 +364,15 @@ int libp2p_providerstore_add(struct ProviderStore* store, const unsigned char* h
  * @returns true(1) if we found something, false(0) if not.
  */
 int libp2p_providerstore_get(struct ProviderStore* store, const unsigned char* hash, int hash_size, unsigned char** peer_id, int *peer_id_size) {
-	struct ProviderEntry* current = NULL;
 	// can I provide it locally?
-	struct DatastoreRecord* datastore_record = NULL;
-	if (store->datastore->datastore_get(hash, hash_size, &datastore_record, store->datastore)) {
+	if (libp2p_datastore_has(store->datastore, hash, hash_size)) {
 		// we found it locally. Let them know
 		*peer_id = malloc(store->local_peer->id_size);
 		if (*peer_id == NULL)
 			return 0;
 		*peer_id_size = store->local_peer->id_size;
 		memcpy(*peer_id, store->local_peer->id, *peer_id_size);
-		libp2p_datastore_record_free(datastore_record);
 		return 1;
 	}
-	// skip index 0, as we checked above...
-	for (int i = 0; i < store->provider_entries->total; i++) {
-		current = (struct ProviderEntry*)libp2p_utils_vector_get(store->provider_entries, i);
-		if (current->hash_size == hash_size && memcmp(current->hash, hash, hash_size) == 0) {
-			*peer_id = malloc(current->peer_id_size);
-			memcpy(*peer_id, current->peer_id, current->peer_id_size);
-			*peer_id_size = current->peer_id_size;
-			return 1;
-		}
-	}
-	return 0;
+	return libp2p_providerstore_get_providers(store, hash, hash_size, peer_id, peer_id_size, 1);
 }
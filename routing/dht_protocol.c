@@ -40,7 +40,7 @@ int libp2p_routing_dht_handle_msg(const struct StreamMessage* msg, struct Stream
 
 struct Libp2pProtocolHandler* libp2p_routing_dht_build_protocol_handler(struct Peerstore* peer_store, struct ProviderStore* provider_store,
 		struct Datastore* datastore, struct Filestore* filestore) {
-	struct Libp2pProtocolHandler* handler = (struct Libp2pProtocolHandler*) malloc(sizeof(struct Libp2pProtocolHandler));
+	struct Libp2pProtocolHandler* handler = libp2p_protocol_handler_new();
 	if (handler != NULL) {
 		struct DhtContext* ctx = (struct DhtContext*) malloc(sizeof(struct DhtContext));
 		ctx->peer_store = peer_store;
@@ -48,6 +48,7 @@ struct Libp2pProtocolHandler* libp2p_routing_dht_build_protocol_handler(struct P
 		ctx->datastore = datastore;
 		ctx->filestore = filestore;
 		handler->context = ctx;
+		handler->protocol_id = "/ipfs/kad/1.0.0";
 		handler->CanHandle = libp2p_routing_dht_can_handle;
 		handler->HandleMessage = libp2p_routing_dht_handle_msg;
 		handler->Shutdown = libp2p_routing_dht_shutdown;
@@ -144,41 +145,38 @@ int libp2p_routing_dht_handle_ping(struct KademliaMessage* message, unsigned cha
  */
 int libp2p_routing_dht_handle_get_providers(struct Stream* stream, struct KademliaMessage* message, struct DhtContext* protocol_context,
 		unsigned char** results, size_t* results_size) {
-	unsigned char* peer_id = NULL;
-	int peer_id_size = 0;
+	unsigned char* peer_ids[PROVIDERSTORE_MAX_PROVIDERS];
+	int peer_id_sizes[PROVIDERSTORE_MAX_PROVIDERS];
+	int num_providers = 0;
 
 	// This shouldn't be needed, but just in case:
 	message->provider_peer_head = NULL;
 
 	// Can I provide it locally?
-	struct DatastoreRecord* datastore_record = NULL;
-	if (protocol_context->datastore->datastore_get((unsigned char*)message->key, message->key_size, &datastore_record, protocol_context->datastore)) {
+	if (libp2p_datastore_has(protocol_context->datastore, (unsigned char*)message->key, message->key_size)) {
 		// we can provide this hash from our datastore
-		libp2p_datastore_record_free(datastore_record);
 		libp2p_logger_debug("dht_protocol", "I can provide myself as a provider for this key.\n");
 		message->provider_peer_head = libp2p_utils_linked_list_new();
 		message->provider_peer_head->item = libp2p_peer_copy(libp2p_peerstore_get_local_peer(protocol_context->peer_store));
-	} else if (libp2p_providerstore_get(protocol_context->provider_store, (unsigned char*)message->key, message->key_size, &peer_id, &peer_id_size)) {
+	} else if ( (num_providers = libp2p_providerstore_get_providers(protocol_context->provider_store, (unsigned char*)message->key, message->key_size, peer_ids, peer_id_sizes, PROVIDERSTORE_MAX_PROVIDERS)) > 0) {
 		// Can I provide it because someone announced it earlier?
-		// we have a peer id, convert it to a peer object
-		struct Libp2pPeer* peer = libp2p_peerstore_get_peer(protocol_context->peer_store, peer_id, peer_id_size);
-		if (peer != NULL) {
+		struct Libp2pLinkedList* last = NULL;
+		for(int i = 0; i < num_providers; i++) {
+			// we have a peer id, convert it to a peer object
+			struct Libp2pPeer* peer = libp2p_peerstore_get_peer(protocol_context->peer_store, peer_ids[i], peer_id_sizes[i]);
+			if (peer == NULL)
+				continue;
 			libp2p_logger_debug("dht_protocol", "I can provide a provider for this key, because %s says he has it.\n", libp2p_peer_id_to_string(peer));
 			// add it to the message
-			if (message->provider_peer_head == NULL) {
-				message->provider_peer_head = libp2p_utils_linked_list_new();
-				message->provider_peer_head->item = libp2p_peer_copy(peer);
-			} else {
-
-				struct Libp2pLinkedList* current = message->provider_peer_head;
-				// find the last one in the list
-				while (current->next != NULL) {
-					current = current->next;
-				}
-				// add to the list
-				current->next = libp2p_utils_linked_list_new();
-				current->next->item = peer;
-			}
+			struct Libp2pLinkedList* item = libp2p_utils_linked_list_new();
+			if (item == NULL)
+				break;
+			item->item = libp2p_peer_copy(peer);
+			if (last == NULL)
+				message->provider_peer_head = item;
+			else
+				last->next = item;
+			last = item;
 		}
 	} else {
 		size_t b58_size = 100;
@@ -190,8 +188,8 @@ int libp2p_routing_dht_handle_get_providers(struct Stream* stream, struct Kademl
 		}
 		free(b58key);
 	}
-	if (peer_id != NULL)
-		free(peer_id);
+	for(int i = 0; i < num_providers; i++)
+		free(peer_ids[i]);
 	// TODO: find closer peers
 	/*
 	if (message->provider_peer_head == NULL) {
@@ -407,7 +405,7 @@ int libp2p_routing_dht_handle_put_value(struct Stream* stream, struct KademliaMe
 	}
 	memcpy(record->value, message->record->value, record->value_size);
 
-	int retVal = protocol_context->datastore->datastore_put(record, protocol_context->datastore);
+	int retVal = libp2p_datastore_put(protocol_context->datastore, record);
 	libp2p_datastore_record_free(record);
 	return retVal;
 }
@@ -429,12 +427,37 @@ int libp2p_routing_dht_handle_find_node(struct Stream* stream, struct KademliaMe
 	if (peer != NULL) {
 		message->provider_peer_head = libp2p_utils_linked_list_new();
 		message->provider_peer_head->item = libp2p_peer_copy(peer);
-		if (!libp2p_routing_dht_protobuf_message(message, result_buffer, result_buffer_size)) {
-			return 0;
+	}
+	// and who is closer to it
+	struct Libp2pPeer* nearest[ROUTING_TABLE_BUCKET_SIZE];
+	int num_nearest = libp2p_routing_table_nearest(protocol_context->peer_store->routing_table, (unsigned char*)message->key, message->key_size, nearest, ROUTING_TABLE_BUCKET_SIZE);
+	struct Libp2pLinkedList* last = message->closer_peer_head;
+	while (last != NULL && last->next != NULL)
+		last = last->next;
+	for(int i = 0; i < num_nearest; i++) {
+		struct Libp2pLinkedList* item = libp2p_utils_linked_list_new();
+		if (item == NULL)
+			break;
+		struct Libp2pPeer* closer = libp2p_peer_copy(nearest[i]);
+		if (closer == NULL) {
+			libp2p_utils_linked_list_free(item);
+			break;
 		}
-		return 1;
+		// the message owns the copy, but not the connection
+		closer->sessionContext = NULL;
+		item->item = closer;
+		if (last == NULL)
+			message->closer_peer_head = item;
+		else
+			last->next = item;
+		last = item;
 	}
-	return 0;
+	if (message->provider_peer_head == NULL && message->closer_peer_head == NULL)
+		return 0;
+	if (!libp2p_routing_dht_protobuf_message(message, result_buffer, result_buffer_size)) {
+		return 0;
+	}
+	return 1;
 }
 
 /***
@@ -574,27 +597,19 @@ int libp2p_routing_dht_send_message(struct SessionContext* sessionContext, struc
  */
 int libp2p_routing_dht_send_message_nearest_x(const struct Dialer* dialer, struct Peerstore* peerstore,
 		struct Datastore* datastore, struct KademliaMessage* msg, int numToSend) {
-	// TODO: Calculate "Nearest"
-	// but for now, grab x peers, and send to them
+	// dial the closest first. There are spares, in case some can't be reached
+	int max = (numToSend > ROUTING_TABLE_BUCKET_SIZE ? numToSend : ROUTING_TABLE_BUCKET_SIZE);
+	struct Libp2pPeer* nearest[max];
+	int num_nearest = libp2p_routing_table_nearest(peerstore->routing_table, (unsigned char*)msg->key, msg->key_size, nearest, max);
 	int numSent = 0;
-	struct Libp2pLinkedList* llpeer_entry = peerstore->head_entry;
-	while (llpeer_entry != NULL) {
-		struct PeerEntry* entry = llpeer_entry->item;
-		if (entry == NULL)
-			break;
-		struct Libp2pPeer* remote_peer = entry->peer;
-		if (!remote_peer->is_local) {
-			// connect (if not connected)
-			if (libp2p_peer_connect(dialer, remote_peer, peerstore, datastore, 5)) {
-				// send message
-				if (libp2p_routing_dht_send_message(remote_peer->sessionContext, msg))
-					numSent++;
-			}
-			if (numSent >= numToSend)
-				break;
+	for(int i = 0; i < num_nearest && numSent < numToSend; i++) {
+		struct Libp2pPeer* remote_peer = nearest[i];
+		// connect (if not connected)
+		if (libp2p_peer_connect(dialer, remote_peer, peerstore, datastore, 5)) {
+			// send message
+			if (libp2p_routing_dht_send_message(remote_peer->sessionContext, msg))
+				numSent++;
 		}
-		// grab next entry
-		llpeer_entry = llpeer_entry->next;
 	}
 	return numSent > 0;
 }
@@ -0,0 +1,240 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "libp2p/routing/routing_table.h"
+#include "libp2p/crypto/sha256.h"
+#include "libp2p/utils/logger.h"
+
+/***
+ * A candidate while looking for the nearest peers
+ */
+struct RoutingTableCandidate {
+	uint8_t distance[ROUTING_TABLE_KEY_SIZE];
+	struct Libp2pPeer* peer;
+};
+
+/***
+ * The number of leading bits two keys share
+ * @param a the first key
+ * @param b the second key
+ * @returns the number of bits (ROUTING_TABLE_NUM_BUCKETS if they are the same)
+ */
+static int libp2p_routing_table_common_prefix(const uint8_t* a, const uint8_t* b) {
+	for(int i = 0; i < ROUTING_TABLE_KEY_SIZE; i++) {
+		uint8_t diff = a[i] ^ b[i];
+		if (diff != 0) {
+			int bits = i * 8;
+			while ((diff & 0x80) == 0) {
+				diff <<= 1;
+				bits++;
+			}
+			return bits;
+		}
+	}
+	return ROUTING_TABLE_NUM_BUCKETS;
+}
+
+/***
+ * Compare candidates by distance, for qsort
+ */
+static int libp2p_routing_table_candidate_compare(const void* a, const void* b) {
+	return memcmp(((const struct RoutingTableCandidate*)a)->distance, ((const struct RoutingTableCandidate*)b)->distance, ROUTING_TABLE_KEY_SIZE);
+}
+
+/***
+ * Create a new, empty routing table
+ * @param local_id the id of the local peer
+ * @param local_id_size the size of local_id
+ * @returns the table, or NULL on error
+ */
+struct RoutingTable* libp2p_routing_table_new(const unsigned char* local_id, size_t local_id_size) {
+	struct RoutingTable* table = (struct RoutingTable*) calloc(1, sizeof(struct RoutingTable));
+	if (table == NULL)
+		return NULL;
+	libp2p_crypto_hashing_sha256(local_id, local_id_size, table->local_key);
+	pthread_mutex_init(&table->lock, NULL);
+	return table;
+}
+
+/***
+ * Free resources of a routing table (but not the peers in it)
+ * @param table the table
+ */
+void libp2p_routing_table_free(struct RoutingTable* table) {
+	if (table != NULL) {
+		for(int i = 0; i < ROUTING_TABLE_NUM_BUCKETS; i++)
+			free(table->buckets[i]);
+		pthread_mutex_destroy(&table->lock);
+		free(table);
+	}
+}
+
+/***
+ * Find a peer in its bucket
+ * @param bucket the bucket
+ * @param key the peer's key
+ * @returns the position in the bucket, or -1
+ */
+static int libp2p_routing_table_bucket_find(struct RoutingTableBucket* bucket, const uint8_t* key) {
+	for(int i = 0; i < bucket->count; i++) {
+		if (memcmp(bucket->entries[i].key, key, ROUTING_TABLE_KEY_SIZE) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/***
+ * Take an entry out of a bucket, keeping the order of the others
+ * @param bucket the bucket
+ * @param pos the position of the entry
+ */
+static void libp2p_routing_table_bucket_remove(struct RoutingTableBucket* bucket, int pos) {
+	memmove(&bucket->entries[pos], &bucket->entries[pos + 1], sizeof(struct RoutingTableEntry) * (bucket->count - pos - 1));
+	bucket->count--;
+}
+
+/***
+ * We heard from (or about) a peer. Add it, or mark it as the most recently seen.
+ * NOTE: If its bucket is full, the least recently seen peer is replaced only if it is not connected.
+ * @param table the table
+ * @param peer the peer. It must live as long as it is in the table
+ * @returns true(1) if the peer is in the table, false(0) otherwise
+ */
+int libp2p_routing_table_update(struct RoutingTable* table, struct Libp2pPeer* peer) {
+	if (table == NULL || peer == NULL || peer->id_size == 0 || peer->is_local)
+		return 0;
+	uint8_t key[ROUTING_TABLE_KEY_SIZE];
+	libp2p_crypto_hashing_sha256((unsigned char*)peer->id, peer->id_size, key);
+	int bucket_num = libp2p_routing_table_common_prefix(table->local_key, key);
+	// that's us
+	if (bucket_num == ROUTING_TABLE_NUM_BUCKETS)
+		return 0;
+
+	int retVal = 0;
+	pthread_mutex_lock(&table->lock);
+	struct RoutingTableBucket* bucket = table->buckets[bucket_num];
+	if (bucket == NULL) {
+		bucket = (struct RoutingTableBucket*) calloc(1, sizeof(struct RoutingTableBucket));
+		if (bucket == NULL)
+			goto exit;
+		table->buckets[bucket_num] = bucket;
+	}
+	int pos = libp2p_routing_table_bucket_find(bucket, key);
+	if (pos >= 0) {
+		// move it to the end
+		libp2p_routing_table_bucket_remove(bucket, pos);
+		table->num_peers--;
+	} else if (bucket->count == ROUTING_TABLE_BUCKET_SIZE) {
+		// Kademlia prefers peers that have been around. Only replace one we are not talking to
+		if (bucket->entries[0].peer->connection_type == CONNECTION_TYPE_CONNECTED)
+			goto exit;
+		libp2p_routing_table_bucket_remove(bucket, 0);
+		table->num_peers--;
+	}
+	memcpy(bucket->entries[bucket->count].key, key, ROUTING_TABLE_KEY_SIZE);
+	bucket->entries[bucket->count].peer = peer;
+	bucket->count++;
+	table->num_peers++;
+	retVal = 1;
+	exit:
+	pthread_mutex_unlock(&table->lock);
+	return retVal;
+}
+
+/***
+ * Take a peer out of the table (i.e. it cannot be reached)
+ * @param table the table
+ * @param peer_id the id of the peer
+ * @param peer_id_size the size of peer_id
+ * @returns true(1) if it was there, false(0) otherwise
+ */
+int libp2p_routing_table_remove(struct RoutingTable* table, const unsigned char* peer_id, size_t peer_id_size) {
+	if (table == NULL || peer_id == NULL)
+		return 0;
+	uint8_t key[ROUTING_TABLE_KEY_SIZE];
+	libp2p_crypto_hashing_sha256(peer_id, peer_id_size, key);
+	int bucket_num = libp2p_routing_table_common_prefix(table->local_key, key);
+	if (bucket_num == ROUTING_TABLE_NUM_BUCKETS)
+		return 0;
+
+	int retVal = 0;
+	pthread_mutex_lock(&table->lock);
+	struct RoutingTableBucket* bucket = table->buckets[bucket_num];
+	if (bucket != NULL) {
+		int pos = libp2p_routing_table_bucket_find(bucket, key);
+		if (pos >= 0) {
+			libp2p_routing_table_bucket_remove(bucket, pos);
+			table->num_peers--;
+			retVal = 1;
+		}
+	}
+	pthread_mutex_unlock(&table->lock);
+	return retVal;
+}
+
+/***
+ * Add the peers of a bucket to the candidates
+ * @param table the table
+ * @param bucket_num the bucket
+ * @param target the key we are looking for
+ * @param candidates the candidates
+ * @param num_candidates the number of candidates so far
+ * @returns the new number of candidates
+ */
+static int libp2p_routing_table_add_candidates(struct RoutingTable* table, int bucket_num, const uint8_t* target,
+		struct RoutingTableCandidate* candidates, int num_candidates) {
+	struct RoutingTableBucket* bucket = table->buckets[bucket_num];
+	if (bucket == NULL)
+		return num_candidates;
+	for(int i = 0; i < bucket->count; i++) {
+		for(int j = 0; j < ROUTING_TABLE_KEY_SIZE; j++)
+			candidates[num_candidates].distance[j] = bucket->entries[i].key[j] ^ target[j];
+		candidates[num_candidates].peer = bucket->entries[i].peer;
+		num_candidates++;
+	}
+	return num_candidates;
+}
+
+/***
+ * Find the peers closest to a key
+ * @param table the table
+ * @param key the key (it is hashed, as peer ids are). NULL for the peers closest to us
+ * @param key_size the size of key
+ * @param results where to put the peers, closest first
+ * @param max the number of slots in results
+ * @returns the number of peers found
+ */
+int libp2p_routing_table_nearest(struct RoutingTable* table, const unsigned char* key, size_t key_size, struct Libp2pPeer** results, int max) {
+	if (table == NULL || results == NULL || max <= 0)
+		return 0;
+	uint8_t target[ROUTING_TABLE_KEY_SIZE];
+	if (key != NULL)
+		libp2p_crypto_hashing_sha256(key, key_size, target);
+	else
+		memcpy(target, table->local_key, ROUTING_TABLE_KEY_SIZE);
+	int shared = libp2p_routing_table_common_prefix(table->local_key, target);
+
+	pthread_mutex_lock(&table->lock);
+	struct RoutingTableCandidate* candidates = (struct RoutingTableCandidate*) malloc(sizeof(struct RoutingTableCandidate) * (table->num_peers + 1));
+	if (candidates == NULL) {
+		pthread_mutex_unlock(&table->lock);
+		return 0;
+	}
+	int num_candidates = 0;
+	// The target's own bucket is closest. The buckets past it are all about as far as each
+	// other (they differ from the target at the same bit). Those before it get further away, one by one.
+	if (shared < ROUTING_TABLE_NUM_BUCKETS)
+		num_candidates = libp2p_routing_table_add_candidates(table, shared, target, candidates, num_candidates);
+	for(int i = shared + 1; i < ROUTING_TABLE_NUM_BUCKETS; i++)
+		num_candidates = libp2p_routing_table_add_candidates(table, i, target, candidates, num_candidates);
+	for(int i = shared - 1; i >= 0 && num_candidates < max; i--)
+		num_candidates = libp2p_routing_table_add_candidates(table, i, target, candidates, num_candidates);
+	pthread_mutex_unlock(&table->lock);
+
+	qsort(candidates, num_candidates, sizeof(struct RoutingTableCandidate), libp2p_routing_table_candidate_compare);
+	int count = (num_candidates < max ? num_candidates : max);
+	for(int i = 0; i < count; i++)
+		results[i] = candidates[i].peer;
+	free(candidates);
+	return count;
+}
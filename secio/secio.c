@@ -25,6 +25,8 @@
 #include "libp2p/utils/string_list.h"
 #include "libp2p/utils/vector.h"
 #include "libp2p/utils/logger.h"
+#include "libp2p/utils/readiness.h"
+#include "libp2p/utils/slab.h"
 #include "libp2p/net/protocol.h"
 #include "mbedtls/md.h"
 #include "mbedtls/cipher.h"
@@ -74,7 +76,7 @@ int libp2p_secio_handle_message(const struct StreamMessage* msg, struct Stream*
 	} else {
 		secio_stream = stream;
 	}
-	int retVal = libp2p_secio_handshake(secio_stream);
+	int retVal = libp2p_secio_handshake(secio_stream, SECIO_HANDSHAKE_TIMEOUT);
 	if (retVal) {
 		return 0;
 	}
@@ -82,22 +84,29 @@ int libp2p_secio_handle_message(const struct StreamMessage* msg, struct Stream*
 }
 
 int libp2p_secio_shutdown(void* context) {
+	if (context != NULL)
+		pthread_mutex_destroy(&((struct SecioContext*)context)->write_lock);
 	free(context);
 	return 1;
 }
 
 struct Libp2pProtocolHandler* libp2p_secio_build_protocol_handler(struct RsaPrivateKey* private_key, struct Peerstore* peer_store) {
-	struct Libp2pProtocolHandler* handler = (struct Libp2pProtocolHandler*) malloc(sizeof(struct Libp2pProtocolHandler));
+	struct Libp2pProtocolHandler* handler = libp2p_protocol_handler_new();
 	if (handler != NULL) {
 		struct SecioContext* context = (struct SecioContext*) malloc(sizeof(struct SecioContext));
 		context->buffered_message = NULL;
-		context->buffered_message_pos = -1;
+		context->buffered_message_pos = 0;
+		context->record_size_pos = 0;
+		context->record = NULL;
+		context->record_pos = 0;
 		context->private_key = private_key;
 		context->peer_store = peer_store;
 		context->stream = NULL;
 		context->session_context = NULL;
 		context->status = secio_status_unknown;
+		pthread_mutex_init(&context->write_lock, NULL);
 		handler->context = context;
+		handler->protocol_id = "/secio/1.0.0";
 		handler->CanHandle = libp2p_secio_can_handle;
 		handler->HandleMessage = libp2p_secio_handle_message;
 		handler->Shutdown = libp2p_secio_shutdown;
@@ -500,6 +509,43 @@ int libp2p_secio_stretch_keys(char* cipherType, char* hashType, unsigned char* s
 	return retVal;
 }
 
+/***
+ * Expand the cipher key and key the HMAC for one direction
+ * @param stretched_key the key material
+ * @param aes_context the cipher context to fill
+ * @param hmac_context the HMAC context to fill
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_secio_setup_cipher_and_hmac(struct StretchedKey* stretched_key, mbedtls_aes_context* aes_context, mbedtls_md_context_t* hmac_context) {
+	//TODO switch between ciphers
+	mbedtls_aes_free(aes_context);
+	mbedtls_aes_init(aes_context);
+	if (mbedtls_aes_setkey_enc(aes_context, stretched_key->cipher_key, stretched_key->cipher_size * 8)) {
+		libp2p_logger_error("secio", "Unable to set key for cipher.\n");
+		return 0;
+	}
+	//TODO make this more generic to use more than SHA256
+	mbedtls_md_free(hmac_context);
+	mbedtls_md_init(hmac_context);
+	if (mbedtls_md_setup(hmac_context, &mbedtls_sha256_info, 1)) {
+		libp2p_logger_error("secio", "Unable to set up HMAC.\n");
+		return 0;
+	}
+	if (mbedtls_md_hmac_starts(hmac_context, stretched_key->mac_key, stretched_key->mac_size)) {
+		libp2p_logger_error("secio", "Unable to set key for HMAC.\n");
+		return 0;
+	}
+	return 1;
+}
+
+/***
+ * Build the cipher and mac state for one direction of the session. The expanded AES key
+ * and the keyed HMAC (with its inner and outer pads) are kept on the SessionContext so
+ * that each record only pays for the encryption and hashing itself.
+ * @param session the session
+ * @param stretched_key the local or remote stretched key of the session
+ * @returns true(1) on success, false(0) otherwise
+ */
 int libp2p_secio_make_mac_and_cipher(struct SessionContext* session, struct StretchedKey* stretched_key) {
 	// mac
 	if (strcmp(session->chosen_hash, "SHA1") == 0) {
@@ -519,7 +565,7 @@ int libp2p_secio_make_mac_and_cipher(struct SessionContext* session, struct Stre
 	*/
 
 	// block cipher
-	if (strcmp(session->chosen_cipher, "AES-128") || strcmp(session->chosen_cipher, "AES-256") == 0) {
+	if (strcmp(session->chosen_cipher, "AES-128") == 0 || strcmp(session->chosen_cipher, "AES-256") == 0) {
 		//we already have the key
 	} else if (strcmp(session->chosen_cipher, "Blowfish") == 0) {
 		//TODO: Implement blowfish
@@ -528,7 +574,15 @@ int libp2p_secio_make_mac_and_cipher(struct SessionContext* session, struct Stre
 		return 0;
 	}
 
-	//TODO: set up the encrypted streams
+	// the local key is used for writing, the remote key for reading
+	if (stretched_key == session->local_stretched_key) {
+		if (!libp2p_secio_setup_cipher_and_hmac(stretched_key, &session->aes_encode_context, &session->hmac_encode_context))
+			return 0;
+	}
+	if (stretched_key == session->remote_stretched_key) {
+		if (!libp2p_secio_setup_cipher_and_hmac(stretched_key, &session->aes_decode_context, &session->hmac_decode_context))
+			return 0;
+	}
 	return 1;
 }
 
@@ -585,7 +639,7 @@ int libp2p_secio_get_socket_descriptor(struct Stream* stream) {
 }
 
 /***
- * Navigate down the tree of streams, and set the raw socket descriptor to 0,
+ * Navigate down the tree of streams, and set the raw socket descriptor to -1,
  * as it appears the connection has been closed. Cleanup will happen later.
  * @param stream the stream
  * @returns true(1)
@@ -595,10 +649,28 @@ int libp2p_secio_set_socket_descriptor(struct Stream* stream) {
 	while (current->parent_stream != NULL)
 		current = current->parent_stream;
 	struct ConnectionContext* ctx = current->stream_context;
-	ctx->socket_descriptor = 0;
+	ctx->socket_descriptor = -1;
 	return 1;
 }
 
+/***
+ * Write an entire buffer to the connection underneath a stream
+ * @param stream the stream
+ * @param buffer the bytes to write
+ * @param buffer_size the number of bytes to write
+ * @returns true(1) on success, false(0) otherwise. On backpressure, errno is EAGAIN
+ */
+int libp2p_secio_write_all(struct Stream* stream, const uint8_t* buffer, size_t buffer_size) {
+	// the raw connection queues what the socket can't take, and waits for it to drain
+	struct Stream* root_stream = stream;
+	while (root_stream->parent_stream != NULL)
+		root_stream = root_stream->parent_stream;
+	struct iovec region;
+	region.iov_base = (void*)buffer;
+	region.iov_len = buffer_size;
+	return libp2p_stream_writev(root_stream, &region, 1) == (int)buffer_size;
+}
+
 /***
  * Write bytes to an unencrypted stream
  * @param session the session information
@@ -609,44 +681,18 @@ int libp2p_secio_set_socket_descriptor(struct Stream* stream) {
 int libp2p_secio_unencrypted_write(struct Stream* secio_stream, struct StreamMessage* msg) {
 	int num_bytes = 0;
 
-	int socket_descriptor = libp2p_secio_get_socket_descriptor(secio_stream);
-
 	if (msg != NULL && msg->data_size > 0) { // only do this is if there is something to send
-		// first send the size
+		// frame it as [size][data], so that it goes out in 1 write
+		size_t frame_size = 4 + msg->data_size;
+		uint8_t* frame = (uint8_t*) malloc(frame_size);
+		if (frame == NULL)
+			return 0;
 		uint32_t size = htonl(msg->data_size);
-		char* size_as_char = (char*)&size;
-		int left = 4;
-		int written = 0;
-		int written_this_time = 0;
-		do {
-			written_this_time = socket_write(socket_descriptor, &size_as_char[written], left, 0);
-			if (written_this_time < 0) {
-				written_this_time = 0;
-				if ( (errno == EAGAIN) || (errno == EWOULDBLOCK)) {
-					// TODO: use epoll or select to wait for socket to be writable
-				} else {
-					return 0;
-				}
-			}
-			left = left - written_this_time;
-		} while (left > 0);
-		// then send the actual data
-		left = msg->data_size;
-		written = 0;
-		do {
-			written_this_time = socket_write(socket_descriptor, (char*)&msg->data[written], left, 0);
-			if (written_this_time < 0) {
-				written_this_time = 0;
-				if ( (errno == EAGAIN) || (errno == EWOULDBLOCK)) {
-					// TODO: use epoll or select to wait for socket to be writable
-				} else {
-					return 0;
-				}
-			}
-			left = left - written_this_time;
-			written += written_this_time;
-		} while (left > 0);
-		num_bytes = written;
+		memcpy(frame, &size, 4);
+		memcpy(&frame[4], msg->data, msg->data_size);
+		if (libp2p_secio_write_all(secio_stream, frame, frame_size))
+			num_bytes = msg->data_size;
+		free(frame);
 	} // there was something to send
 
 	return num_bytes;
@@ -667,95 +713,49 @@ int libp2p_secio_unencrypted_read(struct Stream* secio_stream, struct StreamMess
 		return 0;
 	}
 
-	int socket_descriptor = libp2p_secio_get_socket_descriptor(secio_stream);
+	// read from the raw connection, which parses out of its read buffer
+	struct Stream* root_stream = secio_stream;
+	while (root_stream->parent_stream != NULL)
+		root_stream = root_stream->parent_stream;
+	struct ConnectionContext* connection_context = (struct ConnectionContext*) root_stream->stream_context;
 
-	if (socket_descriptor <= 0)
+	if (connection_context == NULL || connection_context->socket_descriptor < 0)
 		return 0;
 
 	// first read the 4 byte integer
-	char* size = (char*)&buffer_size;
-	int left = 4;
-	int read = 0;
-	int read_this_time = 0;
-	int time_left = timeout_secs;
-	do {
-		read_this_time = socket_read(socket_descriptor, &size[read], 1, 0, timeout_secs);
-		if (read_this_time <= 0) {
-			if ( errno == EINPROGRESS ) {
-				time_left--;
-				sleep(1);
-				if (time_left == 0)
-					break;
-				continue;
-			}
-			if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
-				// TODO: use epoll or select to wait for socket to be writable
-				libp2p_logger_debug("secio", "Attempted read, but got EAGAIN or EWOULDBLOCK. Code %d.\n", errno);
-				return 0;
-			} else {
-				// is this really an error?
-				if (errno != 0) {
-					libp2p_logger_error("secio", "Error in libp2p_secio_unencrypted_read: %s\n", strerror(errno));
-					return 0;
-				}
-				else {
-					libp2p_logger_error("secio", "Stream has been shut down from other end.\n");
-					libp2p_secio_set_socket_descriptor(secio_stream);
-					return 0;
-				}
-			}
+	int read = root_stream->read_raw(connection_context, (uint8_t*)&buffer_size, 4, timeout_secs);
+	if (read != 4) {
+		if (read == 0) {
+			libp2p_logger_error("secio", "Stream has been shut down from other end.\n");
+			libp2p_secio_set_socket_descriptor(secio_stream);
+		} else if (read < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			libp2p_logger_error("secio", "Error in libp2p_secio_unencrypted_read: %s\n", strerror(errno));
 		} else {
-			left = left - read_this_time;
-			read += read_this_time;
+			libp2p_logger_debug("secio", "Attempted read, but the frame length did not arrive in time.\n");
 		}
-	} while (left > 0);
+		return 0;
+	}
 	buffer_size = ntohl(buffer_size);
 	if (buffer_size == 0) {
 		libp2p_logger_error("secio", "unencrypted read buffer size is 0.\n");
 		return 0;
 	}
 
-	// now read the number of bytes we've found, minus the 4 that we just read
-	left = buffer_size;
-	read = 0;
-	read_this_time = 0;
-	*msg = libp2p_stream_message_new();
+	// now read the number of bytes we've found. The layers above slice their payloads out of this
+	*msg = libp2p_stream_message_new_buffer(buffer_size);
 	struct StreamMessage* m = *msg;
 	if (m == NULL) {
-		libp2p_logger_error("secio", "Unable to allocate memory for the incoming message. Size: %ulld", left);
+		libp2p_logger_error("secio", "Unable to allocate memory for the incoming message. Size: %u", buffer_size);
+		return 0;
+	}
+	read = root_stream->read_raw(connection_context, m->data, buffer_size, timeout_secs);
+	if (read != buffer_size) {
+		libp2p_logger_error("secio", "Expected %u bytes from stream %d, but read %d.\n", buffer_size, connection_context->socket_descriptor, read);
+		libp2p_stream_message_free(m);
+		*msg = NULL;
 		return 0;
 	}
-	m->data_size = left;
-	m->data = (uint8_t*) malloc(left);
-	unsigned char* ptr = m->data;
-	time_left = timeout_secs;
-	do {
-		read_this_time = socket_read(socket_descriptor, (char*)&ptr[read], left, 0, timeout_secs);
-		if (read_this_time < 0) {
-			if (errno == EINPROGRESS) {
-				sleep(1);
-				time_left--;
-				if (time_left == 0)
-					break;
-				continue;
-			}
-			read_this_time = 0;
-			if ( (errno == EAGAIN) || (errno == EWOULDBLOCK)) {
-				// TODO: use epoll or select to wait for socket to be writable
-			} else {
-				libp2p_logger_error("secio", "read from socket returned %d.\n", errno);
-				return 0;
-			}
-		} else if (read_this_time == 0) {
-			// socket_read returned 0, which it shouldn't
-			libp2p_logger_error("secio", "socket_read returned 0 trying to read from stream %d.\n", socket_descriptor);
-			return 0;
-		}
-		left = left - read_this_time;
-		read += read_this_time;
-	} while (left > 0);
 
-	m->data_size = buffer_size;
 	return buffer_size;
 }
 
@@ -774,160 +774,251 @@ int libp2p_secio_initialize_crypto(struct SessionContext* session) {
 }
 
 /**
- * Encrypt data before being sent out an insecure stream
+ * Encrypt several buffers as one record before being sent out an insecure stream
  * @param session the session information
- * @param incoming the incoming data
- * @param incoming_size the size of the incoming data
- * @param outgoing where to put the results
- * @param outgoing_size the amount of memory allocated
+ * @param regions the incoming data
+ * @param num_regions the number of buffers
+ * @param outgoing where to put the results. Must have room for the total size + 32 bytes (cipher text then mac)
  * @returns true(1) on success, otherwise false(0)
  */
-int libp2p_secio_encrypt(struct SessionContext* session, const unsigned char* incoming, size_t incoming_size, unsigned char** outgoing, size_t* outgoing_size) {
-	unsigned char* buffer = NULL;
-	size_t buffer_size = 0, original_buffer_size = 0;
-
-	//TODO switch between ciphers
-	mbedtls_aes_context cipher_ctx;
-	mbedtls_aes_init(&cipher_ctx);
-	if (mbedtls_aes_setkey_enc(&cipher_ctx, session->local_stretched_key->cipher_key, session->local_stretched_key->cipher_size * 8)) {
-		fprintf(stderr, "Unable to set key for cipher\n");
-		return 0;
-	}
-
-	original_buffer_size = incoming_size;
-	original_buffer_size += 32;
-	buffer_size = original_buffer_size;
-	buffer = malloc(original_buffer_size);
-	memset(buffer, 0, original_buffer_size);
-
-	if (mbedtls_aes_crypt_ctr(&cipher_ctx, incoming_size, &session->aes_encode_nonce_offset, session->local_stretched_key->iv, session->aes_encode_stream_block, incoming, buffer)) {
-		fprintf(stderr, "Unable to update cipher\n");
-		return 0;
+int libp2p_secio_encryptv(struct SessionContext* session, const struct iovec* regions, int num_regions, unsigned char* outgoing) {
+	// the cipher is a stream cipher, so each buffer continues where the last left off
+	size_t outgoing_size = 0;
+	for(int i = 0; i < num_regions; i++) {
+		if (mbedtls_aes_crypt_ctr(&session->aes_encode_context, regions[i].iov_len, &session->aes_encode_nonce_offset, session->local_stretched_key->iv, session->aes_encode_stream_block, regions[i].iov_base, &outgoing[outgoing_size])) {
+			libp2p_logger_error("secio", "Unable to update cipher.\n");
+			return 0;
+		}
+		outgoing_size += regions[i].iov_len;
 	}
-	buffer_size = incoming_size;
-
-	// Now, buffer size may be set differently than original_buffer_size
-	// The "incoming" is now encrypted, and is in the first part of the buffer
-	mbedtls_aes_free(&cipher_ctx);
-
-	// mac the data
-	mbedtls_md_context_t ctx;
-	mbedtls_md_setup(&ctx, &mbedtls_sha256_info, 1);
-	mbedtls_md_hmac_starts(&ctx, session->local_stretched_key->mac_key, session->local_stretched_key->mac_size);
-	mbedtls_md_hmac_update(&ctx, buffer, buffer_size);
-	// this will tack the mac onto the end of the buffer
-	mbedtls_md_hmac_finish(&ctx, &buffer[buffer_size]);
-	mbedtls_md_free(&ctx);
 
-	// put it all in outgoing
-	*outgoing_size = original_buffer_size;
-	*outgoing = malloc(*outgoing_size);
-	memset(*outgoing, 0, *outgoing_size);
-	memcpy(*outgoing, buffer, original_buffer_size);
+	// mac the cipher text (reset brings back the keyed state)
+	mbedtls_md_hmac_reset(&session->hmac_encode_context);
+	mbedtls_md_hmac_update(&session->hmac_encode_context, outgoing, outgoing_size);
+	// this will tack the mac onto the end of the cipher text
+	mbedtls_md_hmac_finish(&session->hmac_encode_context, &outgoing[outgoing_size]);
 
-	free(buffer);
 	return 1;
 }
 
 /**
- * Write to an encrypted stream
- * @param session the session parameters
- * @param bytes the bytes to write
- * @returns the number of bytes written
+ * Encrypt data before being sent out an insecure stream
+ * @param session the session information
+ * @param incoming the incoming data
+ * @param incoming_size the size of the incoming data
+ * @param outgoing where to put the results. Must have room for incoming_size + 32 bytes (cipher text then mac)
+ * @returns true(1) on success, otherwise false(0)
  */
-int libp2p_secio_encrypted_write(void* stream_context, struct StreamMessage* bytes) {
+int libp2p_secio_encrypt(struct SessionContext* session, const unsigned char* incoming, size_t incoming_size, unsigned char* outgoing) {
+	struct iovec region;
+	region.iov_base = (void*)incoming;
+	region.iov_len = incoming_size;
+	return libp2p_secio_encryptv(session, &region, 1, outgoing);
+}
+
+/**
+ * Write several buffers to the stream as one encrypted record
+ * @param stream_context the SecioContext
+ * @param regions what to write
+ * @param num_regions the number of buffers
+ * @returns the number of bytes of the regions written
+ */
+int libp2p_secio_encrypted_writev(void* stream_context, const struct iovec* regions, int num_regions) {
 	struct SecioContext* ctx = (struct SecioContext*) stream_context;
 	struct Stream* parent_stream = ctx->stream->parent_stream;
 
 	if (ctx->status != secio_status_ack) {
-		return parent_stream->write(parent_stream->stream_context, bytes);
+		return libp2p_stream_writev(parent_stream, regions, num_regions);
 	}
 
 	struct SessionContext* session_context = ctx->session_context;
 
-	// writer uses the local cipher and mac
-	struct StreamMessage outgoing;
-	if (!libp2p_secio_encrypt(session_context, bytes->data, bytes->data_size, &outgoing.data, &outgoing.data_size)) {
+	size_t data_size = 0;
+	for(int i = 0; i < num_regions; i++)
+		data_size += regions[i].iov_len;
+
+	// the record is [size][cipher text][mac], built in one buffer and sent in one write.
+	// The cipher writes straight into it, so the plain text is never gathered first.
+	size_t record_size = data_size + 32;
+	size_t frame_size = 4 + record_size;
+	uint8_t* frame = (uint8_t*) libp2p_utils_slab_alloc(frame_size);
+	if (frame == NULL) {
+		libp2p_logger_error("secio", "Unable to allocate memory for outgoing record.\n");
+		return 0;
+	}
+	uint32_t size = htonl(record_size);
+	memcpy(frame, &size, 4);
+
+	// writer uses the local cipher and mac. The records must go out in the order they
+	// were encrypted, so handing the record to the connection is inside the lock too.
+	pthread_mutex_lock(&ctx->write_lock);
+	// Once encrypted, the record has to go out, or the remote's cipher falls out of step
+	// with ours. So any waiting for a slow peer happens first, while it can still be refused.
+	// On a connection with a flusher there is no waiting, so a slow peer doesn't hold this lock.
+	if (!libp2p_net_connection_wait_writable(parent_stream)) {
+		pthread_mutex_unlock(&ctx->write_lock);
+		libp2p_logger_debug("secio", "The connection is backed up. Not sending %d bytes.\n", (int)data_size);
+		libp2p_utils_slab_free(frame);
+		return 0;
+	}
+	if (!libp2p_secio_encryptv(session_context, regions, num_regions, &frame[4])) {
+		pthread_mutex_unlock(&ctx->write_lock);
 		libp2p_logger_error("secio", "secio_encrypt returned false.\n");
+		libp2p_utils_slab_free(frame);
 		return 0;
 	}
 
-	libp2p_logger_debug("secio", "About to write %d bytes.\n", (int)outgoing.data_size);
-	int retVal = libp2p_secio_unencrypted_write(parent_stream, &outgoing);
-	if (!retVal) {
-		libp2p_logger_error("secio", "secio_unencrypted_write returned false\n");
+	libp2p_logger_debug("secio", "About to write %d bytes.\n", (int)record_size);
+	int retVal = 0;
+	struct iovec record;
+	record.iov_base = frame;
+	record.iov_len = frame_size;
+	if (libp2p_net_connection_writev_reserved(parent_stream, &record, 1) == (int)frame_size) {
+		retVal = data_size;
+	} else {
+		libp2p_logger_error("secio", "Unable to write the record.\n");
 	}
-	free(outgoing.data);
+	pthread_mutex_unlock(&ctx->write_lock);
+	libp2p_utils_slab_free(frame);
 	return retVal;
 }
 
 /**
- * Unencrypt data that was read from the stream
+ * Write to an encrypted stream
+ * @param session the session parameters
+ * @param bytes the bytes to write
+ * @returns the number of bytes written
+ */
+int libp2p_secio_encrypted_write(void* stream_context, struct StreamMessage* bytes) {
+	struct iovec region;
+	region.iov_base = bytes->data;
+	region.iov_len = bytes->data_size;
+	return libp2p_secio_encrypted_writev(stream_context, &region, 1);
+}
+
+/**
+ * Unencrypt data that was read from the stream. This is done in place.
  * @param session the session information
- * @param incoming the incoming bytes
- * @param incoming_size the number of incoming bytes
- * @param outgoing where to put the results
- * @param outgoing_size the amount of memory allocated for the results
- * @returns number of unencrypted bytes
+ * @param buffer the incoming bytes (cipher text then mac). Will be overwritten with the plain text.
+ * @param buffer_size the number of incoming bytes
+ * @returns number of unencrypted bytes (at the start of buffer), or 0 on error
  */
-int libp2p_secio_decrypt(struct SessionContext* session, const unsigned char* incoming, size_t incoming_size, struct StreamMessage** outgoing) {
-	size_t data_section_size = incoming_size - 32;
-	unsigned char* buffer;
+int libp2p_secio_decrypt(struct SessionContext* session, unsigned char* buffer, size_t buffer_size) {
+	if (buffer_size < 32) {
+		libp2p_logger_error("secio", "libp2p_secio_decrypt: Message too small to contain a MAC.\n");
+		return 0;
+	}
+	size_t data_section_size = buffer_size - 32;
 
 	// verify MAC
-	//TODO make this more generic to use more than SHA256
-	mbedtls_md_context_t ctx;
-	mbedtls_md_setup(&ctx, &mbedtls_sha256_info, 1);
-	mbedtls_md_hmac_starts(&ctx, session->remote_stretched_key->mac_key, session->remote_stretched_key->mac_size);
-	mbedtls_md_hmac_update(&ctx, incoming, data_section_size);
+	mbedtls_md_hmac_reset(&session->hmac_decode_context);
+	mbedtls_md_hmac_update(&session->hmac_decode_context, buffer, data_section_size);
 	unsigned char generated_mac[32];
-	mbedtls_md_hmac_finish(&ctx, generated_mac);
-	mbedtls_md_free(&ctx);
+	mbedtls_md_hmac_finish(&session->hmac_decode_context, generated_mac);
 	// 2. check the mac to see if it is the same
-	int retVal = memcmp(&incoming[data_section_size], generated_mac, 32);
+	int retVal = memcmp(&buffer[data_section_size], generated_mac, 32);
 	if (retVal != 0) {
 		// MAC verification failed
 		libp2p_logger_error("secio", "libp2p_secio_decrypt: MAC verification failed.\n");
-		// copy the raw bytes into outgoing for further analysis
-		*outgoing = libp2p_stream_message_new();
-		struct StreamMessage* message = *outgoing;
-		if (message != NULL) {
-			message->data_size = incoming_size;
-			message->data = (uint8_t*) malloc(incoming_size);
-			memcpy(message->data, incoming, incoming_size);
-		}
 		return 0;
 	}
 
 	// The MAC checks out. Now decipher the data section
-
-	mbedtls_aes_context cipher_ctx;
-	mbedtls_aes_init(&cipher_ctx);
-	if (mbedtls_aes_setkey_enc(&cipher_ctx, session->remote_stretched_key->cipher_key, session->remote_stretched_key->cipher_size * 8)) {
-		libp2p_logger_error("secio", "Unable to set key for cipher.\n");
+	if (mbedtls_aes_crypt_ctr(&session->aes_decode_context, data_section_size, &session->aes_decode_nonce_offset, session->remote_stretched_key->iv, session->aes_decode_stream_block, buffer, buffer)) {
+		libp2p_logger_error("secio", "Unable to update cipher.\n");
 		return 0;
 	}
 
-	buffer = malloc(data_section_size);
-	if (mbedtls_aes_crypt_ctr(&cipher_ctx, data_section_size, &session->aes_decode_nonce_offset, session->remote_stretched_key->iv, session->aes_decode_stream_block, incoming, buffer)) {
-		libp2p_logger_error("secio", "Unable to update cipher.\n");
-		return 0;
+	return data_section_size;
+}
+
+/***
+ * Fill part of an incoming record from the connection
+ * @param connection_context the connection
+ * @param buffer where the bytes go
+ * @param pos how much of the buffer is already filled. Moves forward by what was read.
+ * @param size the size of the buffer
+ * @param wait true(1) to wait for the bytes, false(0) to only take what has already arrived
+ * @param deadline when to stop waiting (NULL for never)
+ * @returns true(1) if the buffer is full, false(0) if not yet, or -1 if the connection is gone
+ */
+static int libp2p_secio_receive_bytes(struct ConnectionContext* connection_context, uint8_t* buffer, size_t* pos, size_t size, int wait, const struct timespec* deadline) {
+	while (*pos < size) {
+		int read = libp2p_net_connection_read_now(connection_context, &buffer[*pos], size - *pos);
+		if (read < 0)
+			return -1;
+		if (read > 0) {
+			*pos += read;
+			continue;
+		}
+		if (!wait)
+			return 0;
+		int ready = socket_wait_readable(connection_context->socket_descriptor, deadline);
+		if (ready < 0)
+			return -1;
+		if (ready == 0) // out of time
+			return 0;
 	}
+	return 1;
+}
 
-	mbedtls_aes_free(&cipher_ctx);
-	*outgoing = libp2p_stream_message_new();
-	struct StreamMessage* message = *outgoing;
-	message->data_size = data_section_size;
-	message->data = (uint8_t*) malloc(data_section_size);
-	if (message->data == NULL) {
-		libp2p_stream_message_free(message);
-		*outgoing = NULL;
-		return 0;
+/***
+ * Gather the next record from the connection. What has arrived so far is kept in the
+ * SecioContext, so a record that trickles in is picked up where it was left.
+ * NOTE: the read_mutex should be held
+ * @param ctx the SecioContext
+ * @param wait true(1) to wait for the rest of the record, false(0) to only take what has already arrived
+ * @param timeout_secs how long to wait
+ * @returns the size of the record once all of it is here, 0 if it isn't yet, or -1 on error
+ */
+static int libp2p_secio_receive_record(struct SecioContext* ctx, int wait, int timeout_secs) {
+	struct Stream* root_stream = ctx->stream;
+	while (root_stream->parent_stream != NULL)
+		root_stream = root_stream->parent_stream;
+	struct ConnectionContext* connection_context = (struct ConnectionContext*) root_stream->stream_context;
+	if (connection_context == NULL || connection_context->socket_descriptor < 0)
+		return -1;
+
+	struct timespec deadline;
+	const struct timespec* until = socket_deadline_after_ms(&deadline, (long)timeout_secs * 1000);
+	int retVal = 0;
+	if (ctx->record == NULL) {
+		// first the 4 byte integer
+		retVal = libp2p_secio_receive_bytes(connection_context, ctx->record_size_bytes, &ctx->record_size_pos, 4, wait, until);
+		if (retVal != 1)
+			return retVal;
+		uint32_t record_size = 0;
+		memcpy(&record_size, ctx->record_size_bytes, 4);
+		record_size = ntohl(record_size);
+		if (record_size == 0) {
+			libp2p_logger_error("secio", "Incoming record size is 0.\n");
+			return -1;
+		}
+		// the layers above slice their payloads out of this
+		ctx->record = libp2p_stream_message_new_buffer(record_size);
+		if (ctx->record == NULL) {
+			libp2p_logger_error("secio", "Unable to allocate memory for the incoming record. Size: %u", record_size);
+			return -1;
+		}
+		ctx->record_pos = 0;
 	}
-	memcpy(message->data, buffer, data_section_size);
-	free(buffer);
+	retVal = libp2p_secio_receive_bytes(connection_context, ctx->record->data, &ctx->record_pos, ctx->record->data_size, wait, until);
+	if (retVal != 1)
+		return retVal;
+	return ctx->record->data_size;
+}
 
-	return message->data_size;
+/***
+ * Hand over the record that has arrived, and get ready for the next one
+ * @param ctx the SecioContext
+ * @returns the record
+ */
+static struct StreamMessage* libp2p_secio_take_record(struct SecioContext* ctx) {
+	struct StreamMessage* record = ctx->record;
+	ctx->record = NULL;
+	ctx->record_pos = 0;
+	ctx->record_size_pos = 0;
+	return record;
 }
 
 /**
@@ -945,15 +1036,30 @@ int libp2p_secio_encrypted_read(void* stream_context, struct StreamMessage** byt
 		return parent_stream->read(parent_stream->stream_context, bytes, timeout_secs);
 	}
 	// reader uses the remote cipher and mac
-	// read the data
+	// read the data, finishing any record that a peek started on
 	struct StreamMessage* msg = NULL;
-	if (!libp2p_secio_unencrypted_read(parent_stream, &msg, 10)) {
-		libp2p_logger_error("secio", "Unencrypted_read returned false.\n");
+	int received = libp2p_secio_receive_record(ctx, 1, timeout_secs);
+	if (received <= 0) {
+		if (received < 0) {
+			libp2p_logger_error("secio", "Stream has been shut down from other end.\n");
+			libp2p_secio_set_socket_descriptor(parent_stream);
+		} else {
+			libp2p_logger_debug("secio", "Attempted read, but the record did not arrive in time.\n");
+		}
 		goto exit;
 	}
-	retVal = libp2p_secio_decrypt(ctx->session_context, msg->data, msg->data_size, bytes);
-	if (!retVal)
+	msg = libp2p_secio_take_record(ctx);
+	// decrypt in place, and hand the same message back to the caller
+	retVal = libp2p_secio_decrypt(ctx->session_context, msg->data, msg->data_size);
+	if (!retVal) {
 		libp2p_logger_error("secio", "Decrypting incoming stream returned false.\n");
+		// pass the raw bytes back for further analysis
+		*bytes = msg;
+		return 0;
+	}
+	msg->data_size = retVal;
+	*bytes = msg;
+	return retVal;
 	exit:
 	libp2p_stream_message_free(msg);
 	return retVal;
@@ -1005,19 +1111,37 @@ struct Libp2pPeer* libp2p_secio_get_peer_or_add(struct Peerstore* peerstore, str
 		}
 	}
 	remote_peer->connection_type = CONNECTION_TYPE_CONNECTED;
+	if (peerstore != NULL) {
+		// they are talking to us, so they belong in the routing table
+		struct Libp2pPeer* stored = libp2p_peerstore_get_peer(peerstore, (unsigned char*)remote_peer->id, remote_peer->id_size);
+		libp2p_routing_table_update(peerstore->routing_table, stored);
+	}
 	return remote_peer;
 }
 
+/***
+ * How many seconds a handshake has left to read
+ * @param deadline when the handshake has to be done, or NULL for no limit
+ * @returns the seconds left (rounded up), 0 if there is no limit, or -1 if the time is up
+ */
+static int libp2p_secio_seconds_left(const struct timespec* deadline) {
+	int remaining_ms = socket_deadline_remaining_ms(deadline);
+	if (remaining_ms < 0)
+		return 0;
+	if (remaining_ms == 0)
+		return -1;
+	return (remaining_ms + 999) / 1000;
+}
+
 /***
  * performs initial communication over an insecure channel to share
  * keys, IDs, and initiate connection. This is a framed messaging system
  * NOTE: session must contain a valid socket_descriptor that is a multistream.
- * @param local_session the secure session to be filled
- * @param private_key our private key to use
- * @param peerstore the collection of peers
+ * @param secio_stream a stream that is a Secio stream
+ * @param timeout_secs how long the whole handshake may take (0 or less for no limit)
  * @returns true(1) on success, false(0) otherwise
  */
-int libp2p_secio_handshake(struct Stream* secio_stream) {
+int libp2p_secio_handshake(struct Stream* secio_stream, int timeout_secs) {
 	int retVal = 0;
 	size_t bytes_written = 0;
 	struct StreamMessage* incoming = NULL;
@@ -1037,6 +1161,10 @@ int libp2p_secio_handshake(struct Stream* secio_stream) {
 	size_t exchange_out_protobuf_size = 0;
 	char* char_buffer = NULL;
 	size_t char_buffer_length = 0;
+	struct timespec deadline_buf;
+	// one deadline for all of the reads, so a slow peer can't take 10 seconds for each
+	const struct timespec* deadline = socket_deadline_after_ms(&deadline_buf, (long)timeout_secs * 1000);
+	int seconds_left = 0;
 	struct StretchedKey* k1 = NULL, *k2 = NULL;
 	struct Libp2pPeer* remote_peer = NULL;
 
@@ -1046,7 +1174,7 @@ int libp2p_secio_handshake(struct Stream* secio_stream) {
 	struct Peerstore* peerstore = secio_context->peer_store;
 
 	libp2p_logger_debug("secio", "handshake: Getting read lock.\n");
-	pthread_mutex_lock(secio_stream->socket_mutex);
+	pthread_mutex_lock(secio_stream->read_mutex);
 	libp2p_logger_debug("secio", "handshake: Got read lock.\n");
 
 	//TODO: make sure we're not talking to ourself
@@ -1091,7 +1219,11 @@ int libp2p_secio_handshake(struct Stream* secio_stream) {
 	libp2p_logger_debug("secio", "Sent propose_out, waiting for propose_in.\n");
 
 	// try to get the Propose struct from the remote peer
-	bytes_written = libp2p_secio_unencrypted_read(secio_stream, &incoming, 10);
+	if ((seconds_left = libp2p_secio_seconds_left(deadline)) < 0) {
+		libp2p_logger_error("secio", "The handshake timed out before the Propose struct came in.\n");
+		goto exit;
+	}
+	bytes_written = libp2p_secio_unencrypted_read(secio_stream, &incoming, seconds_left);
 	if (bytes_written <= 0) {
 		libp2p_logger_error("secio", "Unable to get the remote's Propose struct.\n");
 		goto exit;
@@ -1210,7 +1342,11 @@ int libp2p_secio_handshake(struct Stream* secio_stream) {
 
 	// receive Exchange packet
 	libp2p_logger_log("secio", LOGLEVEL_DEBUG, "Reading exchange packet\n");
-	bytes_written = libp2p_secio_unencrypted_read(secio_stream, &incoming, 10);
+	if ((seconds_left = libp2p_secio_seconds_left(deadline)) < 0) {
+		libp2p_logger_error("secio", "The handshake timed out before the exchange packet came in.\n");
+		goto exit;
+	}
+	bytes_written = libp2p_secio_unencrypted_read(secio_stream, &incoming, seconds_left);
 	if (bytes_written == 0) {
 		libp2p_logger_error("secio", "unable to read exchange packet.\n");
 		libp2p_peer_handle_connection_error(remote_peer);
@@ -1283,16 +1419,19 @@ int libp2p_secio_handshake(struct Stream* secio_stream) {
 		goto exit;
 	}
 
-	// this doesn't do much. It is here to match the GO code and maybe eventually remind us
-	// that there is more work to do for compatibility to GO
-	libp2p_secio_make_mac_and_cipher(local_session, local_session->local_stretched_key);
-	libp2p_secio_make_mac_and_cipher(local_session, local_session->remote_stretched_key);
+	// build the cipher and mac state that will be used for every record of this session
+	if (!libp2p_secio_make_mac_and_cipher(local_session, local_session->local_stretched_key)
+			|| !libp2p_secio_make_mac_and_cipher(local_session, local_session->remote_stretched_key)) {
+		libp2p_logger_error("secio", "Unable to build the cipher and mac.\n");
+		goto exit;
+	}
 
 	// now we actually start encrypting things...
 
 	libp2p_secio_initialize_crypto(local_session);
 
 	secio_context->status = secio_status_ack;
+	libp2p_utils_readiness_signal();
 
 	// send their nonce to verify encryption works
 	outgoing.data = (uint8_t*)local_session->remote_nonce;
@@ -1305,7 +1444,11 @@ int libp2p_secio_handshake(struct Stream* secio_stream) {
 	// receive our nonce to verify encryption works
 	libp2p_logger_log("secio", LOGLEVEL_DEBUG, "Receiving our nonce\n");
 	results = NULL;
-	int bytes_read = libp2p_secio_encrypted_read(secio_context, &incoming, 10);
+	if ((seconds_left = libp2p_secio_seconds_left(deadline)) < 0) {
+		libp2p_logger_error("secio", "The handshake timed out before the nonce came in.\n");
+		goto exit;
+	}
+	int bytes_read = libp2p_secio_encrypted_read(secio_context, &incoming, seconds_left);
 	if (bytes_read <= 0 || incoming == NULL) {
 		libp2p_logger_error("secio", "Encrypted read returned %d\n", bytes_read);
 		goto exit;
@@ -1327,6 +1470,7 @@ int libp2p_secio_handshake(struct Stream* secio_stream) {
 	local_session->secure_stream = local_session->insecure_stream;
 	local_session->secure_stream->read = libp2p_secio_encrypted_read;
 	local_session->secure_stream->write = libp2p_secio_encrypted_write;
+	local_session->secure_stream->writev = libp2p_secio_encrypted_writev;
 	// set secure as default
 	local_session->default_stream = local_session->secure_stream;
 	*/
@@ -1335,7 +1479,7 @@ int libp2p_secio_handshake(struct Stream* secio_stream) {
 	//libp2p_logger_log("secio", LOGLEVEL_DEBUG, "Handshake complete\n");
 	exit:
 	libp2p_logger_debug("secio", "Releasing read lock.\n");
-	pthread_mutex_unlock(secio_stream->socket_mutex);
+	pthread_mutex_unlock(secio_stream->read_mutex);
 	libp2p_logger_debug("secio", "Read lock released.\n");
 	if (propose_in_bytes != NULL)
 		free(propose_in_bytes);
@@ -1364,12 +1508,67 @@ int libp2p_secio_handshake(struct Stream* secio_stream) {
 	return retVal;
 }
 
+/***
+ * Check the stream to see if there is something to read
+ * NOTE: Once the handshake is done, this only counts a record when all of it has
+ * arrived, so a reader that follows never waits on the network
+ * @param stream_context the SecioContext
+ * @returns number of bytes to be read, or -1 if there was an error
+ */
 int libp2p_secio_peek(void* stream_context) {
 	if (stream_context == NULL) {
 		return -1;
 	}
 	struct SecioContext* ctx = (struct SecioContext*)stream_context;
-	return ctx->stream->parent_stream->peek(ctx->stream->parent_stream->stream_context);
+	if (ctx->buffered_message != NULL)
+		return ctx->buffered_message->data_size - ctx->buffered_message_pos;
+	if (ctx->status != secio_status_ack)
+		return ctx->stream->parent_stream->peek(ctx->stream->parent_stream->stream_context);
+	// only report a record once all of it has arrived, so that reading it won't wait on the network
+	if (pthread_mutex_trylock(ctx->stream->read_mutex) != 0)
+		return 0; // someone is already reading
+	int retVal = libp2p_secio_receive_record(ctx, 0, 0);
+	pthread_mutex_unlock(ctx->stream->read_mutex);
+	return retVal;
+}
+
+/***
+ * Make sure there is a decrypted record to read from
+ * @param ctx the secio context
+ * @param timeout_secs the network timeout
+ * @returns true(1) if there are bytes in buffered_message, false(0) otherwise
+ */
+int libp2p_secio_fill_buffer(struct SecioContext* ctx, int timeout_secs) {
+	if (ctx->buffered_message != NULL)
+		return 1;
+	// we need to get info from the network
+	if (!ctx->stream->read(ctx->stream->stream_context, &ctx->buffered_message, timeout_secs)) {
+		libp2p_stream_message_free(ctx->buffered_message);
+		ctx->buffered_message = NULL;
+		return 0;
+	}
+	ctx->buffered_message_pos = 0;
+	if (ctx->buffered_message->data_size == 0) {
+		libp2p_stream_message_free(ctx->buffered_message);
+		ctx->buffered_message = NULL;
+		return 0;
+	}
+	return 1;
+}
+
+/***
+ * Move forward in the buffered record, letting it go when it has all been read
+ * @param ctx the secio context
+ * @param num_bytes the number of bytes that were read
+ */
+void libp2p_secio_consume_buffer(struct SecioContext* ctx, size_t num_bytes) {
+	ctx->buffered_message_pos += num_bytes;
+	if (ctx->buffered_message_pos >= ctx->buffered_message->data_size) {
+		// we read everything
+		libp2p_stream_message_free(ctx->buffered_message);
+		ctx->buffered_message = NULL;
+		ctx->buffered_message_pos = 0;
+	}
 }
 
 /***
@@ -1385,32 +1584,64 @@ int libp2p_secio_read_raw(void* stream_context, uint8_t* buffer, int buffer_size
 		return -1;
 	}
 	struct SecioContext* ctx = (struct SecioContext*)stream_context;
-	if (ctx->buffered_message_pos == -1) {
-		// we need to get info from the network
-		if (!ctx->stream->read(ctx->stream->stream_context, &ctx->buffered_message, timeout_secs)) {
-			return -1;
-		}
-		ctx->buffered_message_pos = 0;
-	}
-	// max_to_read is the lesser of bytes read or buffer_size
-	int max_to_read = (buffer_size > ctx->buffered_message->data_size ? ctx->buffered_message->data_size : buffer_size);
+	if (!libp2p_secio_fill_buffer(ctx, timeout_secs))
+		return -1;
+	// max_to_read is the lesser of bytes waiting or buffer_size
+	size_t available = ctx->buffered_message->data_size - ctx->buffered_message_pos;
+	size_t max_to_read = ((size_t)buffer_size > available ? available : (size_t)buffer_size);
 	memcpy(buffer, &ctx->buffered_message->data[ctx->buffered_message_pos], max_to_read);
-	ctx->buffered_message_pos += max_to_read;
-	if (ctx->buffered_message_pos == ctx->buffered_message->data_size) {
-		// we read everything
-		libp2p_stream_message_free(ctx->buffered_message);
-		ctx->buffered_message = NULL;
-		ctx->buffered_message_pos = -1;
-	} else {
-		// we didn't read everything.
-		ctx->buffered_message_pos = max_to_read;
-	}
+	libp2p_secio_consume_buffer(ctx, max_to_read);
 	return max_to_read;
 }
 
+/***
+ * Read exactly num_bytes. When they are all within one decrypted record, the
+ * message shares the record's memory instead of copying it.
+ * @param stream_context the secio context
+ * @param num_bytes the number of bytes to read
+ * @param message where to put the message
+ * @param timeout_secs the network timeout
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_secio_read_slice(void* stream_context, size_t num_bytes, struct StreamMessage** message, int timeout_secs) {
+	*message = NULL;
+	if (stream_context == NULL)
+		return 0;
+	struct SecioContext* ctx = (struct SecioContext*)stream_context;
+	if (!libp2p_secio_fill_buffer(ctx, timeout_secs))
+		return 0;
+	if (ctx->buffered_message->data_size - ctx->buffered_message_pos >= num_bytes) {
+		*message = libp2p_stream_message_slice(ctx->buffered_message, ctx->buffered_message_pos, num_bytes);
+		if (*message == NULL)
+			return 0;
+		libp2p_secio_consume_buffer(ctx, num_bytes);
+		return 1;
+	}
+	// it spans records, so gather it
+	struct StreamMessage* msg = libp2p_stream_message_new_buffer(num_bytes);
+	if (msg == NULL)
+		return 0;
+	size_t pos = 0;
+	while (pos < num_bytes) {
+		int bytes_read = libp2p_secio_read_raw(ctx, &msg->data[pos], num_bytes - pos, timeout_secs);
+		if (bytes_read <= 0) {
+			libp2p_stream_message_free(msg);
+			return 0;
+		}
+		pos += bytes_read;
+	}
+	*message = msg;
+	return 1;
+}
+
 int libp2p_secio_close(struct Stream* stream) {
-	if (stream != NULL && stream->stream_context != NULL)
+	if (stream != NULL && stream->stream_context != NULL) {
+		struct SecioContext* ctx = (struct SecioContext*)stream->stream_context;
+		libp2p_stream_message_free(ctx->buffered_message);
+		libp2p_stream_message_free(ctx->record);
+		pthread_mutex_destroy(&ctx->write_lock);
 		free(stream->stream_context);
+	}
 	return 1;
 }
 
@@ -1440,20 +1671,26 @@ struct Stream* libp2p_secio_stream_new(struct Stream* parent_stream, struct Peer
 			return NULL;
 		}
 		ctx->buffered_message = NULL;
-		ctx->buffered_message_pos = -1;
+		ctx->buffered_message_pos = 0;
+		ctx->record_size_pos = 0;
+		ctx->record = NULL;
+		ctx->record_pos = 0;
 		new_stream->stream_context = ctx;
 		ctx->stream = new_stream;
 		ctx->session_context = session_context;
 		ctx->peer_store = peerstore;
 		ctx->private_key = rsa_private_key;
 		ctx->status = secio_status_initialized;
+		pthread_mutex_init(&ctx->write_lock, NULL);
 		new_stream->parent_stream = parent_stream;
 		new_stream->close = libp2p_secio_close;
 		new_stream->peek = libp2p_secio_peek;
 		new_stream->read = libp2p_secio_encrypted_read;
 		new_stream->read_raw = libp2p_secio_read_raw;
+		new_stream->read_slice = libp2p_secio_read_slice;
 		new_stream->write = libp2p_secio_encrypted_write;
-		new_stream->socket_mutex = parent_stream->socket_mutex;
+		new_stream->writev = libp2p_secio_encrypted_writev;
+		new_stream->read_mutex = parent_stream->read_mutex;
 		parent_stream->handle_upgrade(parent_stream, new_stream);
 		if (!libp2p_secio_send_protocol(parent_stream)) {
 			libp2p_stream_free(new_stream);
@@ -1463,6 +1700,19 @@ struct Stream* libp2p_secio_stream_new(struct Stream* parent_stream, struct Peer
 	return new_stream;
 }
 
+/***
+ * See if the default stream of a session is secio, and the handshake is complete
+ * @param context the SessionContext
+ * @returns true(1) if ready, false(0) otherwise
+ */
+int libp2p_secio_is_ready(void* context) {
+	struct SessionContext* session_context = (struct SessionContext*)context;
+	struct Stream* stream = session_context->default_stream;
+	return stream != NULL
+			&& stream->stream_type == STREAM_TYPE_SECIO
+			&& ((struct SecioContext*)stream->stream_context)->status == secio_status_ack;
+}
+
 /***
  * Wait for secio stream to become ready
  * @param session_context the session context to check
@@ -1470,26 +1720,8 @@ struct Stream* libp2p_secio_stream_new(struct Stream* parent_stream, struct Peer
  * @returns true(1) if it becomes ready, false(0) otherwise
  */
 int libp2p_secio_ready(struct SessionContext* session_context, int timeout_secs) {
-	int counter = 0;
-	while (session_context != NULL
-			&& session_context->default_stream != NULL
-			&& session_context->default_stream->stream_type != STREAM_TYPE_SECIO
-			&& counter <= timeout_secs) {
-		counter++;
-		sleep(1);
-	}
-	if (session_context != NULL
-			&& session_context->default_stream != NULL
-			&& session_context->default_stream->stream_type == STREAM_TYPE_SECIO
-			&& counter < 5) {
-		struct SecioContext* ctx = (struct SecioContext*)session_context->default_stream->stream_context;
-		while (ctx->status != secio_status_ack && counter <= timeout_secs) {
-			counter++;
-			sleep(1);
-		}
-		if (ctx->status == secio_status_ack)
-			return 1;
-	}
-	return 0;
+	if (session_context == NULL)
+		return 0;
+	return libp2p_utils_readiness_wait(libp2p_secio_is_ready, session_context, timeout_secs);
 }
 
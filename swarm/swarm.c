@@ -4,6 +4,10 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
 
 #include "libp2p/net/protocol.h"
 #include "libp2p/net/connectionstream.h"
@@ -16,10 +20,17 @@
 struct SwarmSession {
 	struct SessionContext* session_context;
 	struct SwarmContext* swarm_context;
+	int socket_descriptor; // the socket registered with the event loop
+	uint32_t events; // what the event loop saw the last time it fired
 };
 
 int DEFAULT_NETWORK_TIMEOUT = 5;
 
+// the most events handled per trip through the event loop
+#define SWARM_MAX_EVENTS 64
+// number of threads that handle connections with bytes waiting
+#define SWARM_WORKER_THREADS 25
+
 
 /***
  * Listens on a particular stream, and marshals the request
@@ -34,11 +45,11 @@ int libp2p_swarm_listen_and_handle(struct Stream* stream, struct Libp2pVector* p
 		return -1;
 	// Read from the network
 	libp2p_logger_debug("swarm", "Attempting to get read lock.\n");
-	pthread_mutex_lock(stream->socket_mutex);
+	pthread_mutex_lock(stream->read_mutex);
 	libp2p_logger_debug("swarm", "Got read lock.\n");
 	if (!stream->read(stream->stream_context, &results, 1)) {
 		libp2p_logger_debug("swarm", "Releasing read lock\n");
-		pthread_mutex_unlock(stream->socket_mutex);
+		pthread_mutex_unlock(stream->read_mutex);
 		if (!libp2p_stream_is_open(stream)) {
 			libp2p_logger_error("swarm", "Attempted read on stream, but has been closed.\n");
 			return -1;
@@ -47,7 +58,7 @@ int libp2p_swarm_listen_and_handle(struct Stream* stream, struct Libp2pVector* p
 		return retVal;
 	}
 	libp2p_logger_debug("swarm", "Releasing read lock.\n");
-	pthread_mutex_unlock(stream->socket_mutex);
+	pthread_mutex_unlock(stream->read_mutex);
 	if (results != NULL) {
 		libp2p_logger_debug("swarm", "Attempting to marshal %d bytes from network.\n", results->data_size);
 		retVal = libp2p_protocol_marshal(results, stream, protocol_handlers);
@@ -60,27 +71,147 @@ int libp2p_swarm_listen_and_handle(struct Stream* stream, struct Libp2pVector* p
 }
 
 /***
- * This is on its own thread, and listens for incoming data from a particular client
- * @param session the SessionContext
+ * Retrieve the socket underneath a SessionContext
+ * @param session_context the session
+ * @returns the socket descriptor, or -1
+ */
+int libp2p_swarm_get_socket_descriptor(struct SessionContext* session_context) {
+	if (session_context == NULL || session_context->default_stream == NULL)
+		return -1;
+	struct Stream* root_stream = session_context->default_stream;
+	while (root_stream->parent_stream != NULL)
+		root_stream = root_stream->parent_stream;
+	struct ConnectionContext* ctx = (struct ConnectionContext*)root_stream->stream_context;
+	if (ctx == NULL)
+		return -1;
+	return ctx->socket_descriptor;
+}
+
+/***
+ * Stop watching a connection and release the SwarmSession
+ * @param swarm_session the session to release
  */
-void libp2p_swarm_listen(void* ctx) {
+void libp2p_swarm_unwatch(struct SwarmSession* swarm_session) {
+	struct SessionContext* session_context = swarm_session->session_context;
+	epoll_ctl(swarm_session->swarm_context->epoll_fd, EPOLL_CTL_DEL, swarm_session->socket_descriptor, NULL);
+	// clean up memory
+	if (session_context->host != NULL) {
+		free(session_context->host);
+		session_context->host = NULL;
+	}
+	free(swarm_session);
+}
+
+/***
+ * Called on a worker thread when the event loop sees that a connection has something
+ * for us. Handles everything that is waiting, then hands the connection back to the event loop.
+ * @param ctx the SwarmSession
+ */
+void libp2p_swarm_handle_ready(void* ctx) {
 	struct SwarmSession* swarm_session = (struct SwarmSession*) ctx;
 	struct SessionContext* session_context = swarm_session->session_context;
 	int retVal = 0;
 	for(;;) {
+		// peek only counts whole messages, so the read below doesn't wait on a peer that is slow to send the rest
+		int bytes_waiting = 0;
+		if (session_context->default_stream->peek != NULL)
+			bytes_waiting = session_context->default_stream->peek(session_context->default_stream->stream_context);
+		else if (swarm_session->events & EPOLLIN)
+			bytes_waiting = 1;
+		if (bytes_waiting < 0 || (bytes_waiting == 0 && (swarm_session->events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR)))) {
+			// the other side has gone away
+			libp2p_logger_debug("swarm", "Connection %d has been closed.\n", swarm_session->socket_descriptor);
+			libp2p_swarm_unwatch(swarm_session);
+			return;
+		}
+		if (bytes_waiting == 0)
+			break;
 		// Read from the network
 		retVal = libp2p_swarm_listen_and_handle(session_context->default_stream, swarm_session->swarm_context->protocol_handlers);
 		if (retVal < 0) {
-			// exit the loop on error
-			libp2p_logger_debug("swarm", "listen: Exiting loop due to retVal being %d.\n", retVal);
+			// stop watching on error
+			libp2p_logger_debug("swarm", "handle_ready: No longer watching connection due to retVal being %d.\n", retVal);
+			libp2p_swarm_unwatch(swarm_session);
+			return;
+		}
+		swarm_session->events = 0;
+	}
+	// we've handled everything that was waiting. Wait for more.
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	event.data.ptr = swarm_session;
+	if (epoll_ctl(swarm_session->swarm_context->epoll_fd, EPOLL_CTL_MOD, swarm_session->socket_descriptor, &event) != 0) {
+		libp2p_logger_error("swarm", "Unable to rearm connection %d: %s.\n", swarm_session->socket_descriptor, strerror(errno));
+		libp2p_swarm_unwatch(swarm_session);
+	}
+}
+
+/***
+ * The event loop. Waits for connections to become readable, and passes them to the
+ * worker threads. A connection is only given to one worker at a time. It also sends
+ * what writers have queued, as the sockets become writable.
+ * @param ctx the SwarmContext
+ */
+void* libp2p_swarm_event_loop(void* ctx) {
+	struct SwarmContext* context = (struct SwarmContext*) ctx;
+	struct epoll_event events[SWARM_MAX_EVENTS];
+	while (!context->shutting_down) {
+		int num_events = epoll_wait(context->epoll_fd, events, SWARM_MAX_EVENTS, 1000);
+		if (num_events < 0) {
+			if (errno == EINTR)
+				continue;
+			libp2p_logger_error("swarm", "epoll_wait returned %s. Exiting event loop.\n", strerror(errno));
 			break;
 		}
-	} // end of loop
+		for(int i = 0; i < num_events; i++) {
+			if (events[i].data.ptr == context->flusher) {
+				// sockets that will take more of what is queued for them
+				libp2p_net_connection_flusher_run(context->flusher);
+				continue;
+			}
+			struct SwarmSession* swarm_session = (struct SwarmSession*) events[i].data.ptr;
+			swarm_session->events = events[i].events;
+			if (thpool_add_work(context->thread_pool, libp2p_swarm_handle_ready, swarm_session) < 0) {
+				libp2p_logger_error("swarm", "Unable to hand connection %d to a worker.\n", swarm_session->socket_descriptor);
+			}
+		}
+	}
+	return NULL;
+}
 
-	// clean up memory
-	if (session_context->host != NULL)
-		free(session_context->host);
-	free(swarm_session);
+/***
+ * Ask the event loop to watch a connection
+ * @param context the SwarmContext
+ * @param session_context the connection
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_swarm_watch(struct SwarmContext* context, struct SessionContext* session_context) {
+	int socket_descriptor = libp2p_swarm_get_socket_descriptor(session_context);
+	if (socket_descriptor < 0)
+		return 0;
+	struct SwarmSession* swarm_session = (struct SwarmSession*) malloc(sizeof(struct SwarmSession));
+	if (swarm_session == NULL)
+		return 0;
+	swarm_session->session_context = session_context;
+	swarm_session->swarm_context = context;
+	swarm_session->socket_descriptor = socket_descriptor;
+	swarm_session->events = 0;
+	// writers on this connection leave what the socket can't take to the event loop
+	libp2p_net_connection_flusher_attach(context->flusher, session_context->default_stream);
+
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	event.data.ptr = swarm_session;
+	if (epoll_ctl(context->epoll_fd, EPOLL_CTL_ADD, socket_descriptor, &event) != 0) {
+		free(swarm_session);
+		if (errno == EEXIST) {
+			// we're already watching this one
+			return 1;
+		}
+		libp2p_logger_error("swarm", "Unable to watch connection %d: %s.\n", socket_descriptor, strerror(errno));
+		return 0;
+	}
+	return 1;
 }
 
 /***
@@ -91,18 +222,14 @@ void libp2p_swarm_listen(void* ctx) {
  * @returns true(1) on success, false(0) otherwise
  */
 int libp2p_swarm_add_peer(struct SwarmContext* context, struct Libp2pPeer* peer) {
-	// spin off a thread for this peer
-    struct SwarmSession* swarm_session = (struct SwarmSession*) malloc(sizeof(struct SwarmSession));
-    swarm_session->session_context = peer->sessionContext;
-    swarm_session->swarm_context = context;
-
-    if (thpool_add_work(context->thread_pool, libp2p_swarm_listen, swarm_session) < 0) {
-    	libp2p_logger_error("swarm", "Unable to fire up thread for peer %s\n", libp2p_peer_id_to_string(peer));
-    	return 0;
-    }
-    libp2p_logger_info("swarm", "add_connection: added connection for peer %s.\n", libp2p_peer_id_to_string(peer));
+	// let the event loop know about this peer
+	if (!libp2p_swarm_watch(context, peer->sessionContext)) {
+		libp2p_logger_error("swarm", "Unable to watch connection for peer %s\n", libp2p_peer_id_to_string(peer));
+		return 0;
+	}
+	libp2p_logger_info("swarm", "add_connection: added connection for peer %s.\n", libp2p_peer_id_to_string(peer));
 
-    return 1;
+	return 1;
 }
 
 
@@ -142,12 +269,8 @@ int libp2p_swarm_add_connection(struct SwarmContext* context, int file_descripto
     session->insecure_stream = libp2p_net_connection_new(file_descriptor, session->host, session->port, session);
     session->default_stream = session->insecure_stream;
 
-    struct SwarmSession* swarm_session = (struct SwarmSession*) malloc(sizeof(struct SwarmSession));
-    swarm_session->session_context = session;
-    swarm_session->swarm_context = context;
-
-    if (thpool_add_work(context->thread_pool, libp2p_swarm_listen, swarm_session) < 0) {
-    	libp2p_logger_error("swarm", "Unable to fire up thread for connection %d\n", file_descriptor);
+    if (!libp2p_swarm_watch(context, session)) {
+    	libp2p_logger_error("swarm", "Unable to watch connection %d\n", file_descriptor);
     	return 0;
     }
     libp2p_logger_info("swarm", "add_connection: added connection %d.\n", file_descriptor);
@@ -165,10 +288,63 @@ int libp2p_swarm_add_connection(struct SwarmContext* context, int file_descripto
 struct SwarmContext* libp2p_swarm_new(struct Libp2pVector* protocol_handlers, struct Datastore* datastore, struct Filestore* filestore) {
 	struct SwarmContext* context = (struct SwarmContext*) malloc(sizeof(struct SwarmContext));
 	if (context != NULL) {
-		context->thread_pool = thpool_init(25);
 		context->protocol_handlers = protocol_handlers;
 		context->datastore = datastore;
 		context->filestore = filestore;
+		context->shutting_down = 0;
+		context->epoll_fd = epoll_create1(0);
+		if (context->epoll_fd < 0) {
+			libp2p_logger_error("swarm", "Unable to create epoll descriptor: %s.\n", strerror(errno));
+			free(context);
+			return NULL;
+		}
+		context->flusher = libp2p_net_connection_flusher_new();
+		struct epoll_event event;
+		event.events = EPOLLIN;
+		event.data.ptr = context->flusher; // marks the flusher
+		if (context->flusher == NULL || epoll_ctl(context->epoll_fd, EPOLL_CTL_ADD, libp2p_net_connection_flusher_fd(context->flusher), &event) != 0) {
+			libp2p_logger_error("swarm", "Unable to watch for writable connections.\n");
+			libp2p_net_connection_flusher_free(context->flusher);
+			close(context->epoll_fd);
+			free(context);
+			return NULL;
+		}
+		context->thread_pool = thpool_init(SWARM_WORKER_THREADS);
+		if (context->thread_pool == NULL) {
+			libp2p_logger_error("swarm", "Unable to start the worker threads.\n");
+			libp2p_net_connection_flusher_free(context->flusher);
+			close(context->epoll_fd);
+			free(context);
+			return NULL;
+		}
+		if (pthread_create(&context->event_thread, NULL, libp2p_swarm_event_loop, context) != 0) {
+			libp2p_logger_error("swarm", "Unable to start the event loop.\n");
+			thpool_destroy(context->thread_pool);
+			libp2p_net_connection_flusher_free(context->flusher);
+			close(context->epoll_fd);
+			free(context);
+			return NULL;
+		}
 	}
 	return context;
 }
+
+/***
+ * Shut down the swarm engine, and free the resources of libp2p_swarm_new
+ * NOTE: the connections that were added stay open. They belong to their sessions.
+ * @param context the SwarmContext
+ */
+void libp2p_swarm_free(struct SwarmContext* context) {
+	if (context == NULL)
+		return;
+	// the event loop looks at this at least once a second
+	context->shutting_down = 1;
+	pthread_join(context->event_thread, NULL);
+	// let the workers finish, as they rearm connections with epoll_fd
+	thpool_wait(context->thread_pool);
+	thpool_destroy(context->thread_pool);
+	// the connections go back to flushing for themselves
+	libp2p_net_connection_flusher_free(context->flusher);
+	close(context->epoll_fd);
+	free(context);
+}
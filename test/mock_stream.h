@@ -49,6 +49,7 @@ struct Stream* mock_stream_new() {
 		out->read_raw = mock_stream_read_raw;
 		out->write = mock_stream_write;
 		struct ConnectionContext* ctx = malloc(sizeof(struct ConnectionContext));
+		ctx->read_buffer = NULL;
 		ctx->session_context = (struct SessionContext*)malloc(sizeof(struct SessionContext));
 		ctx->session_context->default_stream = out;
 		out->stream_context = ctx;
@@ -66,5 +67,5 @@ void mock_stream_free(struct Stream* stream) {
 		free(ctx->session_context);
 		free(stream->stream_context);
 	}
-	free(stream);
+	libp2p_stream_free(stream);
 }
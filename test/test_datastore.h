@@ -0,0 +1,150 @@
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "libp2p/db/datastore.h"
+
+/***
+ * A datastore that holds a few records in memory, and counts how often it is asked for one
+ */
+struct MockDatastore {
+	struct DatastoreRecord* records[8];
+	int num_records;
+	int cursor;
+	int gets;
+	int fail_at; // the cursor stops here, as if the read failed. -1 to read everything
+};
+
+int mock_datastore_put(struct DatastoreRecord* record, const struct Datastore* datastore) {
+	struct MockDatastore* mock = (struct MockDatastore*)datastore->datastore_context;
+	struct DatastoreRecord* copy = libp2p_datastore_record_new();
+	copy->key = malloc(record->key_size);
+	memcpy(copy->key, record->key, record->key_size);
+	copy->key_size = record->key_size;
+	mock->records[mock->num_records++] = copy;
+	return 1;
+}
+
+int mock_datastore_get(const unsigned char* key, size_t key_size, struct DatastoreRecord** record, const struct Datastore* datastore) {
+	struct MockDatastore* mock = (struct MockDatastore*)datastore->datastore_context;
+	mock->gets++;
+	for(int i = 0; i < mock->num_records; i++) {
+		if (mock->records[i]->key_size == key_size && memcmp(mock->records[i]->key, key, key_size) == 0) {
+			*record = libp2p_datastore_record_new();
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int mock_datastore_cursor_open(struct Datastore* datastore) {
+	((struct MockDatastore*)datastore->datastore_context)->cursor = 0;
+	return 1;
+}
+
+int mock_datastore_cursor_close(struct Datastore* datastore) {
+	return 1;
+}
+
+int mock_datastore_cursor_get(unsigned char** key, int* key_length, unsigned char** value, int* value_length, enum DatastoreCursorOp op, struct Datastore* datastore) {
+	struct MockDatastore* mock = (struct MockDatastore*)datastore->datastore_context;
+	if (op == CURSOR_LAST)
+		mock->cursor = mock->num_records - 1;
+	if (mock->cursor < 0 || mock->cursor >= mock->num_records || mock->cursor == mock->fail_at)
+		return 0;
+	struct DatastoreRecord* record = mock->records[mock->cursor++];
+	*key = malloc(record->key_size);
+	memcpy(*key, record->key, record->key_size);
+	*key_length = record->key_size;
+	*value = NULL;
+	*value_length = 0;
+	return 1;
+}
+
+/***
+ * Keys that were never put should not reach the backing store
+ */
+int test_datastore_bloom_filter() {
+	int retVal = 0;
+	struct MockDatastore mock = { .num_records = 0, .cursor = 0, .gets = 0, .fail_at = -1 };
+	struct Datastore* datastore = NULL;
+	struct DatastoreRecord* record = NULL;
+	char key[32];
+
+	if (!libp2p_datastore_new(&datastore))
+		goto exit;
+	datastore->datastore_put = mock_datastore_put;
+	datastore->datastore_get = mock_datastore_get;
+	datastore->datastore_cursor_open = mock_datastore_cursor_open;
+	datastore->datastore_cursor_close = mock_datastore_cursor_close;
+	datastore->datastore_cursor_get = mock_datastore_cursor_get;
+	datastore->datastore_context = &mock;
+
+	// something already stored before the filter is built
+	record = libp2p_datastore_record_new();
+	record->key = malloc(6);
+	memcpy(record->key, "Stored", 6);
+	record->key_size = 6;
+	mock_datastore_put(record, datastore);
+	libp2p_datastore_record_free(record);
+	record = NULL;
+
+	datastore->bloom_filter_size = 1024;
+	if (!libp2p_datastore_bloom_filter_load(datastore) || datastore->bloom_filter == NULL) {
+		fprintf(stderr, "Unable to build the Bloom filter\n");
+		goto exit;
+	}
+	// and something stored after
+	record = libp2p_datastore_record_new();
+	record->key = malloc(3);
+	memcpy(record->key, "New", 3);
+	record->key_size = 3;
+	if (!libp2p_datastore_put(datastore, record))
+		goto exit;
+	libp2p_datastore_record_free(record);
+	// the owner of the datastore may put directly
+	record = libp2p_datastore_record_new();
+	record->key = malloc(6);
+	memcpy(record->key, "Direct", 6);
+	record->key_size = 6;
+	if (!datastore->datastore_put(record, datastore))
+		goto exit;
+
+	if (!libp2p_datastore_has(datastore, (unsigned char*)"Stored", 6) || !libp2p_datastore_has(datastore, (unsigned char*)"New", 3)
+			|| !libp2p_datastore_has(datastore, (unsigned char*)"Direct", 6)) {
+		fprintf(stderr, "Unable to find what was stored\n");
+		goto exit;
+	}
+	mock.gets = 0;
+	for(int i = 0; i < 100; i++) {
+		sprintf(key, "Missing%d", i);
+		if (libp2p_datastore_has(datastore, (unsigned char*)key, strlen(key))) {
+			fprintf(stderr, "Found %s, which was never stored\n", key);
+			goto exit;
+		}
+	}
+	// a few false positives would be fine, but not many
+	if (mock.gets > 5) {
+		fprintf(stderr, "The datastore was asked %d times about keys that are not there\n", mock.gets);
+		goto exit;
+	}
+
+	// a cursor that fails part way through leaves no filter
+	mock.fail_at = 1;
+	if (libp2p_datastore_bloom_filter_load(datastore) || datastore->bloom_filter != NULL || datastore->datastore_put != mock_datastore_put) {
+		fprintf(stderr, "A partial Bloom filter was kept\n");
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	libp2p_datastore_record_free(record);
+	for(int i = 0; i < mock.num_records; i++)
+		libp2p_datastore_record_free(mock.records[i]);
+	if (datastore != NULL) {
+		datastore->datastore_context = NULL;
+		libp2p_datastore_free(datastore);
+	}
+	return retVal;
+}
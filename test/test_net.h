@@ -1,5 +1,21 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include "libp2p/os/timespec.h"
+#include "libp2p/net/connectionstream.h"
+#include "libp2p/net/p2pnet.h"
+#include "libp2p/net/multistream.h"
 #include "libp2p/net/server.h"
+#include "libp2p/utils/vector.h"
+#include "libp2p/utils/slab.h"
+#include "libp2p/net/protocol.h"
 
 int test_net_server_startup_shutdown() {
 
@@ -8,3 +24,865 @@ int test_net_server_startup_shutdown() {
 	libp2p_net_server_stop();
 	return 1;
 }
+
+/***
+ * Ask the server for multistream on a raw socket
+ * @param socket the connected socket
+ * @returns true(1) if the server answered with the multistream header, false(0) otherwise
+ */
+int test_net_server_request_multistream(int socket) {
+	const char* protocol = "/multistream/1.0.0\n";
+	char buffer[64];
+	buffer[0] = strlen(protocol);
+	memcpy(&buffer[1], protocol, buffer[0]);
+	if (socket_write(socket, buffer, buffer[0] + 1, 0) != buffer[0] + 1)
+		return 0;
+	memset(buffer, 0, 64);
+	int bytes_read = 0;
+	while (bytes_read < (int)strlen(protocol) + 1) {
+		int retVal = socket_read(socket, &buffer[bytes_read], 64 - bytes_read, 0, 5);
+		if (retVal <= 0)
+			return 0;
+		bytes_read += retVal;
+	}
+	return strncmp(&buffer[1], protocol, strlen(protocol)) == 0;
+}
+
+/***
+ * Spread connections over several shards, and make sure the connection limit holds
+ */
+int test_net_server_sharded() {
+	int retVal = 0;
+	const int num_shards = 4;
+	const int max_connections = 2;
+	int sockets[num_shards * max_connections + 1];
+	int num_sockets = 0;
+
+	struct Libp2pVector* protocol_handlers = libp2p_utils_vector_new(1);
+	libp2p_utils_vector_add(protocol_handlers, libp2p_net_multistream_build_protocol_handler(protocol_handlers));
+
+	if (!libp2p_net_server_start_sharded("127.0.0.1", 1236, protocol_handlers, num_shards, max_connections)) {
+		fprintf(stderr, "Unable to start sharded server.\n");
+		libp2p_protocol_handlers_shutdown(protocol_handlers);
+		return 0;
+	}
+
+	// more connections than the shards will take
+	for(int i = 0; i < num_shards * max_connections + 1; i++) {
+		sockets[i] = socket_open4();
+		if (socket_connect4(sockets[i], hostname_to_ip("127.0.0.1"), 1236) != 0) {
+			fprintf(stderr, "Unable to connect socket %d.\n", i);
+			close(sockets[i]);
+			goto exit;
+		}
+		num_sockets++;
+	}
+
+	// the kernel decides which shard gets which connection, so some shard may have
+	// turned one away. Those have been closed.
+	int num_answered = 0;
+	for(int i = 0; i < num_sockets; i++) {
+		if (test_net_server_request_multistream(sockets[i]))
+			num_answered++;
+	}
+	if (num_answered == 0 || num_answered > num_shards * max_connections) {
+		fprintf(stderr, "Expected between 1 and %d answers, but received %d.\n", num_shards * max_connections, num_answered);
+		goto exit;
+	}
+
+	// hanging up frees the slot
+	for(int i = 0; i < num_sockets; i++)
+		close(sockets[i]);
+	num_sockets = 0;
+	sleep(1);
+	sockets[0] = socket_open4();
+	if (socket_connect4(sockets[0], hostname_to_ip("127.0.0.1"), 1236) != 0) {
+		close(sockets[0]);
+		goto exit;
+	}
+	num_sockets = 1;
+	if (!test_net_server_request_multistream(sockets[0])) {
+		fprintf(stderr, "Server did not answer after connections were closed.\n");
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	for(int i = 0; i < num_sockets; i++)
+		close(sockets[i]);
+	libp2p_net_server_stop();
+	libp2p_protocol_handlers_shutdown(protocol_handlers);
+	return retVal;
+}
+
+int test_net_slow_protocol_can_handle(const struct StreamMessage* msg) {
+	return 0;
+}
+
+int test_net_slow_protocol_handle_message(const struct StreamMessage* msg, struct Stream* stream, void* protocol_context) {
+	// a handler that takes its time, like a handshake with a slow peer
+	nanosleep(&(struct timespec){2, 0}, NULL);
+	return 0;
+}
+
+int test_net_slow_protocol_shutdown(void* context) {
+	return 1;
+}
+
+/***
+ * A slow handler on one connection should not hold up the other connections of its shard
+ */
+int test_net_server_shard_slow_handler() {
+	int retVal = 0;
+	int sockets[2] = { -1, -1 };
+	struct timespec start, end;
+
+	struct Libp2pVector* protocol_handlers = libp2p_utils_vector_new(1);
+	libp2p_utils_vector_add(protocol_handlers, libp2p_net_multistream_build_protocol_handler(protocol_handlers));
+	struct Libp2pProtocolHandler* slow = libp2p_protocol_handler_new();
+	slow->protocol_id = "/test/slow/1.0.0";
+	slow->CanHandle = test_net_slow_protocol_can_handle;
+	slow->HandleMessage = test_net_slow_protocol_handle_message;
+	slow->Shutdown = test_net_slow_protocol_shutdown;
+	libp2p_utils_vector_add(protocol_handlers, slow);
+
+	// one shard, so both connections share it
+	if (!libp2p_net_server_start_sharded("127.0.0.1", 1237, protocol_handlers, 1, 2)) {
+		fprintf(stderr, "Unable to start sharded server.\n");
+		libp2p_protocol_handlers_shutdown(protocol_handlers);
+		return 0;
+	}
+	for(int i = 0; i < 2; i++) {
+		sockets[i] = socket_open4();
+		if (socket_connect4(sockets[i], hostname_to_ip("127.0.0.1"), 1237) != 0) {
+			fprintf(stderr, "Unable to connect socket %d.\n", i);
+			goto exit;
+		}
+	}
+
+	const char* protocol = "/test/slow/1.0.0\n";
+	char buffer[32];
+	buffer[0] = strlen(protocol);
+	memcpy(&buffer[1], protocol, buffer[0]);
+	if (socket_write(sockets[0], buffer, buffer[0] + 1, 0) != buffer[0] + 1)
+		goto exit;
+	// give the shard time to start on it
+	nanosleep(&(struct timespec){0, 200000000}, NULL);
+
+	timespec_get(&start, TIME_UTC);
+	if (!test_net_server_request_multistream(sockets[1])) {
+		fprintf(stderr, "Server did not answer the second connection.\n");
+		goto exit;
+	}
+	timespec_get(&end, TIME_UTC);
+	long elapsed_ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+	if (elapsed_ms > 1000) {
+		fprintf(stderr, "The second connection waited %ldms for the slow one.\n", elapsed_ms);
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	for(int i = 0; i < 2; i++) {
+		if (sockets[i] >= 0)
+			close(sockets[i]);
+	}
+	libp2p_net_server_stop();
+	libp2p_protocol_handlers_shutdown(protocol_handlers);
+	return retVal;
+}
+
+/***
+ * Frames pulled through a connection's read buffer arrive whole and in order,
+ * whether they are smaller or larger than the buffer
+ */
+int test_net_connection_read_buffer() {
+	int retVal = 0;
+	int sockets[2];
+	struct Stream* stream = NULL;
+	const size_t big_size = 200000;
+	uint8_t* big = NULL;
+	uint8_t* results = NULL;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+		return 0;
+	stream = libp2p_net_connection_established(sockets[0], "127.0.0.1", 1, NULL);
+	big = malloc(big_size);
+	results = malloc(big_size);
+	if (stream == NULL || big == NULL || results == NULL)
+		goto exit;
+	for(size_t i = 0; i < big_size; i++)
+		big[i] = i % 251;
+
+	// several small frames sent at once
+	for(int i = 0; i < 100; i++) {
+		uint8_t frame[5] = { 0, 0, 0, 1, (uint8_t)i };
+		socket_write(sockets[1], (char*)frame, 5, 0);
+	}
+	for(int i = 0; i < 100; i++) {
+		uint8_t frame[5];
+		if (stream->read_raw(stream->stream_context, frame, 4, 5) != 4 || frame[3] != 1) {
+			fprintf(stderr, "Frame header %d was wrong.\n", i);
+			goto exit;
+		}
+		if (stream->read_raw(stream->stream_context, &frame[4], 1, 5) != 1 || frame[4] != i) {
+			fprintf(stderr, "Frame body %d was wrong.\n", i);
+			goto exit;
+		}
+	}
+
+	// a frame larger than the read buffer
+	if (fork() == 0) {
+		size_t written = 0;
+		while (written < big_size)
+			written += socket_write(sockets[1], (char*)&big[written], big_size - written, 0);
+		exit(0);
+	}
+	int num_read = stream->read_raw(stream->stream_context, results, big_size, 5);
+	wait(NULL);
+	if (num_read != big_size || memcmp(big, results, big_size) != 0) {
+		fprintf(stderr, "Large frame did not arrive intact.\n");
+		goto exit;
+	}
+
+	// what read hands back is whatever was waiting
+	socket_write(sockets[1], "abc", 3, 0);
+	struct StreamMessage* msg = NULL;
+	if (!stream->read(stream->stream_context, &msg, 5) || msg->data_size != 3 || memcmp(msg->data, "abc", 3) != 0) {
+		fprintf(stderr, "Read did not return the waiting bytes.\n");
+		libp2p_stream_message_free(msg);
+		goto exit;
+	}
+	libp2p_stream_message_free(msg);
+
+	retVal = 1;
+	exit:
+	if (stream != NULL) {
+		stream->close(stream);
+		libp2p_stream_free(stream);
+	} else {
+		close(sockets[0]);
+	}
+	close(sockets[1]);
+	free(big);
+	free(results);
+	return retVal;
+}
+
+/***
+ * A read with nothing to read should give up at its deadline, even a sub-second one
+ */
+int test_net_socket_read_deadline() {
+	int retVal = 0;
+	int sockets[2];
+	char buffer[16];
+	struct timespec deadline, start, end;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+		return 0;
+
+	timespec_get(&start, TIME_UTC);
+	if (socket_read_until(sockets[0], buffer, 16, 0, socket_deadline_after_ms(&deadline, 200)) != -1 || errno != EAGAIN) {
+		fprintf(stderr, "Expected a timeout.\n");
+		goto exit;
+	}
+	timespec_get(&end, TIME_UTC);
+	long elapsed_ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+	if (elapsed_ms < 190 || elapsed_ms > 900) {
+		fprintf(stderr, "Expected the read to take 200ms, but it took %ldms.\n", elapsed_ms);
+		goto exit;
+	}
+
+	// something waiting is read right away
+	socket_write(sockets[1], "abc", 3, 0);
+	if (socket_read_until(sockets[0], buffer, 16, 0, socket_deadline_after_ms(&deadline, 200)) != 3) {
+		fprintf(stderr, "Expected 3 bytes.\n");
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	close(sockets[0]);
+	close(sockets[1]);
+	return retVal;
+}
+
+/***
+ * Buffers handed to writev arrive as one, whether or not the stream has its own writev
+ */
+int test_net_connection_writev() {
+	int retVal = 0;
+	int sockets[2];
+	struct Stream* stream = NULL;
+	char results[32];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+		return 0;
+	stream = libp2p_net_connection_established(sockets[0], "127.0.0.1", 1, NULL);
+	if (stream == NULL)
+		goto exit;
+
+	struct iovec regions[3];
+	regions[0].iov_base = "head";
+	regions[0].iov_len = 4;
+	regions[1].iov_base = "-";
+	regions[1].iov_len = 1;
+	regions[2].iov_base = "payload";
+	regions[2].iov_len = 7;
+
+	// the connection's writev
+	if (libp2p_stream_writev(stream, regions, 3) != 12) {
+		fprintf(stderr, "writev did not write 12 bytes.\n");
+		goto exit;
+	}
+	memset(results, 0, 32);
+	if (socket_read(sockets[1], results, 32, 0, 5) != 12 || strcmp(results, "head-payload") != 0) {
+		fprintf(stderr, "Expected head-payload, but received %s.\n", results);
+		goto exit;
+	}
+
+	// a stream that only knows how to write
+	stream->writev = NULL;
+	if (libp2p_stream_writev(stream, regions, 3) != 12) {
+		fprintf(stderr, "writev without writev did not write 12 bytes.\n");
+		goto exit;
+	}
+	memset(results, 0, 32);
+	if (socket_read(sockets[1], results, 32, 0, 5) != 12 || strcmp(results, "head-payload") != 0) {
+		fprintf(stderr, "Expected head-payload, but received %s.\n", results);
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (stream != NULL) {
+		stream->close(stream);
+		libp2p_stream_free(stream);
+	} else {
+		close(sockets[0]);
+	}
+	close(sockets[1]);
+	return retVal;
+}
+
+/***
+ * Messages that share a buffer keep it alive until the last one is freed
+ */
+int test_net_stream_message_slice() {
+	int retVal = 0;
+	int sockets[2] = { -1, -1 };
+	struct Stream* stream = NULL;
+	struct StreamMessage* record = NULL;
+	struct StreamMessage* slice = NULL;
+	struct StreamMessage* copy = NULL;
+	struct StreamMessage* read = NULL;
+
+	record = libp2p_stream_message_new_buffer(12);
+	if (record == NULL)
+		goto exit;
+	memcpy(record->data, "head-payload", 12);
+	// the header has been parsed, so strip it
+	if (!libp2p_stream_message_strip(record, 5) || record->data_size != 7 || memcmp(record->data, "payload", 7) != 0) {
+		fprintf(stderr, "Strip did not leave the payload.\n");
+		goto exit;
+	}
+	slice = libp2p_stream_message_slice(record, 3, 4);
+	if (slice == NULL || slice->buffer != record->buffer || memcmp(slice->data, "load", 4) != 0) {
+		fprintf(stderr, "Slice does not share the record's buffer.\n");
+		goto exit;
+	}
+	// the slice outlives the record
+	libp2p_stream_message_free(record);
+	record = NULL;
+	if (memcmp(slice->data, "load", 4) != 0)
+		goto exit;
+
+	// a plain message is copied
+	copy = libp2p_stream_message_new();
+	copy->data = (uint8_t*) malloc(4);
+	memcpy(copy->data, "abcd", 4);
+	copy->data_size = 4;
+	if (!libp2p_stream_message_strip(copy, 1) || copy->data_size != 3 || memcmp(copy->data, "bcd", 3) != 0)
+		goto exit;
+	libp2p_stream_message_free(slice);
+	slice = libp2p_stream_message_slice(copy, 1, 2);
+	if (slice == NULL || slice->buffer == NULL || memcmp(slice->data, "cd", 2) != 0)
+		goto exit;
+
+	// a stream without read_slice falls back to read_raw
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+		goto exit;
+	stream = libp2p_net_connection_established(sockets[0], "127.0.0.1", 1, NULL);
+	if (stream == NULL)
+		goto exit;
+	if (write(sockets[1], "head-payload", 12) != 12)
+		goto exit;
+	if (!libp2p_stream_read_slice(stream, 12, &read, 5) || read->data_size != 12 || memcmp(read->data, "head-payload", 12) != 0) {
+		fprintf(stderr, "read_slice did not return head-payload.\n");
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	libp2p_stream_message_free(record);
+	libp2p_stream_message_free(slice);
+	libp2p_stream_message_free(copy);
+	libp2p_stream_message_free(read);
+	if (stream != NULL) {
+		stream->close(stream);
+		libp2p_stream_free(stream);
+	} else if (sockets[0] >= 0) {
+		close(sockets[0]);
+	}
+	if (sockets[1] >= 0)
+		close(sockets[1]);
+	return retVal;
+}
+
+/***
+ * Once the caches are warm, messages and streams stop going to malloc
+ */
+int test_net_stream_message_slab() {
+	struct SlabStats before;
+	struct SlabStats after;
+
+	for(int round = 0; round < 2; round++) {
+		libp2p_utils_slab_stats(&before);
+		for(int i = 0; i < 1000; i++) {
+			struct StreamMessage* msg = libp2p_stream_message_new_buffer(100 + i);
+			struct StreamMessage* slice = libp2p_stream_message_slice(msg, 0, 10);
+			struct Stream* stream = libp2p_stream_new();
+			if (msg == NULL || slice == NULL || stream == NULL)
+				return 0;
+			libp2p_stream_message_free(msg);
+			libp2p_stream_message_free(slice);
+			libp2p_stream_free(stream);
+		}
+		libp2p_utils_slab_stats(&after);
+	}
+	if (after.allocations - before.allocations != 3000 || after.frees - before.frees != 3000) {
+		fprintf(stderr, "Expected 3000 allocations and frees, but counted %d and %d.\n", (int)(after.allocations - before.allocations), (int)(after.frees - before.frees));
+		return 0;
+	}
+#if !defined(__SANITIZE_ADDRESS__)
+	if (after.system_allocations != before.system_allocations) {
+		fprintf(stderr, "Expected no mallocs the second time, but there were %d.\n", (int)(after.system_allocations - before.system_allocations));
+		return 0;
+	}
+#endif
+	return 1;
+}
+
+int test_net_protocol_calls = 0;
+
+int test_net_protocol_can_handle(const struct StreamMessage* msg) {
+	return 0;
+}
+
+int test_net_protocol_handle_message(const struct StreamMessage* msg, struct Stream* stream, void* protocol_context) {
+	test_net_protocol_calls++;
+	return 1;
+}
+
+int test_net_protocol_write(void* stream_context, struct StreamMessage* msg) {
+	return msg->data_size;
+}
+
+/***
+ * Protocols are found by id, and the one that was negotiated gets the rest of the messages
+ */
+int test_net_protocol_marshal() {
+	int retVal = 0;
+	char ids[100][32];
+	struct Libp2pVector* handlers = libp2p_utils_vector_new(1);
+	struct Stream* stream = libp2p_stream_new();
+	stream->write = test_net_protocol_write;
+
+	for(int i = 0; i < 100; i++) {
+		sprintf(ids[i], "/test/%d/1.0.0", i);
+		struct Libp2pProtocolHandler* handler = libp2p_protocol_handler_new();
+		handler->protocol_id = ids[i];
+		handler->CanHandle = test_net_protocol_can_handle;
+		handler->HandleMessage = test_net_protocol_handle_message;
+		libp2p_utils_vector_add(handlers, handler);
+	}
+	const struct Libp2pProtocolHandler* expected = libp2p_utils_vector_get(handlers, 42);
+
+	struct StreamMessage msg;
+	msg.buffer = NULL;
+	msg.error_number = 0;
+	msg.data = (uint8_t*)"/test/42/1.0.0\n";
+	msg.data_size = strlen((char*)msg.data);
+	if (libp2p_protocol_marshal(&msg, stream, handlers) != 1 || stream->protocol_handler != expected) {
+		fprintf(stderr, "/test/42/1.0.0 was not bound to the stream.\n");
+		goto exit;
+	}
+	// not a protocol id, so it goes to the one that was negotiated
+	msg.data = (uint8_t*)"\x08\x01 some data";
+	msg.data_size = 12;
+	if (libp2p_protocol_marshal(&msg, stream, handlers) != 1 || test_net_protocol_calls != 2) {
+		fprintf(stderr, "Data did not go to the bound protocol.\n");
+		goto exit;
+	}
+	// a protocol that isn't there gets "na", even with a protocol bound to the stream
+	msg.data = (uint8_t*)"/test/100/1.0.0\n";
+	msg.data_size = strlen((char*)msg.data);
+	if (libp2p_protocol_marshal(&msg, stream, handlers) != -1 || msg.error_number != 100 || test_net_protocol_calls != 2) {
+		fprintf(stderr, "/test/100/1.0.0 should not have been found.\n");
+		goto exit;
+	}
+	// until it is added
+	struct Libp2pProtocolHandler* added = libp2p_protocol_handler_new();
+	added->protocol_id = "/test/100/1.0.0";
+	added->CanHandle = test_net_protocol_can_handle;
+	added->HandleMessage = test_net_protocol_handle_message;
+	libp2p_utils_vector_add(handlers, added);
+	if (libp2p_protocol_get_handler(handlers, "/test/100/1.0.0\n") != added) {
+		fprintf(stderr, "/test/100/1.0.0 was not found after it was added.\n");
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	for(int i = 0; i < handlers->total; i++)
+		libp2p_protocol_handler_free((struct Libp2pProtocolHandler*)libp2p_utils_vector_get(handlers, i));
+	libp2p_utils_vector_free(handlers);
+	libp2p_stream_free(stream);
+	return retVal;
+}
+
+/***
+ * Holds the read side of a stream in a read that times out
+ * @param args the stream
+ * @returns NULL
+ */
+void* test_net_idle_reader(void* args) {
+	struct Stream* stream = (struct Stream*)args;
+	struct StreamMessage* msg = NULL;
+	libp2p_stream_lock(stream);
+	stream->read(stream->stream_context, &msg, 2);
+	libp2p_stream_unlock(stream);
+	libp2p_stream_message_free(msg);
+	return NULL;
+}
+
+/***
+ * A reader waiting on an idle connection does not hold up a writer
+ */
+int test_net_read_does_not_block_write() {
+	int retVal = 0;
+	int sockets[2];
+	char results[16];
+	pthread_t reader;
+	struct timespec start, end;
+	struct Stream* stream = NULL;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+		return 0;
+	stream = libp2p_net_connection_established(sockets[0], "127.0.0.1", 1, NULL);
+	if (stream == NULL)
+		goto exit;
+	pthread_create(&reader, NULL, test_net_idle_reader, stream);
+	nanosleep(&(struct timespec){ 0, 200000000 }, NULL);
+
+	struct iovec region;
+	region.iov_base = "reply";
+	region.iov_len = 5;
+	timespec_get(&start, TIME_UTC);
+	int written = libp2p_stream_writev(stream, &region, 1);
+	timespec_get(&end, TIME_UTC);
+	long elapsed_ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+	pthread_join(reader, NULL);
+	if (written != 5 || elapsed_ms > 500) {
+		fprintf(stderr, "Write of %d bytes took %ldms while a read was waiting.\n", written, elapsed_ms);
+		goto exit;
+	}
+	memset(results, 0, 16);
+	if (socket_read(sockets[1], results, 16, 0, 5) != 5 || strcmp(results, "reply") != 0)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	if (stream != NULL) {
+		stream->close(stream);
+		libp2p_stream_free(stream);
+	} else {
+		close(sockets[0]);
+	}
+	close(sockets[1]);
+	return retVal;
+}
+
+struct test_net_write_queue_args {
+	struct Stream* stream;
+	uint8_t* buffer;
+	size_t buffer_size;
+	int written;
+};
+
+void* test_net_write_queue_writer(void* data) {
+	struct test_net_write_queue_args* args = (struct test_net_write_queue_args*)data;
+	struct iovec region;
+	region.iov_base = args->buffer;
+	region.iov_len = args->buffer_size;
+	args->written = libp2p_stream_writev(args->stream, &region, 1);
+	return NULL;
+}
+
+struct test_net_trickle_args {
+	int socket;
+	uint8_t* results;
+	size_t total;
+	int stop;
+};
+
+/***
+ * Read a little at a time, so the writer keeps making progress, but the queue stays full
+ */
+void* test_net_trickle_reader(void* data) {
+	struct test_net_trickle_args* args = (struct test_net_trickle_args*)data;
+	while (!__atomic_load_n(&args->stop, __ATOMIC_ACQUIRE)) {
+		int bytes = socket_read(args->socket, (char*)&args->results[args->total], 32 * 1024, 0, 5);
+		if (bytes <= 0)
+			break;
+		args->total += bytes;
+		nanosleep(&(struct timespec){ 0, 200000000 }, NULL);
+	}
+	return NULL;
+}
+
+/***
+ * A peer that reads slowly should hold writers back, and nothing should be lost
+ */
+int test_net_connection_write_queue() {
+	int retVal = 0;
+	int sockets[2];
+	int thread_started = 0;
+	pthread_t writer;
+	struct test_net_write_queue_args args;
+	uint8_t* results = NULL;
+	memset(&args, 0, sizeof(args));
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+		return 0;
+	args.stream = libp2p_net_connection_established(sockets[0], "127.0.0.1", 1, NULL);
+	if (args.stream == NULL)
+		goto exit;
+	libp2p_net_connection_set_write_high_water(args.stream, 4096);
+	// more than the socket buffers will hold
+	args.buffer_size = 4 * 1024 * 1024;
+	args.buffer = (uint8_t*) malloc(args.buffer_size);
+	results = (uint8_t*) malloc(args.buffer_size);
+	if (args.buffer == NULL || results == NULL)
+		goto exit;
+	for(size_t i = 0; i < args.buffer_size; i++)
+		args.buffer[i] = i % 251;
+
+	if (pthread_create(&writer, NULL, test_net_write_queue_writer, &args) != 0)
+		goto exit;
+	thread_started = 1;
+	// give the writer time to fill the socket and queue the rest
+	nanosleep(&(struct timespec){ 0, 200000000 }, NULL);
+
+	// the queue stays over the high water mark, so this should be refused
+	struct test_net_trickle_args trickle;
+	trickle.socket = sockets[1];
+	trickle.results = results;
+	trickle.total = 0;
+	trickle.stop = 0;
+	pthread_t trickle_reader;
+	if (pthread_create(&trickle_reader, NULL, test_net_trickle_reader, &trickle) != 0)
+		goto exit;
+	struct iovec region;
+	region.iov_base = "x";
+	region.iov_len = 1;
+	int refused = (libp2p_stream_writev(args.stream, &region, 1) == -1 && errno == EAGAIN);
+	__atomic_store_n(&trickle.stop, 1, __ATOMIC_RELEASE);
+	pthread_join(trickle_reader, NULL);
+	if (!refused) {
+		fprintf(stderr, "Expected backpressure from a full write queue.\n");
+		goto exit;
+	}
+
+	// now drain it
+	size_t total = trickle.total;
+	while (total < args.buffer_size) {
+		int bytes = socket_read(sockets[1], (char*)&results[total], args.buffer_size - total, 0, 5);
+		if (bytes <= 0) {
+			fprintf(stderr, "Only received %d of %d bytes.\n", (int)total, (int)args.buffer_size);
+			goto exit;
+		}
+		total += bytes;
+	}
+	pthread_join(writer, NULL);
+	thread_started = 0;
+	if (args.written != (int)args.buffer_size || memcmp(args.buffer, results, args.buffer_size) != 0) {
+		fprintf(stderr, "Queued write was not delivered intact.\n");
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (thread_started) {
+		// unblock the writer
+		shutdown(sockets[1], SHUT_RDWR);
+		pthread_join(writer, NULL);
+	}
+	if (args.stream != NULL) {
+		args.stream->close(args.stream);
+		libp2p_stream_free(args.stream);
+	} else {
+		close(sockets[0]);
+	}
+	close(sockets[1]);
+	free(args.buffer);
+	free(results);
+	return retVal;
+}
+
+/***
+ * A peer that stops reading should fail the writer that is flushing, not hold it forever
+ */
+int test_net_connection_write_stall() {
+	int retVal = 0;
+	int sockets[2];
+	struct test_net_write_queue_args args;
+	memset(&args, 0, sizeof(args));
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+		return 0;
+	args.stream = libp2p_net_connection_established(sockets[0], "127.0.0.1", 1, NULL);
+	if (args.stream == NULL)
+		goto exit;
+	args.buffer_size = 4 * 1024 * 1024;
+	args.buffer = (uint8_t*) calloc(1, args.buffer_size);
+	if (args.buffer == NULL)
+		goto exit;
+
+	// nobody reads sockets[1], so this one becomes the flusher and should give up
+	time_t start = time(NULL);
+	test_net_write_queue_writer(&args);
+	if (args.written != -1) {
+		fprintf(stderr, "Expected the write to fail, but it returned %d.\n", args.written);
+		goto exit;
+	}
+	if (time(NULL) - start > 10) {
+		fprintf(stderr, "The flush took %d seconds to give up.\n", (int)(time(NULL) - start));
+		goto exit;
+	}
+	// and the connection should not take anything else
+	struct iovec region;
+	region.iov_base = "x";
+	region.iov_len = 1;
+	if (libp2p_stream_writev(args.stream, &region, 1) != -1) {
+		fprintf(stderr, "A failed connection took another write.\n");
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (args.stream != NULL) {
+		args.stream->close(args.stream);
+		libp2p_stream_free(args.stream);
+	} else {
+		close(sockets[0]);
+	}
+	close(sockets[1]);
+	free(args.buffer);
+	return retVal;
+}
+
+/***
+ * With a flusher, a writer queues what the socket can't take and goes on its way, and is
+ * told right away when too much is queued. The flusher sends it as the peer reads.
+ */
+int test_net_connection_flusher() {
+	int retVal = 0;
+	int sockets[2];
+	struct Stream* stream = NULL;
+	struct ConnectionFlusher* flusher = NULL;
+	const size_t buffer_size = 4 * 1024 * 1024;
+	uint8_t* buffer = (uint8_t*) malloc(buffer_size);
+	uint8_t* results = (uint8_t*) malloc(buffer_size);
+	struct timespec start, end;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) {
+		free(buffer);
+		free(results);
+		return 0;
+	}
+	stream = libp2p_net_connection_established(sockets[0], "127.0.0.1", 1, NULL);
+	flusher = libp2p_net_connection_flusher_new();
+	if (stream == NULL || flusher == NULL || buffer == NULL || results == NULL)
+		goto exit;
+	libp2p_net_connection_set_write_high_water(stream, 65536);
+	if (!libp2p_net_connection_flusher_attach(flusher, stream)) {
+		fprintf(stderr, "Unable to attach the flusher.\n");
+		goto exit;
+	}
+	for(size_t i = 0; i < buffer_size; i++)
+		buffer[i] = i % 251;
+
+	// nobody is reading yet, and neither write waits for them
+	timespec_get(&start, TIME_UTC);
+	struct iovec region;
+	region.iov_base = buffer;
+	region.iov_len = buffer_size;
+	if (libp2p_stream_writev(stream, &region, 1) != (int)buffer_size) {
+		fprintf(stderr, "Expected the write to be queued.\n");
+		goto exit;
+	}
+	region.iov_base = "x";
+	region.iov_len = 1;
+	if (libp2p_stream_writev(stream, &region, 1) != -1 || errno != EAGAIN) {
+		fprintf(stderr, "Expected backpressure from a full write queue.\n");
+		goto exit;
+	}
+	timespec_get(&end, TIME_UTC);
+	long elapsed_ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+	if (elapsed_ms > 500) {
+		fprintf(stderr, "The writers waited %ldms.\n", elapsed_ms);
+		goto exit;
+	}
+
+	// the way an event loop would run it
+	size_t total = 0;
+	time_t give_up = time(NULL) + 10;
+	while (total < buffer_size && time(NULL) < give_up) {
+		struct pollfd poll_fd;
+		poll_fd.fd = libp2p_net_connection_flusher_fd(flusher);
+		poll_fd.events = POLLIN;
+		poll_fd.revents = 0;
+		if (poll(&poll_fd, 1, 100) > 0)
+			libp2p_net_connection_flusher_run(flusher);
+		int bytes = recv(sockets[1], &results[total], buffer_size - total, MSG_DONTWAIT);
+		if (bytes > 0)
+			total += bytes;
+		else if (bytes == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			break;
+	}
+	if (total != buffer_size || memcmp(buffer, results, buffer_size) != 0) {
+		fprintf(stderr, "Only received %d of %d bytes, or they were wrong.\n", (int)total, (int)buffer_size);
+		goto exit;
+	}
+	// and there is room again
+	if (libp2p_stream_writev(stream, &region, 1) != 1) {
+		fprintf(stderr, "The connection did not take more after the queue drained.\n");
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	// the connection outlives its flusher
+	libp2p_net_connection_flusher_free(flusher);
+	if (stream != NULL) {
+		stream->close(stream);
+		libp2p_stream_free(stream);
+	} else {
+		close(sockets[0]);
+	}
+	close(sockets[1]);
+	free(buffer);
+	free(results);
+	return retVal;
+}
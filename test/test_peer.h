@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include "libp2p/peer/peer.h"
 #include "libp2p/peer/peerstore.h"
+#include "libp2p/peer/providerstore.h"
 
 /***
  * Includes Libp2pPeer, PeerEntry, Peerstore
@@ -79,6 +80,154 @@ int test_peerstore() {
 	return retVal;
 }
 
+/***
+ * Many peers, so the index has to grow, and adding one twice should not duplicate it
+ */
+int test_peerstore_many() {
+	int retVal = 0;
+	char id[32];
+	struct Libp2pPeer* peer = libp2p_peer_new();
+	peer->id = malloc(10);
+	strcpy(peer->id, "Qmabcdefg");
+	peer->id_size = strlen(peer->id);
+	struct Peerstore* peerstore = libp2p_peerstore_new(peer);
+	if (peerstore == NULL)
+		goto exit;
+
+	for(int i = 0; i < 1000; i++) {
+		struct Libp2pPeer* current = libp2p_peer_new();
+		sprintf(id, "QmPeer%d", i);
+		current->id = malloc(strlen(id) + 1);
+		strcpy(current->id, id);
+		current->id_size = strlen(id);
+		int added = libp2p_peerstore_add_peer(peerstore, current);
+		// a second time should be a no-op
+		added = added && libp2p_peerstore_add_peer(peerstore, current);
+		libp2p_peer_free(current);
+		if (!added) {
+			fprintf(stderr, "Unable to add peer %d\n", i);
+			goto exit;
+		}
+	}
+
+	for(int i = 0; i < 1000; i++) {
+		sprintf(id, "QmPeer%d", i);
+		struct Libp2pPeer* found = libp2p_peerstore_get_peer(peerstore, (unsigned char*)id, strlen(id));
+		if (found == NULL || found->id_size != strlen(id) || memcmp(found->id, id, found->id_size) != 0) {
+			fprintf(stderr, "Unable to find peer %d\n", i);
+			goto exit;
+		}
+	}
+	if (libp2p_peerstore_get_peer(peerstore, (unsigned char*)"QmPeer1000", 10) != NULL) {
+		fprintf(stderr, "Found a peer that was never added\n");
+		goto exit;
+	}
+
+	// the list should have each peer once, with the local peer first
+	int count = 0;
+	for(struct Libp2pLinkedList* current = peerstore->head_entry; current != NULL; current = current->next)
+		count++;
+	if (count != 1001) {
+		fprintf(stderr, "Expected 1001 entries, but there were %d\n", count);
+		goto exit;
+	}
+	struct Libp2pPeer* local = libp2p_peerstore_get_local_peer(peerstore);
+	if (local == NULL || local->id_size != 9 || memcmp(local->id, "Qmabcdefg", 9) != 0) {
+		fprintf(stderr, "The local peer should be first\n");
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (peerstore != NULL)
+		libp2p_peerstore_free(peerstore);
+	libp2p_peer_free(peer);
+	return retVal;
+}
+
+/***
+ * Providers are deduplicated, capped per hash, and expire
+ */
+int test_providerstore() {
+	int retVal = 0;
+	char peer_id[32];
+	unsigned char* peer_ids[PROVIDERSTORE_MAX_PROVIDERS];
+	int peer_id_sizes[PROVIDERSTORE_MAX_PROVIDERS];
+	int num_found = 0;
+	struct ProviderStore* store = libp2p_providerstore_new(NULL, NULL);
+	if (store == NULL)
+		goto exit;
+
+	// more than the store keeps for one hash, each of them twice
+	for(int i = 0; i < PROVIDERSTORE_MAX_PROVIDERS + 5; i++) {
+		sprintf(peer_id, "QmProvider%d", i);
+		for(int j = 0; j < 2; j++) {
+			if (!libp2p_providerstore_add(store, (unsigned char*)"hash1", 5, (unsigned char*)peer_id, strlen(peer_id))) {
+				fprintf(stderr, "Unable to add provider %d\n", i);
+				goto exit;
+			}
+		}
+	}
+	if (!libp2p_providerstore_add(store, (unsigned char*)"hash2", 5, (unsigned char*)"QmProvider0", 11))
+		goto exit;
+	if (store->num_keys != 2 || store->num_records != PROVIDERSTORE_MAX_PROVIDERS + 1) {
+		fprintf(stderr, "Expected 2 keys and %d records, but there were %d and %d\n", PROVIDERSTORE_MAX_PROVIDERS + 1, (int)store->num_keys, (int)store->num_records);
+		goto exit;
+	}
+
+	num_found = libp2p_providerstore_get_providers(store, (unsigned char*)"hash1", 5, peer_ids, peer_id_sizes, PROVIDERSTORE_MAX_PROVIDERS);
+	if (num_found != PROVIDERSTORE_MAX_PROVIDERS) {
+		fprintf(stderr, "Expected %d providers, but found %d\n", PROVIDERSTORE_MAX_PROVIDERS, num_found);
+		goto exit;
+	}
+	for(int i = 0; i < num_found; i++) {
+		if (peer_id_sizes[i] < 11 || memcmp(peer_ids[i], "QmProvider", 10) != 0) {
+			fprintf(stderr, "Provider %d is wrong\n", i);
+			goto exit;
+		}
+	}
+	if (libp2p_providerstore_get_providers(store, (unsigned char*)"hash3", 5, peer_ids + num_found, peer_id_sizes, 0) != 0)
+		goto exit;
+
+	// nothing has expired yet
+	if (libp2p_providerstore_sweep(store, time(NULL)) != 0) {
+		fprintf(stderr, "Sweep removed providers that had not expired\n");
+		goto exit;
+	}
+	if (libp2p_providerstore_sweep(store, time(NULL) + PROVIDERSTORE_DEFAULT_TTL + 1) != PROVIDERSTORE_MAX_PROVIDERS + 1 || store->num_keys != 0) {
+		fprintf(stderr, "Sweep did not remove expired providers\n");
+		goto exit;
+	}
+
+	// when a sweep comes due, each request only does a few buckets of it
+	store->record_ttl = 0;
+	for(int i = 0; i < 1000; i++) {
+		sprintf(peer_id, "hash%d", i);
+		if (!libp2p_providerstore_add(store, (unsigned char*)peer_id, strlen(peer_id), (unsigned char*)"QmProvider0", 11))
+			goto exit;
+	}
+	store->last_sweep = time(NULL) - PROVIDERSTORE_SWEEP_INTERVAL;
+	if (!libp2p_providerstore_add(store, (unsigned char*)"hash1", 5, (unsigned char*)"QmProvider0", 11))
+		goto exit;
+	if (store->sweep_bucket != PROVIDERSTORE_SWEEP_BUCKETS || store->num_keys > 1000 || store->num_keys < 500) {
+		fprintf(stderr, "Expected part of a sweep, but it is at bucket %d with %d keys left\n", (int)store->sweep_bucket, (int)store->num_keys);
+		goto exit;
+	}
+	// and the rest of it
+	libp2p_providerstore_sweep(store, time(NULL) + 1);
+	if (store->sweep_bucket != 0 || store->num_keys != 0) {
+		fprintf(stderr, "Expected a whole sweep, but %d keys are left\n", (int)store->num_keys);
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	for(int i = 0; i < num_found; i++)
+		free(peer_ids[i]);
+	libp2p_providerstore_free(store);
+	return retVal;
+}
+
 int test_peer_protobuf() {
 	int retVal = 0;
 	struct Libp2pPeer *peer = NULL, *peer_result = NULL;
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "libp2p/crypto/sha256.h"
+#include "libp2p/peer/peerstore.h"
+#include "libp2p/routing/routing_table.h"
+
+/***
+ * The distance from a peer to a key, as the routing table sees it
+ */
+void test_routing_distance(const struct Libp2pPeer* peer, const uint8_t* target, uint8_t* distance) {
+	uint8_t key[ROUTING_TABLE_KEY_SIZE];
+	libp2p_crypto_hashing_sha256((unsigned char*)peer->id, peer->id_size, key);
+	for(int i = 0; i < ROUTING_TABLE_KEY_SIZE; i++)
+		distance[i] = key[i] ^ target[i];
+}
+
+/***
+ * The nearest peers should be the closest of all the peers in the table, in order
+ */
+int test_routing_table_nearest() {
+	int retVal = 0;
+	char id[32];
+	struct Libp2pPeer* nearest[ROUTING_TABLE_BUCKET_SIZE];
+	uint8_t target[ROUTING_TABLE_KEY_SIZE];
+	uint8_t distance[ROUTING_TABLE_KEY_SIZE];
+	uint8_t last_distance[ROUTING_TABLE_KEY_SIZE];
+	struct Libp2pPeer* local = libp2p_peer_new();
+	local->id = malloc(10);
+	strcpy(local->id, "Qmabcdefg");
+	local->id_size = strlen(local->id);
+	struct Peerstore* peerstore = libp2p_peerstore_new(local);
+	if (peerstore == NULL || peerstore->routing_table == NULL)
+		goto exit;
+
+	for(int i = 0; i < 500; i++) {
+		struct Libp2pPeer* peer = libp2p_peer_new();
+		sprintf(id, "QmPeer%d", i);
+		peer->id = malloc(strlen(id) + 1);
+		strcpy(peer->id, id);
+		peer->id_size = strlen(id);
+		libp2p_peerstore_add_peer(peerstore, peer);
+		libp2p_peer_free(peer);
+	}
+	// buckets far from us fill up, so not everyone gets in
+	struct RoutingTable* table = peerstore->routing_table;
+	if (table->num_peers == 0 || table->num_peers >= 500) {
+		fprintf(stderr, "Unexpected number of peers in the table: %d\n", table->num_peers);
+		goto exit;
+	}
+
+	int num_nearest = libp2p_routing_table_nearest(table, (unsigned char*)"SomeKey", 7, nearest, ROUTING_TABLE_BUCKET_SIZE);
+	if (num_nearest != ROUTING_TABLE_BUCKET_SIZE) {
+		fprintf(stderr, "Expected %d peers, but found %d\n", ROUTING_TABLE_BUCKET_SIZE, num_nearest);
+		goto exit;
+	}
+	libp2p_crypto_hashing_sha256((unsigned char*)"SomeKey", 7, target);
+	// closest first
+	for(int i = 0; i < num_nearest; i++) {
+		test_routing_distance(nearest[i], target, distance);
+		if (i > 0 && memcmp(last_distance, distance, ROUTING_TABLE_KEY_SIZE) >= 0) {
+			fprintf(stderr, "Peer %d is out of order\n", i);
+			goto exit;
+		}
+		memcpy(last_distance, distance, ROUTING_TABLE_KEY_SIZE);
+	}
+	// and nobody else in the table is closer than the last of them
+	int found = 0;
+	for(int b = 0; b < ROUTING_TABLE_NUM_BUCKETS; b++) {
+		if (table->buckets[b] == NULL)
+			continue;
+		for(int i = 0; i < table->buckets[b]->count; i++) {
+			struct Libp2pPeer* peer = table->buckets[b]->entries[i].peer;
+			test_routing_distance(peer, target, distance);
+			if (memcmp(distance, last_distance, ROUTING_TABLE_KEY_SIZE) <= 0)
+				found++;
+		}
+	}
+	if (found != num_nearest) {
+		fprintf(stderr, "Expected %d peers at least as close as the last, but there were %d\n", num_nearest, found);
+		goto exit;
+	}
+
+	// once removed, it is not offered again
+	if (!libp2p_routing_table_remove(table, (unsigned char*)nearest[0]->id, nearest[0]->id_size))
+		goto exit;
+	struct Libp2pPeer* removed = nearest[0];
+	libp2p_routing_table_nearest(table, (unsigned char*)"SomeKey", 7, nearest, ROUTING_TABLE_BUCKET_SIZE);
+	if (nearest[0] == removed) {
+		fprintf(stderr, "A removed peer was still returned\n");
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	libp2p_peerstore_free(peerstore);
+	libp2p_peer_free(local);
+	return retVal;
+}
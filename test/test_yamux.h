@@ -1,4 +1,5 @@
 #pragma once
+#include <pthread.h>
 #include "libp2p/yamux/yamux.h"
 #include "libp2p/identify/identify.h"
 #include "mock_stream.h"
@@ -121,6 +122,680 @@ int test_yamux_stream_new() {
 	return retVal;
 }
 
+/***
+ * The session's stream table should find streams by id, grow, and reuse slots
+ */
+int test_yamux_stream_table() {
+	int retVal = 0;
+	const int num_streams = 5000;
+	struct Stream* mock_stream = mock_stream_new();
+	struct yamux_session* session = yamux_session_new(NULL, mock_stream, yamux_session_client, NULL);
+	if (session == NULL)
+		goto exit;
+
+	// many more than the backlog
+	for(int i = 0; i < num_streams; i++) {
+		struct yamux_stream* stream = yamux_stream_new();
+		stream->id = i * 2 + 1;
+		stream->session = session;
+		if (yamux_session_add_stream(session, stream) == NULL) {
+			fprintf(stderr, "Unable to add stream %d.\n", stream->id);
+			yamux_stream_free(stream);
+			goto exit;
+		}
+	}
+	// no duplicates
+	struct yamux_stream duplicate;
+	memset(&duplicate, 0, sizeof(struct yamux_stream));
+	duplicate.id = 1;
+	if (yamux_session_add_stream(session, &duplicate) != NULL) {
+		fprintf(stderr, "Added stream 1 twice.\n");
+		goto exit;
+	}
+	// close every other one
+	for(int i = 0; i < num_streams; i += 2) {
+		struct yamux_session_stream* ss = yamux_get_session_stream(session, i * 2 + 1);
+		if (ss == NULL) {
+			fprintf(stderr, "Unable to find stream %d.\n", i * 2 + 1);
+			goto exit;
+		}
+		yamux_stream_free(ss->stream);
+	}
+	for(int i = 0; i < num_streams; i++) {
+		struct yamux_session_stream* ss = yamux_get_session_stream(session, i * 2 + 1);
+		if ( (i % 2 == 0 && ss != NULL) || (i % 2 == 1 && (ss == NULL || ss->stream->id != i * 2 + 1)) ) {
+			fprintf(stderr, "Stream %d was not where it should be.\n", i * 2 + 1);
+			goto exit;
+		}
+	}
+	if (session->num_streams != num_streams / 2) {
+		fprintf(stderr, "Expected %d streams, but there are %d.\n", num_streams / 2, (int)session->num_streams);
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (session != NULL) {
+		session->closed = 1;
+		yamux_session_free(session);
+	}
+	mock_stream->close(mock_stream);
+	return retVal;
+}
+
+struct yamux_frame test_yamux_window_frames[4];
+int test_yamux_window_num_frames = 0;
+
+/***
+ * Remember the frames yamux sends
+ */
+int test_yamux_window_write(void* context, struct StreamMessage* msg) {
+	if (msg->data_size >= sizeof(struct yamux_frame) && test_yamux_window_num_frames < 4) {
+		struct yamux_frame* frame = &test_yamux_window_frames[test_yamux_window_num_frames++];
+		memcpy(frame, msg->data, sizeof(struct yamux_frame));
+		decode_frame(frame);
+	}
+	return msg->data_size;
+}
+
+/***
+ * Senders should respect the window, and readers should open (and grow) it as they read
+ */
+int test_yamux_window() {
+	int retVal = 0;
+	const char* yamux_id = "/yamux/1.0.0\n";
+	struct Stream* mock_stream = mock_stream_new();
+	mock_message = build_message(yamux_id);
+	struct Stream* yamux_stream = libp2p_yamux_stream_new(mock_stream, 0, NULL);
+	if (yamux_stream == NULL)
+		goto exit;
+	mock_stream->write = test_yamux_window_write;
+	struct YamuxContext* ctx = (struct YamuxContext*)yamux_stream->stream_context;
+	ctx->state = yamux_stream_est;
+	struct Stream* channel_stream = yamux_channel_new(ctx, 0, NULL);
+	if (channel_stream == NULL)
+		goto exit;
+	struct YamuxChannelContext* channel = (struct YamuxChannelContext*)channel_stream->stream_context;
+	channel->state = yamux_stream_est;
+
+	// sending: we can't have more than the window
+	if (yamux_stream_reserve_window(channel, YAMUX_DEFAULT_WINDOW + 10) != YAMUX_DEFAULT_WINDOW) {
+		fprintf(stderr, "Should have been given the default window.\n");
+		goto exit;
+	}
+	// the remote opens it a bit
+	struct yamux_frame update;
+	memset(&update, 0, sizeof(struct yamux_frame));
+	update.version = YAMUX_VERSION;
+	update.type = yamux_frame_window_update;
+	update.streamid = channel->channel;
+	update.length = 1000;
+	encode_frame(&update);
+	if (yamux_decode(ctx, (uint8_t*)&update, sizeof(struct yamux_frame), NULL) < 0)
+		goto exit;
+	if (yamux_stream_reserve_window(channel, 5000) != 1000) {
+		fprintf(stderr, "Should have been given what the window update allowed.\n");
+		goto exit;
+	}
+	// a channel the session doesn't know about has no window
+	struct YamuxChannelContext unregistered = *channel;
+	unregistered.channel = 12345;
+	if (yamux_stream_reserve_window(&unregistered, 10) != 0) {
+		fprintf(stderr, "A channel that is not registered should not be able to send.\n");
+		goto exit;
+	}
+
+	// receiving: reading half the window should send an update, and a ping to learn the round trip time
+	test_yamux_window_num_frames = 0;
+	yamux_stream_consumed(channel, YAMUX_DEFAULT_WINDOW / 2);
+	if (test_yamux_window_num_frames != 2
+			|| test_yamux_window_frames[0].type != yamux_frame_window_update
+			|| test_yamux_window_frames[0].length != YAMUX_DEFAULT_WINDOW / 2
+			|| test_yamux_window_frames[1].type != yamux_frame_ping) {
+		fprintf(stderr, "Expected a window update and a ping.\n");
+		goto exit;
+	}
+	// a far away peer, and the window was used up quickly, so it should grow
+	ctx->session->rtt_usecs = 1000000;
+	test_yamux_window_num_frames = 0;
+	yamux_stream_consumed(channel, YAMUX_DEFAULT_WINDOW / 2);
+	if (test_yamux_window_num_frames != 1
+			|| test_yamux_window_frames[0].length != YAMUX_DEFAULT_WINDOW / 2 + YAMUX_DEFAULT_WINDOW
+			|| channel->receive_window != YAMUX_DEFAULT_WINDOW * 2
+			|| ctx->session->window_growth != YAMUX_DEFAULT_WINDOW) {
+		fprintf(stderr, "Expected the window to grow to %d, but it is %d.\n", YAMUX_DEFAULT_WINDOW * 2, channel->receive_window);
+		goto exit;
+	}
+	// everything given back can be sent
+	if (channel->receive_remaining != YAMUX_DEFAULT_WINDOW * 3) {
+		fprintf(stderr, "Expected the remote to have %d bytes left, but it has %d.\n", YAMUX_DEFAULT_WINDOW * 3, channel->receive_remaining);
+		goto exit;
+	}
+	// and the session gets it back when the channel goes away
+	yamux_stream_release_window(channel);
+	if (ctx->session->window_growth != 0) {
+		fprintf(stderr, "The window growth was not released.\n");
+		goto exit;
+	}
+	// a remote that sends more than it was given gets the stream reset
+	channel->receive_remaining = 10;
+	uint8_t overrun[sizeof(struct yamux_frame) + 20];
+	memset(overrun, 'a', sizeof(overrun));
+	struct yamux_frame data;
+	memset(&data, 0, sizeof(struct yamux_frame));
+	data.version = YAMUX_VERSION;
+	data.type = yamux_frame_data;
+	data.streamid = channel->channel;
+	data.length = 20;
+	encode_frame(&data);
+	memcpy(overrun, &data, sizeof(struct yamux_frame));
+	test_yamux_window_num_frames = 0;
+	yamux_decode(ctx, overrun, sizeof(overrun), NULL);
+	if (test_yamux_window_num_frames != 1 || !(test_yamux_window_frames[0].flags & yamux_frame_rst)
+			|| threadsafe_buffer_size(channel->buffer) != 0) {
+		fprintf(stderr, "Expected the stream to be reset when the window was overrun.\n");
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (yamux_stream != NULL)
+		yamux_stream->close(yamux_stream);
+	if (mock_message != NULL) {
+		libp2p_stream_message_free(mock_message);
+		mock_message = NULL;
+	}
+	return retVal;
+}
+
+/***
+ * Put a data frame for a stream into a buffer
+ * @returns the number of bytes used
+ */
+size_t test_yamux_build_data_frame(uint8_t* buffer, uint32_t stream_id, const char* data) {
+	struct yamux_frame frame;
+	memset(&frame, 0, sizeof(struct yamux_frame));
+	frame.version = YAMUX_VERSION;
+	frame.type = yamux_frame_data;
+	frame.streamid = stream_id;
+	frame.length = strlen(data);
+	encode_frame(&frame);
+	memcpy(buffer, &frame, sizeof(struct yamux_frame));
+	memcpy(&buffer[sizeof(struct yamux_frame)], data, strlen(data));
+	return sizeof(struct yamux_frame) + strlen(data);
+}
+
+/***
+ * A network read can hold more than one frame, or part of one
+ */
+int test_yamux_frame_parser() {
+	int retVal = 0;
+	const char* yamux_id = "/yamux/1.0.0\n";
+	struct Stream* mock_stream = mock_stream_new();
+	mock_message = build_message(yamux_id);
+	struct Stream* yamux_stream = libp2p_yamux_stream_new(mock_stream, 0, NULL);
+	struct StreamMessage* results = NULL;
+	if (yamux_stream == NULL)
+		goto exit;
+	struct YamuxContext* ctx = (struct YamuxContext*)yamux_stream->stream_context;
+	ctx->state = yamux_stream_est;
+	struct Stream* channel_stream = yamux_channel_new(ctx, 0, NULL);
+	if (channel_stream == NULL)
+		goto exit;
+	struct YamuxChannelContext* channel = (struct YamuxChannelContext*)channel_stream->stream_context;
+	channel->state = yamux_stream_est;
+
+	// two whole frames, and the start of a third
+	uint8_t buffer[100];
+	size_t size = test_yamux_build_data_frame(buffer, channel->channel, "Hello, ");
+	size += test_yamux_build_data_frame(&buffer[size], channel->channel, "World");
+	size_t third_size = test_yamux_build_data_frame(&buffer[size], channel->channel, "!!!");
+	libp2p_stream_message_free(mock_message);
+	mock_message = libp2p_stream_message_new();
+	mock_message->data_size = size + 5;
+	mock_message->data = (uint8_t*) malloc(mock_message->data_size);
+	memcpy(mock_message->data, buffer, mock_message->data_size);
+	if (!yamux_stream->read(yamux_stream->stream_context, &results, 1)) {
+		fprintf(stderr, "Read of 2 and a half frames failed.\n");
+		goto exit;
+	}
+	uint8_t data[20];
+	memset(data, 0, 20);
+	int data_size = threadsafe_buffer_read(channel->buffer, data, 20);
+	if (data_size != 12 || memcmp(data, "Hello, World", 12) != 0) {
+		fprintf(stderr, "Expected the data of 2 frames, but got %d bytes.\n", data_size);
+		goto exit;
+	}
+	if (ctx->frame_buffer_size != 5) {
+		fprintf(stderr, "Expected the start of the third frame to be kept, but there are %d bytes.\n", (int)ctx->frame_buffer_size);
+		goto exit;
+	}
+
+	// now the rest of the third frame
+	memcpy(mock_message->data, &buffer[size + 5], third_size - 5);
+	mock_message->data_size = third_size - 5;
+	if (!yamux_stream->read(yamux_stream->stream_context, &results, 1)) {
+		fprintf(stderr, "Read of the rest of the frame failed.\n");
+		goto exit;
+	}
+	data_size = threadsafe_buffer_read(channel->buffer, data, 20);
+	if (data_size != 3 || memcmp(data, "!!!", 3) != 0 || ctx->frame_buffer_size != 0) {
+		fprintf(stderr, "Expected the data of the third frame, but got %d bytes.\n", data_size);
+		goto exit;
+	}
+
+	// a frame bigger than any receive window is refused before it is buffered
+	struct yamux_frame huge;
+	memset(&huge, 0, sizeof(struct yamux_frame));
+	huge.version = YAMUX_VERSION;
+	huge.type = yamux_frame_data;
+	huge.streamid = channel->channel;
+	huge.length = 0x40000000;
+	encode_frame(&huge);
+	memcpy(mock_message->data, &huge, sizeof(struct yamux_frame));
+	mock_message->data_size = sizeof(struct yamux_frame) + 3;
+	if (yamux_stream->read(yamux_stream->stream_context, &results, 1) || ctx->frame_buffer_size != 0) {
+		fprintf(stderr, "Expected a 1 GiB frame to be refused, but %d bytes were kept.\n", (int)ctx->frame_buffer_size);
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (results != NULL)
+		libp2p_stream_message_free(results);
+	if (yamux_stream != NULL)
+		yamux_stream->close(yamux_stream);
+	if (mock_message != NULL) {
+		libp2p_stream_message_free(mock_message);
+		mock_message = NULL;
+	}
+	return retVal;
+}
+
+struct yamux_frame test_yamux_scheduler_frames[10];
+int test_yamux_scheduler_num_frames = 0;
+int test_yamux_scheduler_num_writes = 0;
+struct yamux_session* test_yamux_scheduler_session = NULL;
+int test_yamux_scheduler_wait_priority = yamux_priority_normal;
+
+/***
+ * Remember the frames the scheduler sends. The first write waits for a second writer to get in line.
+ */
+int test_yamux_scheduler_write(void* context, struct StreamMessage* msg) {
+	if (test_yamux_scheduler_num_writes == 0) {
+		for(int i = 0; i < 500 && test_yamux_scheduler_session->send_queue[test_yamux_scheduler_wait_priority] == NULL; i++)
+			nanosleep(&(struct timespec){ 0, 10000000 }, NULL);
+	}
+	test_yamux_scheduler_num_writes++;
+	size_t pos = 0;
+	while (pos + sizeof(struct yamux_frame) <= msg->data_size && test_yamux_scheduler_num_frames < 10) {
+		struct yamux_frame* frame = &test_yamux_scheduler_frames[test_yamux_scheduler_num_frames++];
+		memcpy(frame, &msg->data[pos], sizeof(struct yamux_frame));
+		decode_frame(frame);
+		pos += sizeof(struct yamux_frame) + frame->length;
+	}
+	return msg->data_size;
+}
+
+void* test_yamux_scheduler_bulk_write(void* arg) {
+	struct YamuxChannelContext* channel = (struct YamuxChannelContext*)arg;
+	size_t data_size = YAMUX_DEFAULT_SEND_QUANTUM * 4;
+	uint8_t* data = (uint8_t*) malloc(data_size);
+	memset(data, 1, data_size);
+	yamux_stream_write(channel, data_size, data);
+	free(data);
+	return NULL;
+}
+
+/***
+ * A big write on one channel should not hold up a small write on another
+ */
+int test_yamux_scheduler() {
+	int retVal = 0;
+	int started = 0;
+	pthread_t bulk_thread;
+	const char* yamux_id = "/yamux/1.0.0\n";
+	struct Stream* mock_stream = mock_stream_new();
+	mock_message = build_message(yamux_id);
+	struct Stream* yamux_stream = libp2p_yamux_stream_new(mock_stream, 0, NULL);
+	if (yamux_stream == NULL)
+		goto exit;
+	mock_stream->write = test_yamux_scheduler_write;
+	struct YamuxContext* ctx = (struct YamuxContext*)yamux_stream->stream_context;
+	ctx->state = yamux_stream_est;
+	test_yamux_scheduler_session = ctx->session;
+	test_yamux_scheduler_num_frames = 0;
+	test_yamux_scheduler_num_writes = 0;
+	struct Stream* bulk_stream = yamux_channel_new(ctx, 0, NULL);
+	struct Stream* small_stream = yamux_channel_new(ctx, 0, NULL);
+	if (bulk_stream == NULL || small_stream == NULL)
+		goto exit;
+	struct YamuxChannelContext* bulk = (struct YamuxChannelContext*)bulk_stream->stream_context;
+	struct YamuxChannelContext* small = (struct YamuxChannelContext*)small_stream->stream_context;
+	bulk->state = yamux_stream_est;
+	small->state = yamux_stream_est;
+
+	// the bulk writer starts first, and is held up in its first write until the small writer is in line
+	if (pthread_create(&bulk_thread, NULL, test_yamux_scheduler_bulk_write, bulk) != 0)
+		goto exit;
+	started = 1;
+	while (test_yamux_scheduler_num_writes == 0 && test_yamux_scheduler_session->sending == 0)
+		nanosleep(&(struct timespec){ 0, 1000000 }, NULL);
+	if (yamux_stream_write(small, 5, "Hello") != 5) {
+		fprintf(stderr, "Small write failed.\n");
+		goto exit;
+	}
+	pthread_join(bulk_thread, NULL);
+	started = 0;
+
+	// one quantum of bulk, then the small write gets its turn, then the rest of the bulk.
+	// The small frame shares a write with the bulk frame after it.
+	if (test_yamux_scheduler_num_frames != 5 || test_yamux_scheduler_num_writes != 4) {
+		fprintf(stderr, "Expected 5 frames in 4 writes, but there were %d in %d.\n", test_yamux_scheduler_num_frames, test_yamux_scheduler_num_writes);
+		goto exit;
+	}
+	for(int i = 0; i < 5; i++) {
+		struct yamux_frame* frame = &test_yamux_scheduler_frames[i];
+		uint32_t expected_id = (i == 1 ? small->channel : bulk->channel);
+		uint32_t expected_length = (i == 1 ? 5 : YAMUX_DEFAULT_SEND_QUANTUM);
+		if (frame->streamid != expected_id || frame->length != expected_length) {
+			fprintf(stderr, "Frame %d was %d bytes for stream %d.\n", i, frame->length, frame->streamid);
+			goto exit;
+		}
+	}
+
+	// a FIN sent while the bulk writer is still going waits for the rest of its data
+	test_yamux_scheduler_wait_priority = yamux_priority_bulk;
+	test_yamux_scheduler_num_frames = 0;
+	test_yamux_scheduler_num_writes = 0;
+	if (pthread_create(&bulk_thread, NULL, test_yamux_scheduler_bulk_write, bulk) != 0)
+		goto exit;
+	started = 1;
+	while (test_yamux_scheduler_num_writes == 0 && test_yamux_scheduler_session->sending == 0)
+		nanosleep(&(struct timespec){ 0, 1000000 }, NULL);
+	if (!libp2p_yamux_channel_send_FIN(bulk)) {
+		fprintf(stderr, "Unable to send the FIN.\n");
+		goto exit;
+	}
+	pthread_join(bulk_thread, NULL);
+	started = 0;
+	if (test_yamux_scheduler_num_frames != 5
+			|| test_yamux_scheduler_frames[4].type != yamux_frame_window_update
+			|| !(test_yamux_scheduler_frames[4].flags & yamux_frame_fin)) {
+		fprintf(stderr, "Expected the FIN after the 4 data frames.\n");
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (started)
+		pthread_join(bulk_thread, NULL);
+	if (yamux_stream != NULL)
+		yamux_stream->close(yamux_stream);
+	if (mock_message != NULL) {
+		libp2p_stream_message_free(mock_message);
+		mock_message = NULL;
+	}
+	return retVal;
+}
+
+/***
+ * Write a pattern into a channel buffer, in pieces that don't line up with its segments
+ */
+void* test_yamux_channel_buffer_write(void* arg) {
+	struct ThreadsafeBufferContext* buffer = (struct ThreadsafeBufferContext*)arg;
+	uint8_t piece[1000];
+	for(int i = 0; i < 100; i++) {
+		for(int j = 0; j < 1000; j++)
+			piece[j] = (uint8_t)(i * 1000 + j);
+		threadsafe_buffer_write(buffer, piece, 1000);
+	}
+	return NULL;
+}
+
+/***
+ * One thread fills a channel buffer while another drains it
+ */
+int test_yamux_channel_buffer() {
+	int retVal = 0;
+	int started = 0;
+	pthread_t writer;
+	struct ThreadsafeBufferContext* buffer = threadsafe_buffer_context_new();
+	if (buffer == NULL)
+		goto exit;
+	if (pthread_create(&writer, NULL, test_yamux_channel_buffer_write, buffer) != 0)
+		goto exit;
+	started = 1;
+	// read it back in small pieces, waiting for them as needed
+	uint8_t results[777];
+	size_t total = 0;
+	while (total < 100000) {
+		size_t wanted = (100000 - total < 777 ? 100000 - total : 777);
+		if (threadsafe_buffer_wait(buffer, wanted, 5) < wanted) {
+			fprintf(stderr, "Timed out waiting for bytes after %d.\n", (int)total);
+			goto exit;
+		}
+		uint8_t first = 0;
+		if (threadsafe_buffer_peek(buffer, &first, 1) != 1 || first != (uint8_t)total) {
+			fprintf(stderr, "Peek at %d did not match.\n", (int)total);
+			goto exit;
+		}
+		size_t bytes_read = threadsafe_buffer_read(buffer, results, wanted);
+		for(size_t i = 0; i < bytes_read; i++) {
+			if (results[i] != (uint8_t)(total + i)) {
+				fprintf(stderr, "Byte %d did not match.\n", (int)(total + i));
+				goto exit;
+			}
+		}
+		total += bytes_read;
+	}
+	if (threadsafe_buffer_size(buffer) != 0) {
+		fprintf(stderr, "Expected the buffer to be empty.\n");
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (started)
+		pthread_join(writer, NULL);
+	threadsafe_buffer_context_free(buffer);
+	return retVal;
+}
+
+int test_yamux_dispatch_num_reads = 0;
+
+/***
+ * A slow child: takes everything in the channel buffer as one message
+ */
+int test_yamux_dispatch_read(void* stream_context, struct StreamMessage** msg, int timeout_secs) {
+	struct YamuxChannelContext* ctx = (struct YamuxChannelContext*)stream_context;
+	nanosleep(&(struct timespec){ 0, 200000000 }, NULL);
+	*msg = libp2p_stream_message_new_buffer(threadsafe_buffer_size(ctx->buffer));
+	(*msg)->data_size = threadsafe_buffer_read(ctx->buffer, (*msg)->data, (*msg)->data_size);
+	test_yamux_dispatch_num_reads++;
+	return 1;
+}
+
+/***
+ * A channel is only handed to a dispatcher thread once a whole message is buffered,
+ * and closing it waits for that thread to let go
+ */
+int test_yamux_dispatch() {
+	int retVal = 0;
+	struct YamuxContext yamux_context;
+	struct YamuxChannelContext* ctx = (struct YamuxChannelContext*)calloc(1, sizeof(struct YamuxChannelContext));
+	struct Stream child;
+	memset(&yamux_context, 0, sizeof(struct YamuxContext));
+	memset(&child, 0, sizeof(struct Stream));
+	yamux_context.protocol_handlers = libp2p_utils_vector_new(1);
+	ctx->yamux_context = &yamux_context;
+	ctx->buffer = threadsafe_buffer_context_new();
+	child.stream_context = ctx;
+	child.stream_type = STREAM_TYPE_MULTISTREAM;
+	child.read = test_yamux_dispatch_read;
+	ctx->child_stream = &child;
+
+	// part of a 5 byte message
+	threadsafe_buffer_write(ctx->buffer, (const uint8_t*)"\x05" "ab", 3);
+	libp2p_yamux_notify_child_stream_has_data(ctx);
+	nanosleep(&(struct timespec){ 0, 300000000 }, NULL);
+	if (test_yamux_dispatch_num_reads != 0) {
+		fprintf(stderr, "The child was asked to read part of a message.\n");
+		goto exit;
+	}
+	// the rest of it
+	threadsafe_buffer_write(ctx->buffer, (const uint8_t*)"cde", 3);
+	if (!libp2p_yamux_notify_child_stream_has_data(ctx)) {
+		fprintf(stderr, "The channel was not dispatched.\n");
+		goto exit;
+	}
+	// wait for the read to start, then close while it is running
+	for(int i = 0; i < 100 && threadsafe_buffer_size(ctx->buffer) > 0; i++)
+		nanosleep(&(struct timespec){ 0, 1000000 }, NULL);
+	if (!yamux_stream_dispatch_stop(ctx)) {
+		fprintf(stderr, "Only the dispatcher thread should be left to free the channel.\n");
+		goto exit;
+	}
+	if (test_yamux_dispatch_num_reads != 1 || ctx->read_running) {
+		fprintf(stderr, "Expected the dispatcher to be done with the channel. Reads: %d.\n", test_yamux_dispatch_num_reads);
+		goto exit;
+	}
+	// closed channels are not dispatched
+	threadsafe_buffer_write(ctx->buffer, (const uint8_t*)"\x01" "a", 2);
+	if (libp2p_yamux_notify_child_stream_has_data(ctx)) {
+		fprintf(stderr, "A closed channel was dispatched.\n");
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	yamux_stream_dispatch_stop(ctx);
+	threadsafe_buffer_context_free(ctx->buffer);
+	free(ctx);
+	libp2p_utils_vector_free(yamux_context.protocol_handlers);
+	return retVal;
+}
+
+size_t test_yamux_large_message_size = 0;
+uint32_t test_yamux_large_message_window = 0;
+
+/***
+ * Count what the window updates give back
+ */
+int test_yamux_large_message_write(void* context, struct StreamMessage* msg) {
+	size_t pos = 0;
+	while (pos + sizeof(struct yamux_frame) <= msg->data_size) {
+		struct yamux_frame frame;
+		memcpy(&frame, &msg->data[pos], sizeof(struct yamux_frame));
+		decode_frame(&frame);
+		if (frame.type == yamux_frame_window_update)
+			__atomic_add_fetch(&test_yamux_large_message_window, frame.length, __ATOMIC_SEQ_CST);
+		pos += sizeof(struct yamux_frame) + (frame.type == yamux_frame_data ? frame.length : 0);
+	}
+	return msg->data_size;
+}
+
+int test_yamux_large_message_handle(const struct StreamMessage* msg, struct Stream* stream, void* protocol_context) {
+	__atomic_store_n(&test_yamux_large_message_size, msg->data_size, __ATOMIC_SEQ_CST);
+	return 1;
+}
+
+/***
+ * A message bigger than the receive window still gets through, with a sender that
+ * never sends more than the window allows
+ */
+int test_yamux_large_message() {
+	int retVal = 0;
+	const char* yamux_id = "/yamux/1.0.0\n";
+	struct Stream* mock_stream = mock_stream_new();
+	mock_message = build_message(yamux_id);
+	struct Stream* yamux_stream = libp2p_yamux_stream_new(mock_stream, 0, NULL);
+	struct Libp2pProtocolHandler* handler = libp2p_protocol_handler_new();
+	struct Stream child;
+	uint8_t* frame = NULL;
+	if (yamux_stream == NULL)
+		goto exit;
+	mock_stream->write = test_yamux_large_message_write;
+	struct YamuxContext* ctx = (struct YamuxContext*)yamux_stream->stream_context;
+	ctx->state = yamux_stream_est;
+	struct Stream* channel_stream = yamux_channel_new(ctx, 0, NULL);
+	if (channel_stream == NULL)
+		goto exit;
+	struct YamuxChannelContext* channel = (struct YamuxChannelContext*)channel_stream->stream_context;
+	channel->state = yamux_stream_est;
+	// a child that takes the whole message, once it is all there
+	handler->HandleMessage = test_yamux_large_message_handle;
+	memset(&child, 0, sizeof(struct Stream));
+	child.stream_type = STREAM_TYPE_MULTISTREAM;
+	child.stream_context = channel;
+	child.read = channel_stream->read;
+	child.protocol_handler = handler;
+	channel->child_stream = &child;
+
+	// a varint length, then 600 KiB
+	size_t message_size = 600 * 1024;
+	uint8_t prefix[10];
+	size_t prefix_size = 0;
+	for(size_t n = message_size; n > 0 || prefix_size == 0; n >>= 7)
+		prefix[prefix_size++] = (n & 0x7f) | (n > 0x7f ? 0x80 : 0);
+	size_t total = prefix_size + message_size;
+	size_t chunk_size = 64 * 1024;
+	frame = (uint8_t*) malloc(sizeof(struct yamux_frame) + chunk_size);
+	memset(frame, 'a', sizeof(struct yamux_frame) + chunk_size);
+
+	size_t sent = 0;
+	uint64_t window = YAMUX_DEFAULT_WINDOW;
+	while (sent < total) {
+		window += __atomic_exchange_n(&test_yamux_large_message_window, 0, __ATOMIC_SEQ_CST);
+		size_t len = total - sent;
+		if (len > chunk_size)
+			len = chunk_size;
+		if (len > window) {
+			fprintf(stderr, "The window closed after %d of %d bytes.\n", (int)sent, (int)total);
+			goto exit;
+		}
+		struct yamux_frame header;
+		memset(&header, 0, sizeof(struct yamux_frame));
+		header.version = YAMUX_VERSION;
+		header.type = yamux_frame_data;
+		header.streamid = channel->channel;
+		header.length = len;
+		encode_frame(&header);
+		memcpy(frame, &header, sizeof(struct yamux_frame));
+		if (sent == 0)
+			memcpy(&frame[sizeof(struct yamux_frame)], prefix, prefix_size);
+		else
+			memset(&frame[sizeof(struct yamux_frame)], 'a', prefix_size);
+		if (yamux_decode(ctx, frame, sizeof(struct yamux_frame) + len, NULL) < 0) {
+			fprintf(stderr, "Decode failed after %d bytes.\n", (int)sent);
+			goto exit;
+		}
+		sent += len;
+		window -= len;
+	}
+	for(int i = 0; i < 500 && __atomic_load_n(&test_yamux_large_message_size, __ATOMIC_SEQ_CST) == 0; i++)
+		nanosleep(&(struct timespec){ 0, 10000000 }, NULL);
+	if (test_yamux_large_message_size != total) {
+		fprintf(stderr, "Expected a message of %d bytes, but got %d.\n", (int)total, (int)test_yamux_large_message_size);
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	free(frame);
+	if (yamux_stream != NULL) {
+		yamux_stream_dispatch_stop(channel_stream->stream_context);
+		channel->child_stream = NULL;
+		yamux_stream->close(yamux_stream);
+	}
+	libp2p_protocol_handler_free(handler);
+	if (mock_message != NULL) {
+		libp2p_stream_message_free(mock_message);
+		mock_message = NULL;
+	}
+	return retVal;
+}
+
 /***
  * Attempt to add a protocol to the Yamux protocol
  */
@@ -1,3 +1,5 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 
 #include "crypto/test_aes.h"
@@ -15,6 +17,8 @@
 #include "test_peer.h"
 #include "test_yamux.h"
 #include "test_net.h"
+#include "test_datastore.h"
+#include "test_routing.h"
 #include "libp2p/utils/logger.h"
 
 struct test {
@@ -99,6 +103,8 @@ int build_test_collection() {
 	add_test("test_secio_encrypt_decrypt", test_secio_encrypt_decrypt,1);
 	add_test("test_secio_exchange_protobuf_encode", test_secio_exchange_protobuf_encode,1);
 	add_test("test_secio_encrypt_like_go", test_secio_encrypt_like_go,1);
+	add_test("test_secio_encrypt_benchmark", test_secio_encrypt_benchmark, 0);
+	add_test("test_secio_peek_partial_record", test_secio_peek_partial_record, 1);
 	add_test("test_multistream_connect", test_multistream_connect,1);
 	add_test("test_multistream_get_list", test_multistream_get_list,1);
 	add_test("test_ephemeral_key_generate", test_ephemeral_key_generate,1);
@@ -114,11 +120,34 @@ int build_test_collection() {
 	add_test("test_peer", test_peer,1);
 	add_test("test_peer_protobuf", test_peer_protobuf,1);
 	add_test("test_peerstore", test_peerstore,1);
+	add_test("test_peerstore_many", test_peerstore_many, 1);
+	add_test("test_providerstore", test_providerstore, 1);
+	add_test("test_datastore_bloom_filter", test_datastore_bloom_filter, 1);
+	add_test("test_routing_table_nearest", test_routing_table_nearest, 1);
 	add_test("test_aes", test_aes, 1);
 	add_test("test_yamux_stream_new", test_yamux_stream_new, 1);
+	add_test("test_yamux_stream_table", test_yamux_stream_table, 1);
+	add_test("test_yamux_window", test_yamux_window, 1);
+	add_test("test_yamux_frame_parser", test_yamux_frame_parser, 1);
+	add_test("test_yamux_scheduler", test_yamux_scheduler, 1);
+	add_test("test_yamux_channel_buffer", test_yamux_channel_buffer, 1);
+	add_test("test_yamux_dispatch", test_yamux_dispatch, 1);
+	add_test("test_yamux_large_message", test_yamux_large_message, 1);
 	add_test("test_yamux_identify", test_yamux_identify, 1);
 	add_test("test_yamux_incoming_protocol_request", test_yamux_incoming_protocol_request, 1);
 	add_test("test_net_server_startup_shutdown", test_net_server_startup_shutdown, 1);
+	add_test("test_net_server_sharded", test_net_server_sharded, 1);
+	add_test("test_net_server_shard_slow_handler", test_net_server_shard_slow_handler, 1);
+	add_test("test_net_connection_read_buffer", test_net_connection_read_buffer, 1);
+	add_test("test_net_socket_read_deadline", test_net_socket_read_deadline, 1);
+	add_test("test_net_connection_writev", test_net_connection_writev, 1);
+	add_test("test_net_connection_write_queue", test_net_connection_write_queue, 1);
+	add_test("test_net_connection_write_stall", test_net_connection_write_stall, 1);
+	add_test("test_net_connection_flusher", test_net_connection_flusher, 1);
+	add_test("test_net_stream_message_slice", test_net_stream_message_slice, 1);
+	add_test("test_net_stream_message_slab", test_net_stream_message_slab, 1);
+	add_test("test_net_protocol_marshal", test_net_protocol_marshal, 1);
+	add_test("test_net_read_does_not_block_write", test_net_read_does_not_block_write, 1);
 	add_test("test_yamux_client_server_connect", test_yamux_client_server_connect, 1);
 	add_test("test_yamux_client_server_multistream", test_yamux_client_server_multistream, 1);
 	add_test("test_yamux_multistream_server", test_yamux_multistream_server, 0);
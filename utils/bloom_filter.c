@@ -0,0 +1,92 @@
+/**
+ * A Bloom filter
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "libp2p/utils/bloom_filter.h"
+
+/***
+ * Hash a key twice. The bits a key sets are h1 + i * h2, for i in 0 .. num_hashes
+ * @param key the key
+ * @param key_size the size of the key
+ * @param h1 the first hash
+ * @param h2 the second hash
+ */
+static void bloom_filter_hash(const uint8_t* key, size_t key_size, uint64_t* h1, uint64_t* h2) {
+	// FNV-1a
+	uint64_t hash = 14695981039346656037ull;
+	for(size_t i = 0; i < key_size; i++) {
+		hash ^= key[i];
+		hash *= 1099511628211ull;
+	}
+	*h1 = hash;
+	// mix it into something independent enough for the second (splitmix64)
+	hash += 0x9e3779b97f4a7c15ull;
+	hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+	hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+	// odd, so the bits don't repeat
+	*h2 = (hash ^ (hash >> 31)) | 1;
+}
+
+/***
+ * Create a new, empty Bloom filter
+ * @param size the number of bytes to use for the filter
+ * @param num_hashes the number of bits each key sets
+ * @returns the filter, or NULL on error
+ */
+struct BloomFilter* libp2p_utils_bloom_filter_new(size_t size, int num_hashes) {
+	if (size == 0 || num_hashes <= 0)
+		return NULL;
+	struct BloomFilter* filter = (struct BloomFilter*) calloc(1, sizeof(struct BloomFilter) + size);
+	if (filter != NULL) {
+		filter->num_bits = size * 8;
+		filter->num_hashes = num_hashes;
+	}
+	return filter;
+}
+
+/***
+ * Free resources of a Bloom filter
+ * @param filter the filter
+ */
+void libp2p_utils_bloom_filter_free(struct BloomFilter* filter) {
+	free(filter);
+}
+
+/***
+ * Add a key to the filter
+ * @param filter the filter
+ * @param key the key
+ * @param key_size the size of the key
+ */
+void libp2p_utils_bloom_filter_add(struct BloomFilter* filter, const uint8_t* key, size_t key_size) {
+	if (filter == NULL)
+		return;
+	uint64_t h1, h2;
+	bloom_filter_hash(key, key_size, &h1, &h2);
+	for(int i = 0; i < filter->num_hashes; i++) {
+		size_t bit = (h1 + i * h2) % filter->num_bits;
+		__atomic_or_fetch(&filter->bits[bit / 8], (uint8_t)(1 << (bit % 8)), __ATOMIC_RELAXED);
+	}
+}
+
+/***
+ * See if a key may have been added
+ * @param filter the filter
+ * @param key the key
+ * @param key_size the size of the key
+ * @returns true(1) if the key may have been added, false(0) if it definitely was not
+ */
+int libp2p_utils_bloom_filter_contains(const struct BloomFilter* filter, const uint8_t* key, size_t key_size) {
+	if (filter == NULL)
+		return 1;
+	uint64_t h1, h2;
+	bloom_filter_hash(key, key_size, &h1, &h2);
+	for(int i = 0; i < filter->num_hashes; i++) {
+		size_t bit = (h1 + i * h2) % filter->num_bits;
+		if ((__atomic_load_n(&filter->bits[bit / 8], __ATOMIC_RELAXED) & (1 << (bit % 8))) == 0)
+			return 0;
+	}
+	return 1;
+}
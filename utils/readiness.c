@@ -0,0 +1,48 @@
+/**
+ * Wake threads when a connection changes state
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+
+#include "libp2p/utils/readiness.h"
+
+static pthread_mutex_t readiness_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t readiness_changed = PTHREAD_COND_INITIALIZER;
+
+/***
+ * Wake up everyone waiting, so they can check whether they are ready.
+ * Call this after the state has changed.
+ */
+void libp2p_utils_readiness_signal() {
+	// taking the lock means a waiter is either before its check, or asleep
+	pthread_mutex_lock(&readiness_lock);
+	pthread_cond_broadcast(&readiness_changed);
+	pthread_mutex_unlock(&readiness_lock);
+}
+
+/***
+ * Wait until the check passes, or the time runs out
+ * @param check the function that decides if we're ready
+ * @param context passed to check
+ * @param timeout_secs the number of seconds to wait
+ * @returns true(1) if check passed, false(0) on timeout
+ */
+int libp2p_utils_readiness_wait(libp2p_utils_readiness_check check, void* context, int timeout_secs) {
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_secs;
+	pthread_mutex_lock(&readiness_lock);
+	int ready = check(context);
+	while (!ready) {
+		if (pthread_cond_timedwait(&readiness_changed, &readiness_lock, &deadline) == ETIMEDOUT) {
+			ready = check(context);
+			break;
+		}
+		ready = check(context);
+	}
+	pthread_mutex_unlock(&readiness_lock);
+	return ready;
+}
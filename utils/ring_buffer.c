@@ -0,0 +1,143 @@
+/**
+ * A fixed size ring buffer of bytes
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "libp2p/utils/ring_buffer.h"
+
+/***
+ * Allocate a new ring buffer
+ * @param capacity the number of bytes the buffer can hold
+ * @returns the newly allocated RingBuffer, or NULL on error (out of memory?)
+ */
+struct RingBuffer* libp2p_utils_ring_buffer_new(size_t capacity) {
+	if (capacity == 0)
+		return NULL;
+	struct RingBuffer* ring = (struct RingBuffer*) malloc(sizeof(struct RingBuffer));
+	if (ring != NULL) {
+		ring->buffer = (uint8_t*) malloc(capacity);
+		if (ring->buffer == NULL) {
+			free(ring);
+			return NULL;
+		}
+		ring->capacity = capacity;
+		ring->head = 0;
+		ring->size = 0;
+	}
+	return ring;
+}
+
+/***
+ * Free resources of a ring buffer
+ * @param ring the ring buffer
+ */
+void libp2p_utils_ring_buffer_free(struct RingBuffer* ring) {
+	if (ring != NULL) {
+		free(ring->buffer);
+		free(ring);
+	}
+}
+
+/***
+ * The number of bytes waiting to be read
+ * @param ring the ring buffer
+ * @returns the number of bytes waiting
+ */
+size_t libp2p_utils_ring_buffer_size(const struct RingBuffer* ring) {
+	if (ring == NULL)
+		return 0;
+	return ring->size;
+}
+
+/***
+ * Look at bytes without consuming them
+ * @param ring the ring buffer
+ * @param results where to put the bytes
+ * @param results_size the most bytes to copy
+ * @returns the number of bytes copied
+ */
+size_t libp2p_utils_ring_buffer_peek(const struct RingBuffer* ring, uint8_t* results, size_t results_size) {
+	if (ring == NULL || results == NULL)
+		return 0;
+	size_t to_copy = results_size < ring->size ? results_size : ring->size;
+	// the bytes may wrap around the end of the buffer
+	size_t first = ring->capacity - ring->head;
+	if (first > to_copy)
+		first = to_copy;
+	memcpy(results, &ring->buffer[ring->head], first);
+	if (to_copy > first)
+		memcpy(&results[first], ring->buffer, to_copy - first);
+	return to_copy;
+}
+
+/***
+ * Copy bytes out of the buffer, and consume them
+ * @param ring the ring buffer
+ * @param results where to put the bytes
+ * @param results_size the most bytes to copy
+ * @returns the number of bytes copied
+ */
+size_t libp2p_utils_ring_buffer_read(struct RingBuffer* ring, uint8_t* results, size_t results_size) {
+	size_t num_read = libp2p_utils_ring_buffer_peek(ring, results, results_size);
+	return libp2p_utils_ring_buffer_consume(ring, num_read);
+}
+
+/***
+ * Throw away bytes from the front of the buffer
+ * @param ring the ring buffer
+ * @param num_bytes the number of bytes to throw away
+ * @returns the number of bytes thrown away
+ */
+size_t libp2p_utils_ring_buffer_consume(struct RingBuffer* ring, size_t num_bytes) {
+	if (ring == NULL)
+		return 0;
+	if (num_bytes > ring->size)
+		num_bytes = ring->size;
+	ring->head = (ring->head + num_bytes) % ring->capacity;
+	ring->size -= num_bytes;
+	// an empty buffer starts over at the front, which keeps fills in one piece
+	if (ring->size == 0)
+		ring->head = 0;
+	return num_bytes;
+}
+
+/***
+ * Describe the free space of the buffer, so that it can be filled directly (i.e. with readv).
+ * Call libp2p_utils_ring_buffer_commit afterwards with the number of bytes that were placed.
+ * @param ring the ring buffer
+ * @param regions where to put the description. Must have room for 2 entries.
+ * @returns the number of regions (0 if the buffer is full)
+ */
+int libp2p_utils_ring_buffer_free_regions(struct RingBuffer* ring, struct iovec* regions) {
+	if (ring == NULL || ring->size == ring->capacity)
+		return 0;
+	size_t tail = (ring->head + ring->size) % ring->capacity;
+	if (tail >= ring->head) {
+		// free space runs from the tail to the end, then from the front to the head
+		regions[0].iov_base = &ring->buffer[tail];
+		regions[0].iov_len = ring->capacity - tail;
+		if (ring->head == 0)
+			return 1;
+		regions[1].iov_base = ring->buffer;
+		regions[1].iov_len = ring->head;
+		return 2;
+	}
+	regions[0].iov_base = &ring->buffer[tail];
+	regions[0].iov_len = ring->head - tail;
+	return 1;
+}
+
+/***
+ * Mark bytes placed into the free regions as waiting to be read
+ * @param ring the ring buffer
+ * @param num_bytes the number of bytes that were placed
+ */
+void libp2p_utils_ring_buffer_commit(struct RingBuffer* ring, size_t num_bytes) {
+	if (ring == NULL)
+		return;
+	if (num_bytes > ring->capacity - ring->size)
+		num_bytes = ring->capacity - ring->size;
+	ring->size += num_bytes;
+}
@@ -0,0 +1,271 @@
+/**
+ * A size classed allocator with thread local caches
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "libp2p/utils/slab.h"
+
+// the smallest class is 64 bytes, the largest 64K. Anything bigger goes straight to malloc
+#define SLAB_MIN_SHIFT 6
+#define SLAB_NUM_CLASSES 11
+// how many bytes of each class a thread keeps
+#define SLAB_CACHE_BYTES (128 * 1024)
+// how many times that the depot keeps
+#define SLAB_DEPOT_MULTIPLE 4
+// keeps the memory after it aligned the way malloc's is
+#define SLAB_HEADER_SIZE 16
+
+// ASan can't see a use after free if the block went back to a cache
+#if defined(__SANITIZE_ADDRESS__)
+#define SLAB_CACHING 0
+#else
+#define SLAB_CACHING 1
+#endif
+
+/***
+ * A free block. The link lives where the caller's data would be
+ */
+struct SlabBlock {
+	struct SlabBlock* next;
+};
+
+/***
+ * What one thread keeps
+ */
+struct SlabCache {
+	struct SlabCache* next; // the list of all caches, so the counters can be summed
+	struct SlabCache* prev;
+	struct SlabBlock* blocks[SLAB_NUM_CLASSES];
+	int count[SLAB_NUM_CLASSES];
+	struct SlabStats stats; // only the owner writes these
+};
+
+static __thread struct SlabCache* slab_cache = NULL;
+static pthread_key_t slab_key;
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+// protects everything below
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct SlabBlock* slab_depot[SLAB_NUM_CLASSES];
+static int slab_depot_count[SLAB_NUM_CLASSES];
+static struct SlabCache* slab_caches = NULL;
+static struct SlabStats slab_retired; // counters of threads that have exited
+
+/***
+ * Which class a size belongs in
+ * @param size the number of bytes
+ * @returns the class, or SLAB_NUM_CLASSES if it is too big for one
+ */
+static int slab_size_class(size_t size) {
+	int size_class = 0;
+	size_t block_size = (size_t)1 << SLAB_MIN_SHIFT;
+	while (block_size < size && size_class < SLAB_NUM_CLASSES) {
+		block_size <<= 1;
+		size_class++;
+	}
+	return size_class;
+}
+
+/***
+ * How many blocks of a class a thread keeps
+ * @param size_class the class
+ * @returns the number of blocks
+ */
+static int slab_cache_limit(int size_class) {
+	int limit = SLAB_CACHE_BYTES >> (size_class + SLAB_MIN_SHIFT);
+	return (limit < 4 ? 4 : limit);
+}
+
+/***
+ * Bump a counter of this thread
+ * @param counter the counter
+ */
+static void slab_count(uint64_t* counter) {
+	__atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+/***
+ * Move blocks from a thread to the depot. What the depot has no room for is freed.
+ * NOTE: slab_lock should be held
+ * @param cache the thread's cache
+ * @param size_class the class
+ * @param num_blocks how many to move
+ */
+static void slab_depot_give(struct SlabCache* cache, int size_class, int num_blocks) {
+	int depot_limit = slab_cache_limit(size_class) * SLAB_DEPOT_MULTIPLE;
+	while (num_blocks-- > 0 && cache->blocks[size_class] != NULL) {
+		struct SlabBlock* block = cache->blocks[size_class];
+		cache->blocks[size_class] = block->next;
+		cache->count[size_class]--;
+		if (slab_depot_count[size_class] < depot_limit) {
+			block->next = slab_depot[size_class];
+			slab_depot[size_class] = block;
+			slab_depot_count[size_class]++;
+		} else {
+			slab_count(&cache->stats.system_frees);
+			free((uint8_t*)block - SLAB_HEADER_SIZE);
+		}
+	}
+}
+
+/***
+ * Fill up a thread's cache from the depot
+ * @param cache the thread's cache
+ * @param size_class the class
+ */
+static void slab_depot_take(struct SlabCache* cache, int size_class) {
+	int num_blocks = slab_cache_limit(size_class) / 2;
+	pthread_mutex_lock(&slab_lock);
+	while (num_blocks-- > 0 && slab_depot[size_class] != NULL) {
+		struct SlabBlock* block = slab_depot[size_class];
+		slab_depot[size_class] = block->next;
+		slab_depot_count[size_class]--;
+		block->next = cache->blocks[size_class];
+		cache->blocks[size_class] = block;
+		cache->count[size_class]++;
+	}
+	pthread_mutex_unlock(&slab_lock);
+}
+
+/***
+ * A thread is exiting. Hand its blocks to the depot and keep its counters
+ * @param arg the thread's cache
+ */
+static void slab_cache_release(void* arg) {
+	struct SlabCache* cache = (struct SlabCache*)arg;
+	pthread_mutex_lock(&slab_lock);
+	for(int i = 0; i < SLAB_NUM_CLASSES; i++)
+		slab_depot_give(cache, i, cache->count[i]);
+	slab_retired.allocations += cache->stats.allocations;
+	slab_retired.frees += cache->stats.frees;
+	slab_retired.system_allocations += cache->stats.system_allocations;
+	slab_retired.system_frees += cache->stats.system_frees;
+	if (cache->prev != NULL)
+		cache->prev->next = cache->next;
+	else
+		slab_caches = cache->next;
+	if (cache->next != NULL)
+		cache->next->prev = cache->prev;
+	pthread_mutex_unlock(&slab_lock);
+	if (slab_cache == cache)
+		slab_cache = NULL;
+	free(cache);
+}
+
+static void slab_key_create() {
+	pthread_key_create(&slab_key, slab_cache_release);
+}
+
+/***
+ * Get this thread's cache, creating it if needed
+ * @returns the cache, or NULL if out of memory
+ */
+static struct SlabCache* slab_cache_get() {
+	if (slab_cache != NULL)
+		return slab_cache;
+	pthread_once(&slab_once, slab_key_create);
+	struct SlabCache* cache = (struct SlabCache*) calloc(1, sizeof(struct SlabCache));
+	if (cache == NULL)
+		return NULL;
+	pthread_mutex_lock(&slab_lock);
+	cache->next = slab_caches;
+	if (slab_caches != NULL)
+		slab_caches->prev = cache;
+	slab_caches = cache;
+	pthread_mutex_unlock(&slab_lock);
+	pthread_setspecific(slab_key, cache);
+	slab_cache = cache;
+	return cache;
+}
+
+/***
+ * Allocate memory
+ * @param size the number of bytes needed
+ * @returns the memory, or NULL on error (out of memory?)
+ */
+void* libp2p_utils_slab_alloc(size_t size) {
+	struct SlabCache* cache = slab_cache_get();
+	int size_class = slab_size_class(size);
+	if (cache != NULL) {
+		slab_count(&cache->stats.allocations);
+		if (size_class < SLAB_NUM_CLASSES) {
+			if (cache->blocks[size_class] == NULL)
+				slab_depot_take(cache, size_class);
+			struct SlabBlock* block = cache->blocks[size_class];
+			if (block != NULL) {
+				cache->blocks[size_class] = block->next;
+				cache->count[size_class]--;
+				return block;
+			}
+		}
+	}
+	size_t block_size = (size_class < SLAB_NUM_CLASSES ? (size_t)1 << (size_class + SLAB_MIN_SHIFT) : size);
+	uint8_t* memory = (uint8_t*) malloc(SLAB_HEADER_SIZE + block_size);
+	if (memory == NULL)
+		return NULL;
+	if (cache != NULL)
+		slab_count(&cache->stats.system_allocations);
+	*(uint32_t*)memory = size_class;
+	return &memory[SLAB_HEADER_SIZE];
+}
+
+/***
+ * Allocate memory and set it to zero
+ * @param size the number of bytes needed
+ * @returns the memory, or NULL on error (out of memory?)
+ */
+void* libp2p_utils_slab_calloc(size_t size) {
+	void* ptr = libp2p_utils_slab_alloc(size);
+	if (ptr != NULL)
+		memset(ptr, 0, size);
+	return ptr;
+}
+
+/***
+ * Give back memory from libp2p_utils_slab_alloc
+ * @param ptr the memory (may be NULL)
+ */
+void libp2p_utils_slab_free(void* ptr) {
+	if (ptr == NULL)
+		return;
+	uint8_t* memory = (uint8_t*)ptr - SLAB_HEADER_SIZE;
+	int size_class = *(uint32_t*)memory;
+	struct SlabCache* cache = slab_cache_get();
+	if (cache != NULL) {
+		slab_count(&cache->stats.frees);
+		if (SLAB_CACHING && size_class < SLAB_NUM_CLASSES) {
+			if (cache->count[size_class] >= slab_cache_limit(size_class)) {
+				// too many here. Let other threads have some
+				pthread_mutex_lock(&slab_lock);
+				slab_depot_give(cache, size_class, cache->count[size_class] / 2);
+				pthread_mutex_unlock(&slab_lock);
+			}
+			struct SlabBlock* block = (struct SlabBlock*)ptr;
+			block->next = cache->blocks[size_class];
+			cache->blocks[size_class] = block;
+			cache->count[size_class]++;
+			return;
+		}
+		slab_count(&cache->stats.system_frees);
+	}
+	free(memory);
+}
+
+/***
+ * Get the counters, summed over all threads
+ * @param stats where to put the results
+ */
+void libp2p_utils_slab_stats(struct SlabStats* stats) {
+	pthread_mutex_lock(&slab_lock);
+	*stats = slab_retired;
+	for(struct SlabCache* cache = slab_caches; cache != NULL; cache = cache->next) {
+		stats->allocations += __atomic_load_n(&cache->stats.allocations, __ATOMIC_RELAXED);
+		stats->frees += __atomic_load_n(&cache->stats.frees, __ATOMIC_RELAXED);
+		stats->system_allocations += __atomic_load_n(&cache->stats.system_allocations, __ATOMIC_RELAXED);
+		stats->system_frees += __atomic_load_n(&cache->stats.system_frees, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&slab_lock);
+}
@@ -21,6 +21,7 @@
 #endif
 
 #include "libp2p/utils/thread_pool.h"
+#include "libp2p/utils/slab.h"
 
 #ifdef THPOOL_DEBUG
 #define THPOOL_DEBUG 1
@@ -34,7 +35,6 @@
 #define err(str)
 #endif
 
-static volatile int threads_keepalive;
 static volatile int threads_on_hold;
 
 
@@ -81,6 +81,7 @@ typedef struct thpool_{
 	thread**   threads;                  /* pointer to threads        */
 	volatile int num_threads_alive;      /* threads currently alive   */
 	volatile int num_threads_working;    /* threads currently working */
+	volatile int keepalive;              /* cleared by thpool_destroy */
 	pthread_mutex_t  thcount_lock;       /* used for thread count etc */
 	pthread_cond_t  threads_all_idle;    /* signal to thpool_wait     */
 	jobqueue  jobqueue;                  /* job queue                 */
@@ -121,7 +122,6 @@ static void  bsem_wait(struct bsem *bsem_p);
 struct thpool_* thpool_init(int num_threads){
 
 	threads_on_hold   = 0;
-	threads_keepalive = 1;
 
 	if (num_threads < 0){
 		num_threads = 0;
@@ -136,6 +136,7 @@ struct thpool_* thpool_init(int num_threads){
 	}
 	thpool_p->num_threads_alive   = 0;
 	thpool_p->num_threads_working = 0;
+	thpool_p->keepalive           = 1;
 
 	/* Initialise the job queue */
 	if (jobqueue_init(&thpool_p->jobqueue) == -1){
@@ -176,7 +177,7 @@ struct thpool_* thpool_init(int num_threads){
 int thpool_add_work(thpool_* thpool_p, void (*function_p)(void*), void* arg_p){
 	job* newjob;
 
-	newjob=(struct job*)malloc(sizeof(struct job));
+	newjob=(struct job*)libp2p_utils_slab_alloc(sizeof(struct job));
 	if (newjob==NULL){
 		err("thpool_add_work(): Could not allocate memory for new job\n");
 		return -1;
@@ -210,8 +211,8 @@ void thpool_destroy(thpool_* thpool_p){
 
 	volatile int threads_total = thpool_p->num_threads_alive;
 
-	/* End each thread 's infinite loop */
-	threads_keepalive = 0;
+	/* End each thread 's infinite loop (only this pool's) */
+	thpool_p->keepalive = 0;
 
 	/* Give one second to kill idle threads */
 	double TIMEOUT = 1.0;
@@ -350,11 +351,11 @@ static void* thread_do(struct thread* thread_p){
 	thpool_p->num_threads_alive += 1;
 	pthread_mutex_unlock(&thpool_p->thcount_lock);
 
-	while(threads_keepalive){
+	while(thpool_p->keepalive){
 
 		bsem_wait(thpool_p->jobqueue.has_jobs);
 
-		if (threads_keepalive){
+		if (thpool_p->keepalive){
 
 			pthread_mutex_lock(&thpool_p->thcount_lock);
 			thpool_p->num_threads_working++;
@@ -368,7 +369,7 @@ static void* thread_do(struct thread* thread_p){
 				func_buff = job_p->function;
 				arg_buff  = job_p->arg;
 				func_buff(arg_buff);
-				free(job_p);
+				libp2p_utils_slab_free(job_p);
 			}
 
 			pthread_mutex_lock(&thpool_p->thcount_lock);
@@ -422,7 +423,7 @@ static int jobqueue_init(jobqueue* jobqueue_p){
 static void jobqueue_clear(jobqueue* jobqueue_p){
 
 	while(jobqueue_p->len){
-		free(jobqueue_pull(jobqueue_p));
+		libp2p_utils_slab_free(jobqueue_pull(jobqueue_p));
 	}
 
 	jobqueue_p->front = NULL;
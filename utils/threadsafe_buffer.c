@@ -1,12 +1,33 @@
 /**
  * A thredsafe buffer
  */
+#define _POSIX_C_SOURCE 200809L
 
 #include <stdlib.h>
+#include <time.h>
+#include <errno.h>
 
 #include "libp2p/utils/threadsafe_buffer.h"
 #include "libp2p/utils/logger.h"
 
+/***
+ * Get an empty segment, reusing the spare if there is one
+ * NOTE: only the writer calls this
+ * @param context the context
+ * @returns the segment, or NULL if out of memory
+ */
+struct ThreadsafeBufferSegment* threadsafe_buffer_segment_new(struct ThreadsafeBufferContext* context) {
+	struct ThreadsafeBufferSegment* segment = __atomic_exchange_n(&context->spare, NULL, __ATOMIC_ACQUIRE);
+	if (segment == NULL)
+		segment = (struct ThreadsafeBufferSegment*) malloc(sizeof(struct ThreadsafeBufferSegment));
+	if (segment != NULL) {
+		segment->next = NULL;
+		segment->write_pos = 0;
+		segment->read_pos = 0;
+	}
+	return segment;
+}
+
 /***
  * Allocate a new context
  * @returns a newly allocated context, or NULL on error (out of memory?)
@@ -14,9 +35,18 @@
 struct ThreadsafeBufferContext* threadsafe_buffer_context_new() {
 	struct ThreadsafeBufferContext* context = (struct ThreadsafeBufferContext*) malloc(sizeof(struct ThreadsafeBufferContext));
 	if (context != NULL) {
-		context->buffer_size = 0;
-		context->buffer = NULL;
+		context->spare = NULL;
+		context->head = threadsafe_buffer_segment_new(context);
+		if (context->head == NULL) {
+			free(context);
+			return NULL;
+		}
+		context->tail = context->head;
+		context->bytes_written = 0;
+		context->bytes_read = 0;
+		context->waiting = 0;
 		pthread_mutex_init(&context->lock, NULL);
+		pthread_cond_init(&context->readable, NULL);
 	}
 	return context;
 }
@@ -27,12 +57,77 @@ struct ThreadsafeBufferContext* threadsafe_buffer_context_new() {
  */
 void threadsafe_buffer_context_free(struct ThreadsafeBufferContext* context) {
 	if (context != NULL) {
-		if (context->buffer != NULL)
-			free(context->buffer);
+		struct ThreadsafeBufferSegment* segment = context->head;
+		while (segment != NULL) {
+			struct ThreadsafeBufferSegment* next = segment->next;
+			free(segment);
+			segment = next;
+		}
+		if (context->spare != NULL)
+			free(context->spare);
+		pthread_cond_destroy(&context->readable);
+		pthread_mutex_destroy(&context->lock);
 		free(context);
 	}
 }
 
+/***
+ * The number of bytes waiting to be read
+ * @param context the context
+ * @returns the number of bytes
+ */
+size_t threadsafe_buffer_size(struct ThreadsafeBufferContext* context) {
+	if (context == NULL)
+		return 0;
+	return __atomic_load_n(&context->bytes_written, __ATOMIC_ACQUIRE) - __atomic_load_n(&context->bytes_read, __ATOMIC_ACQUIRE);
+}
+
+/***
+ * Copy bytes out of the buffer, and possibly consume them
+ * NOTE: only the reader calls this
+ * @param context the context
+ * @param results where to put the results
+ * @param results_size the size of the results
+ * @param consume true(1) to move the read pointer, false(0) to leave things as they are
+ * @returns the number of bytes copied
+ */
+size_t threadsafe_buffer_copy_out(struct ThreadsafeBufferContext* context, uint8_t* results, size_t results_size, int consume) {
+	// everything counted in bytes_written has been placed in the segments
+	size_t available = threadsafe_buffer_size(context);
+	size_t bytes_read = (results_size < available ? results_size : available);
+	size_t pos = 0;
+	struct ThreadsafeBufferSegment* segment = context->head;
+	size_t read_pos = segment->read_pos;
+	while (pos < bytes_read) {
+		size_t write_pos = __atomic_load_n(&segment->write_pos, __ATOMIC_ACQUIRE);
+		if (read_pos == write_pos) {
+			// this one is used up, so the writer has moved on to the next
+			struct ThreadsafeBufferSegment* next = __atomic_load_n(&segment->next, __ATOMIC_ACQUIRE);
+			if (consume) {
+				context->head = next;
+				// hand it back to the writer, or let it go
+				struct ThreadsafeBufferSegment* expected = NULL;
+				if (!__atomic_compare_exchange_n(&context->spare, &expected, segment, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+					free(segment);
+			}
+			segment = next;
+			read_pos = segment->read_pos;
+			continue;
+		}
+		size_t len = write_pos - read_pos;
+		if (len > bytes_read - pos)
+			len = bytes_read - pos;
+		memcpy(&results[pos], &segment->data[read_pos], len);
+		pos += len;
+		read_pos += len;
+		if (consume)
+			segment->read_pos = read_pos;
+	}
+	if (consume && bytes_read > 0)
+		__atomic_add_fetch(&context->bytes_read, bytes_read, __ATOMIC_RELEASE);
+	return bytes_read;
+}
+
 /***
  * Read from the buffer without destroying its contents or moving its read pointer
  * @param context the context
@@ -41,17 +136,9 @@ void threadsafe_buffer_context_free(struct ThreadsafeBufferContext* context) {
  * @returns number of bytes read
  */
 size_t threadsafe_buffer_peek(struct ThreadsafeBufferContext* context, uint8_t* results, size_t results_size) {
-	size_t bytes_read = 0;
 	if (context == NULL)
 		return 0;
-	pthread_mutex_lock(&context->lock);
-	// do the read
-	if (context->buffer != NULL && context->buffer_size > 0) {
-		bytes_read = results_size < context->buffer_size ? results_size : context->buffer_size;
-		memcpy(results, context->buffer, bytes_read);
-	}
-	pthread_mutex_unlock(&context->lock);
-	return bytes_read;
+	return threadsafe_buffer_copy_out(context, results, results_size, 0);
 }
 
 /***
@@ -63,35 +150,38 @@ size_t threadsafe_buffer_peek(struct ThreadsafeBufferContext* context, uint8_t*
  * @returns number of bytes read
  */
 size_t threadsafe_buffer_read(struct ThreadsafeBufferContext* context, uint8_t* results, size_t results_size) {
-	size_t bytes_read = 0;
 	if (context == NULL)
 		return 0;
+	size_t bytes_read = threadsafe_buffer_copy_out(context, results, results_size, 1);
+	libp2p_logger_debug("threadsafe_buffer", "read: We wanted to read %d bytes, and read %d.\n", (int)results_size, (int)bytes_read);
+	return bytes_read;
+}
+
+/***
+ * Wait for bytes to be written
+ * @param context the context
+ * @param min_bytes how many bytes we want waiting
+ * @param timeout_secs how long to wait
+ * @returns the number of bytes waiting (which may be less than min_bytes if it timed out)
+ */
+size_t threadsafe_buffer_wait(struct ThreadsafeBufferContext* context, size_t min_bytes, int timeout_secs) {
+	if (context == NULL)
+		return 0;
+	if (threadsafe_buffer_size(context) >= min_bytes || timeout_secs <= 0)
+		return threadsafe_buffer_size(context);
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_secs;
 	pthread_mutex_lock(&context->lock);
-	// do the read
-	if (context->buffer != NULL && context->buffer_size > 0) {
-		bytes_read = results_size < context->buffer_size ? results_size : context->buffer_size;
-		libp2p_logger_debug("threadsafe_buffer", "read: We want to read %d bytes, and have %d in the buffer. Therefore, we will read %d.\n", results_size, context->buffer_size, bytes_read);
-		memcpy(results, context->buffer, bytes_read);
-	}
-	// adjust the size
-	if (bytes_read > 0) {
-		if (context->buffer_size - bytes_read > 0) {
-			// more remains
-			size_t new_buffer_size = context->buffer_size - bytes_read;
-			uint8_t* new_buffer = (uint8_t*) malloc(new_buffer_size);
-			memcpy(new_buffer, &context->buffer[bytes_read], new_buffer_size);
-			free(context->buffer);
-			context->buffer = new_buffer;
-			context->buffer_size = new_buffer_size;
-		} else {
-			// everything has been read
-			free(context->buffer);
-			context->buffer = NULL;
-			context->buffer_size = 0;
-		}
+	// the writer checks this after adding bytes, so either it sees us, or we see the bytes
+	__atomic_add_fetch(&context->waiting, 1, __ATOMIC_SEQ_CST);
+	while (threadsafe_buffer_size(context) < min_bytes) {
+		if (pthread_cond_timedwait(&context->readable, &context->lock, &deadline) == ETIMEDOUT)
+			break;
 	}
+	__atomic_sub_fetch(&context->waiting, 1, __ATOMIC_SEQ_CST);
 	pthread_mutex_unlock(&context->lock);
-	return bytes_read;
+	return threadsafe_buffer_size(context);
 }
 
 /****
@@ -107,17 +197,35 @@ size_t threadsafe_buffer_write(struct ThreadsafeBufferContext* context, const ui
 	if (bytes_size == 0)
 		return 0;
 	size_t bytes_copied = 0;
-	pthread_mutex_lock(&context->lock);
-	// allocate memory
-	uint8_t* new_buffer = (uint8_t*) realloc(context->buffer, context->buffer_size + bytes_size);
-	if (new_buffer != NULL) {
-		// copy data
-		memcpy(&new_buffer[context->buffer_size], bytes, bytes_size);
-		context->buffer_size += bytes_size;
-		context->buffer = new_buffer;
-		bytes_copied = bytes_size;
-		libp2p_logger_debug("threadsafe_buffer", "write: Added %d bytes. Buffer now contains %d bytes.\n", bytes_size, context->buffer_size);
+	while (bytes_copied < bytes_size) {
+		struct ThreadsafeBufferSegment* segment = context->tail;
+		size_t write_pos = segment->write_pos;
+		if (write_pos == THREADSAFE_BUFFER_SEGMENT_SIZE) {
+			struct ThreadsafeBufferSegment* next = threadsafe_buffer_segment_new(context);
+			if (next == NULL) {
+				libp2p_logger_error("threadsafe_buffer", "write: Unable to allocate memory for %d bytes.\n", (int)(bytes_size - bytes_copied));
+				break;
+			}
+			__atomic_store_n(&segment->next, next, __ATOMIC_RELEASE);
+			context->tail = next;
+			continue;
+		}
+		size_t len = THREADSAFE_BUFFER_SEGMENT_SIZE - write_pos;
+		if (len > bytes_size - bytes_copied)
+			len = bytes_size - bytes_copied;
+		memcpy(&segment->data[write_pos], &bytes[bytes_copied], len);
+		__atomic_store_n(&segment->write_pos, write_pos + len, __ATOMIC_RELEASE);
+		bytes_copied += len;
 	}
-	pthread_mutex_unlock(&context->lock);
+	if (bytes_copied == 0)
+		return 0;
+	// publish the bytes, then wake anyone waiting for them
+	__atomic_add_fetch(&context->bytes_written, bytes_copied, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&context->waiting, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&context->lock);
+		pthread_cond_broadcast(&context->readable);
+		pthread_mutex_unlock(&context->lock);
+	}
+	libp2p_logger_debug("threadsafe_buffer", "write: Added %d bytes. Buffer now contains %d bytes.\n", (int)bytes_copied, (int)threadsafe_buffer_size(context));
 	return bytes_copied;
 }
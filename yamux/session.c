@@ -19,9 +19,71 @@ static struct yamux_config dcfg = YAMUX_DEFAULT_CONFIG;
 
 // forward declarations
 struct YamuxContext* libp2p_yamux_get_context(void* stream_context);
-struct yamux_stream* yamux_stream_new();
 
 
+/***
+ * Spread stream ids over the table. Ids go up by 2, so don't rely on the low bits.
+ * @param id the stream id
+ * @returns the hash
+ */
+size_t yamux_session_stream_hash(yamux_streamid id) {
+	uint32_t hash = id * 2654435761u;
+	return hash ^ (hash >> 16);
+}
+
+/***
+ * Find a stream in the session's stream table
+ * @param session the session
+ * @param id the stream id
+ * @returns the slot that holds the stream, or NULL if it is not there
+ */
+struct yamux_session_stream* yamux_session_find_stream(struct yamux_session* session, yamux_streamid id) {
+	if (session == NULL || session->cap_streams == 0)
+		return NULL;
+	size_t mask = session->cap_streams - 1;
+	for (size_t i = yamux_session_stream_hash(id) & mask; session->streams[i].alive; i = (i + 1) & mask) {
+		if (session->streams[i].stream->id == id)
+			return &session->streams[i];
+	}
+	return NULL;
+}
+
+/***
+ * Put a stream in the first free slot, starting at its home slot
+ * @param streams the table
+ * @param cap_streams the number of slots in the table
+ * @param stream the stream
+ * @returns the slot used
+ */
+struct yamux_session_stream* yamux_session_place_stream(struct yamux_session_stream* streams, size_t cap_streams, struct yamux_stream* stream) {
+	size_t mask = cap_streams - 1;
+	size_t i = yamux_session_stream_hash(stream->id) & mask;
+	while (streams[i].alive)
+		i = (i + 1) & mask;
+	streams[i].stream = stream;
+	streams[i].alive = 1;
+	return &streams[i];
+}
+
+/***
+ * Double the size of the session's stream table
+ * @param session the session
+ * @returns true(1) on success, false(0) if out of memory
+ */
+int yamux_session_grow_streams(struct yamux_session* session) {
+	size_t new_cap = session->cap_streams * 2;
+	struct yamux_session_stream* new_streams = (struct yamux_session_stream*)calloc(new_cap, sizeof(struct yamux_session_stream));
+	if (new_streams == NULL)
+		return 0;
+	for (size_t i = 0; i < session->cap_streams; ++i)
+		if (session->streams[i].alive)
+			yamux_session_place_stream(new_streams, new_cap, session->streams[i].stream);
+	free(session->streams);
+	session->streams = new_streams;
+	session->cap_streams = new_cap;
+	return 1;
+}
+
 /***
  * Create a new yamux session
  * @param config the configuration
@@ -38,28 +100,43 @@ struct yamux_session* yamux_session_new(struct yamux_config* config, struct Stre
     if (!config)
         config = &dcfg;
 
-    size_t ab = config->accept_backlog;
+    // the table starts out big enough for the backlog, and grows from there
+    size_t ab = 16;
+    while (ab < config->accept_backlog * 2)
+        ab <<= 1;
 
     struct yamux_session_stream* streams =
-        (struct yamux_session_stream*)malloc(sizeof(struct yamux_session_stream) * ab);
-
-    for (size_t i = 0; i < ab; ++i)
-        streams[i].alive = 0;
+        (struct yamux_session_stream*)calloc(ab, sizeof(struct yamux_session_stream));
+    if (streams == NULL)
+        return NULL;
 
     struct yamux_session* sess = (struct yamux_session*)malloc(sizeof(struct yamux_session));
-    if (sess != NULL) {
+    if (sess == NULL) {
+        free(streams);
+    } else {
         sess->config = config;
         sess->type   = type;
         sess->parent_stream = parent_stream;
         sess->closed = 0;
         sess->nextid = 1 + (type == yamux_session_server);
         sess->num_streams = 0;
-        sess->cap_streams = 0;
+        sess->cap_streams = ab;
         sess->streams = streams;
         struct timespec ts;
         ts.tv_sec = 0;
         ts.tv_nsec = 0;
         sess->since_ping = ts;
+        sess->rtt_usecs = 0;
+        pthread_mutex_init(&sess->window_lock, NULL);
+        pthread_cond_init(&sess->window_opened, NULL);
+        sess->window_growth = 0;
+        pthread_mutex_init(&sess->send_lock, NULL);
+        pthread_cond_init(&sess->send_done, NULL);
+        for (int i = 0; i < YAMUX_PRIORITY_CLASSES; i++) {
+            sess->send_queue[i] = NULL;
+            sess->send_queue_tail[i] = NULL;
+        }
+        sess->sending = 0;
         sess->get_str_ud_fn = NULL;
         sess->ping_fn       = NULL;
         sess->pong_fn       = NULL;
@@ -82,11 +159,20 @@ void yamux_session_free(struct yamux_session* session)
     if (session->free_fn)
         session->free_fn(session);
 
-    for (size_t i = 0; i < session->cap_streams; ++i)
-        if (session->streams[i].alive)
-            yamux_stream_free(session->streams[i].stream);
+    for (size_t i = 0; i < session->cap_streams; ++i) {
+        if (session->streams[i].alive) {
+            // empty the slot first, so yamux_stream_free doesn't rearrange the table under us
+            struct yamux_stream* stream = session->streams[i].stream;
+            session->streams[i].alive = 0;
+            yamux_stream_free(stream);
+        }
+    }
 
     free(session->streams);
+    pthread_cond_destroy(&session->window_opened);
+    pthread_mutex_destroy(&session->window_lock);
+    pthread_cond_destroy(&session->send_done);
+    pthread_mutex_destroy(&session->send_lock);
     free(session);
 }
 
@@ -112,13 +198,11 @@ ssize_t yamux_session_close(struct yamux_session* session, enum yamux_error err)
 
     session->closed = 1;
 
-    struct StreamMessage outgoing;
-    outgoing.data = (uint8_t*)&f;
-    outgoing.data_size = sizeof(struct yamux_frame);
-
-    if (!session->parent_stream->write(session->parent_stream->stream_context, &outgoing))
+    // after whatever data is already on its way
+    encode_frame(&f);
+    if (session->parent_stream == NULL || !yamux_session_send_last_frame(session, session->parent_stream->parent_stream, &f))
     		return 0;
-    return outgoing.data_size;
+    return sizeof(struct yamux_frame);
 }
 
 /***
@@ -141,15 +225,14 @@ ssize_t yamux_session_ping(struct yamux_session* session, uint32_t value, int po
         .length   = value
     };
 
-    if (!timespec_get(&session->since_ping, TIME_UTC))
+    // only time our own pings, not our answers to theirs
+    if (!pong && !timespec_get(&session->since_ping, TIME_UTC))
         return -EACCES;
 
-    struct StreamMessage outgoing;
-    outgoing.data = (uint8_t*)&f;
-    outgoing.data_size = sizeof(struct yamux_frame);
-    if (!session->parent_stream->parent_stream->write(session->parent_stream->parent_stream->stream_context, &outgoing))
+    encode_frame(&f);
+    if (!yamux_session_send_frame(session, session->parent_stream->parent_stream, &f))
     		return 0;
-    return outgoing.data_size;
+    return sizeof(struct yamux_frame);
 }
 
 /***
@@ -164,20 +247,12 @@ int yamux_pull_message_from_frame(const uint8_t* incoming, size_t incoming_size,
 		return 0;
 	}
 	int sz = sizeof(struct yamux_frame);
-	*return_message = libp2p_stream_message_new();
+	*return_message = libp2p_stream_message_new_buffer(incoming_size - sz);
 	struct StreamMessage* msg = *return_message;
 	if (msg == NULL) {
 		libp2p_logger_debug("yamux", "pull_message_from_frame: Unable to allocate memory for message.\n");
 		return 0;
 	}
-	msg->data_size = incoming_size - sz;
-	msg->data = (uint8_t*) malloc(msg->data_size);
-	if (msg->data == NULL) {
-		libp2p_logger_debug("yamux", "pull_message_from_frame: Unable to allocate memory for data portion of message.\n");
-		libp2p_stream_message_free(msg);
-		*return_message = NULL;
-		return 0;
-	}
 	memcpy(msg->data, &incoming[sz], msg->data_size);
 	return 1;
 }
@@ -232,7 +307,7 @@ int yamux_decode(void* context, const uint8_t* incoming, size_t incoming_size, s
                     if (yamux_session->ping_fn)
                         yamux_session->ping_fn(yamux_session, f.length);
                 }
-                else if ((f.flags & yamux_frame_ack) && yamux_session->pong_fn)
+                else if (f.flags & yamux_frame_ack)
                 {
                     struct timespec now, dt, last = yamux_session->since_ping;
                     if (!timespec_get(&now, TIME_UTC))
@@ -247,7 +322,15 @@ int yamux_decode(void* context, const uint8_t* incoming, size_t incoming_size, s
                     else
                         dt.tv_nsec = now.tv_nsec - last.tv_nsec;
 
-                    yamux_session->pong_fn(yamux_session, f.length, dt);
+                    // this feeds the receive window tuning
+                    pthread_mutex_lock(&yamux_session->window_lock);
+                    yamux_session->rtt_usecs = (uint64_t)dt.tv_sec * 1000000 + dt.tv_nsec / 1000;
+                    if (yamux_session->rtt_usecs == 0)
+                        yamux_session->rtt_usecs = 1;
+                    pthread_mutex_unlock(&yamux_session->window_lock);
+
+                    if (yamux_session->pong_fn)
+                        yamux_session->pong_fn(yamux_session, f.length, dt);
                 }
                 else
                     return -EPROTO;
@@ -269,60 +352,56 @@ int yamux_decode(void* context, const uint8_t* incoming, size_t incoming_size, s
     } else {
     	libp2p_logger_debug("yamux", "yamux_decode: received something for yamux stream %d.\n", f.streamid);
     	// we're handling a stream, not something at the yamux protocol level
-        for (size_t i = 0; i < yamux_session->cap_streams; ++i)
+        s = yamux_session_get_stream(yamux_session, f.streamid);
+        if (s != NULL && s->state != yamux_stream_closed) // skip closed streams
         {
-            struct yamux_session_stream* ss = &yamux_session->streams[i];
-            s = ss->stream;
-
-            if (!ss->alive || s->state == yamux_stream_closed) // skip dead or closed streams
-                continue;
-
-            if (s->id == f.streamid) // we have a match between the stored stream and the current stream
-            {
             	libp2p_logger_debug("yamux", "We found our stream id of %d.\n", f.streamid);
-                if (f.flags & yamux_frame_rst)
-                {
-                	libp2p_logger_debug("yamux", "They are asking that stream %d be reset.\n", f.streamid);
-                	// close the stream
-                    s->state = yamux_stream_closed;
-
-                    if (s->rst_fn)
-                        s->rst_fn(s);
-                }
-                else if (f.flags & yamux_frame_fin)
-                {
-                	libp2p_logger_debug("yamux", "They are asking that stream %d be closed.\n", f.streamid);
-                    // local stream didn't initiate FIN
-                    if (s->state != yamux_stream_closing)
-                        yamux_stream_close(libp2p_yamux_get_parent_channel_context(s->stream));
+            if (f.flags & yamux_frame_rst)
+            {
+            	libp2p_logger_debug("yamux", "They are asking that stream %d be reset.\n", f.streamid);
+            	// close the stream
+                s->state = yamux_stream_closed;
 
-                    s->state = yamux_stream_closed;
+                if (s->rst_fn)
+                    s->rst_fn(s);
+            }
+            else if (f.flags & yamux_frame_fin)
+            {
+            	libp2p_logger_debug("yamux", "They are asking that stream %d be closed.\n", f.streamid);
+                // local stream didn't initiate FIN
+                if (s->state != yamux_stream_closing)
+                    yamux_stream_close(libp2p_yamux_get_parent_channel_context(s->stream));
 
-                    if (s->fin_fn)
-                        s->fin_fn(s);
-                }
-                else if (f.flags & yamux_frame_ack)
-                {
-                	libp2p_logger_debug("yamux", "They sent an ack for stream %d.\n", f.streamid);
-                	// acknowldegement
-                    if (s->state != yamux_stream_syn_sent) {
-                    	libp2p_logger_debug("yamux", "We received an ack, but it seems we never sent anything!\n");
-                        return -EPROTO;
-                    }
+                s->state = yamux_stream_closed;
 
-                    s->state = yamux_stream_est;
-                }
-                else if (f.flags) {
-                	libp2p_logger_debug("yamux", "They sent no flags. I don't know what to do. Erroring out.\n");
+                if (s->fin_fn)
+                    s->fin_fn(s);
+            }
+            else if (f.flags & yamux_frame_ack)
+            {
+            	libp2p_logger_debug("yamux", "They sent an ack for stream %d.\n", f.streamid);
+            	// acknowldegement
+                if (s->state != yamux_stream_syn_sent) {
+                	libp2p_logger_debug("yamux", "We received an ack, but it seems we never sent anything!\n");
                     return -EPROTO;
                 }
 
-                libp2p_logger_debug("yamux", "Processing the data after the frame for stream %d, which is %d bytes.\n", f.streamid, incoming_size - frame_size);
+                s->state = yamux_stream_est;
+            }
+            else if (f.flags) {
+            	libp2p_logger_debug("yamux", "They sent no flags. I don't know what to do. Erroring out.\n");
+                return -EPROTO;
+            }
+
+            libp2p_logger_debug("yamux", "Processing the data after the frame for stream %d, which is %d bytes.\n", f.streamid, incoming_size - frame_size);
                	ssize_t re = yamux_stream_process(s, &f, &incoming[frame_size], incoming_size - frame_size);
-                libp2p_logger_debug("yamux", "decode: yamux_stream_process for stream %d returned %d.\n", f.streamid, (int)re);
-                return (re < 0) ? re : (re + incoming_size);
-                //yamux_pull_message_from_frame(incoming, incoming_size, return_message);
-            } // stream id matches
+            libp2p_logger_debug("yamux", "decode: yamux_stream_process for stream %d returned %d.\n", f.streamid, (int)re);
+            if (s->state == yamux_stream_closed) {
+            	// nothing more will come in on this stream, so give up its slot
+            	yamux_stream_free(s);
+            }
+            return (re < 0) ? re : (re + incoming_size);
+            //yamux_pull_message_from_frame(incoming, incoming_size, return_message);
         }
 
         // This stream is not in my list of streams.
@@ -346,19 +425,20 @@ int yamux_decode(void* context, const uint8_t* incoming, size_t incoming_size, s
 					yamux_session->new_stream_fn(yamuxContext, yamuxContext->stream, *return_message);
 				}
 				// handle window update (if there is one)
-				struct yamux_session_stream ss = yamux_session->streams[f.streamid];
-				ss.alive = 1;
-				ss.stream = yamux_stream_new();
-				ss.stream->id = f.streamid;
-				ss.stream->session = yamux_session;
-				ss.stream->state = yamux_stream_syn_recv;
-				ss.stream->window_size = 0;
-				yamux_stream_process(ss.stream, &f, &incoming[frame_size], incoming_size - frame_size);
+				struct yamux_stream* new_stream = yamux_session_get_stream(yamux_session, f.streamid);
+				if (new_stream == NULL) {
+					// new_stream_fn turned it down, and the channel is already gone
+					libp2p_logger_debug("yamux", "session->yamux_decode: Stream %d was closed before it was set up.\n", f.streamid);
+					return 0;
+				}
+				new_stream->state = yamux_stream_syn_recv;
+				// the remote may have asked for more than the default window
+				yamux_stream_process(new_stream, &f, &incoming[frame_size], incoming_size - frame_size);
 				channelContext->state = yamux_stream_syn_recv;
 				if (f.type == yamux_frame_window_update) {
-					libp2p_logger_debug("yamux", "Received window update for stream %d. Sending one back.\n", f.streamid);
-					// send it back
-					yamux_stream_window_update(channelContext, ss.stream->window_size);
+					libp2p_logger_debug("yamux", "Received window update for stream %d. Sending an ack.\n", f.streamid);
+					// acknowledge, and tell them our window
+					yamux_stream_window_update(channelContext, channelContext->receive_window - YAMUX_DEFAULT_WINDOW);
 				}
 				// TODO: Start negotiations of multistream
 				struct Stream* multistream = libp2p_net_multistream_stream_new(yamuxChannelStream, 0);
@@ -383,17 +463,371 @@ int yamux_decode(void* context, const uint8_t* incoming, size_t incoming_size, s
 
 /***
  * Find the correct yamux session stream
+ * NOTE: the window_lock should be held, as the slot moves when the table changes
  * @param streams the collection
  * @param channel the id
  * @returns the correce yamux_session_stream
  */
 struct yamux_session_stream* yamux_get_session_stream(struct yamux_session* session, int channel) {
-    for (size_t i = 0; i < session->cap_streams; ++i)
-    {
-        struct yamux_session_stream* ss = &session->streams[i];
-        if (ss != NULL && ss->stream != NULL && ss->stream->stream != NULL && ss->stream->stream->channel == channel)
-        	return ss;
-    }
-    return NULL;
+	return yamux_session_find_stream(session, (yamux_streamid)channel);
 }
 
+/***
+ * Look up a stream by id, safe against other threads adding or removing streams
+ * @param session the session
+ * @param id the stream id
+ * @returns the stream, or NULL if there is no stream with that id
+ */
+struct yamux_stream* yamux_session_get_stream(struct yamux_session* session, yamux_streamid id) {
+	if (session == NULL)
+		return NULL;
+	pthread_mutex_lock(&session->window_lock);
+	struct yamux_session_stream* ss = yamux_session_find_stream(session, id);
+	struct yamux_stream* stream = (ss == NULL) ? NULL : ss->stream;
+	pthread_mutex_unlock(&session->window_lock);
+	return stream;
+}
+
+/***
+ * Add a stream to the session's stream table, growing the table if necessary
+ * @param session the session
+ * @param stream the stream (its id must be set)
+ * @returns the slot that now holds the stream, or NULL if the id is in use (or out of memory)
+ */
+struct yamux_session_stream* yamux_session_add_stream(struct yamux_session* session, struct yamux_stream* stream) {
+	pthread_mutex_lock(&session->window_lock);
+	if (yamux_session_find_stream(session, stream->id) != NULL) {
+		pthread_mutex_unlock(&session->window_lock);
+		return NULL;
+	}
+	// keep the table at most half full, so probes stay short
+	if ((session->num_streams + 1) * 2 > session->cap_streams) {
+		if (!yamux_session_grow_streams(session)) {
+			pthread_mutex_unlock(&session->window_lock);
+			return NULL;
+		}
+	}
+	struct yamux_session_stream* ss = yamux_session_place_stream(session->streams, session->cap_streams, stream);
+	session->num_streams++;
+	pthread_mutex_unlock(&session->window_lock);
+	return ss;
+}
+
+/***
+ * Take a stream out of the session's stream table, so the slot can be reused
+ * NOTE: this does not free the stream
+ * @param session the session
+ * @param stream the stream (nothing is removed if its id now belongs to another stream)
+ * @returns true(1) if it was found and removed, false(0) otherwise
+ */
+int yamux_session_remove_stream(struct yamux_session* session, struct yamux_stream* stream) {
+	pthread_mutex_lock(&session->window_lock);
+	struct yamux_session_stream* ss = yamux_session_find_stream(session, stream->id);
+	if (ss == NULL || ss->stream != stream) {
+		pthread_mutex_unlock(&session->window_lock);
+		return 0;
+	}
+	size_t mask = session->cap_streams - 1;
+	size_t hole = ss - session->streams;
+	session->streams[hole].alive = 0;
+	session->streams[hole].stream = NULL;
+	session->num_streams--;
+	// shift back anything after the hole that would no longer be found
+	for (size_t i = (hole + 1) & mask; session->streams[i].alive; i = (i + 1) & mask) {
+		size_t home = yamux_session_stream_hash(session->streams[i].stream->id) & mask;
+		// can it move into the hole? Only if its home is not between the hole and where it is now
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			session->streams[hole] = session->streams[i];
+			session->streams[i].alive = 0;
+			session->streams[i].stream = NULL;
+			hole = i;
+		}
+	}
+	// anyone waiting on this stream's window should give up
+	pthread_cond_broadcast(&session->window_opened);
+	pthread_mutex_unlock(&session->window_lock);
+	return 1;
+}
+
+/***
+ * Put a request at the back of the line for its priority class
+ * NOTE: the send_lock should be held
+ * @param session the session
+ * @param request the request
+ */
+void yamux_session_send_enqueue(struct yamux_session* session, struct yamux_send_request* request) {
+	request->next = NULL;
+	if (session->send_queue_tail[request->priority] == NULL)
+		session->send_queue[request->priority] = request;
+	else
+		session->send_queue_tail[request->priority]->next = request;
+	session->send_queue_tail[request->priority] = request;
+}
+
+/***
+ * Take a request out of line
+ * NOTE: the send_lock should be held
+ * @param session the session
+ * @param request the request
+ */
+void yamux_session_send_dequeue(struct yamux_session* session, struct yamux_send_request* request) {
+	struct yamux_send_request* previous = NULL;
+	struct yamux_send_request* current = session->send_queue[request->priority];
+	while (current != NULL && current != request) {
+		previous = current;
+		current = current->next;
+	}
+	if (current == NULL)
+		return;
+	if (previous == NULL)
+		session->send_queue[request->priority] = request->next;
+	else
+		previous->next = request->next;
+	if (session->send_queue_tail[request->priority] == request)
+		session->send_queue_tail[request->priority] = previous;
+	request->next = NULL;
+}
+
+/***
+ * See if data for a stream is still waiting to be sent
+ * NOTE: the send_lock should be held
+ * @param session the session
+ * @param streamid the stream, or 0 for any stream
+ * @param batch the requests that are about to be written
+ * @param batch_size the number of requests in batch
+ * @returns true(1) if some of its data has not been written yet
+ */
+static int yamux_session_send_has_data(struct yamux_session* session, yamux_streamid streamid, struct yamux_send_request** batch, int batch_size) {
+	for (int i = 0; i < batch_size; i++) {
+		if (batch[i]->control == NULL && (streamid == 0 || batch[i]->streamid == streamid))
+			return 1;
+	}
+	for (int priority = 0; priority < YAMUX_PRIORITY_CLASSES; priority++) {
+		for (struct yamux_send_request* request = session->send_queue[priority]; request != NULL; request = request->next) {
+			if (request->control == NULL && (streamid == 0 || request->streamid == streamid))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/***
+ * Send queued frames, one turn at a time, until the given request is finished. The frames of
+ * several turns go out in one write (and so one secio record), up to the coalesce size.
+ * NOTE: the send_lock should be held. It is released while writing.
+ * @param session the session
+ * @param mine the request of the caller
+ */
+void yamux_session_send_queued(struct yamux_session* session, struct yamux_send_request* mine) {
+	size_t quantum = session->config->send_quantum;
+	if (quantum == 0)
+		quantum = YAMUX_DEFAULT_SEND_QUANTUM;
+	size_t coalesce_size = session->config->coalesce_size;
+	while (!mine->done) {
+		struct yamux_frame headers[YAMUX_SEND_MAX_FRAMES];
+		struct yamux_send_request* owners[YAMUX_SEND_MAX_FRAMES];
+		size_t lengths[YAMUX_SEND_MAX_FRAMES];
+		struct iovec outgoing[YAMUX_SEND_MAX_REGIONS];
+		int num_frames = 0;
+		int num_outgoing = 0;
+		size_t write_size = 0;
+		// gather turns until the write is big enough (or nothing else is waiting)
+		while (num_frames < YAMUX_SEND_MAX_FRAMES && num_outgoing + 2 <= YAMUX_SEND_MAX_REGIONS && (num_frames == 0 || write_size < coalesce_size)) {
+			// the first in line, in the highest priority class, that is ready to go
+			struct yamux_send_request* request = NULL;
+			for (int priority = 0; priority < YAMUX_PRIORITY_CLASSES && request == NULL; priority++) {
+				for (request = session->send_queue[priority]; request != NULL; request = request->next) {
+					if (!request->after_data || !yamux_session_send_has_data(session, request->streamid, owners, num_frames))
+						break;
+				}
+			}
+			if (request == NULL)
+				break;
+			yamux_session_send_dequeue(session, request);
+			size_t len = 0;
+			if (request->control != NULL) {
+				headers[num_frames] = *request->control;
+				outgoing[num_outgoing].iov_base = &headers[num_frames];
+				outgoing[num_outgoing].iov_len = sizeof(struct yamux_frame);
+				num_outgoing++;
+			} else {
+				// its turn: up to a quantum of its data
+				request->deficit += quantum;
+				size_t turn = (request->deficit < request->remaining ? request->deficit : request->remaining);
+				int header = num_outgoing++;
+				// the data is not copied, the regions point into the caller's buffers
+				while (len < turn && num_outgoing < YAMUX_SEND_MAX_REGIONS) {
+					size_t region_len = request->regions[request->region].iov_len - request->region_pos;
+					if (region_len > turn - len)
+						region_len = turn - len;
+					outgoing[num_outgoing].iov_base = (uint8_t*)request->regions[request->region].iov_base + request->region_pos;
+					outgoing[num_outgoing].iov_len = region_len;
+					num_outgoing++;
+					len += region_len;
+					request->region_pos += region_len;
+					if (request->region_pos == request->regions[request->region].iov_len) {
+						request->region++;
+						request->region_pos = 0;
+					}
+				}
+				headers[num_frames] = (struct yamux_frame){
+					.version  = YAMUX_VERSION,
+					.type     = yamux_frame_data,
+					.flags    = request->flags,
+					.streamid = request->streamid,
+					.length   = (uint32_t)len
+				};
+				encode_frame(&headers[num_frames]);
+				outgoing[header].iov_base = &headers[num_frames];
+				outgoing[header].iov_len = sizeof(struct yamux_frame);
+				request->flags = 0;
+				request->remaining -= len;
+				request->deficit -= len;
+				if (request->remaining == 0)
+					request->deficit = 0;
+			}
+			owners[num_frames] = request;
+			lengths[num_frames] = len;
+			write_size += sizeof(struct yamux_frame) + len;
+			num_frames++;
+		}
+		if (num_frames == 0)
+			break;
+		// these requests are out of line until the write is done, so others may get in line meanwhile
+		pthread_mutex_unlock(&session->send_lock);
+		int written = libp2p_stream_writev(owners[0]->parent_stream, outgoing, num_outgoing);
+		int error = errno;
+		pthread_mutex_lock(&session->send_lock);
+		for (int i = 0; i < num_frames; i++) {
+			struct yamux_send_request* request = owners[i];
+			if (request->done)
+				continue;
+			if (written != (int)write_size) {
+				libp2p_logger_debug("yamux", "send: Unable to send %d bytes for stream %d.\n", (int)lengths[i], request->streamid);
+				yamux_session_send_dequeue(session, request);
+				request->done = -1;
+				request->error = error;
+				continue;
+			}
+			request->sent += lengths[i];
+			if (request->remaining == 0)
+				request->done = 1;
+			else
+				yamux_session_send_enqueue(session, request); // to the back of the line
+		}
+		pthread_cond_broadcast(&session->send_done);
+	}
+}
+
+/***
+ * Wait in line until a request has been sent
+ * @param session the session
+ * @param request the request
+ */
+void yamux_session_send_wait(struct yamux_session* session, struct yamux_send_request* request) {
+	pthread_mutex_lock(&session->send_lock);
+	yamux_session_send_enqueue(session, request);
+	while (!request->done) {
+		if (!session->sending) {
+			// nobody is sending, so it's up to us
+			session->sending = 1;
+			yamux_session_send_queued(session, request);
+			session->sending = 0;
+			// let a waiting writer take over
+			pthread_cond_broadcast(&session->send_done);
+		} else {
+			pthread_cond_wait(&session->send_done, &session->send_lock);
+		}
+	}
+	pthread_mutex_unlock(&session->send_lock);
+}
+
+/***
+ * Send data frames through the session's scheduler. Writers take turns: each gets to send
+ * up to config->send_quantum bytes (deficit round robin), and higher priority classes go first.
+ * Frames that are waiting together are sent together, up to config->coalesce_size bytes.
+ * NOTE: The caller must already have the window for all of the data
+ * @param session the session
+ * @param parent_stream where the frames go
+ * @param streamid the stream the data is for
+ * @param flags the flags for the first frame
+ * @param priority the priority class (see enum yamux_priority)
+ * @param regions the data
+ * @param num_regions the number of regions
+ * @returns the number of data bytes sent, or -1 if nothing was sent (errno is set)
+ */
+ssize_t yamux_session_send(struct yamux_session* session, struct Stream* parent_stream, yamux_streamid streamid, uint16_t flags, int priority, const struct iovec* regions, int num_regions) {
+	if (session == NULL || parent_stream == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	struct yamux_send_request request;
+	memset(&request, 0, sizeof(struct yamux_send_request));
+	request.parent_stream = parent_stream;
+	request.priority = priority;
+	if (priority < 0 || priority >= YAMUX_PRIORITY_CLASSES)
+		request.priority = yamux_priority_normal;
+	request.streamid = streamid;
+	request.flags = flags;
+	request.regions = regions;
+	request.num_regions = num_regions;
+	for (int i = 0; i < num_regions; i++)
+		request.remaining += regions[i].iov_len;
+
+	yamux_session_send_wait(session, &request);
+
+	if (request.done < 0 && request.sent == 0) {
+		errno = request.error;
+		return -1;
+	}
+	return request.sent;
+}
+
+/***
+ * Send a frame without data (a window update, ping, etc.) through the session's scheduler.
+ * It goes ahead of data frames, and shares a secio record with whatever else is waiting.
+ * @param session the session
+ * @param parent_stream where the frame goes
+ * @param frame the frame, already encoded
+ * @returns true(1) on success, false(0) otherwise
+ */
+int yamux_session_send_frame(struct yamux_session* session, struct Stream* parent_stream, struct yamux_frame* frame) {
+	if (session == NULL || parent_stream == NULL || frame == NULL)
+		return 0;
+	struct yamux_send_request request;
+	memset(&request, 0, sizeof(struct yamux_send_request));
+	request.parent_stream = parent_stream;
+	request.priority = yamux_priority_high;
+	request.control = frame;
+
+	yamux_session_send_wait(session, &request);
+
+	return request.done > 0;
+}
+
+/***
+ * Send a frame that ends a stream (a FIN) or the session (a go away) through the session's
+ * scheduler. It waits for the data already queued for its stream (or, for the session, all
+ * streams), so it can't get there before that data does.
+ * @param session the session
+ * @param parent_stream where the frame goes
+ * @param frame the frame, already encoded
+ * @returns true(1) on success, false(0) otherwise
+ */
+int yamux_session_send_last_frame(struct yamux_session* session, struct Stream* parent_stream, struct yamux_frame* frame) {
+	if (session == NULL || parent_stream == NULL || frame == NULL)
+		return 0;
+	struct yamux_frame decoded = *frame;
+	decode_frame(&decoded);
+	struct yamux_send_request request;
+	memset(&request, 0, sizeof(struct yamux_send_request));
+	request.parent_stream = parent_stream;
+	request.priority = yamux_priority_bulk;
+	request.control = frame;
+	request.after_data = 1;
+	request.streamid = decoded.streamid;
+
+	yamux_session_send_wait(session, &request);
+
+	return request.done > 0;
+}
@@ -4,6 +4,8 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "libp2p/conn/session.h"
 #include "libp2p/net/stream.h"
@@ -11,11 +13,31 @@
 #include "libp2p/yamux/stream.h"
 #include "libp2p/yamux/yamux.h"
 #include "libp2p/utils/logger.h"
+#include "libp2p/os/timespec.h"
 #include "libp2p/utils/threadsafe_buffer.h"
+#include "libp2p/utils/thread_pool.h"
+#include "libp2p/utils/slab.h"
+#include "varint.h"
 
 #define MIN(x,y) (y^((x^y)&-(x<y)))
 #define MAX(x,y) (x^((x^y)&-(x<y)))
 
+// how long a writer waits for the remote to open the window before giving up
+#define YAMUX_WINDOW_TIMEOUT 5
+// the number of threads that run channel handlers
+#define YAMUX_DISPATCH_THREADS 8
+
+// protects read_running, read_pending and read_closed of the channels
+static pthread_mutex_t yamux_dispatch_lock = PTHREAD_MUTEX_INITIALIZER;
+// signalled when a dispatcher thread lets go of a channel
+static pthread_cond_t yamux_dispatch_done = PTHREAD_COND_INITIALIZER;
+static pthread_once_t yamux_dispatcher_once = PTHREAD_ONCE_INIT;
+static threadpool yamux_dispatcher = NULL;
+
+static void yamux_dispatcher_init() {
+	yamux_dispatcher = thpool_init(YAMUX_DISPATCH_THREADS);
+}
+
 // forward declarations
 struct YamuxContext* libp2p_yamux_get_context(void* context);
 struct YamuxChannelContext* libp2p_yamux_get_channel_context(void* context);
@@ -40,40 +62,10 @@ struct Stream* yamux_channel_new(struct YamuxContext* context, yamux_streamid id
         session->nextid += 2;
     }
 
-    struct yamux_stream* y_stream = NULL;
-    struct yamux_session_stream* session_stream = NULL;
-
-    if (session->num_streams != session->cap_streams) {
-    	// attempt to reuse dead streams
-        for (size_t i = 0; i < session->cap_streams; ++i)
-        {
-            session_stream = &session->streams[i];
-
-            if (!session_stream->alive)
-            {
-                y_stream = session_stream->stream;
-                session_stream->alive = 1;
-                goto FOUND;
-            }
-        }
-    }
-
-    if (session->cap_streams == session->config->accept_backlog)
-        return NULL;
-
-    // we didn't find a dead stream, so create a new one
-    session_stream = &session->streams[session->cap_streams];
-
-    if (session_stream->alive)
+    struct yamux_stream* y_stream = libp2p_utils_slab_alloc(sizeof(struct yamux_stream));
+    if (y_stream == NULL)
         return NULL;
 
-    session->cap_streams++;
-
-    session_stream->alive = 1;
-    y_stream = session_stream->stream = malloc(sizeof(struct yamux_stream));
-
-FOUND:;
-
     struct yamux_stream nst = (struct yamux_stream){
         .id          = id,
         .session     = session,
@@ -83,10 +75,21 @@ FOUND:;
         .read_fn = NULL,
         .fin_fn  = NULL,
         .rst_fn  = NULL,
-		.stream  = libp2p_yamux_channel_stream_new(context->stream, id)
+		.stream  = NULL
     };
     *y_stream = nst;
 
+    // fails if the id is already in use
+    if (yamux_session_add_stream(session, y_stream) == NULL) {
+        libp2p_utils_slab_free(y_stream);
+        return NULL;
+    }
+    y_stream->stream = nst.stream = libp2p_yamux_channel_stream_new(context->stream, id);
+    if (nst.stream == NULL) {
+        yamux_stream_free(y_stream);
+        return NULL;
+    }
+
     /*
     if (libp2p_protocol_marshal(msg, nst.stream, context->protocol_handlers) >= 0) {
     	// success
@@ -112,13 +115,11 @@ int yamux_write_frame(void* context, struct yamux_frame* f) {
 	if (context == NULL)
 		return 0;
 	encode_frame(f);
-	struct StreamMessage outgoing;
-	outgoing.data = (uint8_t*)f;
-	outgoing.data_size = sizeof(struct yamux_frame);
 	struct YamuxContext* ctx = libp2p_yamux_get_context(context);
-	if (!ctx->stream->parent_stream->write(ctx->stream->parent_stream->stream_context, &outgoing))
+	// in line with the data frames, so it can ride along in the same record
+	if (!yamux_session_send_frame(ctx->session, ctx->stream->parent_stream, f))
 		return 0;
-	return outgoing.data_size;
+	return sizeof(struct yamux_frame);
 }
 
 /***
@@ -267,15 +268,172 @@ ssize_t yamux_stream_window_update(struct YamuxChannelContext* channel_ctx, int3
         .length   = (uint32_t)delta
     };
 
+    // count it before they can act on it
+    struct yamux_session* session = channel_ctx->yamux_context->session;
+    if (delta > 0 && session != NULL) {
+        pthread_mutex_lock(&session->window_lock);
+        channel_ctx->receive_remaining += delta;
+        pthread_mutex_unlock(&session->window_lock);
+    }
+
     return yamux_write_frame(channel_ctx->yamux_context->stream->stream_context, &f);
 }
 
+/***
+ * The application has read bytes out of the channel's buffer. Once half of the
+ * receive window has been read, tell the remote it can send more. If the window
+ * is being used up in less than a few round trips, it is what is holding the
+ * stream back, so grow it (within the limits of the config).
+ * @param channel_ctx the channel
+ * @param bytes the number of bytes read
+ */
+void yamux_stream_consumed(struct YamuxChannelContext* channel_ctx, size_t bytes)
+{
+    if (channel_ctx == NULL || bytes == 0 || channel_ctx->yamux_context == NULL || channel_ctx->yamux_context->session == NULL)
+        return;
+    struct yamux_session* session = channel_ctx->yamux_context->session;
+    struct yamux_config* config = session->config;
+    uint32_t delta = 0;
+    int need_rtt = 0;
+
+    pthread_mutex_lock(&session->window_lock);
+    // some of it may have been given back before it was read
+    size_t credited = bytes < channel_ctx->receive_credited ? bytes : channel_ctx->receive_credited;
+    channel_ctx->receive_credited -= credited;
+    channel_ctx->receive_consumed += bytes - credited;
+    if (channel_ctx->receive_consumed > 0 && channel_ctx->receive_consumed >= channel_ctx->receive_window / 2) {
+        struct timespec now;
+        timespec_get(&now, TIME_UTC);
+        uint64_t elapsed = (uint64_t)(now.tv_sec - channel_ctx->receive_window_time.tv_sec) * 1000000
+                + (now.tv_nsec - channel_ctx->receive_window_time.tv_nsec) / 1000;
+        delta = channel_ctx->receive_consumed;
+        if (session->rtt_usecs == 0) {
+            need_rtt = (session->since_ping.tv_sec == 0 && session->since_ping.tv_nsec == 0);
+        } else if (elapsed < session->rtt_usecs * 4 && channel_ctx->receive_window < config->max_stream_window_size) {
+            // double it, if we can
+            size_t growth = channel_ctx->receive_window;
+            if (growth > config->max_stream_window_size - channel_ctx->receive_window)
+                growth = config->max_stream_window_size - channel_ctx->receive_window;
+            if (session->window_growth + growth > config->max_session_window_growth)
+                growth = config->max_session_window_growth > session->window_growth ? config->max_session_window_growth - session->window_growth : 0;
+            if (growth > 0) {
+                libp2p_logger_debug("yamux", "Growing the receive window of channel %d to %d.\n", channel_ctx->channel, (int)(channel_ctx->receive_window + growth));
+                channel_ctx->receive_window += growth;
+                session->window_growth += growth;
+                delta += growth;
+            }
+        }
+        channel_ctx->receive_consumed = 0;
+        channel_ctx->receive_window_time = now;
+    }
+    pthread_mutex_unlock(&session->window_lock);
+
+    if (delta > 0)
+        yamux_stream_window_update(channel_ctx, delta);
+    // we can't tune without knowing how far away they are
+    if (need_rtt)
+        yamux_session_ping(session, 0, 0);
+}
+
+/***
+ * The buffer holds part of a message the child can't read yet. If the part is half the
+ * receive window, give the window back now, or a message bigger than the window could
+ * never arrive. Nothing is given back once max_stream_window_size bytes are waiting.
+ * @param channel_ctx the channel
+ */
+void yamux_stream_credit_buffered(struct YamuxChannelContext* channel_ctx)
+{
+    if (channel_ctx == NULL || channel_ctx->yamux_context == NULL || channel_ctx->yamux_context->session == NULL)
+        return;
+    struct yamux_session* session = channel_ctx->yamux_context->session;
+    uint32_t delta = 0;
+
+    pthread_mutex_lock(&session->window_lock);
+    size_t buffered = threadsafe_buffer_size(channel_ctx->buffer);
+    size_t uncredited = buffered > channel_ctx->receive_credited ? buffered - channel_ctx->receive_credited : 0;
+    if (buffered < session->config->max_stream_window_size
+            && uncredited + channel_ctx->receive_consumed >= channel_ctx->receive_window / 2) {
+        delta = uncredited + channel_ctx->receive_consumed;
+        channel_ctx->receive_credited += uncredited;
+        channel_ctx->receive_consumed = 0;
+        timespec_get(&channel_ctx->receive_window_time, TIME_UTC);
+    }
+    pthread_mutex_unlock(&session->window_lock);
+
+    if (delta > 0) {
+        libp2p_logger_debug("yamux", "Giving back %d bytes of channel %d that are waiting for the rest of a message.\n", (int)delta, channel_ctx->channel);
+        yamux_stream_window_update(channel_ctx, delta);
+    }
+}
+
+/***
+ * A channel is going away. Give back what its receive window grew, so other channels can use it.
+ * @param channel_ctx the channel
+ */
+void yamux_stream_release_window(struct YamuxChannelContext* channel_ctx)
+{
+    if (channel_ctx == NULL || channel_ctx->yamux_context == NULL || channel_ctx->yamux_context->session == NULL)
+        return;
+    struct yamux_session* session = channel_ctx->yamux_context->session;
+    pthread_mutex_lock(&session->window_lock);
+    if (channel_ctx->receive_window > YAMUX_DEFAULT_WINDOW) {
+        session->window_growth -= channel_ctx->receive_window - YAMUX_DEFAULT_WINDOW;
+        channel_ctx->receive_window = YAMUX_DEFAULT_WINDOW;
+    }
+    pthread_mutex_unlock(&session->window_lock);
+}
+
+/***
+ * Take bytes from the send window of a channel, waiting for the remote to open it if it is empty
+ * @param channel_ctx the channel
+ * @param wanted the number of bytes we would like to send
+ * @returns the number of bytes that may be sent now (up to wanted), or 0 if the window stayed closed
+ */
+uint32_t yamux_stream_reserve_window(struct YamuxChannelContext* channel_ctx, uint32_t wanted)
+{
+    // a channel that is not registered has no window
+    if (channel_ctx == NULL || channel_ctx->yamux_context == NULL || channel_ctx->yamux_context->session == NULL)
+        return 0;
+    struct yamux_session* session = channel_ctx->yamux_context->session;
+    uint32_t allowed = 0;
+
+    pthread_mutex_lock(&session->window_lock);
+    struct yamux_session_stream* ss = yamux_get_session_stream(session, channel_ctx->channel);
+    if (ss != NULL) {
+        struct yamux_stream* stream = ss->stream;
+        if (stream->window_size == 0) {
+            struct timespec deadline;
+            timespec_get(&deadline, TIME_UTC);
+            deadline.tv_sec += YAMUX_WINDOW_TIMEOUT;
+            while (stream->window_size == 0 && !session->closed) {
+                if (pthread_cond_timedwait(&session->window_opened, &session->window_lock, &deadline) == ETIMEDOUT)
+                    break;
+                // the stream may have been closed while we waited
+                ss = yamux_get_session_stream(session, channel_ctx->channel);
+                if (ss == NULL || ss->stream != stream)
+                    break;
+            }
+            if (ss == NULL || ss->stream != stream) {
+                // it was closed while we waited
+                pthread_mutex_unlock(&session->window_lock);
+                return 0;
+            }
+        }
+        allowed = wanted;
+        if (allowed > stream->window_size)
+            allowed = stream->window_size;
+        stream->window_size -= allowed;
+    }
+    pthread_mutex_unlock(&session->window_lock);
+    return allowed;
+}
+
 /***
  * Write data to the stream.
  * @param stream the stream (includes the "channel")
  * @param data_length the length of the data to be sent
  * @param data_ the data to be sent
- * @return the number of bytes sent
+ * @return the number of bytes sent, -EAGAIN if the connection or the remote's window is backed up, or -EIO on error
  */
 ssize_t yamux_stream_write(struct YamuxChannelContext* channel_ctx, uint32_t data_length, void* data_)
 {
@@ -291,36 +449,29 @@ ssize_t yamux_stream_write(struct YamuxChannelContext* channel_ctx, uint32_t dat
     // gather details
     char* data = (char*)data_;
     char* data_end = data + data_length;
-    uint32_t ws = channel_ctx->window_size;
     uint32_t id = channel_ctx->channel;
+    struct Stream* parent_stream = channel_ctx->yamux_context->stream->parent_stream;
 
-    char sendd[ws + sizeof(struct yamux_frame)];
-
-    // Send the data, breaking it up into pieces if it is too large
+    // Send the data, one frame per piece of window the remote gives us
     while (data < data_end) {
-        uint32_t dr  = (uint32_t)(data_end - data); // length of the data for this round
-        uint32_t adv = MIN(dr, ws); // the size of the data we will send this round
-
-        struct yamux_frame f = (struct yamux_frame){
-            .version  = YAMUX_VERSION   ,
-            .type     = yamux_frame_data,
-            .flags    = get_flags(channel_ctx),
-            .streamid = id,
-            .length   = adv
-        };
-
-        encode_frame(&f);
-        // put the frame into the buffer
-        memcpy(sendd, &f, sizeof(struct yamux_frame));
-        // put the data into the buffer
-        memcpy(sendd + sizeof(struct yamux_frame), data, (size_t)adv);
-
-        // send the buffer through the network
-        struct StreamMessage outgoing;
-        outgoing.data = (uint8_t*)sendd;
-        outgoing.data_size = adv + sizeof(struct yamux_frame);
-        if (!channel_ctx->yamux_context->stream->parent_stream->write(channel_ctx->yamux_context->stream->parent_stream->stream_context, &outgoing))
-        		return adv;
+        uint32_t adv = yamux_stream_reserve_window(channel_ctx, (uint32_t)(data_end - data)); // the size of the data we will send this round
+        if (adv == 0) {
+        	// the remote isn't reading
+        	if (data == (char*)data_)
+        		return -EAGAIN;
+        	return data - (char*)data_;
+        }
+
+        // send it when our turn comes, without copying it
+        struct iovec outgoing;
+        outgoing.iov_base = data;
+        outgoing.iov_len = adv;
+        if (yamux_session_send(channel_ctx->yamux_context->session, parent_stream, id, get_flags(channel_ctx), channel_ctx->priority, &outgoing, 1) != (ssize_t)adv) {
+        	// the connection is backed up, or gone. Report what made it out
+        	if (data == (char*)data_)
+        		return errno == EAGAIN ? -EAGAIN : -EIO;
+        	return data - (char*)data_;
+        }
 
         // prepare to loop again
         data += adv;
@@ -341,80 +492,166 @@ void yamux_stream_free(struct yamux_stream* stream)
     if (stream->free_fn)
         stream->free_fn(stream);
 
-    struct yamux_stream s = *stream;
-
-    for (size_t i = 0; i < s.session->cap_streams; ++i)
-    {
-        struct yamux_session_stream* ss = &s.session->streams[i];
-        if (ss->alive && ss->stream->id == s.id)
-        {
-            ss->alive = 0;
+    // give up the slot, if it is still ours
+    if (stream->session != NULL)
+        yamux_session_remove_stream(stream->session, stream);
 
-            s.session->num_streams--;
-            if (i == s.session->cap_streams - 1)
-                s.session->cap_streams--;
+    libp2p_utils_slab_free(stream);
+}
 
-            break;
-        }
-    }
+struct yamux_stream* yamux_stream_new() {
+	return (struct yamux_stream*) libp2p_utils_slab_calloc(sizeof(struct yamux_stream));
+}
 
-    free(stream);
+/***
+ * See if the child prefixes its messages with a varint length. Multistream, and the
+ * protocols it negotiates, do. Other children are handed whatever is buffered.
+ * @param child_stream the child of the channel
+ * @returns true(1) if the child's messages have a varint length
+ */
+static int yamux_channel_child_is_framed(const struct Stream* child_stream) {
+	return child_stream->stream_type == STREAM_TYPE_MULTISTREAM
+			|| child_stream->stream_type == STREAM_TYPE_IDENTIFY
+			|| child_stream->stream_type == STREAM_TYPE_KADEMLIA;
 }
 
-struct yamux_stream* yamux_stream_new() {
-	struct yamux_stream* out = (struct yamux_stream*) malloc(sizeof(struct yamux_stream));
-	if (out != NULL) {
-		memset(out, 0, sizeof(struct yamux_stream));
+/***
+ * See if the child can read without waiting on the network
+ * @param context the YamuxChannelContext
+ * @returns true(1) if a complete message (or, for a child without varint lengths, anything) is buffered
+ */
+static int yamux_channel_has_message(struct YamuxChannelContext* context) {
+	if (context->child_stream != NULL && !yamux_channel_child_is_framed(context->child_stream))
+		return threadsafe_buffer_size(context->buffer) > 0;
+	uint8_t header[10];
+	size_t header_size = threadsafe_buffer_peek(context->buffer, header, sizeof(header));
+	for(size_t i = 0; i < header_size; i++) {
+		if (header[i] >> 7 == 0) {
+			size_t varint_length = 0;
+			uint64_t message_size = varint_decode(header, i + 1, &varint_length);
+			return threadsafe_buffer_size(context->buffer) >= varint_length + message_size;
+		}
 	}
-	return out;
+	// a length can't be that long, let the child find out what it is
+	return header_size == sizeof(header);
 }
 
 /***
- * Called by notify_child_stream_has_data to process incoming data (perhaps)
+ * Called by the dispatcher to process incoming data (perhaps)
+ * NOTE: only whole messages are read, and with no timeout, so this never waits on the
+ * network. The rest of a message is handled when the frame that completes it comes in.
  * @param args a YamuxChannelContext
  * @returns NULL;
  */
 void* yamux_read_method(void* args) {
 	struct YamuxChannelContext* context = (struct YamuxChannelContext*) args;
-	context->read_running = 1;
 	struct StreamMessage* message = NULL;
-	// continue to read until the buffer is empty
-	while (context->buffer->buffer_size > 0) {
-		if (context->child_stream == NULL || context->child_stream->stream_context == NULL || context->child_stream->read == NULL) {
-			libp2p_logger_error("yamux", "read_method: Child stream not set up properly for channel %d.\n", context->channel);
-			context->read_running = 0;
-			return NULL;
-		}
+	// continue to read until there is not a whole message left
+	while (!__atomic_load_n(&context->read_closed, __ATOMIC_ACQUIRE) && yamux_channel_has_message(context)) {
 		struct Stream* child_stream = context->child_stream;
-		if (child_stream == NULL || child_stream->read == NULL) {
+		if (child_stream == NULL || child_stream->stream_context == NULL || child_stream->read == NULL) {
 			libp2p_logger_error("yamux", "read_method: Child stream not set up properly for channel %d.\n", context->channel);
-			context->read_running = 0;
 			return NULL;
 		}
-		if (context->child_stream->read(context->child_stream->stream_context, &message, 5) && message != NULL) {
-			libp2p_logger_debug("yamux", "read_method: read returned a message of %d bytes. [%s]\n", message->data_size, message->data);
-			int retVal = libp2p_protocol_marshal(message, context->child_stream, context->yamux_context->protocol_handlers);
-			libp2p_logger_debug("yamux", "read_method: protocol_marshal returned %d.\n", retVal);
-			libp2p_stream_message_free(message);
-		} else {
+		if (!child_stream->read(child_stream->stream_context, &message, 0) || message == NULL) {
 			libp2p_logger_debug("yamux", "read_method: read returned false.\n");
+			return NULL;
 		}
+		libp2p_logger_debug("yamux", "read_method: read returned a message of %d bytes. [%s]\n", message->data_size, message->data);
+		int retVal = libp2p_protocol_marshal(message, child_stream, context->yamux_context->protocol_handlers);
+		libp2p_logger_debug("yamux", "read_method: protocol_marshal returned %d.\n", retVal);
+		libp2p_stream_message_free(message);
+		message = NULL;
 	}
-	context->read_running = 0;
 	return NULL;
 }
 
+/***
+ * The threads that run channel handlers, shared by all sessions
+ * @returns the thread pool
+ */
+threadpool yamux_get_dispatcher() {
+	pthread_once(&yamux_dispatcher_once, yamux_dispatcher_init);
+	return yamux_dispatcher;
+}
+
+/***
+ * Run on a dispatcher thread. Handles what a channel has waiting, then lets it be
+ * dispatched again. A channel is only handled by one thread at a time, so its
+ * messages are handled in order.
+ * @param args the YamuxChannelContext
+ */
+void yamux_dispatch_channel(void* args) {
+	struct YamuxChannelContext* context = (struct YamuxChannelContext*) args;
+	pthread_mutex_lock(&yamux_dispatch_lock);
+	context->read_thread = pthread_self();
+	pthread_mutex_unlock(&yamux_dispatch_lock);
+	yamux_read_method(context);
+	pthread_mutex_lock(&yamux_dispatch_lock);
+	if (context->read_pending && !context->read_closed) {
+		// more came in while we were busy. Go to the back of the line, so other channels get a turn
+		context->read_pending = 0;
+		pthread_mutex_unlock(&yamux_dispatch_lock);
+		if (thpool_add_work(yamux_get_dispatcher(), yamux_dispatch_channel, context) == 0)
+			return;
+		pthread_mutex_lock(&yamux_dispatch_lock);
+	}
+	context->read_running = 0;
+	// the handler closed the channel from this thread, so it was left for us to free
+	int free_channel = context->read_closed > 1;
+	pthread_cond_broadcast(&yamux_dispatch_done);
+	pthread_mutex_unlock(&yamux_dispatch_lock);
+	if (free_channel)
+		libp2p_yamux_channel_free(context);
+}
+
+/***
+ * A channel is being closed. Stop handing it to the dispatcher, and wait for a
+ * dispatcher thread that has it to let go.
+ * @param context the YamuxChannelContext
+ * @returns true(1) if the caller may free the channel now, false(0) if we were called
+ * from the channel's own handler, and the dispatcher thread will free it when the handler returns
+ */
+int yamux_stream_dispatch_stop(struct YamuxChannelContext* context) {
+	pthread_mutex_lock(&yamux_dispatch_lock);
+	context->read_closed = 1;
+	if (context->read_running && pthread_equal(context->read_thread, pthread_self())) {
+		context->read_closed = 2;
+		pthread_mutex_unlock(&yamux_dispatch_lock);
+		return 0;
+	}
+	while (context->read_running)
+		pthread_cond_wait(&yamux_dispatch_done, &yamux_dispatch_lock);
+	pthread_mutex_unlock(&yamux_dispatch_lock);
+	return 1;
+}
+
 /**
- * spin off a new thread to handle a child's reading of data
+ * Have a dispatcher thread handle a child's reading of data
  * @param context the YamuxChannelContext
+ * @returns true(1) if the channel was handed to the dispatcher, false(0) if it is already there (or on error)
  */
 int libp2p_yamux_notify_child_stream_has_data(struct YamuxChannelContext* context) {
-	if (!context->read_running) {
-		pthread_t new_thread;
-
-		if (pthread_create(&new_thread, NULL, yamux_read_method, context) == 0)
-			return 1;
+	pthread_mutex_lock(&yamux_dispatch_lock);
+	if (context->read_closed) {
+		pthread_mutex_unlock(&yamux_dispatch_lock);
+		return 0;
+	}
+	if (context->read_running) {
+		// it will look again when it is done
+		context->read_pending = 1;
+		pthread_mutex_unlock(&yamux_dispatch_lock);
+		return 0;
 	}
+	context->read_running = 1;
+	context->read_pending = 0;
+	pthread_mutex_unlock(&yamux_dispatch_lock);
+	if (thpool_add_work(yamux_get_dispatcher(), yamux_dispatch_channel, context) == 0)
+		return 1;
+	libp2p_logger_error("yamux", "Unable to dispatch channel %d.\n", context->channel);
+	pthread_mutex_lock(&yamux_dispatch_lock);
+	context->read_running = 0;
+	pthread_mutex_unlock(&yamux_dispatch_lock);
 	return 0;
 }
 
@@ -435,9 +672,13 @@ ssize_t yamux_stream_process(struct yamux_stream* stream, struct yamux_frame* fr
         case yamux_frame_window_update:
             {
             	libp2p_logger_debug("yamux", "stream_process: We received a window update.\n");
+            	pthread_mutex_lock(&stream->session->window_lock);
                 uint64_t nws = (uint64_t) ( (int64_t)stream->window_size + (int64_t)(int32_t)f.length );
                 nws &= 0xFFFFFFFFLL;
                 stream->window_size = (uint32_t)nws;
+                // wake up anyone waiting to send
+                pthread_cond_broadcast(&stream->session->window_opened);
+            	pthread_mutex_unlock(&stream->session->window_lock);
             }
             //no break
         case yamux_frame_data:
@@ -467,12 +708,26 @@ ssize_t yamux_stream_process(struct yamux_stream* stream, struct yamux_frame* fr
                 	libp2p_logger_error("yamux", "Unable to get channel context for stream %d.\n", frame->streamid);
                 	return -EPROTO;
                 }
+                if (f.type == yamux_frame_data) {
+                    // they may not send more than we said we would take
+                    pthread_mutex_lock(&stream->session->window_lock);
+                    int overrun = incoming_size > channelContext->receive_remaining;
+                    if (!overrun)
+                        channelContext->receive_remaining -= incoming_size;
+                    pthread_mutex_unlock(&stream->session->window_lock);
+                    if (overrun) {
+                        libp2p_logger_error("yamux", "Stream %d sent %d bytes with only %d left in its window. Resetting it.\n", frame->streamid, (int)incoming_size, (int)channelContext->receive_remaining);
+                        yamux_stream_reset(channelContext);
+                        stream->state = yamux_stream_closed;
+                        return incoming_size;
+                    }
+                }
                 libp2p_logger_debug("yamux", "writing %d bytes to channel context %d.\n", incoming_size, channelContext->channel);
                 threadsafe_buffer_write(channelContext->buffer, incoming, incoming_size);
                 if(channelContext->child_stream == NULL) {
-                	// we have to handle this ourselves
+                	// we have to handle this ourselves (there is no child to read the buffer, so we are its reader)
                 	// see if we have the entire message
-                	int buffer_size = channelContext->buffer->buffer_size;
+                	int buffer_size = threadsafe_buffer_size(channelContext->buffer);
                 	uint8_t buffer[buffer_size];
                 	buffer_size = threadsafe_buffer_peek(channelContext->buffer, buffer, buffer_size);
                 	struct StreamMessage message;
@@ -481,15 +736,17 @@ ssize_t yamux_stream_process(struct yamux_stream* stream, struct yamux_frame* fr
                 	if (libp2p_protocol_is_valid_protocol(&message, channelContext->yamux_context->protocol_handlers)) {
                 		// marshal the call
                 		buffer_size = threadsafe_buffer_read(channelContext->buffer, buffer, buffer_size);
+                		yamux_stream_consumed(channelContext, buffer_size);
                 		message.data_size = buffer_size;
                 		message.data = buffer;
                 		libp2p_protocol_marshal(&message, stream->stream, channelContext->yamux_context->protocol_handlers);
                 	}
                 } else {
                 	// Alert the child protocol that these bytes came in.
-                	// NOTE: We're doing the work in a separate thread
-                	// we tell them, and they need to be smart enough to see if this is a complete message or not
+                	// NOTE: We're doing the work in a separate thread, once there is a whole message to read
                 	libp2p_yamux_notify_child_stream_has_data(channelContext);
+                	if (!yamux_channel_has_message(channelContext))
+                		yamux_stream_credit_buffered(channelContext);
                 	/*
                 	struct StreamMessage* message = NULL;
                 	if (channelContext->child_stream->read(channelContext->child_stream->stream_context, &message, 5) && message != NULL) {
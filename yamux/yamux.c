@@ -1,5 +1,7 @@
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
 #include "varint.h"
 #include "libp2p/yamux/session.h"
 #include "libp2p/yamux/yamux.h"
@@ -8,6 +10,8 @@
 #include "libp2p/net/connectionstream.h"
 #include "libp2p/conn/session.h"
 #include "libp2p/utils/logger.h"
+#include "libp2p/os/timespec.h"
+#include "libp2p/utils/readiness.h"
 
 // function declarations that we don't want in the header file
 int libp2p_yamux_channels_free(struct YamuxContext* ctx);
@@ -104,6 +108,7 @@ int yamux_handle_message(const struct StreamMessage* msg, struct Stream* stream,
 			//TODO: check to make sure they sent the yamux protocol id
 			// we sent a protocol ID, and this is them responding
 			ctx->state = yamux_stream_est;
+			libp2p_utils_readiness_signal();
 		}
 		return 1;
 	}
@@ -113,6 +118,7 @@ int yamux_handle_message(const struct StreamMessage* msg, struct Stream* stream,
 	if (new_stream != NULL) {
 		struct YamuxContext* ctx = (struct YamuxContext*) new_stream->stream_context;
 		ctx->state = yamux_stream_est;
+		libp2p_utils_readiness_signal();
 		// upgrade
 		return stream->handle_upgrade(stream, new_stream);
 	}
@@ -140,6 +146,7 @@ struct Libp2pProtocolHandler* libp2p_yamux_build_protocol_handler(struct Libp2pV
 		}
 		ctx->protocol_handlers = handlers;
 		handler->context = ctx;
+		handler->protocol_id = "/yamux/1.0.0";
 		handler->CanHandle = yamux_can_handle;
 		handler->HandleMessage = yamux_handle_message;
 		handler->Shutdown = yamux_shutdown;
@@ -153,25 +160,10 @@ struct Libp2pProtocolHandler* libp2p_yamux_build_protocol_handler(struct Libp2pV
  * @returns true(1) on success, false(0) on error
  */
 int libp2p_yamux_send_go_away(struct Stream* stream) {
-	struct YamuxChannelContext* channel = libp2p_yamux_get_channel_context(stream->stream_context);
 	struct YamuxContext* ctx = libp2p_yamux_get_context(stream->stream_context);
-	if (ctx != NULL) {
-		struct StreamMessage* msg = libp2p_stream_message_new();
-		msg->data_size = sizeof(struct yamux_frame);
-		msg->data = malloc(msg->data_size);
-		struct yamux_frame* f = (struct yamux_frame*) msg->data;
-		f->type = yamux_frame_go_away;
-		f->flags = yamux_frame_fin;
-		f->streamid = 0;
-		f->version = 0;
-		f->length = 0;
-		if (channel != NULL) {
-			f->streamid = channel->channel;
-		}
-		encode_frame(f);
-		stream->parent_stream->write(stream->parent_stream->stream_context, msg);
-		libp2p_stream_message_free(msg);
-		return 1;
+	if (ctx != NULL && ctx->session != NULL) {
+		// behind the data that is already queued
+		return yamux_session_close(ctx->session, yamux_error_normal) > 0;
 	}
 	return 0;
 }
@@ -198,29 +190,117 @@ int libp2p_yamux_close(struct Stream* stream) {
 }
 
 /***
- * Determine if the incoming is a data frame, but we need more data
- * @param incoming the incoming message
- * @returns > 0 if we need more data, 0 if not
+ * Determine how big the frame at the front of the buffer is
+ * @param data the bytes from the network
+ * @param data_size the number of bytes
+ * @returns the size of the frame (header and data), or 0 if the header has not all arrived
  */
-int yamux_more_to_read(struct StreamMessage* incoming) {
-	if (incoming == NULL)
-		return 0;
-	if (incoming->data_size < 12) {
+size_t yamux_next_frame_size(const uint8_t* data, size_t data_size) {
+	if (data_size < sizeof(struct yamux_frame))
 		return 0;
+	struct yamux_frame frame;
+	memcpy(&frame, data, sizeof(struct yamux_frame));
+	decode_frame(&frame);
+	if (frame.type != yamux_frame_data)
+		return sizeof(struct yamux_frame);
+	return sizeof(struct yamux_frame) + frame.length;
+}
+
+/***
+ * Decode every complete frame in the buffer. Frames are decoded where they sit,
+ * so their data is only copied once, into the channel's buffer.
+ * NOTE: frames are not sliced out of the record. A channel's buffer is a byte queue
+ * that children read in pieces of any size, and a frame can span records.
+ * @param ctx the YamuxContext
+ * @param data the bytes from the network
+ * @param data_size the number of bytes
+ * @param message where to put a message for the caller. Decoding stops after the frame that produced it.
+ * @param num_frames incremented for each frame decoded
+ * @returns the number of bytes used, or -1 on error
+ */
+long yamux_decode_frames(struct YamuxContext* ctx, const uint8_t* data, size_t data_size, struct StreamMessage** message, int* num_frames) {
+	// no receive window grows past this, so a bigger frame is never allowed (and would all be buffered)
+	size_t max_frame_size = sizeof(struct yamux_frame) + YAMUX_DEFAULT_MAX_WINDOW;
+	if (ctx->session != NULL && ctx->session->config != NULL)
+		max_frame_size = sizeof(struct yamux_frame) + ctx->session->config->max_stream_window_size;
+	size_t pos = 0;
+	while (*message == NULL) {
+		size_t frame_size = yamux_next_frame_size(&data[pos], data_size - pos);
+		if (frame_size > max_frame_size) {
+			libp2p_logger_error("yamux", "decode_frames: A frame of %lu bytes is larger than the receive window allows.\n", (unsigned long)frame_size);
+			return -1;
+		}
+		if (frame_size == 0 || frame_size > data_size - pos)
+			break; // the rest hasn't arrived yet
+		if (data[pos] != YAMUX_VERSION) {
+			libp2p_logger_error("yamux", "decode_frames: Incorrect Yamux version. Expected %d but received %d.\n", YAMUX_VERSION, data[pos]);
+			return -1;
+		}
+		if (yamux_decode(ctx, &data[pos], frame_size, message) < 0) {
+			libp2p_logger_error("yamux", "yamux_decode returned error.\n");
+			return -1;
+		}
+		pos += frame_size;
+		(*num_frames)++;
+		// The message may not have anything in it. If so, everything has been handled
+		if (*message != NULL && (*message)->data_size == 0) {
+			libp2p_stream_message_free(*message);
+			*message = NULL;
+		}
 	}
-	// get frame
-	struct yamux_frame* original_frame = (struct yamux_frame*)incoming->data;
-	struct yamux_frame* copy = (struct yamux_frame*) malloc(sizeof(struct yamux_frame));
-	memcpy(copy, original_frame, sizeof(struct yamux_frame));
-	decode_frame(copy);
-	if (copy->type == yamux_frame_data) {
-		libp2p_logger_debug("yamux", "Checking frame sizes. It says we should have %d, and I see %d.\n", copy->length, incoming->data_size - sizeof(struct yamux_frame));
-		int retVal = copy->length - (incoming->data_size - sizeof(struct yamux_frame));
-		free(copy);
-		return retVal;
+	return pos;
+}
+
+/***
+ * Keep bytes that could not be decoded yet
+ * @param ctx the YamuxContext
+ * @param data the bytes
+ * @param data_size the number of bytes
+ * @returns true(1) on success, false(0) otherwise
+ */
+int yamux_frame_buffer_append(struct YamuxContext* ctx, const uint8_t* data, size_t data_size) {
+	if (data_size == 0)
+		return 1;
+	if (ctx->frame_buffer_pos + ctx->frame_buffer_size + data_size > ctx->frame_buffer_capacity) {
+		// what was already decoded can be dropped from the front
+		if (ctx->frame_buffer_pos > 0) {
+			memmove(ctx->frame_buffer, &ctx->frame_buffer[ctx->frame_buffer_pos], ctx->frame_buffer_size);
+			ctx->frame_buffer_pos = 0;
+		}
+		if (ctx->frame_buffer_size + data_size > ctx->frame_buffer_capacity) {
+			size_t capacity = (ctx->frame_buffer_capacity == 0 ? 1024 : ctx->frame_buffer_capacity);
+			while (capacity < ctx->frame_buffer_size + data_size)
+				capacity *= 2;
+			uint8_t* bigger = (uint8_t*) realloc(ctx->frame_buffer, capacity);
+			if (bigger == NULL) {
+				libp2p_logger_error("yamux", "frame_buffer_append: Unable to allocate %d bytes.\n", (int)capacity);
+				return 0;
+			}
+			ctx->frame_buffer = bigger;
+			ctx->frame_buffer_capacity = capacity;
+		}
 	}
-	free(copy);
-	return 0;
+	memcpy(&ctx->frame_buffer[ctx->frame_buffer_pos + ctx->frame_buffer_size], data, data_size);
+	ctx->frame_buffer_size += data_size;
+	return 1;
+}
+
+/***
+ * Decode what is waiting in the frame buffer
+ * @param ctx the YamuxContext
+ * @param message where to put a message for the caller
+ * @param num_frames incremented for each frame decoded
+ * @returns true(1) on success, false(0) on error
+ */
+int yamux_frame_buffer_decode(struct YamuxContext* ctx, struct StreamMessage** message, int* num_frames) {
+	long used = yamux_decode_frames(ctx, &ctx->frame_buffer[ctx->frame_buffer_pos], ctx->frame_buffer_size, message, num_frames);
+	if (used < 0)
+		return 0;
+	ctx->frame_buffer_pos += used;
+	ctx->frame_buffer_size -= used;
+	if (ctx->frame_buffer_size == 0)
+		ctx->frame_buffer_pos = 0;
+	return 1;
 }
 
 int libp2p_yamux_channel_read(void* stream_context, struct StreamMessage** message, int timeout_secs) {
@@ -233,36 +313,30 @@ int libp2p_yamux_channel_read(void* stream_context, struct StreamMessage** messa
 		libp2p_logger_error("yamux", "channel_read: stream_context not a channel context\n");
 		return 0;
 	}
-	// reserve the necessary memory
-	*message = libp2p_stream_message_new();
-	struct StreamMessage* msg = *message;
-	if (msg == NULL) {
-		libp2p_logger_error("yamux", "channel_read: Unable to allocate memory for message struct.\n");
-		return 0;
-	}
-	msg->data_size = context->buffer->buffer_size;
-	if (msg->data_size == 0) {
+	size_t data_size = threadsafe_buffer_size(context->buffer);
+	if (data_size == 0) {
 		libp2p_logger_debug("yamux", "channel_read: Nothing to read.\n");
-		libp2p_stream_message_free(msg);
 		*message = NULL;
 		return 0;
 	}
-	msg->data = (uint8_t*) malloc(msg->data_size);
-	if (msg->data == NULL) {
-		libp2p_logger_error("yamux", "chanel_read: Unable to allocate memory for message data.\n");
-		libp2p_stream_message_free(msg);
-		*message = NULL;
+	// reserve the necessary memory
+	*message = libp2p_stream_message_new_buffer(data_size);
+	struct StreamMessage* msg = *message;
+	if (msg == NULL) {
+		libp2p_logger_error("yamux", "channel_read: Unable to allocate memory for message.\n");
 		return 0;
 	}
 	// ok, we have our struct. Now fill it
 	msg->data_size = threadsafe_buffer_read(context->buffer, msg->data, msg->data_size);
 	libp2p_logger_debug("yamux", "channel_read: Read %d bytes from buffer.\n", msg->data_size);
+	yamux_stream_consumed(context, msg->data_size);
 	return msg->data_size;
 }
 
 /**
- * Read from the network, expecting a yamux frame.
- * NOTE: This will also dispatch the frame to the correct protocol
+ * Read from the network, expecting yamux frames.
+ * NOTE: This will also dispatch the frames to the correct protocol. A read may
+ * hold several frames, or only part of one. Partial frames are kept for the next call.
  * @param stream_context the YamuxContext
  * @param message the resultant message
  * @param timeout_secs when to give up
@@ -297,6 +371,7 @@ int libp2p_yamux_read(void* stream_context, struct StreamMessage** message, int
 			if (strstr((char*)incoming_message->data, "/yamux/1.0.0") != NULL) {
 				libp2p_logger_debug("yamux", "read: We got the protocol we've been waiting for.\n");
 				ctx->state = yamux_stream_est;
+				libp2p_utils_readiness_signal();
 				libp2p_stream_message_free(incoming_message);
 				*message = NULL;
 				return 0;
@@ -307,50 +382,67 @@ int libp2p_yamux_read(void* stream_context, struct StreamMessage** message, int
 
 	struct Stream* parent_stream = libp2p_yamux_get_parent_stream(stream_context);
 	// this is the normal situation (not dead code).
+	int num_frames = 0;
+	*message = NULL;
+	if (ctx->frame_buffer_size > 0) {
+		// frames left over from the last read go first
+		if (!yamux_frame_buffer_decode(ctx, message, &num_frames))
+			goto error;
+		if (num_frames > 0)
+			return 1;
+	}
 	struct StreamMessage* incoming = NULL;
-	// we need a lock
-	if (parent_stream->read(parent_stream->stream_context, &incoming, yamux_default_timeout)) {
-		libp2p_logger_debug("yamux", "read: successfully read %d bytes from network.\n", incoming->data_size);
-		// This could be a data frame with the actual data coming later. Yuck.
-		// JMJ in the case of an incomplete buffer, the next read should be the data. This must
-		// be true, as the next data does not have a frame. We should only read the bytes we need.
-		int moreToRead = yamux_more_to_read(incoming);
-		if (moreToRead > 0) {
-			uint8_t buffer[moreToRead];
-			if (parent_stream->read_raw(parent_stream->stream_context, buffer, moreToRead, timeout_secs) == moreToRead) {
-				// we have the bytes we need
-				uint8_t* new_buffer = (uint8_t*) malloc(incoming->data_size + moreToRead);
-				memcpy(new_buffer, incoming->data, incoming->data_size);
-				memcpy(&new_buffer[incoming->data_size], buffer, moreToRead);
-				incoming->data_size += moreToRead;
-				free(incoming->data);
-				incoming->data = new_buffer;
-			} else {
-				// we didn't get the bytes we needed
-				return 0;
-			}
-		}
-		// parse the frame. This is where the work happens.
-		if (yamux_decode(ctx, incoming->data, incoming->data_size, message) >= 0) {
+	if (!parent_stream->read(parent_stream->stream_context, &incoming, yamux_default_timeout) || incoming == NULL) {
+		libp2p_logger_error("yamux", "Unable to do network read.\n");
+		return 0;
+	}
+	libp2p_logger_debug("yamux", "read: successfully read %d bytes from network.\n", incoming->data_size);
+	if (ctx->frame_buffer_size > 0) {
+		// this finishes (or continues) a frame we already have the start of
+		int success = yamux_frame_buffer_append(ctx, incoming->data, incoming->data_size);
+		libp2p_stream_message_free(incoming);
+		if (!success || !yamux_frame_buffer_decode(ctx, message, &num_frames))
+			goto error;
+	} else {
+		// parse the frames right out of what was read. This is where the work happens.
+		long used = yamux_decode_frames(ctx, incoming->data, incoming->data_size, message, &num_frames);
+		if (used < 0 || !yamux_frame_buffer_append(ctx, &incoming->data[used], incoming->data_size - used)) {
 			libp2p_stream_message_free(incoming);
-			// The message may not have anything in it. If so, return 0, as if nothing was done. Everything has been handled
-			if (*message != NULL && (*message)->data_size == 0) {
-				libp2p_stream_message_free(*message);
-				*message = NULL;
-				return 0;
-			}
-			return 1;
+			goto error;
 		}
-		libp2p_logger_error("yamux", "yamux_decode returned error.\n");
 		libp2p_stream_message_free(incoming);
-	} else {
-		// read failed
 	}
-
-	libp2p_logger_error("yamux", "Unable to do network read.\n");
+	// If nothing was decoded, return 0, as if nothing was done.
+	return num_frames > 0;
+	error:
+	// we can't find the next frame boundary, so what is waiting is useless
+	ctx->frame_buffer_pos = 0;
+	ctx->frame_buffer_size = 0;
+	if (*message != NULL) {
+		libp2p_stream_message_free(*message);
+		*message = NULL;
+	}
 	return 0;
 }
 
+/***
+ * Change how a channel's writes are scheduled against the other channels of the session
+ * @param stream the yamux channel stream (or a stream above it)
+ * @param priority the priority class (see enum yamux_priority)
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_yamux_channel_set_priority(struct Stream* stream, int priority) {
+	if (priority < 0 || priority >= YAMUX_PRIORITY_CLASSES)
+		return 0;
+	while (stream != NULL && (stream->stream_context == NULL || libp2p_yamux_get_channel_context(stream->stream_context) == NULL))
+		stream = stream->parent_stream;
+	if (stream == NULL)
+		return 0;
+	struct YamuxChannelContext* channel = libp2p_yamux_get_channel_context(stream->stream_context);
+	channel->priority = priority;
+	return 1;
+}
+
 /***
  * Prepare a new Yamux StreamMessage based on another StreamMessage
  * NOTE: The frame is not encoded yet
@@ -396,12 +488,68 @@ uint32_t libp2p_yamux_get_next_id(struct YamuxContext* ctx) {
 }
 
 /***
- * Write to the remote
+ * Send data on an established channel. The data goes out as the remote gives us send window,
+ * in frames cut by the session's send scheduler.
+ * @param channel the channel
+ * @param first_frame the (encoded) frame header for all of the data
+ * @param regions the data
+ * @param num_regions the number of regions
+ * @returns the number of bytes written (including frame headers), or -1 on error. If
+ * the remote doesn't open the window in time, errno is EAGAIN.
+ */
+int libp2p_yamux_channel_writev(struct YamuxChannelContext* channel, struct yamux_frame* first_frame, const struct iovec* regions, int num_regions) {
+	struct Stream* parent_stream = libp2p_yamux_get_parent_stream(channel);
+	struct yamux_frame frame = *first_frame;
+	decode_frame(&frame);
+	size_t data_size = frame.length;
+	size_t sent = 0;
+	int retVal = 0;
+	// where we are in the regions
+	int region = 0;
+	size_t region_pos = 0;
+	do {
+		uint32_t allowed = yamux_stream_reserve_window(channel, data_size - sent);
+		if (allowed == 0 && data_size > 0) {
+			libp2p_logger_debug("yamux", "The window of channel %d stayed closed. %d of %d bytes were sent.\n", channel->channel, (int)sent, (int)data_size);
+			errno = EAGAIN;
+			return sent == 0 ? -1 : retVal;
+		}
+		// the next "allowed" bytes of the regions
+		struct iovec outgoing[num_regions + 1];
+		int num_outgoing = 0;
+		size_t left = allowed;
+		while (left > 0) {
+			size_t len = regions[region].iov_len - region_pos;
+			if (len > left)
+				len = left;
+			outgoing[num_outgoing].iov_base = (uint8_t*)regions[region].iov_base + region_pos;
+			outgoing[num_outgoing].iov_len = len;
+			num_outgoing++;
+			left -= len;
+			region_pos += len;
+			if (region_pos == regions[region].iov_len) {
+				region++;
+				region_pos = 0;
+			}
+		}
+		// the scheduler takes turns with the other channels, so big writes don't hold up small ones
+		ssize_t written = yamux_session_send(channel->yamux_context->session, parent_stream, frame.streamid, (sent == 0 ? frame.flags : 0), channel->priority, outgoing, num_outgoing);
+		if (written != (ssize_t)allowed)
+			return sent == 0 ? -1 : retVal;
+		retVal += written + sizeof(struct yamux_frame);
+		sent += allowed;
+	} while (sent < data_size);
+	return retVal;
+}
+
+/***
+ * Write several buffers to the remote as one yamux frame
  * @param stream_context the context. Could be a YamuxContext or YamuxChannelContext
- * @param message the message to write
+ * @param regions the buffers to write
+ * @param num_regions the number of buffers
  * @returns the number of bytes written
  */
-int libp2p_yamux_write(void* stream_context, struct StreamMessage* message) {
+int libp2p_yamux_writev(void* stream_context, const struct iovec* regions, int num_regions) {
 	if (stream_context == NULL)
 		return 0;
 	// look at the first byte of the context to determine if this is a YamuxContext (we're negotiating)
@@ -420,38 +568,61 @@ int libp2p_yamux_write(void* stream_context, struct StreamMessage* message) {
 		return 0;
 
 	if (ctx->state != yamux_stream_est) {
-		struct Stream* parent_stream = ctx->stream->parent_stream;
-		return parent_stream->write(parent_stream->stream_context, message);
+		return libp2p_stream_writev(ctx->stream->parent_stream, regions, num_regions);
 	}
 
-	struct StreamMessage* outgoing_message = libp2p_yamux_prepare_to_send(message);
-	// now convert fame for network use
-	struct yamux_frame* frame = (struct yamux_frame*)outgoing_message->data;
+	size_t data_size = 0;
+	for(int i = 0; i < num_regions; i++)
+		data_size += regions[i].iov_len;
+
+	// the frame header goes in front, the data is passed along as is
+	struct yamux_frame frame;
+	memset(&frame, 0, sizeof(struct yamux_frame));
+	frame.length = data_size;
+	frame.type = yamux_frame_data;
+	frame.version = YAMUX_VERSION;
 	// set a few more flags
-	frame->flags = get_flags(stream_context);
+	frame.flags = get_flags(stream_context);
 	if (channel == NULL) {
 		// if we don't yet have a channel, set the id to the next available
-		frame->streamid = libp2p_yamux_get_next_id(ctx);
+		frame.streamid = libp2p_yamux_get_next_id(ctx);
 	} else {
-		frame->streamid = channel->channel;
+		frame.streamid = channel->channel;
 	}
-	encode_frame(frame);
+	// now convert fame for network use
+	encode_frame(&frame);
+
+	struct iovec outgoing[num_regions + 1];
+	outgoing[0].iov_base = &frame;
+	outgoing[0].iov_len = sizeof(struct yamux_frame);
+	memcpy(&outgoing[1], regions, sizeof(struct iovec) * num_regions);
 
 	int retVal = 0;
 	if (channel != NULL && channel->channel != 0) {
 		// we have an established channel. Use it.
-		libp2p_logger_debug("yamux", "About to write %d bytes to yamux channel %d.\n", outgoing_message->data_size, channel->channel);
-		struct Stream* parent_stream = libp2p_yamux_get_parent_stream(stream_context);
-		retVal = parent_stream->write(parent_stream->stream_context, outgoing_message);
+		libp2p_logger_debug("yamux", "About to write %d bytes to yamux channel %d.\n", (int)(data_size + sizeof(struct yamux_frame)), channel->channel);
+		retVal = libp2p_yamux_channel_writev(channel, &frame, regions, num_regions);
 	} else if (ctx != NULL) {
-		libp2p_logger_debug("yamux", "About to write %d bytes to stream.\n", outgoing_message->data_size);
-		retVal = ctx->stream->parent_stream->write(ctx->stream->parent_stream->stream_context, outgoing_message);
+		libp2p_logger_debug("yamux", "About to write %d bytes to stream.\n", (int)(data_size + sizeof(struct yamux_frame)));
+		retVal = libp2p_stream_writev(ctx->stream->parent_stream, outgoing, num_regions + 1);
 	}
-	libp2p_stream_message_free(outgoing_message);
 
 	return retVal;
 }
 
+/***
+ * Write to the remote
+ * @param stream_context the context. Could be a YamuxContext or YamuxChannelContext
+ * @param message the message to write
+ * @returns the number of bytes written
+ */
+int libp2p_yamux_write(void* stream_context, struct StreamMessage* message) {
+	struct iovec region;
+	region.iov_base = message->data;
+	region.iov_len = message->data_size;
+	return libp2p_yamux_writev(stream_context, &region, 1);
+}
+
 /***
  * Check to see if there is anything waiting on the network.
  * @param stream_context the YamuxContext
@@ -466,6 +637,13 @@ int libp2p_yamux_peek(void* stream_context) {
 	if (parent_stream == NULL)
 		return -1;
 
+	// a whole frame may already be waiting from an earlier read
+	if (ctx->frame_buffer_size > 0) {
+		size_t frame_size = yamux_next_frame_size(&ctx->frame_buffer[ctx->frame_buffer_pos], ctx->frame_buffer_size);
+		if (frame_size > 0 && frame_size <= ctx->frame_buffer_size)
+			return ctx->frame_buffer_size;
+	}
+
 	return parent_stream->peek(parent_stream->stream_context);
 }
 
@@ -474,7 +652,7 @@ int libp2p_yamux_peek(void* stream_context) {
  * @param stream_context a YamuxChannelContext
  * @param buffer where to put the results
  * @param buffer_size the size of the buffer
- * @param timeout_secs how long to wait (currently unused)
+ * @param timeout_secs how long to wait for buffer_size bytes to arrive
  * @returns the number of bytes placed into the buffer
  */
 int libp2p_yamux_channel_read_raw(void* stream_context, uint8_t* buffer, int buffer_size, int timeout_secs) {
@@ -484,12 +662,10 @@ int libp2p_yamux_channel_read_raw(void* stream_context, uint8_t* buffer, int buf
 	if (channelContext == NULL)
 		return 0;
 	// wait to see if we get the bytes we need
-	int counter = 0;
-	while (channelContext->buffer->buffer_size < buffer_size && counter < timeout_secs) {
-		sleep(1);
-		counter++;
-	}
-	return threadsafe_buffer_read(channelContext->buffer, buffer, buffer_size);
+	threadsafe_buffer_wait(channelContext->buffer, buffer_size, timeout_secs);
+	int bytes_read = threadsafe_buffer_read(channelContext->buffer, buffer, buffer_size);
+	yamux_stream_consumed(channelContext, bytes_read);
+	return bytes_read;
 }
 
 /***
@@ -554,6 +730,10 @@ struct YamuxContext* libp2p_yamux_context_new(struct Stream* stream, int amServe
 		ctx->state = 0;
 		ctx->buffered_message = NULL;
 		ctx->buffered_message_pos = -1;
+		ctx->frame_buffer = NULL;
+		ctx->frame_buffer_pos = 0;
+		ctx->frame_buffer_size = 0;
+		ctx->frame_buffer_capacity = 0;
 		ctx->protocol_handlers = NULL;
 	}
 	return ctx;
@@ -591,12 +771,13 @@ int libp2p_yamux_handle_upgrade(struct Stream* yamux_stream, struct Stream* new_
 	if (yamux_channel_context != NULL) {
 		// they've asked to upgrade on a channel. Make them the new default stream for this channel
 		yamux_channel_context->child_stream = new_stream;
-		struct yamux_session_stream* yamux_session_stream = yamux_get_session_stream(yamux_channel_context->yamux_context->session, yamux_channel_context->channel);
+		libp2p_utils_readiness_signal();
+		struct yamux_stream* yamux_session_stream = yamux_session_get_stream(yamux_channel_context->yamux_context->session, yamux_channel_context->channel);
 		if (yamux_session_stream == NULL) {
 			libp2p_logger_error("yamux", "Unable to get correct session stream.\n");
 			return 0;
 		}
-		yamux_session_stream->stream->stream = new_stream;
+		yamux_session_stream->stream = new_stream;
 		return 1;
 	} else {
 		// they've asked to upgrade on the main channel. I don't think this should never happen.
@@ -630,11 +811,12 @@ struct Stream* libp2p_yamux_stream_new(struct Stream* parent_stream, int am_serv
 		out->close = libp2p_yamux_close;
 		out->read = libp2p_yamux_read;
 		out->write = libp2p_yamux_write;
+		out->writev = libp2p_yamux_writev;
 		out->peek = libp2p_yamux_peek;
 		out->read_raw = libp2p_yamux_read_raw;
 		out->handle_upgrade = libp2p_yamux_handle_upgrade;
 		out->address = parent_stream->address;
-		out->socket_mutex = parent_stream->socket_mutex;
+		out->read_mutex = parent_stream->read_mutex;
 		// build YamuxContext
 		struct YamuxContext* ctx = libp2p_yamux_context_new(out, am_server);
 		if (ctx == NULL) {
@@ -681,25 +863,19 @@ int libp2p_yamux_channel_send_FIN(struct YamuxChannelContext* channel) {
 	if (channel == NULL)
 		return 0;
 	struct YamuxContext* ctx = channel->yamux_context;
-	if (ctx != NULL) {
-		struct StreamMessage* msg = libp2p_stream_message_new();
-		msg->data_size = sizeof(struct yamux_frame);
-		msg->data = malloc(msg->data_size);
-		struct yamux_frame* f = (struct yamux_frame*) msg->data;
-		f->type = yamux_frame_window_update;
-		f->flags = yamux_frame_fin;
-		f->streamid = channel->channel;
-		f->version = 0;
-		f->length = 0;
-		encode_frame(f);
-		struct Stream* parent_to_yamux = libp2p_yamux_get_parent_stream(channel);
-		if (parent_to_yamux != NULL)
-			parent_to_yamux->write(parent_to_yamux->stream_context, msg);
-		libp2p_stream_message_free(msg);
-		return 1;
+	if (ctx != NULL && ctx->session != NULL) {
+		struct yamux_frame f = (struct yamux_frame){
+			.version  = YAMUX_VERSION,
+			.type     = yamux_frame_window_update,
+			.flags    = yamux_frame_fin,
+			.streamid = channel->channel,
+			.length   = 0
+		};
+		encode_frame(&f);
+		// behind the data that is already queued for the channel
+		return yamux_session_send_last_frame(ctx->session, libp2p_yamux_get_parent_stream(channel), &f);
 	}
 	return 0;
-
 }
 
 /**
@@ -713,14 +889,28 @@ int libp2p_yamux_channel_close(void* context) {
 	if (ctx != NULL) {
 		//Send FIN
 		libp2p_yamux_channel_send_FIN(ctx);
+		// give back what the window grew
+		yamux_stream_release_window(ctx);
 		// close the child's stream
 		ctx->child_stream->close(ctx->child_stream);
-		libp2p_stream_free(ctx->stream);
-		free(ctx);
+		// a dispatcher thread may still have it
+		if (yamux_stream_dispatch_stop(ctx))
+			libp2p_yamux_channel_free(ctx);
 	}
 	return 1;
 }
 
+/***
+ * Free the memory of a channel that has been closed
+ * @param ctx the YamuxChannelContext
+ */
+void libp2p_yamux_channel_free(struct YamuxChannelContext* ctx) {
+	if (ctx == NULL)
+		return;
+	libp2p_stream_free(ctx->stream);
+	free(ctx);
+}
+
 /***
  * Close all channels
  * @param ctx the YamuxContext that contains a vector of channels
@@ -749,6 +939,8 @@ void libp2p_yamux_context_free(struct YamuxContext* ctx) {
 		libp2p_stream_message_free(ctx->buffered_message);
 		ctx->buffered_message = NULL;
 	}
+	if (ctx->frame_buffer != NULL)
+		free(ctx->frame_buffer);
 	// free all the channels
 	libp2p_yamux_channels_free(ctx);
 	if (ctx->session != NULL)
@@ -804,7 +996,8 @@ struct Stream* libp2p_yamux_channel_stream_new(struct Stream* incoming_stream, i
 			out->read = incoming_stream->parent_stream->read;
 			out->read_raw = incoming_stream->parent_stream->read_raw;
 			out->write = incoming_stream->parent_stream->write;
-			out->socket_mutex = incoming_stream->parent_stream->socket_mutex;
+			out->writev = incoming_stream->parent_stream->writev;
+			out->read_mutex = incoming_stream->parent_stream->read_mutex;
 			ctx->yamux_context = incoming_stream->parent_stream->stream_context;
 			ctx->child_stream = incoming_stream;
 			// this does the wrap
@@ -815,7 +1008,8 @@ struct Stream* libp2p_yamux_channel_stream_new(struct Stream* incoming_stream, i
 			out->read = incoming_stream->read;
 			out->read_raw = incoming_stream->read_raw;
 			out->write = incoming_stream->write;
-			out->socket_mutex = incoming_stream->socket_mutex;
+			out->writev = incoming_stream->writev;
+			out->read_mutex = incoming_stream->read_mutex;
 			ctx->yamux_context = incoming_stream->stream_context;
 			ctx->child_stream = NULL;
 		}
@@ -827,6 +1021,14 @@ struct Stream* libp2p_yamux_channel_stream_new(struct Stream* incoming_stream, i
 		ctx->stream = out;
 		ctx->buffer = threadsafe_buffer_context_new();
 		ctx->read_running = 0;
+		ctx->read_pending = 0;
+		ctx->read_closed = 0;
+		ctx->priority = yamux_priority_normal;
+		ctx->receive_window = YAMUX_DEFAULT_WINDOW;
+		ctx->receive_consumed = 0;
+		ctx->receive_credited = 0;
+		ctx->receive_remaining = YAMUX_DEFAULT_WINDOW;
+		timespec_get(&ctx->receive_window_time, TIME_UTC);
 		out->stream_context = ctx;
 		out->handle_upgrade = libp2p_yamux_handle_upgrade;
 		out->channel = channelNumber;
@@ -864,6 +1066,19 @@ int libp2p_yamux_stream_add(struct YamuxContext* ctx, struct Stream* stream) {
 	return 1;
 }
 
+/***
+ * See if the default stream of a session is yamux, and it has been established
+ * @param context the SessionContext
+ * @returns true(1) if ready, false(0) otherwise
+ */
+int libp2p_yamux_stream_is_ready(void* context) {
+	struct SessionContext* session_context = (struct SessionContext*)context;
+	struct Stream* stream = session_context->default_stream;
+	return stream != NULL
+			&& stream->stream_type == STREAM_TYPE_YAMUX
+			&& ((struct YamuxContext*)stream->stream_context)->state == yamux_stream_est;
+}
+
 /***
  * Wait for yamux stream to become ready
  * @param session_context the session context to check
@@ -871,26 +1086,8 @@ int libp2p_yamux_stream_add(struct YamuxContext* ctx, struct Stream* stream) {
  * @returns true(1) if it becomes ready, false(0) otherwise
  */
 int libp2p_yamux_stream_ready(struct SessionContext* session_context, int timeout_secs) {
-	int counter = 0;
-	while (session_context != NULL
-			&& session_context->default_stream != NULL
-			&& session_context->default_stream->stream_type != STREAM_TYPE_YAMUX
-			&& counter <= timeout_secs) {
-		counter++;
-		sleep(1);
-	}
-	if (session_context != NULL
-			&& session_context->default_stream != NULL
-			&& session_context->default_stream->stream_type == STREAM_TYPE_YAMUX
-			&& counter < 5) {
-		struct YamuxContext* ctx = (struct YamuxContext*)session_context->default_stream->stream_context;
-		while (ctx->state != yamux_stream_est && counter <= timeout_secs) {
-			counter++;
-			sleep(1);
-		}
-		if (ctx->state == yamux_stream_est)
-			return 1;
-	}
-	return 0;
+	if (session_context == NULL)
+		return 0;
+	return libp2p_utils_readiness_wait(libp2p_yamux_stream_is_ready, session_context, timeout_secs);
 }
 